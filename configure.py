@@ -98,6 +98,8 @@ target[FIELD_PREFFIX] = "MKDFS"
 target[FIELD_TYPE] = BIN_EXECUTABLE
 target[FIELD_OUTPUT_DIRECTORY] = "build/tools"
 target[FIELD_OUTPUT_FILE] = "mkdfs"
+target[FIELD_CFLAGS] = "-pthread"
+target[FIELD_LDFLAGS] = "-pthread"
 target[FIELD_OBJECT_DIRECTORY] = "build/linux/obj/utils/dfs"
 target[FIELD_SOURCE_DIRECTORY] = "utils/dfs"
 target[FIELD_SOURCES] = \
@@ -134,9 +136,11 @@ target[FIELD_SOURCES] = \
     [ \
     #"sys/kernel/apm.c", \
     "sys/kernel/kdebug.c", \
+    "sys/kernel/aio.c", \
     "sys/kernel/buf.c", \
     "sys/kernel/cpu.c", \
     "sys/kernel/dbg.c", \
+    "sys/kernel/dcache.c", \
     "sys/kernel/dev.c", \
     "sys/kernel/fpu.c", \
     "sys/kernel/hndl.c", \
@@ -161,6 +165,7 @@ target[FIELD_SOURCES] = \
     "arch/x86/sys/kernel/sched.c", \
     "arch/x86/sys/kernel/sched.s", \
     "arch/x86/sys/kernel/mach.s", \
+    "sys/kernel/splice.c", \
     "sys/kernel/start.c", \
     "sys/kernel/syscall.c", \
     "sys/kernel/timer.c", \
@@ -185,8 +190,11 @@ target[FIELD_SOURCES] = \
     "sys/dev/video.c", \
     "sys/dev/virtioblk.c", \
     "sys/dev/virtiocon.c", \
+    "sys/dev/ahci.c", \
+    "sys/dev/nvme.c", \
     # network
     "sys/net/arp.c", \
+    "sys/net/chksum.c", \
     "sys/net/dhcp.c", \
     "sys/net/ether.c", \
     "sys/net/icmp.c", \
@@ -209,11 +217,13 @@ target[FIELD_SOURCES] = \
     # file system
     "sys/fs/cdfs/cdfs.c", \
     "sys/fs/devfs/devfs.c", \
+    "sys/fs/dfs/defrag.c", \
     "sys/fs/dfs/dfs.c", \
     "sys/fs/dfs/dir.c", \
     "sys/fs/dfs/file.c", \
     "sys/fs/dfs/group.c", \
     "sys/fs/dfs/inode.c", \
+    "sys/fs/dfs/journal.c", \
     "sys/fs/dfs/super.c", \
     "sys/fs/pipefs/pipefs.c", \
     "sys/fs/procfs/procfs.c", \
@@ -221,6 +231,7 @@ target[FIELD_SOURCES] = \
     "sys/fs/smbfs/smbfs.c", \
     "sys/fs/smbfs/smbproto.c", \
     "sys/fs/smbfs/smbutil.c", \
+    "sys/fs/tmpfs/tmpfs.c", \
     # internal libc
     "lib/libc/bitops.c", \
     "lib/libc/ctype.c", \
@@ -524,6 +535,7 @@ target[FIELD_OUTPUT_FILE] = "machina.iso"
 target[FIELD_COMMANDS] = [
     "mkdir -p build/install/dev", \
     "mkdir -p build/install/proc", \
+    "mkdir -p build/install/tmp", \
     "build/tools/mkdfs -d build/install/BOOTIMG.BIN -b $(CDEMBOOT_OUT_FILE) -l $(OSLDR_OUT_FILE)" \
     " -k $(KERNEL32_OUT_FILE) -c 1024 -C 1440 -I 8192 -i -f -K rootdev=cd0,rootfs=cdfs", \
     "genisoimage -J -quiet -c BOOTCAT.BIN -b BOOTIMG.BIN -o $(ISO_OUT_FILE) build/install" ]
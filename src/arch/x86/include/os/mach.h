@@ -254,6 +254,7 @@ static inline void kmach_poweroff()
 
 
 unsigned int kmach_rdtsc() __asm__("___hw_rdtsc");
+unsigned long long kmach_rdtsc64() __asm__("___hw_rdtsc");
 
 KERNELAPI unsigned char inb(port_t port) __asm__("___inb");
 KERNELAPI unsigned char inp(port_t port) __asm__("___inp");
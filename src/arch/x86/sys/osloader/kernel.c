@@ -242,9 +242,10 @@ void kernel_load( int bootdrv )
         panic("unable to read super block from boot device");
     }
 
-    // check signature and version
+    // check signature and version; the kernel inode is always block mapped,
+    // so incompatible features do not matter here
     if (sb->signature != DFS_SIGNATURE) panic("invalid DFS signature");
-    if (sb->version != DFS_VERSION) panic("invalid DFS version");
+    if (sb->version != DFS_VERSION && sb->version != DFS_VERSION_NOINCOMPAT) panic("invalid DFS version");
     blocksize = 1 << sb->log_block_size;
     blks_per_sect =  blocksize / SECTORSIZE;
 
@@ -43,6 +43,7 @@
 #include <sys/stat.h>
 
 #define BLKSIZE 4096
+#define CHUNKSIZE (1024 * 1024)
 
 struct options {
   int force;
@@ -54,6 +55,43 @@ struct options {
 
 static int copy_file(char *src, char *dest, struct options *opts);
 
+static int copy_data(int fin, int fout, char *src, char *dest) {
+  char *buffer;
+  int n;
+
+  // Let the kernel move the data between the files
+  while ((n = copy_file_range(fin, NULL, fout, NULL, CHUNKSIZE, 0)) > 0);
+  if (n == 0) return 0;
+
+  // Devices and procfs files cannot be copied in the kernel, copy them
+  // through a buffer instead
+  if (errno != EINVAL && errno != ENOSYS && errno != ESPIPE) {
+    perror(dest);
+    return -1;
+  }
+
+  buffer = malloc(BLKSIZE);
+  if (!buffer) {
+    perror(dest);
+    return -1;
+  }
+
+  while ((n = read(fin, buffer, BLKSIZE)) != 0) {
+    if (n < 0) {
+      perror(src);
+      break;
+    }
+    if (write(fout, buffer, n) != n) {
+      perror(dest);
+      n = -1;
+      break;
+    }
+  }
+
+  free(buffer);
+  return n;
+}
+
 static int copy_directory(char *src, char *dest, struct options *opts) {
   struct dirent *dp;
   DIR *dirp;
@@ -93,7 +131,6 @@ static int copy_file(char *src, char *dest, struct options *opts) {
   int fin;
   int fout;
   struct stat st;
-  char *buffer;
   int n;
 
   // Refuse to copy file unto itself
@@ -125,22 +162,13 @@ static int copy_file(char *src, char *dest, struct options *opts) {
   if (opts->verbose) printf("%s -> %s\n", src, dest);
   if (opts->force) unlink(dest);
   fout = open(dest, O_WRONLY | O_CREAT | (opts->noclobber ? O_EXCL : O_TRUNC) | O_BINARY, 0666);
-  buffer = malloc(BLKSIZE);
-  if (fout < 0 || !buffer) {
+  if (fout < 0) {
     perror(dest);
     close(fin);
     return 1;
   }
-  while ((n = read(fin, buffer, BLKSIZE)) != 0) {
-    if (n < 0) {
-      perror(src);
-      break;
-    }
-    if (write(fout, buffer, n) != n) {
-      perror(dest);
-      break;
-    }
-  }
+
+  n = copy_data(fin, fout, src, dest);
   fchmod(fout, st.st_mode);
 
   if (opts->preserve) {
@@ -152,7 +180,6 @@ static int copy_file(char *src, char *dest, struct options *opts) {
     fchown(fout, st.st_uid, st.st_gid);
   }
 
-  free(buffer);
   close(fin);
   close(fout);
 
@@ -0,0 +1,256 @@
+//
+// defrag.c
+//
+// Defragment files
+//
+// Copyright (C) 2012 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+//
+#include <os.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <shlib.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_GROUPS 4096
+
+struct options {
+  int analyze;
+  int verbose;
+  int groups;
+};
+
+struct totals {
+  unsigned int files;
+  unsigned int fragmented;
+  unsigned int blocks;
+  unsigned int fragments;
+  unsigned int moved;
+  unsigned int failed;
+};
+
+static int defrag_file(char *path, struct options *opts, struct totals *totals) {
+  struct dfs_fraginfo info;
+  int before;
+  int fd;
+  int rc;
+
+  fd = open(path, opts->analyze ? O_RDONLY | O_BINARY : O_RDWR | O_BINARY);
+  if (fd < 0) {
+    perror(path);
+    totals->failed++;
+    return 0;
+  }
+
+  rc = ioctl(fd, IOCTL_DFS_FRAGINFO, &info, sizeof(struct dfs_fraginfo));
+  if (rc < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    close(fd);
+    totals->failed++;
+    return 0;
+  }
+
+  before = info.fragments;
+  if (!opts->analyze && info.fragments > 1) {
+    rc = ioctl(fd, IOCTL_DFS_DEFRAG, &info, sizeof(struct dfs_fraginfo));
+    if (rc < 0) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      totals->failed++;
+    }
+  }
+  close(fd);
+
+  totals->files++;
+  totals->blocks += info.blocks;
+  totals->fragments += info.fragments;
+  totals->moved += info.moved;
+  if (before > 1) totals->fragmented++;
+
+  if (opts->verbose || before > 1) {
+    if (opts->analyze || info.moved == 0) {
+      printf("%8d %8d  %s\n", info.blocks, before, path);
+    } else {
+      printf("%8d %8d -> %d  %s\n", info.blocks, before, info.fragments, path);
+    }
+  }
+
+  return 0;
+}
+
+static int defrag_directory(char *path, struct options *opts, struct totals *totals) {
+  struct stat st;
+  struct dirent *dp;
+  DIR *dirp;
+  char *fn;
+  int rc = 0;
+
+  dirp = opendir(path);
+  if (!dirp) {
+    perror(path);
+    return -1;
+  }
+  while ((dp = readdirplus(dirp, &st))) {
+    fn = join_path(path, dp->d_name);
+    if (!fn) {
+      fprintf(stderr, "error: out of memory\n");
+      closedir(dirp);
+      return -1;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      rc = defrag_directory(fn, opts, totals);
+    } else if (S_ISREG(st.st_mode)) {
+      rc = defrag_file(fn, opts, totals);
+    }
+    free(fn);
+    if (rc < 0) break;
+  }
+  closedir(dirp);
+
+  return rc;
+}
+
+static int defrag_path(char *path, struct options *opts, struct totals *totals) {
+  struct stat st;
+
+  if (stat(path, &st) < 0) {
+    perror(path);
+    return -1;
+  }
+
+  if (S_ISDIR(st.st_mode)) return defrag_directory(path, opts, totals);
+  if (S_ISREG(st.st_mode)) return defrag_file(path, opts, totals);
+  return 0;
+}
+
+static int free_space_report(char *path) {
+  struct dfs_freeinfo *info;
+  unsigned int free_blocks = 0;
+  unsigned int free_runs = 0;
+  int fd;
+  int n;
+  int i;
+
+  info = (struct dfs_freeinfo *) malloc(MAX_GROUPS * sizeof(struct dfs_freeinfo));
+  if (!info) {
+    fprintf(stderr, "error: out of memory\n");
+    return -1;
+  }
+
+  fd = open(path, O_RDONLY | O_BINARY);
+  if (fd < 0) {
+    perror(path);
+    free(info);
+    return -1;
+  }
+  n = ioctl(fd, IOCTL_DFS_FREEINFO, info, MAX_GROUPS * sizeof(struct dfs_freeinfo));
+  close(fd);
+  if (n < 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    free(info);
+    return -1;
+  }
+
+  printf("\ngroup   blocks     free     runs  largest\n");
+  for (i = 0; i < n; i++) {
+    printf("%5d %8d %8d %8d %8d\n", info[i].group, info[i].block_count,
+           info[i].free_blocks, info[i].free_runs, info[i].largest_run);
+    free_blocks += info[i].free_blocks;
+    free_runs += info[i].free_runs;
+  }
+  printf("%d free blocks in %d runs", free_blocks, free_runs);
+  if (free_runs > 0) printf(", average run %d blocks", free_blocks / free_runs);
+  printf("\n");
+
+  free(info);
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: defrag [OPTIONS] FILE...\n\n");
+  fprintf(stderr, "  -a      Analyze only, do not move any blocks\n");
+  fprintf(stderr, "  -g      Report free space fragmentation per group\n");
+  fprintf(stderr, "  -v      List all files, not only fragmented files\n");
+  exit(1);
+}
+
+shellcmd(defrag) {
+  struct options opts;
+  struct totals totals;
+  int c;
+  int rc;
+  int i;
+
+  // Parse command line options
+  memset(&opts, 0, sizeof(struct options));
+  memset(&totals, 0, sizeof(struct totals));
+  while ((c = getopt(argc, argv, "agv?")) != EOF) {
+    switch (c) {
+      case 'a':
+        opts.analyze = 1;
+        break;
+
+      case 'g':
+        opts.groups = 1;
+        break;
+
+      case 'v':
+        opts.verbose = 1;
+        break;
+
+      case '?':
+      default:
+        usage();
+    }
+  }
+
+  printf("  blocks    frags  file\n");
+  if (optind == argc) {
+    rc = defrag_path(".", &opts, &totals);
+  } else {
+    for (i = optind; i < argc; i++) {
+      rc = defrag_path(argv[i], &opts, &totals);
+      if (rc < 0) break;
+    }
+  }
+
+  printf("%d files, %d blocks, %d fragmented", totals.files, totals.blocks, totals.fragmented);
+  if (totals.files > 0) {
+    printf(", %d.%02d fragments per file", totals.fragments / totals.files,
+           totals.fragments % totals.files * 100 / totals.files);
+  }
+  if (!opts.analyze) printf(", %d blocks moved", totals.moved);
+  if (totals.failed) printf(", %d failed", totals.failed);
+  printf("\n");
+
+  if (rc >= 0 && opts.groups) rc = free_space_report(optind == argc ? "." : argv[optind]);
+
+  return rc < 0;
+}
@@ -44,52 +44,61 @@ struct options {
   int all;
 };
 
-static int display_file_size(char *path, struct options *opts) {
+static int display_directory_size(char *path, struct options *opts) {
   struct stat st;
+  struct dirent *dp;
+  DIR *dirp;
+  char *fn;
   int total = 0;
+  int size;
 
-  // Stat file
-  if (stat(path ? path : ".", &st) < 0) {
+  dirp = opendir(path);
+  if (!dirp) {
     perror(path);
     return -1;
   }
-
-  if (S_ISDIR(st.st_mode)) {
-    struct dirent *dp;
-    DIR *dirp;
-    char *fn;
-    int size;
-
-    dirp = opendir(path);
-    if (!dirp) {
-      perror(path);
+  while ((dp = readdirplus(dirp, &st))) {
+    fn = join_path(path, dp->d_name);
+    if (!fn) {
+      fprintf(stderr, "error: out of memory\n");
+      closedir(dirp);
       return -1;
     }
-    while ((dp = readdir(dirp))) {
-      fn = join_path(path, dp->d_name);
-      if (!fn) {
-        fprintf(stderr, "error: out of memory\n");
-        closedir(dirp);
-        return -1;
-      }
-      size = display_file_size(fn, opts);
-      free(fn);
-      if (size == -1) {
-        closedir(dirp);
-        return -1;
-      }
-      total += size;
+    if (S_ISDIR(st.st_mode)) {
+      size = display_directory_size(fn, opts);
+    } else {
+      size = st.st_size;
+      if (opts->all) printf("%d\t%s\n", (size + opts->blksize - 1) / opts->blksize, fn);
     }
-    closedir(dirp);
-  } else {
-    total = st.st_size;
+    free(fn);
+    if (size == -1) {
+      closedir(dirp);
+      return -1;
+    }
+    total += size;
+  }
+  closedir(dirp);
+
+  printf("%d\t%s\n", (total + opts->blksize - 1) / opts->blksize, path);
+  return total;
+}
+
+static int display_file_size(char *path, struct options *opts) {
+  struct stat st;
+
+  // Stat file
+  if (stat(path ? path : ".", &st) < 0) {
+    perror(path);
+    return -1;
   }
 
-  if (opts->all || S_ISDIR(st.st_mode)) {
-    printf("%d\t%s\n", (total + opts->blksize - 1) / opts->blksize, path);
+  if (S_ISDIR(st.st_mode)) return display_directory_size(path, opts);
+
+  if (opts->all) {
+    printf("%d\t%s\n", (st.st_size + opts->blksize - 1) / opts->blksize, path);
   }
 
-  return total;
+  return st.st_size;
 }
 
 static void usage() {
@@ -0,0 +1,229 @@
+//
+// iobench.c
+//
+// Block device throughput benchmark
+//
+// Copyright (C) 2012 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+#include <os.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <shlib.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <os/dev.h>
+#include <sys/time.h>
+
+#define MAX_THREADS 32
+
+struct options {
+  int blksize;
+  int count;
+  int threads;
+  int random;
+  int write;
+};
+
+struct job {
+  struct options *opts;
+  handle_t dev;
+  int blocks;
+  int ops;
+  int errors;
+  unsigned int seed;
+  int first;
+  char *buffer;
+};
+
+static unsigned int nextrand(unsigned int *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 1) & 0x7FFFFFFF;
+}
+
+static void __stdcall worker(void *arg) {
+  struct job *job = (struct job *) arg;
+  struct options *opts = job->opts;
+  int i, rc;
+  int blk;
+
+  for (i = 0; i < job->ops; i++) {
+    if (opts->random) {
+      blk = nextrand(&job->seed) % job->blocks;
+    } else {
+      blk = (job->first + i) % job->blocks;
+    }
+
+    if (opts->write) {
+      rc = pwrite(job->dev, job->buffer, opts->blksize, (off64_t) blk * opts->blksize);
+    } else {
+      rc = pread(job->dev, job->buffer, opts->blksize, (off64_t) blk * opts->blksize);
+    }
+    if (rc != opts->blksize) job->errors++;
+  }
+}
+
+static int bench(char *devname, struct options *opts) {
+  struct job jobs[MAX_THREADS];
+  handle_t threads[MAX_THREADS];
+  struct timeval start, end;
+  handle_t dev;
+  int devsize, blksize;
+  int i, rc;
+  int ops, errors;
+  double elapsed, mbytes;
+
+  // Open device and determine its size
+  dev = open(devname, opts->write ? O_RDWR : O_RDONLY);
+  if (dev < 0) {
+    perror(devname);
+    return 1;
+  }
+  blksize = ioctl(dev, IOCTL_GETBLKSIZE, NULL, 0);
+  devsize = ioctl(dev, IOCTL_GETDEVSIZE, NULL, 0);
+  if (blksize <= 0 || devsize <= 0) {
+    fprintf(stderr, "%s: unable to determine device size\n", devname);
+    close(dev);
+    return 1;
+  }
+  if (opts->blksize < blksize || opts->blksize % blksize != 0) {
+    fprintf(stderr, "%s: transfer size must be a multiple of %d\n", devname, blksize);
+    close(dev);
+    return 1;
+  }
+
+  // Prepare jobs
+  memset(jobs, 0, sizeof(jobs));
+  for (i = 0; i < opts->threads; i++) {
+    jobs[i].opts = opts;
+    jobs[i].dev = dev;
+    jobs[i].blocks = (int) ((off64_t) devsize * blksize / opts->blksize);
+    jobs[i].ops = opts->count / opts->threads;
+    jobs[i].seed = 1 + i * 7919;
+    jobs[i].first = i * jobs[i].ops;
+    jobs[i].buffer = malloc(opts->blksize);
+    if (!jobs[i].buffer) {
+      fprintf(stderr, "iobench: out of memory\n");
+      exit(1);
+    }
+    memset(jobs[i].buffer, 0, opts->blksize);
+  }
+
+  // Run benchmark
+  gettimeofday(&start, NULL);
+  for (i = 0; i < opts->threads; i++) {
+    threads[i] = beginthread(worker, 0, &jobs[i], 0, "iobench", NULL);
+    if (threads[i] < 0) {
+      perror("beginthread");
+      exit(1);
+    }
+  }
+  rc = waitall(threads, opts->threads, INFINITE);
+  gettimeofday(&end, NULL);
+  if (rc < 0) perror("waitall");
+
+  // Report results
+  errors = 0;
+  for (i = 0; i < opts->threads; i++) {
+    errors += jobs[i].errors;
+    close(threads[i]);
+    free(jobs[i].buffer);
+  }
+  close(dev);
+
+  ops = jobs[0].ops * opts->threads;
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+  if (elapsed <= 0.0) elapsed = 0.000001;
+  mbytes = (double) opts->blksize * ops / (1024 * 1024);
+  printf("%s: %d %s %s of %d bytes with %d thread(s)\n", devname, ops,
+         opts->random ? "random" : "sequential", opts->write ? "writes" : "reads",
+         opts->blksize, opts->threads);
+  printf("%.3f s, %.2f MB/s, %.0f IOPS, %.3f ms avg latency, %d errors\n",
+         elapsed, mbytes / elapsed, ops / elapsed, elapsed * 1000.0 * opts->threads / ops, errors);
+
+  return errors ? 1 : 0;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: iobench [OPTIONS] DEVICE...\n\n");
+  fprintf(stderr, "  -b SIZE  Transfer size in bytes (default 4096)\n");
+  fprintf(stderr, "  -n COUNT Number of transfers (default 4096)\n");
+  fprintf(stderr, "  -t NUM   Number of concurrent threads (default 1)\n");
+  fprintf(stderr, "  -r       Random offsets instead of sequential\n");
+  fprintf(stderr, "  -w       Write instead of read (destroys data on device)\n");
+  exit(1);
+}
+
+shellcmd(iobench) {
+  struct options opts;
+  int c, i;
+  int rc;
+
+  // Parse command line options
+  memset(&opts, 0, sizeof(struct options));
+  opts.blksize = 4096;
+  opts.count = 4096;
+  opts.threads = 1;
+  while ((c = getopt(argc, argv, "b:n:t:rw?")) != EOF) {
+    switch (c) {
+      case 'b':
+        opts.blksize = atoi(optarg);
+        break;
+
+      case 'n':
+        opts.count = atoi(optarg);
+        break;
+
+      case 't':
+        opts.threads = atoi(optarg);
+        break;
+
+      case 'r':
+        opts.random = 1;
+        break;
+
+      case 'w':
+        opts.write = 1;
+        break;
+
+      case '?':
+      default:
+        usage();
+    }
+  }
+  if (optind == argc) usage();
+  if (opts.threads < 1 || opts.threads > MAX_THREADS || opts.count < opts.threads) usage();
+
+  // Run the same workload on each device for comparison
+  rc = 0;
+  for (i = optind; i < argc; i++) {
+    if (bench(argv[i], &opts) != 0) rc = 1;
+  }
+
+  return rc;
+}
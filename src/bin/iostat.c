@@ -0,0 +1,257 @@
+//
+// iostat.c
+//
+// Block device I/O statistics
+//
+// Copyright (C) 2012 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+#include <os.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <shlib.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define MAX_DISKS    64
+#define LAT_BUCKETS  24
+
+struct sample {
+  struct timeval time;
+  int ndisks;
+  struct proc_diskstat disks[MAX_DISKS];
+};
+
+static char *read_proc(char *filename, char *buffer, int size) {
+  int fd;
+  int n, len;
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror(filename);
+    return NULL;
+  }
+
+  len = 0;
+  while (len < size - 1 && (n = read(fd, buffer + len, size - 1 - len)) > 0) len += n;
+  buffer[len] = 0;
+  close(fd);
+  return buffer;
+}
+
+static int get_sample(struct sample *s) {
+  int fd;
+  int n;
+
+  // Read fixed-layout disk statistics records
+  fd = open("/proc/diskstats", O_RDONLY);
+  if (fd < 0) {
+    perror("/proc/diskstats");
+    return -1;
+  }
+
+  if (ioctl(fd, IOCTL_PROC_BINARY, NULL, 0) < 0) {
+    perror("/proc/diskstats");
+    close(fd);
+    return -1;
+  }
+
+  n = read(fd, s->disks, sizeof(s->disks));
+  close(fd);
+  if (n < 0) {
+    perror("/proc/diskstats");
+    return -1;
+  }
+
+  gettimeofday(&s->time, NULL);
+  s->ndisks = n / sizeof(struct proc_diskstat);
+
+  return 0;
+}
+
+static struct proc_diskstat *find_disk(struct sample *s, int devno) {
+  int i;
+
+  if (!s) return NULL;
+  for (i = 0; i < s->ndisks; i++) {
+    if (s->disks[i].devno == devno) return &s->disks[i];
+  }
+  return NULL;
+}
+
+static void print_report(struct sample *prev, struct sample *curr) {
+  struct proc_diskstat zero;
+  struct proc_diskstat *c, *p;
+  struct loadinfo load;
+  double ms;
+  unsigned long rd, wr;
+  int i;
+
+  // Without a previous sample, report averages since boot
+  memset(&zero, 0, sizeof(zero));
+  if (prev) {
+    ms = (curr->time.tv_sec - prev->time.tv_sec) * 1000.0 + (curr->time.tv_usec - prev->time.tv_usec) / 1000.0;
+  } else if (sysinfo(SYSINFO_LOAD, &load, sizeof(struct loadinfo)) >= 0) {
+    ms = load.uptime * 1000.0;
+  } else {
+    ms = 0.0;
+  }
+  if (ms <= 0.0) ms = 1.0;
+
+  printf("Device        r/s     w/s    rkB/s    wkB/s rrqm/s wrqm/s r_await w_await aqu-sz  %%util\n");
+  for (i = 0; i < curr->ndisks; i++) {
+    c = &curr->disks[i];
+    p = find_disk(prev, c->devno);
+    if (!p) p = &zero;
+
+    rd = c->rd_ios - p->rd_ios;
+    wr = c->wr_ios - p->wr_ios;
+    printf("%-8s %8.1f%8.1f %8.1f %8.1f %6.1f %6.1f %7.2f %7.2f %6.2f %6.1f\n",
+           c->name,
+           rd * 1000.0 / ms,
+           wr * 1000.0 / ms,
+           (c->rd_sectors - p->rd_sectors) / 2.0 * 1000.0 / ms,
+           (c->wr_sectors - p->wr_sectors) / 2.0 * 1000.0 / ms,
+           (c->rd_merges - p->rd_merges) * 1000.0 / ms,
+           (c->wr_merges - p->wr_merges) * 1000.0 / ms,
+           rd ? (double) (c->rd_ms - p->rd_ms) / rd : 0.0,
+           wr ? (double) (c->wr_ms - p->wr_ms) / wr : 0.0,
+           (c->weighted_ms - p->weighted_ms) / ms,
+           (c->io_ms - p->io_ms) * 100.0 / ms);
+  }
+  printf("\n");
+}
+
+static void print_bucket_limit(int n) {
+  if (n < 10) {
+    printf("%7dus", 1 << n);
+  } else if (n < 20) {
+    printf("%7dms", 1 << (n - 10));
+  } else {
+    printf("%7ds ", 1 << (n - 20));
+  }
+}
+
+static int print_latency() {
+  static char buffer[16384];
+  char *p, *next, *s;
+  char name[32], op[8];
+  unsigned long hist[LAT_BUCKETS];
+  unsigned long total, max;
+  int i, n, width;
+
+  if (!read_proc("/proc/disklatency", buffer, sizeof(buffer))) return 1;
+
+  p = buffer;
+  while (*p) {
+    next = strchr(p, '\n');
+    if (next) *next++ = 0;
+
+    // Parse device name, operation and histogram buckets
+    if (sscanf(p, "%31s %7s%n", name, op, &n) == 2) {
+      s = p + n;
+      total = max = 0;
+      for (i = 0; i < LAT_BUCKETS; i++) {
+        hist[i] = strtoul(s, &s, 10);
+        total += hist[i];
+        if (hist[i] > max) max = hist[i];
+      }
+
+      if (total > 0) {
+        printf("%s %s latency (%lu requests):\n", name, op, total);
+        for (i = 0; i < LAT_BUCKETS; i++) {
+          if (hist[i] == 0) continue;
+          printf("  < ");
+          if (i == LAT_BUCKETS - 1) {
+            printf("     inf ");
+          } else {
+            print_bucket_limit(i);
+          }
+          printf(" %9lu ", hist[i]);
+          width = (int) (hist[i] * 40 / max);
+          while (width-- > 0) putchar('*');
+          printf("\n");
+        }
+        printf("\n");
+      }
+    }
+
+    if (!next) break;
+    p = next;
+  }
+
+  return 0;
+}
+
+static void usage() {
+  fprintf(stderr, "usage: iostat [OPTIONS] [INTERVAL [COUNT]]\n\n");
+  fprintf(stderr, "  -l      Show latency histograms\n");
+  exit(1);
+}
+
+shellcmd(iostat) {
+  struct sample samples[2];
+  int latency = 0;
+  int interval = 0;
+  int count = -1;
+  int c, n;
+
+  // Parse command line options
+  while ((c = getopt(argc, argv, "l?")) != EOF) {
+    switch (c) {
+      case 'l':
+        latency = 1;
+        break;
+
+      case '?':
+      default:
+        usage();
+    }
+  }
+  if (optind < argc) interval = atoi(argv[optind++]);
+  if (optind < argc) count = atoi(argv[optind++]);
+  if (optind < argc) usage();
+
+  if (latency) return print_latency();
+
+  // First report covers the time since boot, the following ones each interval
+  if (get_sample(&samples[0]) < 0) return 1;
+  print_report(NULL, &samples[0]);
+  if (interval <= 0) return 0;
+
+  n = 0;
+  while (count < 0 || --count > 0) {
+    sleep(interval);
+    if (get_sample(&samples[(n + 1) & 1]) < 0) return 1;
+    print_report(&samples[n & 1], &samples[(n + 1) & 1]);
+    n++;
+  }
+
+  return 0;
+}
@@ -121,16 +121,14 @@ void collect_directory(struct filelist *list, char *dir, struct options *opts) {
     return;
   }
 
-  while ((dp = readdir(dirp))) {
-    fn = join_path(dir, dp->d_name);
-    if (!fn) break;
-    if (stat(fn, &st) >= 0) {
-      add_file(list, dir, dp->d_name, &st);
-      if (opts->recurse && S_ISDIR(st.st_mode)) {
-        collect_directory(list, fn, opts);
-      }
+  while ((dp = readdirplus(dirp, &st))) {
+    add_file(list, dir, dp->d_name, &st);
+    if (opts->recurse && S_ISDIR(st.st_mode)) {
+      fn = join_path(dir, dp->d_name);
+      if (!fn) break;
+      collect_directory(list, fn, opts);
+      free(fn);
     }
-    free(fn);
   }
   closedir(dirp);
 }
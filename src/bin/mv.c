@@ -32,11 +32,13 @@
 // 
 
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <fcntl.h>
 #include <shlib.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <utime.h>
 #include <sys/stat.h>
 
 struct options {
@@ -44,6 +46,60 @@ struct options {
   int verbose;
 };
 
+#define CHUNKSIZE (1024 * 1024)
+
+//
+// Files cannot be renamed across volumes, so regular files are copied
+// inside the kernel and the source is removed afterwards.
+//
+
+static int move_file(char *src, char *dest) {
+  struct stat st;
+  struct utimbuf times;
+  int fin;
+  int fout;
+  int n;
+
+  if (rename(src, dest) == 0) return 0;
+  if (errno != EXDEV) return -1;
+
+  fin = open(src, O_RDONLY | O_BINARY);
+  if (fin < 0) return -1;
+  if (fstat(fin, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fin);
+    errno = EXDEV;
+    return -1;
+  }
+
+  fout = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, st.st_mode);
+  if (fout < 0) {
+    close(fin);
+    return -1;
+  }
+
+  do {
+    n = copy_file_range(fin, NULL, fout, NULL, CHUNKSIZE, 0);
+  } while (n > 0);
+
+  if (n == 0) {
+    times.modtime = st.st_mtime;
+    times.actime = st.st_atime;
+    times.ctime = -1;
+    futime(fout, &times);
+    fchown(fout, st.st_uid, st.st_gid);
+  }
+
+  close(fin);
+  close(fout);
+
+  if (n < 0) {
+    unlink(dest);
+    return -1;
+  }
+
+  return unlink(src);
+}
+
 static void usage() {
   fprintf(stderr, "usage: mv [OPTIONS] SRC DEST\n");
   fprintf(stderr, "       mv [OPTIONS] SRC... DIR\n\n");
@@ -96,7 +152,7 @@ shellcmd(mv) {
       char *destfn = join_path(dest, argv[i]);
       if (opts.force) unlink(destfn);
       if (opts.verbose) printf("move '%s' to '%s'\n", argv[i], destfn);
-      rc = rename(argv[i], destfn);
+      rc = move_file(argv[i], destfn);
       if (rc < 0) {
         perror(destfn);
         free(destfn);
@@ -108,7 +164,7 @@ shellcmd(mv) {
     // Rename source file to destination
     if (opts.force) unlink(argv[optind + 1]);
     if (opts.verbose) printf("move '%s' to '%s'\n", argv[optind], argv[optind + 1]);
-    rc = rename(argv[optind], argv[optind + 1]);
+    rc = move_file(argv[optind], argv[optind + 1]);
     if (rc < 0) {
       perror(argv[optind]);
       return 1;
@@ -124,6 +124,8 @@ static int extract_files(char *url, FILE *f, char *manifest, int verbose, int *t
   int n, size, left, mode, first, zeroblks;
   struct utimbuf times;
   char *slash;
+  off64_t ofs;
+  long start;
   int fd;
 
   zeroblks = 0;
@@ -191,6 +193,36 @@ static int extract_files(char *url, FILE *f, char *manifest, int verbose, int *t
         return 1;
       }
       left = size;
+
+      // Copy file data inside the kernel when the package is a local file
+      start = ftell(f);
+      if (start >= 0 && left > 0) {
+        ofs = start;
+        while (left > 0) {
+          n = copy_file_range(fileno(f), &ofs, fd, NULL, left, 0);
+          if (n <= 0) break;
+          left -= n;
+        }
+
+        if (left > 0 && left != size) {
+          if (n < 0) {
+            perror(fn);
+          } else {
+            fprintf(stderr, "%s: tar archive truncated (%s)\n", url, fn);
+          }
+          close(fd);
+          unlink(fn);
+          return 1;
+        }
+
+        if (left == 0 && fseek(f, start + (size + TAR_BLKSIZ - 1) / TAR_BLKSIZ * TAR_BLKSIZ, SEEK_SET) < 0) {
+          fprintf(stderr, "%s: tar archive truncated (%s)\n", url, fn);
+          close(fd);
+          unlink(fn);
+          return 1;
+        }
+      }
+
       while (left > 0) {
         n = fread(buffer, 1, TAR_BLKSIZ, f);
         if (n != TAR_BLKSIZ) {
@@ -48,12 +48,20 @@ struct dirent {
   char d_name[NAME_MAX + 1];
 };
 
+#define DIRPLUS_BUFSIZE 8192
+
 typedef struct {
   int handle;
   char path[NAME_MAX + 1];
   struct dirent entry;
+  char *buf;
+  int bufpos;
+  int buflen;
 } DIR;
 
+struct stat;
+struct stat64;
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -63,6 +71,8 @@ int closedir(DIR *dirp);
 struct dirent *readdir(DIR *dirp);
 int readdir_r(DIR *dirp, struct dirent *entry, struct dirent **result);
 int rewinddir(DIR *dirp);
+struct dirent *readdirplus(DIR *dirp, struct stat *buffer);
+struct dirent *readdirplus64(DIR *dirp, struct stat64 *buffer);
 
 #ifdef  __cplusplus
 }
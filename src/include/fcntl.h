@@ -71,6 +71,12 @@
 
 #endif
 
+#ifndef FALLOC_FL_KEEP_SIZE
+
+#define FALLOC_FL_KEEP_SIZE     0x0001  // Do not extend file size
+
+#endif
+
 #ifndef R_OK
 
 #define R_OK    4               // Test for read permission
@@ -102,6 +108,9 @@
 #define F_SETLK   7       // Set or clear a file segment lock
 #define F_SETLKW  8       // Wait and set or clear a file segment lock
 
+#define F_SETPIPE_SZ 9    // Set the pipe capacity
+#define F_GETPIPE_SZ 10   // Get the pipe capacity
+
 //
 // File lock
 //
@@ -125,6 +134,8 @@ extern "C" {
 osapi handle_t open(const char *name, int flags, ...);
 osapi handle_t creat(const char *name, int mode);
 int fcntl(handle_t f, int cmd, ...);
+osapi int fallocate(handle_t f, int mode, off64_t offset, off64_t len);
+osapi int copy_file_range(handle_t in, off64_t *inpos, handle_t out, off64_t *outpos, size_t count, int flags);
 
 #ifdef  __cplusplus
 }
@@ -37,9 +37,18 @@
 #ifndef INET_H
 #define INET_H
 
+// inet.c
+
 unsigned short inet_chksum(void *data, int len);
 unsigned short inet_chksum_pbuf(struct pbuf *p);
 unsigned short inet_chksum_pseudo(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest, unsigned char proto, unsigned short proto_len);
+unsigned short inet_chksum_pseudo_partial(void *hdr, int hdrlen, unsigned long datasum, struct ip_addr *src, struct ip_addr *dest, unsigned char proto, unsigned short proto_len);
+
+// chksum.c
+
+unsigned long chksum(void *data, int len);
+unsigned long chksum_copy(void *dst, void *src, int len);
+unsigned long chksum_add(unsigned long sum, unsigned long partial, int offset);
 
 #if BYTE_ORDER == BIG_ENDIAN
 
@@ -223,6 +223,8 @@ struct tcp_pcb {
   struct tcp_seg *unsent;   // Unsent (queued) segments
   struct tcp_seg *unacked;  // Sent but unacknowledged segments
   struct tcp_seg *ooseq;    // Received out of sequence segments
+
+  struct tcp_pcb *hashnext; // Next PCB in the connection or listener hash chain
 };
 
 struct tcp_pcb_listen {
@@ -247,6 +249,7 @@ struct tcp_seg {
   void *dataptr;           // Pointer to the TCP data in the pbuf
   int len;                 // TCP length of this segment
   struct tcp_hdr *tcphdr;  // TCP header
+  unsigned long datasum;   // Checksum of the TCP data, computed when copied
 };
 
 // Internal functions and global variables
@@ -293,6 +296,16 @@ extern struct tcp_pcb_listen *tcp_listen_pcbs;  // List of all TCP PCBs in LISTE
 extern struct tcp_pcb *tcp_active_pcbs;         // List of all TCP PCBs that are in a state in which they accept or send data
 extern struct tcp_pcb *tcp_tw_pcbs;             // List of all TCP PCBs in TIME-WAIT
 
+// PCB hash tables. Every PCB on the lists is also in a hash table: active
+// and TIME-WAIT PCBs are hashed on remote address and ports, LISTEN PCBs
+// on local port. The local ports in use are reference counted so free
+// ports can be found without scanning the lists.
+
+void tcp_hash_insert(struct tcp_pcb *pcb);
+void tcp_hash_remove(struct tcp_pcb *pcb);
+struct tcp_pcb *tcp_lookup(struct ip_addr *local_ip, unsigned short local_port, struct ip_addr *remote_ip, unsigned short remote_port);
+struct tcp_pcb *tcp_lookup_listen(struct ip_addr *local_ip, unsigned short local_port);
+
 //
 // Axoims about the above lists:
 //   1) Every TCP PCB that is not CLOSED is in one of the lists.
@@ -307,6 +320,7 @@ extern struct tcp_pcb *tcp_tw_pcbs;             // List of all TCP PCBs in TIME-
 #define TCP_REG(pcbs, npcb) do { \
                             npcb->next = *pcbs; \
                             *pcbs = npcb; \
+                            tcp_hash_insert(npcb); \
                             } while (0)
 
 #define TCP_RMV(pcbs, npcb) do { \
@@ -320,6 +334,7 @@ extern struct tcp_pcb *tcp_tw_pcbs;             // List of all TCP PCBs in TIME-
                                } \
                             } \
                             npcb->next = NULL; \
+                            tcp_hash_remove(npcb); \
                             } while (0)
 
 #endif
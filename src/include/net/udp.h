@@ -51,9 +51,11 @@ struct udp_hdr {
 #define UDP_FLAGS_NOCHKSUM  0x01
 #define UDP_FLAGS_BROADCAST 0x02
 #define UDP_FLAGS_CONNECTED 0x04
+#define UDP_FLAGS_BOUND     0x08   // PCB is on the PCB list and in the port hash table
 
 struct udp_pcb {
   struct udp_pcb *next;
+  struct udp_pcb *hashnext;
 
   struct ip_addr local_ip, remote_ip;
   unsigned short local_port, remote_port;
@@ -227,6 +227,22 @@ struct section;
 
 #endif
 
+//
+// Flags for fallocate
+//
+
+#ifndef FALLOC_FL_KEEP_SIZE
+
+#define FALLOC_FL_KEEP_SIZE     0x0001  // Do not extend file size
+
+#endif
+
+//
+// Flags for splice and vmsplice
+//
+
+#define SPLICE_F_GIFT           0x0008  // Pages are gifted to the pipe
+
 //
 // File mode flags (type and permissions)
 //
@@ -708,6 +724,22 @@ struct direntry {
   char name[MAXPATH];
 };
 
+//
+// Directory entry with attributes returned by _readdirplus(). Records are
+// packed back to back in the buffer; reclen is the distance to the next
+// record and is always a multiple of 8.
+//
+
+struct direntplus {
+  unsigned int reclen;
+  unsigned int namelen;
+  struct stat64 stat;
+  char name[MAXPATH];
+};
+
+#define DIRENTPLUS_HDRSIZE ((unsigned int) &((struct direntplus *) 0)->name)
+#define DIRENTPLUS_RECLEN(namelen) ((DIRENTPLUS_HDRSIZE + (namelen) + 1 + 7) & ~7)
+
 #ifndef _UTIMBUF_DEFINED
 #define _UTIMBUF_DEFINED
 
@@ -792,6 +824,94 @@ struct serial_status {
 #define IOCTL_SET_TTY            1033
 #define IOCTL_GET_TTY            1034
 
+//
+// Pipes
+//
+
+#define IOCTL_GETPIPE_SZ         1040
+#define IOCTL_SETPIPE_SZ         1041
+
+//
+// Proc file system
+//
+// Files generated by record can be switched to binary mode, where each
+// read returns an array of fixed-layout records instead of text.
+//
+
+#define IOCTL_PROC_BINARY        1050
+
+struct proc_thread {
+  int tid;                               // Thread id
+  handle_t hndl;                         // Thread handle
+  int state;                             // Thread state
+  int wait_reason;                       // Wait reason if waiting
+  int base_priority;                     // Base priority
+  int priority;                          // Current priority
+  int suspend_count;                     // Suspend count
+  int handle_count;                      // Number of handles to thread
+  unsigned long utime;                   // Time spent in user mode
+  unsigned long stime;                   // Time spent in kernel mode
+  unsigned long context_switches;        // Number of context switches
+  unsigned long stacksize;               // Size of user stack
+  char name[16];                         // Thread name
+};
+
+struct proc_bufstat {
+  char device[32];                       // Device name
+  unsigned long blocks_read;             // Blocks read from device
+  unsigned long blocks_written;          // Blocks written to device
+  unsigned long cache_hits;              // Buffer cache hits
+  unsigned long cache_misses;            // Buffer cache misses
+  unsigned long blocks_allocated;        // Buffers allocated
+  unsigned long blocks_freed;            // Buffers freed
+  unsigned long blocks_updated;          // Buffers marked dirty
+  unsigned long blocks_lazywrite;        // Buffers written by lazy writer
+  unsigned long blocks_synched;          // Buffers written by sync
+};
+
+struct proc_diskstat {
+  int devno;                             // Device number
+  char name[32];                         // Device name
+  unsigned long rd_ios;                  // Read requests
+  unsigned long rd_merges;               // Merged read requests
+  unsigned long rd_sectors;              // Sectors read
+  unsigned long rd_ms;                   // Time spent reading (ms)
+  unsigned long wr_ios;                  // Write requests
+  unsigned long wr_merges;               // Merged write requests
+  unsigned long wr_sectors;              // Sectors written
+  unsigned long wr_ms;                   // Time spent writing (ms)
+  int inflight;                          // Requests in progress
+  unsigned long io_ms;                   // Time device was busy (ms)
+  unsigned long weighted_ms;             // Total request time (ms)
+};
+
+//
+// DFS file system
+//
+// IOCTL_DFS_FRAGINFO and IOCTL_DFS_DEFRAG are issued on a regular file and
+// fill in a dfs_fraginfo structure. IOCTL_DFS_FREEINFO can be issued on any
+// file in the volume and fills in an array of dfs_freeinfo structures, one
+// per block group, returning the number of groups.
+//
+
+#define IOCTL_DFS_FRAGINFO       1060
+#define IOCTL_DFS_DEFRAG         1061
+#define IOCTL_DFS_FREEINFO       1062
+
+struct dfs_fraginfo {
+  unsigned int blocks;                   // Blocks allocated to file
+  unsigned int fragments;                // Runs of contiguous blocks
+  unsigned int moved;                    // Blocks relocated by defrag
+};
+
+struct dfs_freeinfo {
+  unsigned int group;                    // Block group number
+  unsigned int block_count;              // Blocks in group
+  unsigned int free_blocks;              // Free blocks in group
+  unsigned int free_runs;                // Runs of free blocks
+  unsigned int largest_run;              // Largest run of free blocks
+};
+
 //
 // I/O control codes
 //
@@ -1415,6 +1535,19 @@ osapi loff_t lseek(handle_t f, loff_t offset, int origin);
 osapi off64_t lseek64(handle_t f, off64_t offset, int origin);
 osapi int ftruncate(handle_t f, loff_t size);
 osapi int ftruncate64(handle_t f, off64_t size);
+osapi int fallocate(handle_t f, int mode, off64_t offset, off64_t len);
+osapi int splice(handle_t in, off64_t *inpos, handle_t out, off64_t *outpos, size_t count, int flags);
+osapi int copy_file_range(handle_t in, off64_t *inpos, handle_t out, off64_t *outpos, size_t count, int flags);
+
+// Asynchronous I/O requests are handles that are signaled (IOEVT_READ) on
+// completion; wait on them or add them to an iomux with dispatch(). Data
+// read by aio_read is stored in the buffer when aio_result is called.
+osapi handle_t aio_read(handle_t f, void *data, size_t size, off64_t offset);
+osapi handle_t aio_write(handle_t f, const void *data, size_t size, off64_t offset);
+osapi handle_t aio_fsync(handle_t f);
+osapi int aio_result(handle_t req);
+osapi int aio_cancel(handle_t req);
+
 osapi int futime(handle_t f, struct utimbuf *times);
 osapi int utime(const char *name, struct utimbuf *times);
 osapi int fstat(handle_t f, struct stat *buffer);
@@ -1449,8 +1582,10 @@ osapi int unlink(const char *name);
 
 osapi handle_t _opendir(const char *name);
 osapi int _readdir(handle_t f, struct direntry *dirp, int count);
+osapi int _readdirplus(handle_t f, struct direntplus *buf, size_t size);
 
 osapi int pipe(handle_t fildes[2]);
+osapi int vmsplice(handle_t f, struct iovec *iov, int count, int flags);
 
 osapi void *vmalloc(void *addr, unsigned long size, int type, int protect, unsigned long tag);
 osapi int vmfree(void *addr, unsigned long size, int type);
@@ -1619,6 +1754,7 @@ osapi int recvfrom(int s, void *data, int size, unsigned int flags, struct socka
 osapi int recvmsg(int s, struct msghdr *hdr, unsigned int flags);
 osapi int send(int s, const void *data, int size, unsigned int flags);
 osapi int sendto(int s, const void *data, int size, unsigned int flags, const struct sockaddr *to, int tolen);
+osapi int sendfile(int s, handle_t f, off64_t *offset, size_t count);
 osapi int sendmsg(int s, struct msghdr *hdr, unsigned int flags);
 osapi int setsockopt(int s, int level, int optname, const char *optval, int optlen);
 osapi int shutdown(int s, int how);
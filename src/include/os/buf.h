@@ -75,6 +75,7 @@ struct buf {
   struct buflink chain;
   unsigned short state;
   unsigned short locks;
+  unsigned short pins;
   struct thread *waiters;
   blkno_t blkno;
   char *data;
@@ -126,7 +127,10 @@ KERNELAPI struct buf *alloc_buffer(struct bufpool *pool, blkno_t blkno);
 KERNELAPI void mark_buffer_updated(struct bufpool *pool, struct buf *buf);
 KERNELAPI void mark_buffer_invalid(struct bufpool *pool, struct buf *buf);
 KERNELAPI void release_buffer(struct bufpool *pool, struct buf *buf);
+KERNELAPI void pin_buffer(struct bufpool *pool, struct buf *buf);
+KERNELAPI void unpin_buffer(struct bufpool *pool, struct buf *buf);
 KERNELAPI void invalidate_buffer(struct bufpool *pool, blkno_t blkno);
+KERNELAPI int sync_buffer(struct bufpool *pool, blkno_t blkno);
 KERNELAPI int flush_buffers(struct bufpool *pool, int interruptable);
 KERNELAPI int sync_buffers(struct bufpool *pool, int interruptable);
 
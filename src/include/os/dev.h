@@ -59,6 +59,7 @@ struct unit;
 #define IOCTL_GETDEVSIZE        2
 #define IOCTL_GETGEOMETRY       3
 #define IOCTL_REVALIDATE        4
+#define IOCTL_FLUSH             5
 
 #define RESOURCE_IO             1
 #define RESOURCE_MEM            2
@@ -170,6 +171,22 @@ struct driver
     int (*set_rx_mode)(struct dev *dev);
 };
 
+//
+// Block device I/O statistics
+//
+
+#define DEV_LAT_BUCKETS         24
+
+struct iostat
+{
+    unsigned long ops;                    // Completed requests
+    unsigned long errors;                 // Failed requests
+    unsigned long merges;                 // Requests merged with adjacent requests
+    unsigned long long bytes;             // Bytes transferred
+    unsigned long long cycles;            // Sum of request latencies in TSC cycles
+    unsigned long hist[DEV_LAT_BUCKETS];  // Latency histogram, bucket n is below 2^n us
+};
+
 //
 // Device
 //
@@ -191,6 +208,12 @@ struct dev
     int input;
     int output;
 
+    struct iostat rdstat;
+    struct iostat wrstat;
+    int inflight;                         // Requests currently in driver
+    unsigned long long busy;              // TSC cycles with requests in flight
+    unsigned long long busystart;         // Start of current busy period
+
     struct netif *netif;
     int (*receive)(struct netif *netif, struct pbuf *p);
 };
@@ -261,6 +284,7 @@ KERNELAPI int kdev_close(dev_t devno);
 KERNELAPI int kdev_ioctl(dev_t devno, int cmd, void *args, size_t size);
 KERNELAPI int kdev_read(dev_t devno, void *buffer, size_t count, blkno_t blkno, int flags);
 KERNELAPI int kdev_write(dev_t devno, void *buffer, size_t count, blkno_t blkno, int flags);
+KERNELAPI void kdev_merged(dev_t devno, int write, int count);
 
 KERNELAPI int kdev_attach(dev_t dev, struct netif *netif, int (*receive)(struct netif *netif, struct pbuf *p));
 KERNELAPI int kdev_detach(dev_t devno);
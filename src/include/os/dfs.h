@@ -39,7 +39,8 @@
 #include <os/user.h>
 
 #define DFS_SIGNATURE              0x00534644
-#define DFS_VERSION                2
+#define DFS_VERSION                3
+#define DFS_VERSION_NOINCOMPAT     2
 
 #define DFS_TOPBLOCKDIR_SIZE       16
 #define DFS_MAX_DEPTH              10
@@ -53,9 +54,63 @@
 #define NOINODE                    (-1)
 #define NOBLOCK                    (-1)
 
+#define DFS_INODE_HASHSIZE         256
+#define DFS_GROUP_RUNS             8
+
+#define DFS_PREALLOC_MIN           8
+#define DFS_DELALLOC_MAX           64
+#define DFS_DELALLOC_RESERVE       64
+
+#define DFS_SPLICE_BATCH           16
+#define DFS_COPY_CLUSTER           (256 * 1024)
+#define DFS_COPY_CLUSTER_MIN       (64 * 1024)
+#define DFS_DEFRAG_CLUSTER         (256 * 1024)
+
+#define DFS_JOURNAL_MIN            64
+#define DFS_JOURNAL_HASHSIZE       256
+
 #define FSOPT_QUICK                1
 #define FSOPT_PROGRESS             2
 #define FSOPT_FORMAT               4
+#define FSOPT_NODIRINDEX           8
+#define FSOPT_DIRINDEX             16
+#define FSOPT_NOEXTENTS            32
+#define FSOPT_EXTENTS              64
+#define FSOPT_NOJOURNAL            128
+#define FSOPT_JOURNAL              256
+
+//
+// Compatible features. DFS_FEATURE_DIRINDEX was used for directory indexing
+// before it became an incompatible feature. It is converted to
+// DFS_INCOMPAT_DIRINDEX when the file system is mounted.
+//
+
+#define DFS_FEATURE_DIRINDEX       0x00000001
+
+//
+// Incompatible features. A file system with an incompatible feature bit
+// that the kernel does not know must not be mounted. DFS_INCOMPAT_EXTENTS
+// marks file systems that may contain extent mapped files.
+// DFS_INCOMPAT_JOURNAL marks file systems with a metadata journal, which
+// must be replayed before the file system is modified.
+// DFS_INCOMPAT_DIRINDEX marks file systems that may contain hash indexed
+// directories, which a kernel without the index would corrupt when adding
+// entries. Directories without DFS_INODE_FLAG_DIRINDEX use the linear
+// format. Version 2 file systems have no incompatible feature word; a file
+// system is moved to DFS_VERSION 3 when the first incompatible feature is
+// enabled, so older kernels refuse it.
+//
+
+#define DFS_INCOMPAT_EXTENTS       0x00000001
+#define DFS_INCOMPAT_JOURNAL       0x00000002
+#define DFS_INCOMPAT_DIRINDEX      0x00000004
+
+#define DFS_INCOMPAT_SUPPORTED     (DFS_INCOMPAT_EXTENTS | DFS_INCOMPAT_JOURNAL | DFS_INCOMPAT_DIRINDEX)
+
+#define DFS_INODE_FLAG_DIRINDEX    0x0001
+#define DFS_INODE_FLAG_EXTENTS     0x0002
+
+#define DFS_EXTENT_MAGIC           0xE5E5
 
 #include <os/vfs.h>
 
@@ -66,6 +121,10 @@ struct fsoptions {
   int flags;
   int reserved_inodes;
   int reserved_blocks;
+  int inode_cache;
+  int prealloc;
+  int delalloc;
+  int journal;
 };
 
 struct superblock {
@@ -86,6 +145,10 @@ struct superblock {
   unsigned int cache_buffers;
   unsigned int compress_offset;
   unsigned int compress_size;
+  unsigned int features;
+  blkno_t journal_block;
+  unsigned int journal_blocks;
+  unsigned int incompat_features;
 };
 
 struct groupdesc {
@@ -102,7 +165,7 @@ struct inodedesc {
   mode_t mode;
   uid_t uid;
   gid_t gid;
-  unsigned short resv;
+  unsigned short flags;
   time_t atime;
   time_t ctime;
   time_t mtime;
@@ -121,17 +184,231 @@ struct dentry {
   char name[0];
 };
 
+//
+// Hash index for directories. Block 0 of an indexed directory is the index
+// root. With one index level the root points to index nodes, which point to
+// leaf blocks. Leaf blocks hold ordinary directory entries for a range of
+// name hashes. Index blocks start with an unused directory entry that covers
+// the whole block, so linear directory scans skip them.
+//
+
+struct dxentry {
+  unsigned int hash;
+  unsigned int block;
+};
+
+struct dxnode {
+  ino_t ino;                    // NOINODE
+  unsigned int reclen;          // Block size
+  unsigned int namelen;         // Block size minus directory entry header
+  unsigned int entries;         // Number of names in directory (root only)
+  unsigned short levels;        // Number of index node levels below root (root only)
+  unsigned short count;
+  unsigned short limit;
+  unsigned short reserved;
+  struct dxentry entry[0];
+};
+
+//
+// Extent tree for regular files. In an extent mapped inode the block
+// directory holds the root node of the tree and the inode depth is the
+// number of index levels. Leaf nodes hold runs of physically contiguous
+// blocks ordered by logical block; index nodes hold the first logical block
+// and the tree block of each child. Blocks are only added at the end of the
+// file, so nodes are always filled from the left.
+//
+
+struct extenthdr {
+  unsigned short magic;         // DFS_EXTENT_MAGIC
+  unsigned short count;         // Number of entries in node
+  unsigned short limit;         // Maximum number of entries in node
+  unsigned short reserved;
+};
+
+struct extent {
+  unsigned int iblock;          // First logical block
+  unsigned int count;           // Number of blocks
+  blkno_t start;                // First physical block
+};
+
+struct extentidx {
+  unsigned int iblock;          // First logical block covered by child
+  blkno_t block;                // Tree block for child
+};
+
+//
+// Metadata journal. The journal is a run of blocks reserved in the block
+// bitmap. The first block is the journal header and the rest is a circular
+// log of transactions. A transaction is one or more descriptor blocks, each
+// followed by copies of the blocks it tags, and a commit block with a
+// checksum of the transaction. Revoke tags have no block copy; they keep
+// older copies of a freed block from being replayed. Log positions are
+// block numbers relative to the start of the journal.
+//
+
+#define DFS_JOURNAL_MAGIC          0x4A534644
+
+#define JOURNAL_HEADER             1
+#define JOURNAL_DESCRIPTOR         2
+#define JOURNAL_COMMIT             3
+
+#define JOURNAL_TAG_REVOKE         0x0001
+
+struct jheader {
+  unsigned int magic;           // DFS_JOURNAL_MAGIC
+  unsigned int type;
+  unsigned int seq;             // Transaction sequence number
+};
+
+struct jsuper {
+  struct jheader hdr;           // Sequence number of first transaction
+  unsigned int blocksize;
+  unsigned int first;           // First log block
+  unsigned int last;            // Last log block
+  unsigned int start;           // Log block of first transaction, 0 if empty
+};
+
+struct jtag {
+  blkno_t block;
+  unsigned int flags;
+};
+
+struct jdesc {
+  struct jheader hdr;
+  unsigned int count;
+  struct jtag tag[0];
+};
+
+struct jcommit {
+  struct jheader hdr;
+  unsigned int blocks;          // Log blocks in transaction before commit block
+  unsigned int checksum;        // CRC32 of these blocks
+};
+
+//
+// In-memory summary of the largest runs of free blocks in a group. The
+// summary is built from the block bitmap when the group is first used for
+// allocation and is updated when blocks are allocated and freed. Runs in
+// the summary are always free, but not all free blocks are in the summary.
+//
+
+struct freerun {
+  unsigned int start;           // relative to group
+  unsigned int count;
+};
+
 struct blkgroup {
   struct groupdesc *desc;
-  unsigned int first_free_block; // relative to group
   unsigned int first_free_inode; // relative to group
+  int nruns;                    // -1 if summary has not been built
+  int runs_lost;                // Freed runs were left out of the summary
+  struct freerun runs[DFS_GROUP_RUNS];
+  unsigned char *committed;     // Block bitmap at last commit if running transaction freed blocks
+  unsigned char *reserved;      // Blocks reserved in memory, NULL if none
+  unsigned int nreserved;
+};
+
+//
+// In-memory journal state. Metadata buffers changed by the running
+// transaction are pinned in the buffer cache until the transaction has been
+// committed. File operations that run without the file system lock hold a
+// journal handle, and a transaction is only committed when no handles are
+// held. Blocks logged since the last checkpoint are recorded, so freeing
+// them adds a revoke tag to the running transaction.
+//
+
+struct jrecord {
+  blkno_t block;
+  unsigned int seq;             // Last transaction that logged or revoked the block
+  int revoked;                  // Revoked by running transaction
+  struct jrecord *next;
+};
+
+struct jhandle {
+  struct thread *thread;
+  struct jhandle *next;
 };
 
+struct journal {
+  blkno_t block;                // First block of journal
+  unsigned int first;           // First log block
+  unsigned int last;            // Last log block
+  unsigned int start;           // Log block of first transaction, 0 if empty
+  unsigned int head;            // Next log block to write
+  unsigned int used;            // Log blocks used since last checkpoint
+  unsigned int seq;             // Sequence number of running transaction
+
+  // Running transaction
+  struct buf **bufs;
+  int count;
+  int maxbufs;
+  int limit;
+  blkno_t *revokes;
+  int nrevokes;
+  int maxrevokes;
+
+  int error;                    // Running transaction could not be fully logged
+
+  // Handles for operations in progress and commit state
+  struct jhandle *handles;
+  int closing;
+  struct thread *committer;
+  struct mutex commit_lock;     // Held by the committer
+  struct event idle;            // Signaled when no handles are held
+  struct event open;            // Signaled when no commit is closing the transaction
+
+  struct jrecord *records[DFS_JOURNAL_HASHSIZE];
+
+  // Staging area for sequential log writes
+  char *iobuf;
+  int iosize;
+  int iocount;
+  unsigned int iostart;
+  unsigned long crc;
+
+  struct jsuper *super;
+};
+
+#define INODE_DIRTY                1
+#define INODE_FLUSHING             2
+#define INODE_DEFRAG               4
+
 struct inode {
   struct filsys *fs;
   ino_t ino;
   struct inodedesc *desc;
-  struct buf *buf;
+  int refcnt;
+  int flags;
+
+  // Inode cache hash chain and list of unreferenced inodes
+  struct inode *hash_next;
+  struct inode *hash_prev;
+  struct inode *lru_next;
+  struct inode *lru_prev;
+
+  // Last resolved run of contiguous blocks
+  unsigned int map_iblock;
+  unsigned int map_count;
+  blkno_t map_start;
+  unsigned int map_gen;
+
+  // Blocks reserved for appending to the file
+  blkno_t prealloc_start;
+  unsigned int prealloc_count;
+  unsigned int prealloc_window;
+
+  // Data written past the last allocated block. Blocks are assigned when
+  // the data is flushed.
+  char **delalloc;
+  unsigned int delalloc_count;
+
+  // Writes to the file data in progress and started, so a relocation can
+  // tell whether the data changed while it was copied
+  int writers;
+  unsigned int write_gen;
+
+  // In-memory copy of inode descriptor
+  struct inodedesc data;
 };
 
 struct filsys {
@@ -144,11 +421,29 @@ struct filsys {
   unsigned int groupdescs_per_block;
   unsigned int log_blkptrs_per_block;
   int super_dirty;
+  unsigned int map_gen;
 
   struct superblock *super;
   struct bufpool *cache;
   struct buf **groupdesc_buffers;
   struct blkgroup *groups;
+
+  // Inode cache
+  struct inode *inode_hash[DFS_INODE_HASHSIZE];
+  struct inode *lru_head;
+  struct inode *lru_tail;
+  int inodes_cached;
+  int inode_cache_size;
+
+  // Block allocation
+  unsigned int prealloc_limit;
+  unsigned int delalloc_limit;
+  unsigned int delalloc_blocks;
+
+  // Metadata journal
+  struct journal *journal;
+
+  struct fs *vfs;
 };
 
 #ifdef KRNL_LIB
@@ -174,14 +469,22 @@ int dfs_chown(struct fs *fs, char *name, int owner, int group);
 static struct filsys *create_filesystem(char *devname, struct fsoptions *fsopts);
 static struct filsys *open_filesystem(char *devname, struct fsoptions *fsopts);
 static void close_filesystem(struct filsys *fs);
+void set_incompat_feature(struct filsys *fs, unsigned int feature);
 int dfs_mkfs(char *devname, char *opts);
 int dfs_mount(struct fs *fs, char *opts);
 int dfs_umount(struct fs *fs);
 int dfs_statfs(struct fs *fs, struct statfs *buf);
 
 // group.c
+int new_blocks(struct filsys *fs, blkno_t goal, unsigned int count, blkno_t *first);
 blkno_t new_block(struct filsys *fs, blkno_t goal);
-void free_blocks(struct filsys *fs, blkno_t *blocks, int count);
+int free_blocks(struct filsys *fs, blkno_t *blocks, int count);
+blkno_t find_free_run(struct filsys *fs, blkno_t goal, unsigned int count);
+void release_freed_blocks(struct filsys *fs);
+int reserve_blocks(struct filsys *fs, blkno_t goal, unsigned int count, blkno_t *first);
+int claim_blocks(struct filsys *fs, blkno_t start, unsigned int count);
+void unreserve_blocks(struct filsys *fs, blkno_t start, unsigned int count);
+int get_group_freeinfo(struct filsys *fs, unsigned int group, struct dfs_freeinfo *info);
 
 ino_t new_inode(struct filsys *fs, ino_t parent, int dir);
 void free_inode(struct filsys *fs, ino_t ino);
@@ -189,13 +492,31 @@ void free_inode(struct filsys *fs, ino_t ino);
 // inode.c
 void mark_inode_dirty(struct inode *inode);
 blkno_t get_inode_block(struct inode *inode, unsigned int iblock);
+int map_inode_blocks(struct inode *inode, unsigned int iblock, unsigned int count, blkno_t *blk);
 blkno_t set_inode_block(struct inode *inode, unsigned int iblock, blkno_t block);
 struct inode *alloc_inode(struct inode *parent, mode_t mode);
 int unlink_inode(struct inode *inode);
 int get_inode(struct filsys *fs, ino_t ino, struct inode **retval);
 void release_inode(struct inode *inode);
+void stat_inode(struct inode *inode, struct stat64 *buffer);
+int sync_inodes(struct filsys *fs);
+void purge_inodes(struct filsys *fs);
 blkno_t expand_inode(struct inode *inode);
 int truncate_inode(struct inode *inode, unsigned int blocks);
+int reserve_inode_blocks(struct inode *inode, unsigned int count);
+int flush_delalloc(struct inode *inode);
+void free_extent_blocks(struct filsys *fs, blkno_t start, unsigned int count);
+int remap_inode_blocks(struct inode *inode, struct extent *oldmap, int nold, struct extent *newmap, int nnew);
+
+// journal.c
+int create_journal(struct filsys *fs, unsigned int blocks);
+int open_journal(struct filsys *fs);
+int close_journal(struct filsys *fs);
+void journal_start(struct filsys *fs, struct jhandle *h);
+void journal_stop(struct filsys *fs, struct jhandle *h);
+int journal_dirty(struct filsys *fs, struct buf *buf);
+int journal_revoke(struct filsys *fs, blkno_t block);
+int journal_commit(struct filsys *fs);
 
 // dir.c
 int find_dir_entry(struct inode *dir, char *name, int len, ino_t *retval);
@@ -208,8 +529,10 @@ int namei(struct filsys *fs, char *name, struct inode **inode);
 
 int dfs_opendir(struct file *filp, char *name);
 int dfs_readdir(struct file *filp, struct direntry *dirp, int count);
+int dfs_readdirplus(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count);
 
 // file.c
+int direct_transfer(struct inode *inode, blkno_t blk, int n, char *p, int write);
 int dfs_open(struct file *filp, char *name);
 int dfs_close(struct file *filp);
 int dfs_destroy(struct file *filp);
@@ -220,9 +543,17 @@ int dfs_ioctl(struct file *filp, int cmd, void *data, size_t size);
 off64_t dfs_tell(struct file *filp);
 off64_t dfs_lseek(struct file *filp, off64_t offset, int origin);
 int dfs_ftruncate(struct file *filp, off64_t size);
+int dfs_fallocate(struct file *filp, int mode, off64_t offset, off64_t len);
+int dfs_splice_read(struct file *filp, off64_t pos, size_t size, splice_actor_t actor, void *arg);
+int dfs_copy_range(struct file *in, off64_t inpos, struct file *out, off64_t outpos, size_t count);
 int dfs_futime(struct file *filp, struct utimbuf *times);
 int dfs_fstat(struct file *filp, struct stat64 *buffer);
 int dfs_fchmod(struct file *filp, int mode);
 int dfs_fchown(struct file *filp, int owner, int group);
 
+// defrag.c
+int dfs_fraginfo(struct file *filp, struct dfs_fraginfo *info);
+int dfs_defrag(struct file *filp, struct dfs_fraginfo *info);
+int dfs_freeinfo(struct file *filp, struct dfs_freeinfo *info, int count);
+
 #endif
@@ -51,8 +51,9 @@
 #define OBJECT_SOCKET     6
 #define OBJECT_IOMUX      7
 #define OBJECT_FILEMAP    8
+#define OBJECT_AIO        9
 
-#define OBJECT_TYPES      9
+#define OBJECT_TYPES      10
 
 #define THREAD_STATE_INITIALIZED 0
 #define THREAD_STATE_READY       1
@@ -75,7 +76,7 @@
 #define THREAD_ALERTABLE         4
 #define THREAD_INTERRUPTED       8
 
-#define ISIOOBJECT(o) ((o)->object.type == OBJECT_SOCKET || (o)->object.type == OBJECT_FILE)
+#define ISIOOBJECT(o) ((o)->object.type == OBJECT_SOCKET || (o)->object.type == OBJECT_FILE || (o)->object.type == OBJECT_AIO)
 
 #define THREAD_NAME_LEN          16
 
@@ -237,6 +238,7 @@ struct filemap {
   int pages;
 
   handle_t self;
+  struct filemap *next;
 };
 
 #include <os/sched.h>
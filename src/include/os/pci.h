@@ -90,6 +90,7 @@
 #define  PCI_COMMAND_WAIT               0x0080   // Enable address/data stepping
 #define  PCI_COMMAND_SERR               0x0100   // Enable SERR/
 #define  PCI_COMMAND_FAST_BACK          0x0200   // Enable back-to-back writes
+#define  PCI_COMMAND_INTX_DISABLE       0x0400   // Disable INTx interrupts
 
 //
 // PCI Status
@@ -121,6 +122,22 @@
 #define PCI_CAP_ID_MSI                  0x05    // Message Signalled Interrupts
 #define PCI_CAP_ID_CHSWP                0x06    // CompactPCI HotSwap
 
+//
+// PCI Message Signalled Interrupts
+//
+
+#define PCI_MSI_FLAGS                   2       // Message control (16 bits)
+#define PCI_MSI_FLAGS_ENABLE            0x0001  // MSI enable
+#define PCI_MSI_FLAGS_QSIZE             0x0070  // Multiple messages enabled
+#define PCI_MSI_FLAGS_64BIT             0x0080  // 64-bit addresses allowed
+#define PCI_MSI_ADDRESS_LO              4       // Lower 32 bits of message address
+#define PCI_MSI_ADDRESS_HI              8       // Upper 32 bits (64-bit capable devices)
+#define PCI_MSI_DATA_32                 8       // Message data for 32-bit devices
+#define PCI_MSI_DATA_64                 12      // Message data for 64-bit devices
+
+#define PCI_MSI_VECTOR_FIRST            50      // Interrupt vectors available for MSI
+#define PCI_MSI_VECTOR_LAST             63
+
 //
 // PCI Power Management
 //
@@ -164,6 +181,10 @@ KERNELAPI void pci_read_buffer(struct unit *unit, int addr, void *buffer, int le
 KERNELAPI void pci_write_buffer(struct unit *unit, int addr, void *buffer, int len);
 
 KERNELAPI void pci_enable_busmastering(struct unit *unit);
+KERNELAPI int pci_find_capability(struct unit *unit, int cap);
+
+KERNELAPI int pci_enable_msi(struct unit *unit);
+KERNELAPI void pci_msi_eoi();
 
 void enum_pci_bus(struct bus *bus);
 unsigned long get_pci_hostbus_unitcode();
@@ -71,6 +71,7 @@
 #define PFT_TIB               0x15
 #define PFT_PEB               0x16
 #define PFT_CACHE             0x17
+#define PFT_TMPFS             0x18 /// RAM file system data
 
 #define INVALID_PFRAME        ((uint32_t)0xFFFFFFFF)
 
@@ -37,20 +37,40 @@
 
 #define PROC_BLKSIZE    4088
 #define PROC_ROOT_INODE 0
+#define PROC_HASHSIZE   64
+
+#define PROC_SEQ_HEADER ((void *) 1)
 
 struct proc_file;
 
 typedef int (*proc_t)(struct proc_file *f, void *arg);
 
+/**
+ * Iterator for proc files generated one record at a time. start() returns
+ * the record at the given index (PROC_SEQ_HEADER may be returned for
+ * index 0) and next() the record following it, both NULL at the end.
+ * show() formats a record as text and record() writes it in binary form
+ * for files opened in binary mode (IOCTL_PROC_BINARY).
+ */
+struct proc_seqops
+{
+    void *(*start)(struct proc_file *pf, int index);
+    void *(*next)(struct proc_file *pf, void *v);
+    int (*show)(struct proc_file *pf, void *v);
+    int (*record)(struct proc_file *pf, void *v);
+};
+
 struct proc_inode
 {
     char *name;
     int namelen;
     ino_t ino;
     proc_t proc;
+    struct proc_seqops *seqops;
     void *arg;
     size_t size;
     struct proc_inode *next;
+    struct proc_inode *hash_next;
 };
 
 
@@ -68,11 +88,15 @@ struct proc_file
     size_t size;
     struct proc_blk *blkhead;
     struct proc_blk *blktail;
+    off64_t recoff;     /// File offset of buffered record (seq files)
+    int index;          /// Index of next record to generate (seq files)
+    int binary;         /// Generate binary records (seq files)
 };
 
 void init_procfs();
 
 KERNELAPI int register_proc_inode(char *name, proc_t proc, void *arg);
+KERNELAPI int register_proc_seq(char *name, struct proc_seqops *ops, void *arg);
 KERNELAPI int proc_write(struct proc_file *pf, void *buffer, size_t size);
 KERNELAPI int pprintf(struct proc_file *pf, const char *fmt, ...);
 
@@ -145,7 +145,18 @@
 #define SYSCALL_ALARM         108
 #define SYSCALL_VMMAP         109
 #define SYSCALL_VMSYNC        110
+#define SYSCALL_FALLOCATE     111
+#define SYSCALL_SENDFILE      112
+#define SYSCALL_SPLICE        113
+#define SYSCALL_VMSPLICE      114
+#define SYSCALL_READDIRPLUS   115
+#define SYSCALL_COPY_FILE_RANGE 116
+#define SYSCALL_AIO_READ      117
+#define SYSCALL_AIO_WRITE     118
+#define SYSCALL_AIO_FSYNC     119
+#define SYSCALL_AIO_RESULT    120
+#define SYSCALL_AIO_CANCEL    121
 
-#define SYSCALL_MAX           110
+#define SYSCALL_MAX           121
 
 #endif
@@ -74,6 +74,9 @@
 #define FSOP_UNLINK     0x04000000
 #define FSOP_OPENDIR    0x08000000
 #define FSOP_READDIR    0x10000000
+#define FSOP_FALLOCATE  0x20000000
+#define FSOP_SPLICE     0x40000000
+#define FSOP_READDIRPLUS 0x80000000
 
 struct filesystem
 {
@@ -96,8 +99,24 @@ struct fs
     gid_t gid;
     void *data;
     struct filesystem *fsys;
+    int flags;
+    struct fs *hashnext;
 };
 
+#define FS_DCACHE         1   // Namespace only changes through the VFS, names can be cached
+
+//
+// Directory entry cache
+//
+
+#define DCACHE_MAXNAME    255
+
+#define DCACHE_MISS       0
+#define DCACHE_HIT        1
+
+#define DCACHE_NEGATIVE   1   // Name does not exist
+#define DCACHE_SEARCH     2   // All directories on the path are searchable by everybody
+
 struct file {
   struct ioobject iob;
 
@@ -112,6 +131,35 @@ struct file {
   char chbuf;
 };
 
+//
+// Asynchronous file I/O request
+//
+
+#define AIO_READ          1
+#define AIO_WRITE         2
+#define AIO_FSYNC         3
+
+#define AIO_PENDING       0   // Queued, not yet picked up by a worker
+#define AIO_RUNNING       1   // Being executed by a worker
+#define AIO_DONE          2   // Completed, result is valid
+
+struct aio {
+  struct ioobject iob;
+
+  int op;
+  int state;
+  struct file *filp;
+  void *buffer;
+  size_t size;
+  off64_t offset;
+  int result;
+  char *bounce;       // Kernel copy of the data for requests from user space
+  void *user;         // User buffer that read data is copied back to
+  struct aio *next;
+};
+
+typedef int (*splice_actor_t)(void *arg, struct iovec *iov, int count);
+
 struct fsops {
   unsigned long reentrant;
 
@@ -159,6 +207,15 @@ struct fsops {
 
   int (*opendir)(struct file *filp, char *name);
   int (*readdir)(struct file *filp, struct direntry *dirp, int count);
+
+  int (*fallocate)(struct file *filp, int mode, off64_t offset, off64_t len);
+
+  int (*splice_read)(struct file *filp, off64_t pos, size_t size, splice_actor_t actor, void *arg);
+  int (*readdirplus)(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count);
+
+  int (*map_page)(struct file *filp, off64_t offset, unsigned long *pfn);
+
+  int (*copy_range)(struct file *in, off64_t inpos, struct file *out, off64_t outpos, size_t count);
 };
 
 #ifdef KERNEL
@@ -178,6 +235,13 @@ KERNELAPI int umount(char *path);
 
 int umount_all();
 
+int init_dcache();
+KERNELAPI unsigned long dcache_generation();
+KERNELAPI int dcache_lookup(struct fs *fs, char *name, int len, ino_t *ino, int *flags);
+KERNELAPI void dcache_enter(struct fs *fs, char *name, int len, ino_t ino, int flags, unsigned long gen);
+KERNELAPI void dcache_invalidate(struct fs *fs, char *name, int len, int subtree);
+KERNELAPI void dcache_purge(struct fs *fs);
+
 KERNELAPI int getfsstat(struct statfs *buf, size_t size);
 KERNELAPI int fstatfs(struct file *filp, struct statfs *buf);
 KERNELAPI int statfs(char *name, struct statfs *buf);
@@ -200,6 +264,13 @@ KERNELAPI int writev(struct file *filp, struct iovec *iov, int count);
 KERNELAPI off64_t tell(struct file *filp);
 KERNELAPI off64_t lseek(struct file *filp, off64_t offset, int origin);
 KERNELAPI int ftruncate(struct file *filp, off64_t size);
+KERNELAPI int fallocate(struct file *filp, int mode, off64_t offset, off64_t len);
+
+KERNELAPI int splice_read(struct file *filp, off64_t pos, size_t size, splice_actor_t actor, void *arg);
+KERNELAPI int map_page(struct file *filp, off64_t offset, unsigned long *pfn);
+KERNELAPI int splice(struct object *in, off64_t *inpos, struct object *out, off64_t *outpos, size_t count, int flags);
+KERNELAPI int copy_range(struct file *in, off64_t inpos, struct file *out, off64_t outpos, size_t count);
+KERNELAPI int copy_file_range(struct file *in, off64_t *inpos, struct file *out, off64_t *outpos, size_t count, int flags);
 
 KERNELAPI int futime(struct file *filp, struct utimbuf *times);
 KERNELAPI int utime(char *name, struct utimbuf *times);
@@ -225,6 +296,15 @@ KERNELAPI int unlink(char *name);
 
 KERNELAPI int opendir(char *name, struct file **retval);
 KERNELAPI int readdir(struct file *filp, struct direntry *dirp, int count);
+KERNELAPI int readdirplus(struct file *filp, struct direntplus *buf, size_t size);
+
+// aio.c
+
+KERNELAPI int submit_aio(struct file *filp, int op, void *buffer, size_t size, off64_t offset, struct aio **retval);
+KERNELAPI int cancel_aio(struct aio *aio);
+int submit_user_aio(struct file *filp, int op, void *data, size_t size, off64_t offset, struct aio **retval);
+int close_aio(struct aio *aio);
+int destroy_aio(struct aio *aio);
 
 #endif
 
@@ -61,6 +61,13 @@
 #define VIRTIO_CONFIG_S_DRIVER_OK       4
 #define VIRTIO_CONFIG_S_FAILED          0x80
 
+//
+// Transport feature bits
+//
+
+#define VIRTIO_RING_F_INDIRECT_DESC     (1 << 28) // Supports indirect descriptor tables
+#define VIRTIO_RING_F_EVENT_IDX         (1 << 29) // Supports used_event and avail_event fields
+
 //
 // Ring descriptor flags
 //
@@ -108,6 +115,20 @@ struct vring {
   struct vring_used *used;
 };
 
+//
+// Event index fields are placed right after the avail and used rings
+//
+
+#define vring_used_event(vr) ((vr)->avail->ring[(vr)->size])
+#define vring_avail_event(vr) (*(unsigned short *) &(vr)->used->ring[(vr)->size])
+
+//
+// Maximum number of descriptors in an indirect table. The table is
+// allocated with kmalloc and must not cross a page boundary.
+//
+
+#define VIRTIO_MAX_INDIRECT (PAGESIZE / 2 / sizeof(struct vring_desc))
+
 //
 // Virtual queue
 //
@@ -130,6 +151,7 @@ struct virtio_queue {
   struct event bufavail;        // Event for tracking free buffers
   virtio_callback_t callback;   // Callback for notifying about completion
   void **data;                  // Tokens for callbacks
+  struct vring_desc **indirect; // Indirect descriptor tables for each head
 };
 
 //
@@ -168,5 +190,7 @@ KERNELAPI int virtio_queue_size(struct virtio_queue *vq);
 KERNELAPI int virtio_enqueue(struct virtio_queue *vq, struct scatterlist sg[], unsigned int out, unsigned int in, void *data);
 KERNELAPI void virtio_kick(struct virtio_queue *vq);
 KERNELAPI void *virtio_dequeue(struct virtio_queue *vq, unsigned int *len);
+KERNELAPI void virtio_disable_cb(struct virtio_queue *vq);
+KERNELAPI int virtio_enable_cb(struct virtio_queue *vq);
 
 #endif
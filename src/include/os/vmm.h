@@ -49,6 +49,7 @@ KERNELAPI int vmsync(void *addr, unsigned long size);
 KERNELAPI int vmfree(void *addr, unsigned long size, int type);
 KERNELAPI void *vmrealloc(void *addr, unsigned long oldsize, unsigned long newsize, int type, int protect, unsigned long tag);
 KERNELAPI int vmprotect(void *addr, unsigned long size, int protect);
+KERNELAPI void *vmdetach(void *addr, unsigned long size, int *rc);
 KERNELAPI int vmlock(void *addr, unsigned long size);
 KERNELAPI int vmunlock(void *addr, unsigned long size);
 
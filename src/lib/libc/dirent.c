@@ -62,11 +62,85 @@ int closedir(DIR *dirp) {
   }
 
   rc = close(dirp->handle);
+  if (dirp->buf) free(dirp->buf);
   free(dirp);
   
   return rc;
 }
 
+static struct direntplus *next_direntplus(DIR *dirp) {
+  struct direntplus *dp;
+  int rc;
+
+  if (dirp->bufpos >= dirp->buflen) {
+    if (!dirp->buf) {
+      dirp->buf = (char *) malloc(DIRPLUS_BUFSIZE);
+      if (!dirp->buf) {
+        errno = ENOMEM;
+        return NULL;
+      }
+    }
+
+    dirp->bufpos = dirp->buflen = 0;
+    rc = _readdirplus(dirp->handle, (struct direntplus *) dirp->buf, DIRPLUS_BUFSIZE);
+    if (rc <= 0) return NULL;
+    dirp->buflen = rc;
+  }
+
+  dp = (struct direntplus *) (dirp->buf + dirp->bufpos);
+  dirp->bufpos += dp->reclen;
+
+  dirp->entry.d_ino = dp->stat.st_ino;
+  dirp->entry.d_namlen = dp->namelen;
+  memcpy(dirp->entry.d_name, dp->name, dp->namelen);
+  dirp->entry.d_name[dp->namelen] = 0;
+
+  return dp;
+}
+
+struct dirent *readdirplus64(DIR *dirp, struct stat64 *buffer) {
+  struct direntplus *dp;
+
+  if (!dirp) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  dp = next_direntplus(dirp);
+  if (!dp) return NULL;
+
+  if (buffer) memcpy(buffer, &dp->stat, sizeof(struct stat64));
+  return &dirp->entry;
+}
+
+struct dirent *readdirplus(DIR *dirp, struct stat *buffer) {
+  struct direntplus *dp;
+
+  if (!dirp) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  dp = next_direntplus(dirp);
+  if (!dp) return NULL;
+
+  if (buffer) {
+    buffer->st_dev = dp->stat.st_dev;
+    buffer->st_ino = dp->stat.st_ino;
+    buffer->st_mode = dp->stat.st_mode;
+    buffer->st_nlink = dp->stat.st_nlink;
+    buffer->st_uid = dp->stat.st_uid;
+    buffer->st_gid = dp->stat.st_gid;
+    buffer->st_rdev = dp->stat.st_rdev;
+    buffer->st_size = dp->stat.st_size > 0x7FFFFFFF ? 0x7FFFFFFF : (loff_t) dp->stat.st_size;
+    buffer->st_atime = dp->stat.st_atime;
+    buffer->st_mtime = dp->stat.st_mtime;
+    buffer->st_ctime = dp->stat.st_ctime;
+  }
+
+  return &dirp->entry;
+}
+
 struct dirent *readdir(DIR *dirp) {
   struct direntry dirent;
   int rc;
@@ -76,6 +150,9 @@ struct dirent *readdir(DIR *dirp) {
     return NULL;
   }
 
+  // Return entries already read ahead by readdirplus first
+  if (dirp->bufpos < dirp->buflen) return next_direntplus(dirp) ? &dirp->entry : NULL;
+
   rc = _readdir(dirp->handle, &dirent, 1);
   if (rc <= 0) return NULL;
 
@@ -96,6 +173,13 @@ int readdir_r(DIR *dirp, struct dirent *entry, struct dirent **result) {
     return -1;
   }
 
+  if (dirp->bufpos < dirp->buflen) {
+    if (!next_direntplus(dirp)) return -1;
+    memcpy(entry, &dirp->entry, sizeof(struct dirent));
+    *result = entry;
+    return 0;
+  }
+
   rc = _readdir(dirp->handle, &dirent, 1);
   if (rc <= 0) return -1;
 
@@ -115,6 +199,7 @@ int rewinddir(DIR *dirp) {
   }
 
   close(dirp->handle);
+  dirp->bufpos = dirp->buflen = 0;
   dirp->handle = _opendir(dirp->path);
   if (dirp->handle < 0) return -1;
   return 0;
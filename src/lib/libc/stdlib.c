@@ -35,6 +35,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
 #include <inifile.h>
 
 #define SHELL "sh.exe"
@@ -306,6 +308,20 @@ int lockf(handle_t f, int func, off_t size) {
 }
 
 int fcntl(handle_t f, int cmd, ...) {
+  va_list args;
+  int arg;
+
+  switch (cmd) {
+    case F_GETPIPE_SZ:
+      return ioctl(f, IOCTL_GETPIPE_SZ, NULL, 0);
+
+    case F_SETPIPE_SZ:
+      va_start(args, cmd);
+      arg = va_arg(args, int);
+      va_end(args);
+      return ioctl(f, IOCTL_SETPIPE_SZ, &arg, sizeof(int));
+  }
+
   // TODO implement
   errno = ENOSYS;
   return -1;
@@ -328,9 +328,8 @@ void doretr(struct ftpstate *fs, char *name) {
   struct stat st;
   clock_t started;
   clock_t ended;
-  int ofs;
+  off64_t ofs;
   int n;
-  char buf[4096];
   double t;
   double speed;
 
@@ -384,33 +383,20 @@ void doretr(struct ftpstate *fs, char *name) {
 
   started = clock();
   ofs = fs->restartat;
-  if (ofs != 0) lseek(f, ofs, SEEK_SET);
 
   while (ofs < st.st_size) {
-    n = st.st_size - ofs;
-    if (n > sizeof(buf)) n = sizeof(buf);
-
-    n  = read(f, buf, n);
+    n = sendfile(sock, f, &ofs, (size_t) (st.st_size - ofs));
     if (n <= 0) {
       if (n == 0) {
         addreply(fs, 451, "unexpected end of file");
       } else {
-        error(fs, 451, "error reading file");
+        addreply(fs, 426, "Transfer aborted");
       }
 
       close(f);
       close(sock);
       return;
     }
-
-    if (send(sock, buf, n, 0) < 0) {
-      addreply(fs, 426, "Transfer aborted");
-      close(f);
-      close(sock);
-      return;
-    }
-
-    ofs += n;
   }
 
   ended = clock();
@@ -816,6 +802,7 @@ void donlist(struct ftpstate *fs, char *arg) {
   char dirname[MAXPATH];
   DIR *dir;
   struct dirent *de;
+  struct stat st;
   int sock;
   int matches;
   int opt_l = 0;
@@ -855,23 +842,16 @@ void donlist(struct ftpstate *fs, char *arg) {
   doreply(fs);
 
   matches = 0;
-  while ((de = readdir(dir)) != NULL) {
+  while ((de = opt_l ? readdirplus(dir, &st) : readdir(dir)) != NULL) {
     char buf[MAXPATH + 128];
 
     if (opt_l) {
-      char fn[MAXPATH * 2 + 2];
-      struct stat st;
       char perm[11];
       char timestr[6];
       struct passwd *pwd;
       struct group *grp;
       struct tm *tm;
 
-      strcpy(fn, dirname);
-      strcat(fn, "/");
-      strcat(fn, de->d_name);
-
-      if (stat(fn, &st) < 0) continue;
       if ((tm = localtime(&st.st_mtime)) == NULL) continue;
 
       strcpy(perm, " ---------");
@@ -40,6 +40,8 @@
 
 #include <httpd.h>
 
+#define LS_DIRBUF_SIZE 4096
+
 char *get_extension(char *path) {
   char *ext;
 
@@ -73,9 +75,10 @@ int ls(struct httpd_connection *conn) {
   int dir;
   int rc;
   int urllen;
-  struct stat64 statbuf;
-  struct direntry dirp;
-  char path[MAXPATH];
+  int pos;
+  struct stat64 *statbuf;
+  struct direntplus *dirp;
+  char dirbuf[LS_DIRBUF_SIZE];
   char buf[32];
   struct tm *tm;
 
@@ -100,53 +103,51 @@ int ls(struct httpd_connection *conn) {
 
   if (urllen > 1) httpd_send(conn->rsp, "<IMG SRC=\"/icons/folder.gif\"> <A HREF=\"..\">..</A>\r\n", -1);
 
-  while (_readdir(dir, &dirp, 1) > 0) {
-    strcpy(path, conn->req->path_translated);
-    strcat(path, "/");
-    strcat(path, dirp.name);
+  while ((rc = _readdirplus(dir, (struct direntplus *) dirbuf, sizeof(dirbuf))) > 0) {
+    for (pos = 0; pos < rc; pos += dirp->reclen) {
+      dirp = (struct direntplus *) (dirbuf + pos);
+      statbuf = &dirp->stat;
 
-    rc = stat64(path, &statbuf);
-    if (rc < 0) return -1;
+      tm = gmtime(&statbuf->st_mtime);
+      if (!tm) return -1;
 
-    tm = gmtime(&statbuf.st_mtime);
-    if (!tm) return -1;
+      if ((statbuf->st_mode & S_IFMT) == S_IFDIR) {
+        httpd_send(conn->rsp, "<IMG SRC=\"/icons/folder.gif\"> ", -1);
+      } else {
+        httpd_send(conn->rsp, "<IMG SRC=\"/icons/file.gif\"> ", -1);
+      }
 
-    if ((statbuf.st_mode & S_IFMT) == S_IFDIR) {
-      httpd_send(conn->rsp, "<IMG SRC=\"/icons/folder.gif\"> ", -1);
-    } else {
-      httpd_send(conn->rsp, "<IMG SRC=\"/icons/file.gif\"> ", -1);
-    }
+      httpd_send(conn->rsp, "<A HREF=\"", -1);
+      httpd_send(conn->rsp, dirp->name, dirp->namelen);
+      if ((statbuf->st_mode & S_IFMT) == S_IFDIR) httpd_send(conn->rsp, "/", -1);
+      httpd_send(conn->rsp, "\">", -1);
 
-    httpd_send(conn->rsp, "<A HREF=\"", -1);
-    httpd_send(conn->rsp, dirp.name, dirp.namelen);
-    if ((statbuf.st_mode & S_IFMT) == S_IFDIR) httpd_send(conn->rsp, "/", -1);
-    httpd_send(conn->rsp, "\">", -1);
+      httpd_send(conn->rsp, dirp->name, dirp->namelen);
+      if ((statbuf->st_mode & S_IFMT) == S_IFDIR) httpd_send(conn->rsp, "/", -1);
+      httpd_send(conn->rsp, "</A>", -1);
+      if ((statbuf->st_mode & S_IFMT) != S_IFDIR) httpd_send(conn->rsp, " ", -1);
 
-    httpd_send(conn->rsp, dirp.name, dirp.namelen);
-    if ((statbuf.st_mode & S_IFMT) == S_IFDIR) httpd_send(conn->rsp, "/", -1);
-    httpd_send(conn->rsp, "</A>", -1);
-    if ((statbuf.st_mode & S_IFMT) != S_IFDIR) httpd_send(conn->rsp, " ", -1);
+      if (dirp->namelen < 32) httpd_send(conn->rsp, "                                        ", 32 - dirp->namelen);
 
-    if (dirp.namelen < 32) httpd_send(conn->rsp, "                                        ", 32 - dirp.namelen);
+      strftime(buf, 32, "%d-%b-%Y %H:%M:%S", tm);
+      httpd_send(conn->rsp, buf, -1);
 
-    strftime(buf, 32, "%d-%b-%Y %H:%M:%S", tm);
-    httpd_send(conn->rsp, buf, -1);
+      if ((statbuf->st_mode & S_IFMT) != S_IFDIR) {
+        if (statbuf->st_size < 1024) {
+          sprintf(buf, "%8d B", (int) statbuf->st_size);
+        } else if (statbuf->st_size < 1024 * 1024) {
+          sprintf(buf, "%8d KB", (int) (statbuf->st_size / 1024));
+        } else if (statbuf->st_size < 1073741824i64) {
+          sprintf(buf, "%8d MB", (int) (statbuf->st_size / (1024 * 1024)));
+        } else {
+          sprintf(buf, "%8d GB", (int) (statbuf->st_size / 1073741824i64));
+        }
 
-    if ((statbuf.st_mode & S_IFMT) != S_IFDIR) {
-      if (statbuf.st_size < 1024) {
-        sprintf(buf, "%8d B", (int) statbuf.st_size);
-      } else if (statbuf.st_size < 1024 * 1024) {
-        sprintf(buf, "%8d KB", (int) (statbuf.st_size / 1024));
-      } else if (statbuf.st_size < 1073741824i64) {
-        sprintf(buf, "%8d MB", (int) (statbuf.st_size / (1024 * 1024)));
-      } else {
-        sprintf(buf, "%8d GB", (int) (statbuf.st_size / 1073741824i64));
+        httpd_send(conn->rsp, buf, -1);
       }
 
-      httpd_send(conn->rsp, buf, -1);
+      httpd_send(conn->rsp, "\r\n", -1);
     }
-
-    httpd_send(conn->rsp, "\r\n", -1);
   }
 
   httpd_send(conn->rsp, "</PRE><HR>\r\n", -1);
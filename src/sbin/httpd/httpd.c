@@ -934,7 +934,8 @@ int httpd_translate_path(struct httpd_request *req) {
 int httpd_write(struct httpd_connection *conn) {
   int left;
   int bytes;
-  int rc;
+  int size;
+  loff_t pos;
 
   // Sent any remaining data in response header
   left = conn->rsphdr.end - conn->rsphdr.start;
@@ -955,36 +956,31 @@ int httpd_write(struct httpd_connection *conn) {
     if (bytes < left) return 1;
   }
 
-  // Send response body
-  while (1) {
-    // Send any remaining data in response body buffer
-    left = conn->rspbody.end - conn->rspbody.start;
-    if (left > 0) {
-      bytes = send(conn->sock, conn->rspbody.start, left, 0);
-      if (bytes < 0) return bytes;
-      conn->rspbody.start += bytes;
-      if (bytes < left) return 1;
-    }
+  // Send any remaining data in response body buffer
+  left = conn->rspbody.end - conn->rspbody.start;
+  if (left > 0) {
+    bytes = send(conn->sock, conn->rspbody.start, left, 0);
+    if (bytes < 0) return bytes;
+    conn->rspbody.start += bytes;
+    if (bytes < left) return 1;
+  }
 
-    // Fill response buffer
-    if (conn->fd >= 0) {
-      // Allocate response body buffer if not already done
-      if (conn->rspbody.floor == NULL) {
-        rc = allocate_buffer(&conn->rspbody, conn->server->rspbufsiz);
-        if (rc < 0) return rc;
-      }
+  // Send rest of response file directly from the kernel
+  if (conn->fd >= 0) {
+    size = fstat(conn->fd, NULL);
+    if (size < 0) return size;
+    pos = tell(conn->fd);
+    if (pos < 0) return pos;
 
-      // Read from file
-      bytes = read(conn->fd, conn->rspbody.floor, buffer_capacity(&conn->rspbody));
+    left = size - pos;
+    if (left > 0) {
+      bytes = sendfile(conn->sock, conn->fd, NULL, left);
       if (bytes < 0) return bytes;
-      if (bytes == 0) return 0;
-
-      conn->rspbody.start = conn->rspbody.floor;
-      conn->rspbody.end = conn->rspbody.floor + bytes;
-    } else {
-      return 0;
+      if (bytes < left) return 1;
     }
   }
+
+  return 0;
 }
 
 int httpd_process(struct httpd_connection *conn) {
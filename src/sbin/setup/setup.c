@@ -282,6 +282,31 @@ int dosysprep(struct section *sect) {
   return 0;
 }
 
+//
+// copy_data
+//
+// Copy up to size bytes from fin to fout. The data is copied in the kernel
+// when possible and through the block buffer when the files do not support
+// it, e.g. devices and procfs files.
+//
+
+int copy_data(int fin, int fout, int size) {
+  int bytes;
+  int rc;
+
+  bytes = copy_file_range(fin, NULL, fout, NULL, size, 0);
+  if (bytes >= 0 || (errno != EINVAL && errno != ENOSYS && errno != ESPIPE)) return bytes;
+
+  if (size > sizeof block) size = sizeof block;
+  bytes = read(fin, block, size);
+  if (bytes <= 0) return bytes;
+
+  rc = write(fout, block, bytes);
+  if (rc < 0) return -1;
+
+  return bytes;
+}
+
 //
 // dokernel
 //
@@ -323,16 +348,13 @@ int dokernel(struct section *sect) {
 
   left = size;
   while (left > 0) {
-    bytes = read(fin, block, sizeof block);
+    bytes = copy_data(fin, fout, left);
     if (!bytes) {
       errno = EIO;
       return -1;
     }
     if (bytes < 0) return -1;
 
-    rc = write(fout, block, bytes);
-    if (rc < 0) return -1;
-
     left -= bytes;
   }
 
@@ -438,16 +460,13 @@ int copy_file(char *srcfn, char *dstfn) {
   ut.actime = st.st_atime;
   futime(fout, &ut);
 
-  while ((bytes = read(fin , block, sizeof block)) > 0) {
-    rc = write(fout, block, bytes);
-    if (rc < 0) return -1;
-  }
-
-  if (bytes < 0) return -1;
+  // Copy until end of file; procfs and device files do not report their size
+  while ((bytes = copy_data(fin, fout, sizeof block)) > 0);
 
   close(fin);
   close(fout);
 
+  if (bytes < 0) return -1;
   return 0;
 }
 
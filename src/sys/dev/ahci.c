@@ -0,0 +1,978 @@
+//
+// ahci.c
+//
+// AHCI SATA disk driver with native command queuing
+//
+// Copyright (C) 2013-2014 Bruno Ribeiro.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+//
+
+#include <os/krnl.h>
+#include <os/dev.h>
+#include <os/trap.h>
+#include <os/pci.h>
+#include <os/pic.h>
+#include <os/kmem.h>
+#include <bitops.h>
+
+#define PCI_CLASS_STORAGE_SATA_AHCI 0x010601
+
+#define AHCI_MAX_PORTS          32
+#define AHCI_MAX_SLOTS          32
+#define AHCI_MAX_PRDS           56
+#define AHCI_MAX_XFER_SIZE      ((AHCI_MAX_PRDS - 1) * PAGESIZE)
+#define AHCI_MAX_PRD_BYTES      (4 * 1024 * 1024)
+
+#define AHCI_TIMEOUT_RESET      1000
+#define AHCI_TIMEOUT_LINK       1000
+#define AHCI_TIMEOUT_STOP       500
+#define AHCI_TIMEOUT_BUSY       60000
+#define AHCI_TIMEOUT_XFER       10000
+
+//
+// HBA generic host control registers
+//
+
+#define AHCI_CAP                0x00    // Host capabilities
+#define AHCI_GHC                0x04    // Global host control
+#define AHCI_IS                 0x08    // Interrupt status
+#define AHCI_PI                 0x0C    // Ports implemented
+#define AHCI_VS                 0x10    // Version
+#define AHCI_CCC_CTL            0x14    // Command completion coalescing control
+#define AHCI_CCC_PORTS          0x18    // Command completion coalescing ports
+
+#define AHCI_CAP_NP             0x0000001F  // Number of ports
+#define AHCI_CAP_CCCS           0x00000080  // Supports command completion coalescing
+#define AHCI_CAP_NCS            0x00001F00  // Number of command slots
+#define AHCI_CAP_SCLO           0x01000000  // Supports command list override
+#define AHCI_CAP_SSS            0x08000000  // Supports staggered spin-up
+#define AHCI_CAP_SNCQ           0x40000000  // Supports native command queuing
+#define AHCI_CAP_S64A           0x80000000  // Supports 64-bit addressing
+
+#define AHCI_GHC_HR             0x00000001  // HBA reset
+#define AHCI_GHC_IE             0x00000002  // Interrupt enable
+#define AHCI_GHC_AE             0x80000000  // AHCI enable
+
+#define AHCI_CCC_EN             0x00000001  // Enable coalescing
+#define AHCI_CCC_INT_SHIFT      3           // Interrupt used for coalescing
+#define AHCI_CCC_CC_SHIFT       8           // Command completions
+#define AHCI_CCC_TV_SHIFT       16          // Timeout value in ms
+
+//
+// Port registers
+//
+
+#define AHCI_PORT_BASE          0x100
+#define AHCI_PORT_SIZE          0x80
+
+#define AHCI_PxCLB              0x00    // Command list base address
+#define AHCI_PxCLBU             0x04    // Command list base address upper 32 bits
+#define AHCI_PxFB               0x08    // FIS base address
+#define AHCI_PxFBU              0x0C    // FIS base address upper 32 bits
+#define AHCI_PxIS               0x10    // Interrupt status
+#define AHCI_PxIE               0x14    // Interrupt enable
+#define AHCI_PxCMD              0x18    // Command and status
+#define AHCI_PxTFD              0x20    // Task file data
+#define AHCI_PxSIG              0x24    // Signature
+#define AHCI_PxSSTS             0x28    // SATA status
+#define AHCI_PxSCTL             0x2C    // SATA control
+#define AHCI_PxSERR             0x30    // SATA error
+#define AHCI_PxSACT             0x34    // SATA active (NCQ tags outstanding)
+#define AHCI_PxCI               0x38    // Command issue
+
+#define AHCI_PxCMD_ST           0x00000001  // Start
+#define AHCI_PxCMD_SUD          0x00000002  // Spin-up device
+#define AHCI_PxCMD_POD          0x00000004  // Power on device
+#define AHCI_PxCMD_CLO          0x00000008  // Command list override
+#define AHCI_PxCMD_FRE          0x00000010  // FIS receive enable
+#define AHCI_PxCMD_FR           0x00004000  // FIS receive running
+#define AHCI_PxCMD_CR           0x00008000  // Command list running
+
+#define AHCI_PxINT_DHRS         0x00000001  // Device to host register FIS
+#define AHCI_PxINT_PSS          0x00000002  // PIO setup FIS
+#define AHCI_PxINT_DSS          0x00000004  // DMA setup FIS
+#define AHCI_PxINT_SDBS         0x00000008  // Set device bits FIS
+#define AHCI_PxINT_DPS          0x00000020  // Descriptor processed
+#define AHCI_PxINT_IFS          0x08000000  // Interface fatal error
+#define AHCI_PxINT_HBDS         0x10000000  // Host bus data error
+#define AHCI_PxINT_HBFS         0x20000000  // Host bus fatal error
+#define AHCI_PxINT_TFES         0x40000000  // Task file error
+
+#define AHCI_PxINT_COMPLETE     (AHCI_PxINT_DHRS | AHCI_PxINT_PSS | AHCI_PxINT_SDBS)
+#define AHCI_PxINT_ERROR        (AHCI_PxINT_IFS | AHCI_PxINT_HBDS | AHCI_PxINT_HBFS | AHCI_PxINT_TFES)
+
+#define AHCI_PxTFD_ERR          0x01
+#define AHCI_PxTFD_DRQ          0x08
+#define AHCI_PxTFD_BSY          0x80
+
+#define AHCI_SSTS_DET_MASK      0x0F
+#define AHCI_SSTS_DET_PRESENT   0x03
+
+#define AHCI_SCTL_DET_MASK      0x0F
+#define AHCI_SCTL_DET_INIT      0x01    // Send COMRESET
+
+#define AHCI_SIG_ATA            0x00000101
+
+//
+// ATA commands
+//
+
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+#define ATA_CMD_IDENTIFY        0xEC
+
+#define FIS_TYPE_REG_H2D        0x27
+#define FIS_REG_H2D_CMD         0x80
+#define ATA_DEV_LBA             0x40
+
+//
+// Command list header
+//
+
+#define AHCI_CMDHDR_WRITE       0x0040
+#define AHCI_CMDHDR_PREFETCH    0x0080
+#define AHCI_CMDHDR_CLR_BUSY    0x0400
+
+struct ahci_cmdhdr {
+  unsigned short flags;                 // Command FIS length in dwords and flags
+  unsigned short prdtl;                 // Number of PRD table entries
+  unsigned long prdbc;                  // Bytes transferred
+  unsigned long ctba;                   // Command table base address
+  unsigned long ctbau;                  // Command table base address upper 32 bits
+  unsigned long reserved[4];
+};
+
+//
+// Physical region descriptor
+//
+
+#define AHCI_PRD_INTR           0x80000000
+
+struct ahci_prd {
+  unsigned long dba;                    // Data base address
+  unsigned long dbau;                   // Data base address upper 32 bits
+  unsigned long reserved;
+  unsigned long dbc;                    // Byte count - 1 and interrupt flag
+};
+
+//
+// Command table (must be 128 byte aligned)
+//
+
+struct ahci_cmdtbl {
+  unsigned char cfis[64];               // Command FIS
+  unsigned char acmd[16];               // ATAPI command
+  unsigned char reserved[48];
+  struct ahci_prd prdt[AHCI_MAX_PRDS];  // Physical region descriptor table
+};
+
+//
+// Request; may span several command slots
+//
+
+struct ahci_request {
+  struct event done;                    // Signaled when no slots are pending
+  int pending;                          // Number of slots outstanding
+  int result;                           // First error, or zero
+};
+
+struct ahci;
+
+struct ahci_port {
+  struct ahci *hba;                     // Host bus adapter
+  int portno;                           // Port number on HBA
+  unsigned char *regs;                  // Port registers
+
+  struct ahci_cmdhdr *cmdlist;          // Command list (1K aligned)
+  unsigned char *rfis;                  // Received FIS area (256 byte aligned)
+  struct ahci_cmdtbl *cmdtbl;           // Command tables, one per slot
+
+  int ncq;                              // Use native command queuing
+  int depth;                            // Number of usable command slots
+  unsigned long busy;                   // Slots in use
+  unsigned long issued;                 // Slots written to the command issue register
+  int recover;                          // Command engine stopped after an error
+  unsigned long irqstat;                // Port interrupt status from handler
+  struct ahci_request *reqs[AHCI_MAX_SLOTS]; // Request owning each slot
+
+  struct sem slots;                     // Free command slots
+  struct mutex lock;                    // Excludes non-queued commands
+  struct event idle;                    // Signaled when all slots complete
+
+  unsigned int blks;                    // Number of sectors on disk
+  int lba48;                            // Disk supports 48-bit addressing
+  char model[41];                       // Model name
+  dev_t devno;                          // Device number
+};
+
+struct ahci {
+  struct unit *unit;                    // PCI unit
+  unsigned char *mmio;                  // HBA memory registers (ABAR)
+  int irq;                              // Interrupt request line
+  struct interrupt intr;                // Interrupt handler
+  struct dpc dpc;                       // DPC for completion processing
+  unsigned long cap;                    // Host capabilities
+  unsigned long ccc_ports;              // Ports using completion coalescing
+  int nslots;                           // Command slots per port
+  struct ahci_port *ports[AHCI_MAX_PORTS];
+};
+
+#define hba_read(hba, reg) (*(volatile unsigned long *) ((hba)->mmio + (reg)))
+#define hba_write(hba, reg, val) (*(volatile unsigned long *) ((hba)->mmio + (reg)) = (val))
+
+#define port_read(port, reg) (*(volatile unsigned long *) ((port)->regs + (reg)))
+#define port_write(port, reg, val) (*(volatile unsigned long *) ((port)->regs + (reg)) = (val))
+
+static void ahci_fixstring(unsigned char *s, int len) {
+  unsigned char tmp;
+  int i;
+
+  // Convert from big-endian words and strip trailing blanks
+  for (i = 0; i < len; i += 2) {
+    tmp = s[i];
+    s[i] = s[i + 1];
+    s[i + 1] = tmp;
+  }
+  s[len] = 0;
+  while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == 0)) s[--len] = 0;
+}
+
+static int ahci_wait_clear(struct ahci_port *port, int reg, unsigned long mask, unsigned int timeout) {
+  unsigned int start = global_clocks;
+
+  while (port_read(port, reg) & mask) {
+    if (time_before(start + timeout, global_clocks)) return -ETIMEOUT;
+    kthread_yield();
+  }
+
+  return 0;
+}
+
+static int ahci_stop_port(struct ahci_port *port) {
+  unsigned long cmd;
+
+  // Stop command processing and FIS reception
+  cmd = port_read(port, AHCI_PxCMD);
+  port_write(port, AHCI_PxCMD, cmd & ~(AHCI_PxCMD_ST | AHCI_PxCMD_FRE));
+  if (ahci_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_CR | AHCI_PxCMD_FR, AHCI_TIMEOUT_STOP) < 0) {
+    kprintf(KERN_WARNING "ahci: port %d did not stop\n", port->portno);
+    return -EIO;
+  }
+
+  return 0;
+}
+
+static void ahci_start_port(struct ahci_port *port) {
+  // Clear errors and pending interrupts before starting
+  port_write(port, AHCI_PxSERR, 0xFFFFFFFF);
+  port_write(port, AHCI_PxIS, 0xFFFFFFFF);
+
+  port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+  port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+//
+// Complete all slots in mask with the given result. Must be called with
+// interrupts disabled, since the slot state is shared with ahci_issue().
+//
+
+static void ahci_complete_slots(struct ahci_port *port, unsigned long mask, int result) {
+  struct ahci_request *req;
+  int tag;
+
+  while (mask) {
+    tag = find_lowest_bit(mask);
+    mask &= ~(1 << tag);
+
+    req = port->reqs[tag];
+    port->reqs[tag] = NULL;
+    port->busy &= ~(1 << tag);
+    port->issued &= ~(1 << tag);
+
+    if (req) {
+      if (result < 0 && req->result == 0) req->result = result;
+      if (--req->pending == 0) set_event(&req->done);
+    }
+    release_sem(&port->slots, 1);
+  }
+
+  if (port->busy == 0) set_event(&port->idle);
+}
+
+static void ahci_port_error(struct ahci_port *port, unsigned long is) {
+  unsigned long tfd = port_read(port, AHCI_PxTFD);
+
+  kprintf(KERN_ERR "ahci: port %d error, is=%08X tfd=%08X serr=%08X\n", port->portno, is, tfd, port_read(port, AHCI_PxSERR));
+
+  // A failed queued command aborts all outstanding commands on the port,
+  // so fail every issued slot and stop the command engine. The port is
+  // recovered by the next command, since recovery has to wait for the HBA.
+  port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+  kmach_cli();
+  port->recover = 1;
+  ahci_complete_slots(port, port->issued, -EIO);
+  kmach_sti();
+}
+
+static int ahci_reset_port(struct ahci_port *port) {
+  unsigned long sctl;
+  unsigned int start;
+
+  kprintf(KERN_WARNING "ahci: resetting port %d\n", port->portno);
+
+  // Send COMRESET and wait for the link to come back
+  sctl = port_read(port, AHCI_PxSCTL) & ~AHCI_SCTL_DET_MASK;
+  port_write(port, AHCI_PxSCTL, sctl | AHCI_SCTL_DET_INIT);
+  msleep(1);
+  port_write(port, AHCI_PxSCTL, sctl);
+
+  start = global_clocks;
+  while ((port_read(port, AHCI_PxSSTS) & AHCI_SSTS_DET_MASK) != AHCI_SSTS_DET_PRESENT) {
+    if (time_before(start + AHCI_TIMEOUT_LINK, global_clocks)) return -EIO;
+    kthread_yield();
+  }
+
+  port_write(port, AHCI_PxSERR, 0xFFFFFFFF);
+  return ahci_wait_clear(port, AHCI_PxTFD, AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ, AHCI_TIMEOUT_RESET);
+}
+
+//
+// Restart the command engine after an error using the recovery sequence
+// from the AHCI specification. Must be called with the port lock held and
+// no commands issued.
+//
+
+static int ahci_recover_port(struct ahci_port *port) {
+  int rc;
+
+  // Wait for the command list to stop running
+  port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+  if (ahci_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_CR, AHCI_TIMEOUT_STOP) < 0) {
+    kprintf(KERN_WARNING "ahci: port %d did not stop\n", port->portno);
+    return -EIO;
+  }
+  port_write(port, AHCI_PxSERR, 0xFFFFFFFF);
+
+  // A device that is still busy must be released with a command list
+  // override or a port reset before the engine can be started
+  if (port_read(port, AHCI_PxTFD) & (AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ)) {
+    if (port->hba->cap & AHCI_CAP_SCLO) {
+      port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_CLO);
+      ahci_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_CLO, AHCI_TIMEOUT_STOP);
+    }
+
+    if (port_read(port, AHCI_PxTFD) & (AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ)) {
+      rc = ahci_reset_port(port);
+      if (rc < 0) {
+        kprintf(KERN_ERR "ahci: unable to reset port %d\n", port->portno);
+        return rc;
+      }
+    }
+  }
+
+  ahci_start_port(port);
+  port->recover = 0;
+  return 0;
+}
+
+static void ahci_port_complete(struct ahci_port *port) {
+  unsigned long is;
+  unsigned long active;
+
+  // Fetch status saved by interrupt handler
+  kmach_cli();
+  is = port->irqstat;
+  port->irqstat = 0;
+  kmach_sti();
+
+  if (is & AHCI_PxINT_ERROR) {
+    ahci_port_error(port, is);
+    return;
+  }
+
+  // Issued slots that are no longer in the command issue or active
+  // registers have completed. Slots that are still being set up have not
+  // been issued yet. Handling every finished slot in one pass coalesces
+  // completions that arrive close together into a single DPC.
+  kmach_cli();
+  active = port_read(port, AHCI_PxCI) | port_read(port, AHCI_PxSACT);
+  if (port->issued & ~active) ahci_complete_slots(port, port->issued & ~active, 0);
+  kmach_sti();
+}
+
+static void ahci_dpc(void *arg) {
+  struct ahci *hba = (struct ahci *) arg;
+  int i;
+
+  for (i = 0; i < AHCI_MAX_PORTS; i++) {
+    if (hba->ports[i] && (hba->ports[i]->irqstat || (hba->ccc_ports & (1 << i)))) {
+      ahci_port_complete(hba->ports[i]);
+    }
+  }
+}
+
+static int ahci_handler(struct context *ctxt, void *arg) {
+  struct ahci *hba = (struct ahci *) arg;
+  struct ahci_port *port;
+  unsigned long is;
+  int i;
+
+  // Check if interrupt is for this controller
+  is = hba_read(hba, AHCI_IS);
+  if (!is) return 0;
+
+  // Acknowledge port interrupts before the global status, otherwise the
+  // level triggered interrupt would be raised again
+  for (i = 0; i < AHCI_MAX_PORTS; i++) {
+    if (!(is & (1 << i))) continue;
+    port = hba->ports[i];
+    if (port) {
+      unsigned long pis = port_read(port, AHCI_PxIS);
+      port_write(port, AHCI_PxIS, pis);
+      port->irqstat |= pis;
+    }
+  }
+  hba_write(hba, AHCI_IS, is);
+
+  kdpc_queue_irq(&hba->dpc, ahci_dpc, "ahci_dpc", hba);
+  kpic_eoi(hba->irq);
+  return 1;
+}
+
+static void ahci_setup_fis(unsigned char *fis, int cmd, unsigned int lba, int count, int tag, int queued) {
+  memset(fis, 0, 20);
+  fis[0] = FIS_TYPE_REG_H2D;
+  fis[1] = FIS_REG_H2D_CMD;
+  fis[2] = cmd;
+  fis[4] = lba & 0xFF;
+  fis[5] = (lba >> 8) & 0xFF;
+  fis[6] = (lba >> 16) & 0xFF;
+  fis[7] = ATA_DEV_LBA;
+  fis[8] = (lba >> 24) & 0xFF;
+
+  if (queued) {
+    // FPDMA commands carry the sector count in the feature register and
+    // the tag in the count register
+    fis[3] = count & 0xFF;
+    fis[11] = (count >> 8) & 0xFF;
+    fis[12] = tag << 3;
+  } else {
+    fis[12] = count & 0xFF;
+    fis[13] = (count >> 8) & 0xFF;
+  }
+}
+
+static int ahci_setup_prdt(struct ahci_cmdtbl *tbl, char *buffer, int size) {
+  unsigned long addr;
+  int len;
+  int n;
+
+  // Build scatter-gather list; physically adjacent pages are merged
+  n = 0;
+  while (size > 0) {
+    len = PAGESIZE - ((unsigned long) buffer & (PAGESIZE - 1));
+    if (len > size) len = size;
+    addr = kpage_virt2phys(buffer);
+
+    if (n > 0 && tbl->prdt[n - 1].dba + tbl->prdt[n - 1].dbc + 1 == addr && tbl->prdt[n - 1].dbc + 1 + len <= AHCI_MAX_PRD_BYTES) {
+      tbl->prdt[n - 1].dbc += len;
+    } else {
+      if (n == AHCI_MAX_PRDS) return -EINVAL;
+      tbl->prdt[n].dba = addr;
+      tbl->prdt[n].dbau = 0;
+      tbl->prdt[n].reserved = 0;
+      tbl->prdt[n].dbc = len - 1;
+      n++;
+    }
+
+    buffer += len;
+    size -= len;
+  }
+
+  return n;
+}
+
+//
+// Issue a command in a free slot. Queued commands return as soon as the
+// command has been issued; the caller waits for the request to complete.
+// Non-queued commands wait for the port to become idle and complete
+// before returning.
+//
+
+static int ahci_issue(struct ahci_port *port, struct ahci_request *req, int cmd, unsigned int lba, int count, char *buffer, int size, int write, int queued) {
+  struct ahci_cmdhdr *hdr;
+  struct ahci_cmdtbl *tbl;
+  int nprds;
+  int tag;
+  int rc;
+
+  // Allocate command slot
+  if (wait_for_object(&port->slots, AHCI_TIMEOUT_BUSY) < 0) return -EBUSY;
+  if (wait_for_object(&port->lock, AHCI_TIMEOUT_BUSY) < 0) {
+    release_sem(&port->slots, 1);
+    return -EBUSY;
+  }
+
+  // Restart the port if it was stopped by an error. All issued commands
+  // have been failed, and new commands are only issued with the lock held.
+  if (port->recover) {
+    rc = ahci_recover_port(port);
+    if (rc < 0) {
+      release_mutex(&port->lock);
+      release_sem(&port->slots, 1);
+      return rc;
+    }
+  }
+
+  // Non-queued commands must not be mixed with queued commands
+  if (!queued) {
+    while (port->busy) {
+      if (wait_for_object(&port->idle, AHCI_TIMEOUT_XFER) < 0) {
+        release_mutex(&port->lock);
+        release_sem(&port->slots, 1);
+        return -ETIMEOUT;
+      }
+    }
+  }
+
+  kmach_cli();
+  tag = find_lowest_bit(~port->busy);
+  port->busy |= 1 << tag;
+  kmach_sti();
+
+  // Setup command table
+  hdr = &port->cmdlist[tag];
+  tbl = &port->cmdtbl[tag];
+  ahci_setup_fis(tbl->cfis, cmd, lba, count, tag, queued);
+  nprds = 0;
+  if (size > 0) {
+    nprds = ahci_setup_prdt(tbl, buffer, size);
+    if (nprds < 0) {
+      kmach_cli();
+      port->busy &= ~(1 << tag);
+      kmach_sti();
+      release_mutex(&port->lock);
+      release_sem(&port->slots, 1);
+      return nprds;
+    }
+  }
+
+  // Setup command header; FIS length is 5 dwords
+  hdr->flags = 5 | (write ? AHCI_CMDHDR_WRITE : 0) | AHCI_CMDHDR_PREFETCH;
+  hdr->prdtl = nprds;
+  hdr->prdbc = 0;
+
+  // Issue command
+  kmach_cli();
+  port->reqs[tag] = req;
+  req->pending++;
+  if (queued) port_write(port, AHCI_PxSACT, 1 << tag);
+  port_write(port, AHCI_PxCI, 1 << tag);
+  port->issued |= 1 << tag;
+  kmach_sti();
+
+  if (queued) {
+    release_mutex(&port->lock);
+    return 0;
+  }
+
+  // Wait for non-queued command to complete while holding port
+  while (req->pending > 0) {
+    if (wait_for_object(&req->done, AHCI_TIMEOUT_XFER) < 0) {
+      kprintf(KERN_WARNING "ahci: timeout waiting for command %02X on port %d\n", cmd, port->portno);
+      kmach_cli();
+      port->irqstat |= AHCI_PxINT_TFES;
+      kmach_sti();
+      ahci_port_complete(port);
+      break;
+    }
+  }
+
+  release_mutex(&port->lock);
+  return req->result;
+}
+
+static int ahci_wait_request(struct ahci_port *port, struct ahci_request *req) {
+  while (req->pending > 0) {
+    if (wait_for_object(&req->done, AHCI_TIMEOUT_XFER) < 0) {
+      kprintf(KERN_WARNING "ahci: timeout waiting for transfer on port %d\n", port->portno);
+
+      // Abort all outstanding commands on port
+      kmach_cli();
+      port->irqstat |= AHCI_PxINT_TFES;
+      kmach_sti();
+      ahci_port_complete(port);
+    }
+  }
+
+  return req->result;
+}
+
+static int ahci_transfer(struct ahci_port *port, char *buffer, size_t count, blkno_t blkno, int write) {
+  struct ahci_request req;
+  int nsects, size, left;
+  int cmd;
+  int rc, err;
+
+  if (count == 0) return 0;
+  if (count % SECTORSIZE != 0) return -EINVAL;
+  if (blkno + count / SECTORSIZE > port->blks) return -EFAULT;
+
+  init_event(&req.done, 0, 0);
+  req.pending = 0;
+  req.result = 0;
+
+  if (port->ncq) {
+    cmd = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+  } else {
+    cmd = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+  }
+
+  // Split transfer into commands. With NCQ all the commands are queued
+  // to the drive before waiting for any of them to complete.
+  err = 0;
+  left = count;
+  while (left > 0) {
+    size = left;
+    if (size > AHCI_MAX_XFER_SIZE) size = AHCI_MAX_XFER_SIZE;
+    nsects = size / SECTORSIZE;
+
+    err = ahci_issue(port, &req, cmd, blkno, nsects, buffer, nsects * SECTORSIZE, write, port->ncq);
+    if (err < 0) break;
+
+    blkno += nsects;
+    buffer += nsects * SECTORSIZE;
+    left -= nsects * SECTORSIZE;
+  }
+
+  // Wait for the commands already queued even if a later issue failed
+  rc = ahci_wait_request(port, &req);
+  if (err < 0) return err;
+  if (rc < 0) return rc;
+  return count;
+}
+
+static int ahci_command(struct ahci_port *port, int cmd, void *buffer, int size) {
+  struct ahci_request req;
+  int rc;
+
+  init_event(&req.done, 0, 0);
+  req.pending = 0;
+  req.result = 0;
+
+  rc = ahci_issue(port, &req, cmd, 0, 0, buffer, size, 0, 0);
+  return rc;
+}
+
+static int ahci_ioctl(struct dev *dev, int cmd, void *args, size_t size) {
+  struct ahci_port *port = (struct ahci_port *) dev->privdata;
+
+  switch (cmd) {
+    case IOCTL_GETDEVSIZE:
+      return port->blks;
+
+    case IOCTL_GETBLKSIZE:
+      return SECTORSIZE;
+
+    case IOCTL_FLUSH:
+      return ahci_command(port, ATA_CMD_FLUSH_CACHE_EXT, NULL, 0);
+  }
+
+  return -ENOSYS;
+}
+
+static int ahci_read(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
+  struct ahci_port *port = (struct ahci_port *) dev->privdata;
+  return ahci_transfer(port, (char *) buffer, count, blkno, 0);
+}
+
+static int ahci_write(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
+  struct ahci_port *port = (struct ahci_port *) dev->privdata;
+  return ahci_transfer(port, (char *) buffer, count, blkno, 1);
+}
+
+struct driver ahci_driver = {
+  "ahci",
+  DEV_TYPE_BLOCK,
+  ahci_ioctl,
+  ahci_read,
+  ahci_write
+};
+
+static int ahci_identify(struct ahci_port *port) {
+  unsigned short *param;
+  int depth;
+  int rc;
+
+  param = (unsigned short *) kmalloc(SECTORSIZE);
+  if (!param) return -ENOMEM;
+  memset(param, 0, SECTORSIZE);
+
+  rc = ahci_command(port, ATA_CMD_IDENTIFY, param, SECTORSIZE);
+  if (rc < 0) {
+    kfree(param);
+    return rc;
+  }
+
+  // Get model name
+  memcpy(port->model, param + 27, 40);
+  ahci_fixstring((unsigned char *) port->model, 40);
+
+  // Get disk size; 48-bit LBA is required for the DMA EXT commands
+  port->lba48 = (param[83] & (1 << 10)) != 0;
+  if (port->lba48) {
+    if ((param[101] & 0x8000) || param[102] || param[103]) {
+      port->blks = 0x7FFFFFFF;
+    } else {
+      port->blks = param[100] | (param[101] << 16);
+    }
+  } else {
+    port->blks = param[60] | (param[61] << 16);
+  }
+
+  // Determine queue depth if drive supports NCQ
+  port->depth = 1;
+  port->ncq = 0;
+  if ((port->hba->cap & AHCI_CAP_SNCQ) && (param[76] & (1 << 8))) {
+    depth = (param[75] & 0x1F) + 1;
+    if (depth > port->hba->nslots) depth = port->hba->nslots;
+    if (depth > 1) {
+      port->ncq = 1;
+      port->depth = depth;
+    }
+  }
+
+  kfree(param);
+  return port->lba48 ? 0 : -ENODEV;
+}
+
+static struct ahci_port *ahci_setup_port(struct ahci *hba, int portno) {
+  struct ahci_port *port;
+  unsigned long ssts;
+  unsigned int start;
+  unsigned long phys;
+  char *mem;
+  int i;
+
+  port = (struct ahci_port *) kmalloc(sizeof(struct ahci_port));
+  if (!port) return NULL;
+  memset(port, 0, sizeof(struct ahci_port));
+  port->hba = hba;
+  port->portno = portno;
+  port->regs = hba->mmio + AHCI_PORT_BASE + portno * AHCI_PORT_SIZE;
+
+  // Power up and spin up device
+  port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_POD | AHCI_PxCMD_SUD);
+
+  // Wait for link to be established
+  start = global_clocks;
+  while (1) {
+    ssts = port_read(port, AHCI_PxSSTS);
+    if ((ssts & AHCI_SSTS_DET_MASK) == AHCI_SSTS_DET_PRESENT) break;
+    if (time_before(start + AHCI_TIMEOUT_LINK, global_clocks)) {
+      kfree(port);
+      return NULL;
+    }
+    kthread_yield();
+  }
+
+  // Only ATA disks are supported
+  if (port_read(port, AHCI_PxSIG) != AHCI_SIG_ATA) {
+    kfree(port);
+    return NULL;
+  }
+
+  if (ahci_stop_port(port) < 0) {
+    kfree(port);
+    return NULL;
+  }
+
+  // Allocate command list, received FIS area and command tables. The first
+  // page holds the command list (1K) and received FIS (256 bytes); the
+  // command tables follow, 1K each.
+  mem = kmem_alloc_linear(1 + AHCI_MAX_SLOTS * sizeof(struct ahci_cmdtbl) / PAGESIZE, PFT_KMEM);
+  if (!mem) {
+    kfree(port);
+    return NULL;
+  }
+  memset(mem, 0, PAGESIZE + AHCI_MAX_SLOTS * sizeof(struct ahci_cmdtbl));
+  port->cmdlist = (struct ahci_cmdhdr *) mem;
+  port->rfis = (unsigned char *) mem + 1024;
+  port->cmdtbl = (struct ahci_cmdtbl *) (mem + PAGESIZE);
+
+  phys = kpage_virt2phys(port->cmdtbl);
+  for (i = 0; i < AHCI_MAX_SLOTS; i++) {
+    port->cmdlist[i].ctba = phys + i * sizeof(struct ahci_cmdtbl);
+    port->cmdlist[i].ctbau = 0;
+  }
+
+  port_write(port, AHCI_PxCLB, kpage_virt2phys(port->cmdlist));
+  port_write(port, AHCI_PxCLBU, 0);
+  port_write(port, AHCI_PxFB, kpage_virt2phys(port->rfis));
+  port_write(port, AHCI_PxFBU, 0);
+
+  // Initialize synchronization objects; identify runs with one slot
+  init_sem(&port->slots, 1);
+  init_mutex(&port->lock, 0);
+  init_event(&port->idle, 0, 1);
+
+  ahci_start_port(port);
+
+  // Enable completion and error interrupts
+  hba->ports[portno] = port;
+  port_write(port, AHCI_PxIE, AHCI_PxINT_COMPLETE | AHCI_PxINT_ERROR);
+
+  return port;
+}
+
+static void ahci_setup_coalescing(struct ahci *hba) {
+  unsigned long ctl;
+  int completions;
+  int timeout;
+  int i;
+
+  // Command completion coalescing is off unless requested by kernel options
+  completions = get_num_option(krnlopts, "ahciccc", 0);
+  timeout = get_num_option(krnlopts, "ahcicccto", 1);
+  if (completions <= 1 || !(hba->cap & AHCI_CAP_CCCS)) return;
+  if (completions > 255) completions = 255;
+
+  // Coalesced ports must not raise individual completion interrupts
+  for (i = 0; i < AHCI_MAX_PORTS; i++) {
+    struct ahci_port *port = hba->ports[i];
+    if (!port || !port->ncq) continue;
+    port_write(port, AHCI_PxIE, AHCI_PxINT_ERROR);
+    hba->ccc_ports |= 1 << i;
+  }
+  if (!hba->ccc_ports) return;
+
+  ctl = hba_read(hba, AHCI_CCC_CTL);
+  hba_write(hba, AHCI_CCC_CTL, ctl & ~AHCI_CCC_EN);
+  hba_write(hba, AHCI_CCC_PORTS, hba->ccc_ports);
+  ctl = (ctl & (0x1F << AHCI_CCC_INT_SHIFT)) | (completions << AHCI_CCC_CC_SHIFT) | (timeout << AHCI_CCC_TV_SHIFT);
+  hba_write(hba, AHCI_CCC_CTL, ctl | AHCI_CCC_EN);
+
+  kprintf(KERN_INFO "ahci: coalescing %d completions or %d ms\n", completions, timeout);
+}
+
+static int install_ahci(struct unit *unit) {
+  unsigned long abar;
+  struct ahci *hba;
+  struct ahci_port *port;
+  unsigned long pi;
+  unsigned int start;
+  int i;
+  int rc;
+
+  // AHCI registers are located in memory space at ABAR (BAR5)
+  abar = pci_read_config_dword(unit, PCI_CONFIG_BASE_ADDR_5) & ~0xF;
+  if (!abar) return -ENODEV;
+
+  hba = (struct ahci *) kmalloc(sizeof(struct ahci));
+  if (!hba) return -ENOMEM;
+  memset(hba, 0, sizeof(struct ahci));
+  hba->unit = unit;
+  hba->irq = kdev_get_unit_irq(unit);
+  hba->mmio = (unsigned char *) iomap(abar, AHCI_PORT_BASE + AHCI_MAX_PORTS * AHCI_PORT_SIZE);
+  unit->vendorname = "AHCI";
+  unit->productname = "AHCI SATA Controller";
+
+  pci_enable_busmastering(unit);
+
+  // Reset controller and enable AHCI mode
+  hba_write(hba, AHCI_GHC, hba_read(hba, AHCI_GHC) | AHCI_GHC_AE);
+  hba_write(hba, AHCI_GHC, hba_read(hba, AHCI_GHC) | AHCI_GHC_HR);
+  start = global_clocks;
+  while (hba_read(hba, AHCI_GHC) & AHCI_GHC_HR) {
+    if (time_before(start + AHCI_TIMEOUT_RESET, global_clocks)) {
+      kprintf(KERN_ERR "ahci: controller reset timeout\n");
+      iounmap(hba->mmio, AHCI_PORT_BASE + AHCI_MAX_PORTS * AHCI_PORT_SIZE);
+      kfree(hba);
+      return -EIO;
+    }
+    kthread_yield();
+  }
+  hba_write(hba, AHCI_GHC, hba_read(hba, AHCI_GHC) | AHCI_GHC_AE);
+
+  hba->cap = hba_read(hba, AHCI_CAP);
+  hba->nslots = ((hba->cap & AHCI_CAP_NCS) >> 8) + 1;
+  pi = hba_read(hba, AHCI_PI);
+
+  // Install interrupt handler; interrupts are enabled on the HBA once the
+  // ports have been set up
+  kdpc_create(&hba->dpc);
+  register_interrupt(&hba->intr, IRQ2INTR(hba->irq), ahci_handler, hba);
+  kpic_enable_irq(hba->irq);
+  hba_write(hba, AHCI_IS, 0xFFFFFFFF);
+  hba_write(hba, AHCI_GHC, hba_read(hba, AHCI_GHC) | AHCI_GHC_IE);
+
+  // Probe ports for disks
+  for (i = 0; i < AHCI_MAX_PORTS; i++) {
+    if (!(pi & (1 << i))) continue;
+    port = ahci_setup_port(hba, i);
+    if (!port) continue;
+
+    rc = ahci_identify(port);
+    if (rc < 0) {
+      kprintf(KERN_WARNING "ahci: error %d identifying disk on port %d\n", rc, i);
+      port_write(port, AHCI_PxIE, 0);
+      ahci_stop_port(port);
+      hba->ports[i] = NULL;
+      continue;
+    }
+
+    // Allow as many outstanding commands as the queue depth
+    if (port->depth > 1) release_sem(&port->slots, port->depth - 1);
+
+    port->devno = kdev_create("sd#", &ahci_driver, unit, port);
+    kprintf(KERN_INFO "%s: %s (%d MB)", kdev_get(port->devno)->name, port->model, port->blks / (1024 * 1024 / SECTORSIZE));
+    if (port->ncq) kprintf(", NCQ depth %d", port->depth);
+    kprintf("\n");
+  }
+
+  ahci_setup_coalescing(hba);
+  return 0;
+}
+
+int __declspec(dllexport) ahci(struct unit *unit, char *opts) {
+  return install_ahci(unit);
+}
+
+void init_ahci() {
+  struct unit *unit;
+
+  // Install driver for all AHCI controllers found by PCI enumeration
+  unit = kdev_lookup_unit_by_class(NULL, PCI_CLASS_STORAGE_SATA_AHCI, 0xFFFFFF);
+  while (unit) {
+    install_ahci(unit);
+    unit = kdev_lookup_unit_by_class(unit, PCI_CLASS_STORAGE_SATA_AHCI, 0xFFFFFF);
+  }
+}
@@ -1295,6 +1295,9 @@ static int part_ioctl(struct dev *dev, int cmd, void *args, size_t size) {
 
     case IOCTL_GETBLKSIZE:
       return kdev_ioctl(part->dev, IOCTL_GETBLKSIZE, NULL, 0);
+
+    case IOCTL_FLUSH:
+      return kdev_ioctl(part->dev, IOCTL_FLUSH, NULL, 0);
   }
 
   return -ENOSYS;
@@ -0,0 +1,872 @@
+//
+// nvme.c
+//
+// NVMe disk driver
+//
+// Copyright (C) 2013-2014 Bruno Ribeiro.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+
+#include <os/krnl.h>
+#include <os/dev.h>
+#include <os/trap.h>
+#include <os/pci.h>
+#include <os/pic.h>
+#include <os/kmem.h>
+
+#define PCI_CLASS_STORAGE_NVME  0x010802
+
+#define NVME_ADMIN_QUEUE_SIZE   32
+#define NVME_IO_QUEUE_SIZE      128
+#define NVME_MAX_QUEUE_SIZE     128
+#define NVME_MAX_PRPS           32
+#define NVME_MAX_XFER_SIZE      (NVME_MAX_PRPS * PAGESIZE)
+#define NVME_MAX_NAMESPACES     16
+#define NVME_REGS_SIZE          (2 * PAGESIZE)
+
+#define NVME_TIMEOUT_BUSY       60000
+#define NVME_TIMEOUT_CMD        10000
+
+//
+// Controller registers
+//
+
+#define NVME_CAP                0x00    // Controller capabilities (64 bits)
+#define NVME_VS                 0x08    // Version
+#define NVME_INTMS              0x0C    // Interrupt mask set
+#define NVME_INTMC              0x10    // Interrupt mask clear
+#define NVME_CC                 0x14    // Controller configuration
+#define NVME_CSTS               0x1C    // Controller status
+#define NVME_AQA                0x24    // Admin queue attributes
+#define NVME_ASQ                0x28    // Admin submission queue base (64 bits)
+#define NVME_ACQ                0x30    // Admin completion queue base (64 bits)
+#define NVME_DOORBELL           0x1000  // First doorbell register
+
+#define NVME_CAP_MQES           0x0000FFFF  // Maximum queue entries supported - 1
+#define NVME_CAP_TO_SHIFT       24          // Ready timeout in 500 ms units
+#define NVME_CAP_DSTRD          0x0000000F  // Doorbell stride (upper dword)
+#define NVME_CAP_MPSMIN_SHIFT   16          // Minimum page size (upper dword)
+
+#define NVME_CC_EN              0x00000001  // Enable
+#define NVME_CC_CSS_NVM         0x00000000  // NVM command set
+#define NVME_CC_MPS_SHIFT       7           // Memory page size is 2^(12 + MPS)
+#define NVME_CC_IOSQES          (6 << 16)   // I/O submission queue entry size (64 bytes)
+#define NVME_CC_IOCQES          (4 << 20)   // I/O completion queue entry size (16 bytes)
+
+#define NVME_CSTS_RDY           0x00000001  // Ready
+#define NVME_CSTS_CFS           0x00000002  // Controller fatal status
+
+//
+// Admin commands
+//
+
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_ID_CNS_NS          0x00
+#define NVME_ID_CNS_CTRL        0x01
+
+#define NVME_FEAT_NUM_QUEUES    0x07
+
+#define NVME_QUEUE_PHYS_CONTIG  0x0001
+#define NVME_CQ_IRQ_ENABLED     0x0002
+
+//
+// NVM I/O commands
+//
+
+#define NVME_CMD_FLUSH          0x00
+#define NVME_CMD_WRITE          0x01
+#define NVME_CMD_READ           0x02
+
+//
+// Submission queue entry
+//
+
+struct nvme_sqe {
+  unsigned long cdw0;                   // Opcode and command identifier
+  unsigned long nsid;                   // Namespace identifier
+  unsigned long cdw2;
+  unsigned long cdw3;
+  unsigned long long mptr;              // Metadata pointer
+  unsigned long long prp1;              // First PRP entry
+  unsigned long long prp2;              // Second PRP entry or PRP list pointer
+  unsigned long cdw10;
+  unsigned long cdw11;
+  unsigned long cdw12;
+  unsigned long cdw13;
+  unsigned long cdw14;
+  unsigned long cdw15;
+};
+
+//
+// Completion queue entry
+//
+
+struct nvme_cqe {
+  unsigned long result;                 // Command specific result
+  unsigned long reserved;
+  unsigned short sqhd;                  // Submission queue head pointer
+  unsigned short sqid;                  // Submission queue identifier
+  unsigned short cid;                   // Command identifier
+  unsigned short status;                // Status field and phase tag
+};
+
+//
+// Request; may span several commands
+//
+
+struct nvme_request {
+  struct event done;                    // Signaled when no commands are pending
+  int pending;                          // Number of commands outstanding
+  int result;                           // First error, or zero
+};
+
+struct nvme;
+
+struct nvme_queue {
+  struct nvme *ctrl;                    // Controller
+  int qid;                              // Queue identifier
+  int size;                             // Number of entries in queue
+  struct nvme_sqe *sq;                  // Submission queue
+  struct nvme_cqe *cq;                  // Completion queue
+  volatile unsigned long *sqdb;         // Submission queue tail doorbell
+  volatile unsigned long *cqdb;         // Completion queue head doorbell
+  int sqtail;                           // Next free submission queue entry
+  int cqhead;                           // Next completion queue entry
+  int phase;                            // Expected phase tag
+  unsigned long long *prps;             // PRP lists, one per command identifier
+
+  struct nvme_request *reqs[NVME_MAX_QUEUE_SIZE]; // Request owning each command
+  unsigned short freecids[NVME_MAX_QUEUE_SIZE]; // Free command identifiers
+  int nfree;                            // Number of free command identifiers
+
+  struct sem slots;                     // Free command slots
+  struct mutex lock;                    // Serializes submission queue updates
+};
+
+struct nvme {
+  struct unit *unit;                    // PCI unit
+  unsigned char *mmio;                  // Controller registers (BAR0)
+  int irq;                              // Interrupt request line
+  int intrno;                           // Interrupt vector
+  int msi;                              // Using message signalled interrupts
+  struct interrupt intr;                // Interrupt handler
+  struct dpc dpc;                       // DPC for completion processing
+  int dstrd;                            // Doorbell stride
+  int timeout;                          // Controller ready timeout in ms
+  int maxxfer;                          // Maximum transfer size per command
+  struct nvme_queue adminq;             // Admin queue pair
+  struct nvme_queue ioq;                // I/O queue pair
+  int resetting;                        // Controller is being reset
+  int failed;                           // Controller did not recover from a reset
+  char model[41];                       // Model number
+  char serial[21];                      // Serial number
+};
+
+struct nvme_ns {
+  struct nvme *ctrl;                    // Controller
+  int nsid;                             // Namespace identifier
+  unsigned int blks;                    // Number of logical blocks
+  int blksize;                          // Logical block size
+  dev_t devno;                          // Device number
+};
+
+#define nvme_readl(ctrl, reg) (*(volatile unsigned long *) ((ctrl)->mmio + (reg)))
+#define nvme_writel(ctrl, reg, val) (*(volatile unsigned long *) ((ctrl)->mmio + (reg)) = (val))
+
+static void nvme_fixstring(char *s, int len) {
+  s[len] = 0;
+  while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == 0)) s[--len] = 0;
+}
+
+static int nvme_wait_ready(struct nvme *ctrl, int ready) {
+  unsigned int start = global_clocks;
+
+  while ((nvme_readl(ctrl, NVME_CSTS) & NVME_CSTS_RDY) != (ready ? NVME_CSTS_RDY : 0)) {
+    if (nvme_readl(ctrl, NVME_CSTS) & NVME_CSTS_CFS) return -EIO;
+    if (time_before(start + ctrl->timeout, global_clocks)) return -ETIMEOUT;
+    kthread_yield();
+  }
+
+  return 0;
+}
+
+static int nvme_enable(struct nvme *ctrl) {
+  nvme_writel(ctrl, NVME_AQA, ((NVME_ADMIN_QUEUE_SIZE - 1) << 16) | (NVME_ADMIN_QUEUE_SIZE - 1));
+  nvme_writel(ctrl, NVME_ASQ, kpage_virt2phys(ctrl->adminq.sq));
+  nvme_writel(ctrl, NVME_ASQ + 4, 0);
+  nvme_writel(ctrl, NVME_ACQ, kpage_virt2phys(ctrl->adminq.cq));
+  nvme_writel(ctrl, NVME_ACQ + 4, 0);
+
+  // Enable controller with 4K pages and the NVM command set
+  nvme_writel(ctrl, NVME_CC, NVME_CC_EN | NVME_CC_CSS_NVM | (0 << NVME_CC_MPS_SHIFT) | NVME_CC_IOSQES | NVME_CC_IOCQES);
+  return nvme_wait_ready(ctrl, 1);
+}
+
+static void nvme_free_queue(struct nvme_queue *q) {
+  if (q->sq) kmem_free(q->sq, PAGES(q->size * sizeof(struct nvme_sqe)));
+  if (q->cq) kmem_free(q->cq, PAGES(q->size * sizeof(struct nvme_cqe)));
+  if (q->prps) kmem_free(q->prps, PAGES(q->size * NVME_MAX_PRPS * sizeof(unsigned long long)));
+  q->sq = NULL;
+  q->cq = NULL;
+  q->prps = NULL;
+}
+
+static int nvme_alloc_queue(struct nvme *ctrl, struct nvme_queue *q, int qid, int size) {
+  struct nvme_sqe *sq;
+  struct nvme_cqe *cq;
+  int i;
+
+  sq = (struct nvme_sqe *) kmem_alloc_linear(PAGES(size * sizeof(struct nvme_sqe)), PFT_KMEM);
+  cq = (struct nvme_cqe *) kmem_alloc_linear(PAGES(size * sizeof(struct nvme_cqe)), PFT_KMEM);
+  if (!sq || !cq) {
+    if (sq) kmem_free(sq, PAGES(size * sizeof(struct nvme_sqe)));
+    if (cq) kmem_free(cq, PAGES(size * sizeof(struct nvme_cqe)));
+    return -ENOMEM;
+  }
+  memset(sq, 0, PAGES(size * sizeof(struct nvme_sqe)) * PAGESIZE);
+  memset(cq, 0, PAGES(size * sizeof(struct nvme_cqe)) * PAGESIZE);
+
+  // The completion queue is set last, as the interrupt handler polls it
+  memset(q, 0, sizeof(struct nvme_queue));
+  q->ctrl = ctrl;
+  q->qid = qid;
+  q->size = size;
+  q->phase = 1;
+  q->sq = sq;
+
+  // PRP lists are only needed for I/O commands. Each list holds
+  // NVME_MAX_PRPS entries and never crosses a page boundary.
+  if (qid > 0) {
+    q->prps = (unsigned long long *) kmem_alloc(PAGES(size * NVME_MAX_PRPS * sizeof(unsigned long long)), PFT_KMEM);
+    if (!q->prps) {
+      kmem_free(cq, PAGES(size * sizeof(struct nvme_cqe)));
+      nvme_free_queue(q);
+      return -ENOMEM;
+    }
+  }
+
+  q->sqdb = (volatile unsigned long *) (ctrl->mmio + NVME_DOORBELL + (2 * qid) * (4 << ctrl->dstrd));
+  q->cqdb = (volatile unsigned long *) (ctrl->mmio + NVME_DOORBELL + (2 * qid + 1) * (4 << ctrl->dstrd));
+
+  // One entry is always left unused, so a full queue can be told from an empty one
+  for (i = 0; i < size - 1; i++) q->freecids[i] = size - 2 - i;
+  q->nfree = size - 1;
+  init_sem(&q->slots, size - 1);
+  init_mutex(&q->lock, 0);
+  q->cq = cq;
+
+  return 0;
+}
+
+static void nvme_setup_prps(struct nvme_queue *q, int cid, struct nvme_sqe *sqe, char *buffer, int size) {
+  unsigned long long *list;
+  int len;
+  int n;
+
+  if (size == 0) return;
+
+  // First entry may start at an offset within a page
+  sqe->prp1 = kpage_virt2phys(buffer);
+  len = PAGESIZE - ((unsigned long) buffer & (PAGESIZE - 1));
+  if (size <= len) return;
+  buffer += len;
+  size -= len;
+
+  // A transfer ending in the next page uses the second entry directly,
+  // longer transfers point to a PRP list
+  if (size <= PAGESIZE) {
+    sqe->prp2 = kpage_virt2phys(buffer);
+    return;
+  }
+
+  list = q->prps + cid * NVME_MAX_PRPS;
+  n = 0;
+  while (size > 0) {
+    list[n++] = kpage_virt2phys(buffer);
+    buffer += PAGESIZE;
+    size -= PAGESIZE;
+  }
+  sqe->prp2 = kpage_virt2phys(list);
+}
+
+//
+// Queue a command on a submission queue. The command is owned by the
+// request until it completes; the caller waits for the request.
+//
+
+static int nvme_submit(struct nvme_queue *q, struct nvme_request *req, struct nvme_sqe *sqe, void *buffer, int size) {
+  int cid;
+
+  // Allocate command identifier
+  if (wait_for_object(&q->slots, NVME_TIMEOUT_BUSY) < 0) return -EBUSY;
+  if (wait_for_object(&q->lock, NVME_TIMEOUT_BUSY) < 0) {
+    release_sem(&q->slots, 1);
+    return -EBUSY;
+  }
+  if (q->ctrl->failed) {
+    release_mutex(&q->lock);
+    release_sem(&q->slots, 1);
+    return -EIO;
+  }
+
+  kmach_cli();
+  cid = q->freecids[--q->nfree];
+  q->reqs[cid] = req;
+  req->pending++;
+  kmach_sti();
+
+  // Copy command into submission queue and ring doorbell
+  nvme_setup_prps(q, cid, sqe, (char *) buffer, size);
+  sqe->cdw0 = (sqe->cdw0 & 0xFFFF) | (cid << 16);
+  memcpy(&q->sq[q->sqtail], sqe, sizeof(struct nvme_sqe));
+  if (++q->sqtail == q->size) q->sqtail = 0;
+  *q->sqdb = q->sqtail;
+
+  release_mutex(&q->lock);
+  return 0;
+}
+
+static int nvme_cq_pending(struct nvme_queue *q) {
+  return q->cq && (q->cq[q->cqhead].status & 1) == q->phase;
+}
+
+//
+// Process all new entries on a completion queue. Must be called with
+// interrupts disabled or from the DPC.
+//
+
+static void nvme_process_cq(struct nvme_queue *q) {
+  struct nvme_cqe *cqe;
+  struct nvme_request *req;
+  int status;
+  int cid;
+  int n;
+
+  n = 0;
+  while (nvme_cq_pending(q)) {
+    cqe = &q->cq[q->cqhead];
+    cid = cqe->cid;
+    status = cqe->status >> 1;
+
+    if (cid < q->size && q->reqs[cid]) {
+      req = q->reqs[cid];
+      q->reqs[cid] = NULL;
+      q->freecids[q->nfree++] = cid;
+
+      if (status != 0) {
+        kprintf(KERN_ERR "nvme: command %d on queue %d failed, status %04X\n", cid, q->qid, status);
+        if (req->result == 0) req->result = -EIO;
+      }
+      if (--req->pending == 0) set_event(&req->done);
+      release_sem(&q->slots, 1);
+    }
+
+    if (++q->cqhead == q->size) {
+      q->cqhead = 0;
+      q->phase ^= 1;
+    }
+    n++;
+  }
+
+  // Completions handled in one pass are acknowledged with a single doorbell write
+  if (n > 0) *q->cqdb = q->cqhead;
+}
+
+static void nvme_dpc(void *arg) {
+  struct nvme *ctrl = (struct nvme *) arg;
+
+  nvme_process_cq(&ctrl->adminq);
+  nvme_process_cq(&ctrl->ioq);
+
+  // Unmask interrupt; the controller reasserts it if new entries arrived
+  nvme_writel(ctrl, NVME_INTMC, 1);
+}
+
+static int nvme_handler(struct context *ctxt, void *arg) {
+  struct nvme *ctrl = (struct nvme *) arg;
+
+  // A shared INTx line may belong to another device
+  if (!ctrl->msi && !nvme_cq_pending(&ctrl->adminq) && !nvme_cq_pending(&ctrl->ioq)) return 0;
+
+  // Mask interrupt until the DPC has drained the completion queues
+  nvme_writel(ctrl, NVME_INTMS, 1);
+  kdpc_queue_irq(&ctrl->dpc, nvme_dpc, "nvme_dpc", ctrl);
+
+  if (ctrl->msi) {
+    pci_msi_eoi();
+  } else {
+    kpic_eoi(ctrl->irq);
+  }
+  return 1;
+}
+
+//
+// Fail all outstanding commands on a queue and empty it. The controller
+// must be disabled, so it no longer uses the queue.
+//
+
+static void nvme_abort_queue(struct nvme_queue *q, int result) {
+  struct nvme_request *req;
+  int cid;
+
+  if (!q->cq) return;
+
+  kmach_cli();
+  for (cid = 0; cid < q->size; cid++) {
+    req = q->reqs[cid];
+    if (!req) continue;
+
+    q->reqs[cid] = NULL;
+    q->freecids[q->nfree++] = cid;
+    if (req->result == 0) req->result = result;
+    if (--req->pending == 0) set_event(&req->done);
+    release_sem(&q->slots, 1);
+  }
+
+  q->sqtail = 0;
+  q->cqhead = 0;
+  q->phase = 1;
+  memset(q->cq, 0, q->size * sizeof(struct nvme_cqe));
+  kmach_sti();
+}
+
+static void nvme_disable(struct nvme *ctrl) {
+  nvme_writel(ctrl, NVME_CC, nvme_readl(ctrl, NVME_CC) & ~NVME_CC_EN);
+  if (nvme_wait_ready(ctrl, 0) < 0) kprintf(KERN_ERR "nvme: controller reset timeout\n");
+
+  nvme_abort_queue(&ctrl->adminq, -ETIMEOUT);
+  nvme_abort_queue(&ctrl->ioq, -ETIMEOUT);
+}
+
+static int nvme_setup_io_queues(struct nvme *ctrl);
+
+//
+// Reset the controller when a command does not complete in time.
+// Disabling the controller aborts all outstanding commands, which are
+// failed, and the queues are then set up again. A controller that does not
+// come back is left disabled, and all further requests fail.
+//
+
+static void nvme_reset(struct nvme *ctrl) {
+  int rc;
+
+  // A command timing out while the queues are set up fails the reset
+  if (ctrl->resetting) {
+    nvme_disable(ctrl);
+    return;
+  }
+
+  // Keep new commands out until the queues are ready again
+  wait_for_object(&ctrl->adminq.lock, INFINITE);
+  if (ctrl->ioq.cq) wait_for_object(&ctrl->ioq.lock, INFINITE);
+  ctrl->resetting = 1;
+
+  kprintf(KERN_WARNING "nvme: resetting controller\n");
+  nvme_disable(ctrl);
+  rc = nvme_enable(ctrl);
+  if (rc >= 0 && ctrl->ioq.cq) rc = nvme_setup_io_queues(ctrl);
+  if (rc < 0) {
+    kprintf(KERN_ERR "nvme: controller failed, error %d\n", rc);
+    nvme_disable(ctrl);
+    ctrl->failed = 1;
+  }
+
+  ctrl->resetting = 0;
+  if (ctrl->ioq.cq) release_mutex(&ctrl->ioq.lock);
+  release_mutex(&ctrl->adminq.lock);
+}
+
+static int nvme_wait(struct nvme_queue *q, struct nvme_request *req) {
+  while (req->pending > 0) {
+    if (wait_for_object(&req->done, NVME_TIMEOUT_CMD) < 0) {
+      // Poll completion queue in case the interrupt was lost
+      kmach_cli();
+      nvme_process_cq(q);
+      kmach_sti();
+      if (req->pending == 0) break;
+
+      // The reset fails the request if the controller does not respond
+      kprintf(KERN_WARNING "nvme: timeout waiting for queue %d\n", q->qid);
+      nvme_reset(q->ctrl);
+    }
+  }
+
+  return req->result;
+}
+
+static int nvme_admin(struct nvme *ctrl, struct nvme_sqe *sqe, void *buffer, int size) {
+  struct nvme_request req;
+  int rc;
+
+  init_event(&req.done, 0, 0);
+  req.pending = 0;
+  req.result = 0;
+
+  rc = nvme_submit(&ctrl->adminq, &req, sqe, buffer, size);
+  if (rc < 0) return rc;
+  return nvme_wait(&ctrl->adminq, &req);
+}
+
+static int nvme_transfer(struct nvme_ns *ns, char *buffer, size_t count, blkno_t blkno, int write) {
+  struct nvme *ctrl = ns->ctrl;
+  struct nvme_request req;
+  struct nvme_sqe sqe;
+  int nblks, size, left;
+  int maxblks;
+  int rc;
+
+  if (count == 0) return 0;
+  if (count % ns->blksize != 0) return -EINVAL;
+  if (blkno + count / ns->blksize > ns->blks) return -EFAULT;
+
+  init_event(&req.done, 0, 0);
+  req.pending = 0;
+  req.result = 0;
+
+  // Split transfer into commands and queue all of them before waiting
+  maxblks = ctrl->maxxfer / ns->blksize;
+  left = count;
+  rc = 0;
+  while (left > 0) {
+    nblks = left / ns->blksize;
+    if (nblks > maxblks) nblks = maxblks;
+    size = nblks * ns->blksize;
+
+    memset(&sqe, 0, sizeof(struct nvme_sqe));
+    sqe.cdw0 = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+    sqe.nsid = ns->nsid;
+    sqe.cdw10 = blkno;
+    sqe.cdw11 = 0;
+    sqe.cdw12 = nblks - 1;
+
+    rc = nvme_submit(&ctrl->ioq, &req, &sqe, buffer, size);
+    if (rc < 0) break;
+
+    blkno += nblks;
+    buffer += size;
+    left -= size;
+  }
+
+  if (req.pending > 0) {
+    int result = nvme_wait(&ctrl->ioq, &req);
+    if (rc == 0) rc = result;
+  }
+  if (rc < 0) return rc;
+  return count;
+}
+
+static int nvme_flush(struct nvme_ns *ns) {
+  struct nvme_request req;
+  struct nvme_sqe sqe;
+  int rc;
+
+  init_event(&req.done, 0, 0);
+  req.pending = 0;
+  req.result = 0;
+
+  memset(&sqe, 0, sizeof(struct nvme_sqe));
+  sqe.cdw0 = NVME_CMD_FLUSH;
+  sqe.nsid = ns->nsid;
+
+  rc = nvme_submit(&ns->ctrl->ioq, &req, &sqe, NULL, 0);
+  if (rc < 0) return rc;
+  return nvme_wait(&ns->ctrl->ioq, &req);
+}
+
+static int nvme_ioctl(struct dev *dev, int cmd, void *args, size_t size) {
+  struct nvme_ns *ns = (struct nvme_ns *) dev->privdata;
+
+  switch (cmd) {
+    case IOCTL_GETDEVSIZE:
+      return ns->blks;
+
+    case IOCTL_GETBLKSIZE:
+      return ns->blksize;
+
+    case IOCTL_FLUSH:
+      return nvme_flush(ns);
+  }
+
+  return -ENOSYS;
+}
+
+static int nvme_read(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
+  struct nvme_ns *ns = (struct nvme_ns *) dev->privdata;
+  return nvme_transfer(ns, (char *) buffer, count, blkno, 0);
+}
+
+static int nvme_write(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
+  struct nvme_ns *ns = (struct nvme_ns *) dev->privdata;
+  return nvme_transfer(ns, (char *) buffer, count, blkno, 1);
+}
+
+struct driver nvme_driver = {
+  "nvme",
+  DEV_TYPE_BLOCK,
+  nvme_ioctl,
+  nvme_read,
+  nvme_write
+};
+
+static int nvme_identify(struct nvme *ctrl, int cns, int nsid, void *buffer) {
+  struct nvme_sqe sqe;
+
+  memset(&sqe, 0, sizeof(struct nvme_sqe));
+  sqe.cdw0 = NVME_ADMIN_IDENTIFY;
+  sqe.nsid = nsid;
+  sqe.cdw10 = cns;
+  return nvme_admin(ctrl, &sqe, buffer, PAGESIZE);
+}
+
+static int nvme_setup_io_queues(struct nvme *ctrl) {
+  struct nvme_sqe sqe;
+  int size = ctrl->ioq.size;
+  int rc;
+
+  // Ask for a single I/O queue pair
+  memset(&sqe, 0, sizeof(struct nvme_sqe));
+  sqe.cdw0 = NVME_ADMIN_SET_FEATURES;
+  sqe.cdw10 = NVME_FEAT_NUM_QUEUES;
+  sqe.cdw11 = 0;
+  nvme_admin(ctrl, &sqe, NULL, 0);
+
+  // The completion queue must exist before the submission queue using it
+  memset(&sqe, 0, sizeof(struct nvme_sqe));
+  sqe.cdw0 = NVME_ADMIN_CREATE_CQ;
+  sqe.prp1 = kpage_virt2phys(ctrl->ioq.cq);
+  sqe.cdw10 = ((size - 1) << 16) | ctrl->ioq.qid;
+  sqe.cdw11 = NVME_QUEUE_PHYS_CONTIG | NVME_CQ_IRQ_ENABLED;
+  rc = nvme_admin(ctrl, &sqe, NULL, 0);
+  if (rc < 0) return rc;
+
+  memset(&sqe, 0, sizeof(struct nvme_sqe));
+  sqe.cdw0 = NVME_ADMIN_CREATE_SQ;
+  sqe.prp1 = kpage_virt2phys(ctrl->ioq.sq);
+  sqe.cdw10 = ((size - 1) << 16) | ctrl->ioq.qid;
+  sqe.cdw11 = (ctrl->ioq.qid << 16) | NVME_QUEUE_PHYS_CONTIG;
+  rc = nvme_admin(ctrl, &sqe, NULL, 0);
+  if (rc < 0) return rc;
+
+  return 0;
+}
+
+static int nvme_create_io_queues(struct nvme *ctrl, int size) {
+  int rc;
+
+  rc = nvme_alloc_queue(ctrl, &ctrl->ioq, 1, size);
+  if (rc < 0) return rc;
+  return nvme_setup_io_queues(ctrl);
+}
+
+static void nvme_setup_namespaces(struct nvme *ctrl, int nn, unsigned char *id) {
+  struct nvme_ns *ns;
+  unsigned long long nsze;
+  unsigned long lbaf;
+  int lbads;
+  int nsid;
+  int rc;
+
+  if (nn > NVME_MAX_NAMESPACES) nn = NVME_MAX_NAMESPACES;
+  for (nsid = 1; nsid <= nn; nsid++) {
+    rc = nvme_identify(ctrl, NVME_ID_CNS_NS, nsid, id);
+    if (rc < 0) continue;
+
+    // Inactive namespaces have zero size
+    nsze = *(unsigned long long *) id;
+    if (nsze == 0) continue;
+
+    // Get logical block size from the formatted LBA format
+    lbaf = *(unsigned long *) (id + 128 + 4 * (id[26] & 0x0F));
+    lbads = (lbaf >> 16) & 0xFF;
+    if (lbads < 9 || lbads > PAGESHIFT) {
+      kprintf(KERN_WARNING "nvme: namespace %d has unsupported block size\n", nsid);
+      continue;
+    }
+
+    ns = (struct nvme_ns *) kmalloc(sizeof(struct nvme_ns));
+    if (!ns) return;
+    memset(ns, 0, sizeof(struct nvme_ns));
+    ns->ctrl = ctrl;
+    ns->nsid = nsid;
+    ns->blksize = 1 << lbads;
+    ns->blks = nsze > 0x7FFFFFFF ? 0x7FFFFFFF : (unsigned int) nsze;
+
+    ns->devno = kdev_create("nvme#", &nvme_driver, ctrl->unit, ns);
+    kprintf(KERN_INFO "%s: %s (%d MB, %d byte blocks)\n", kdev_get(ns->devno)->name, ctrl->model,
+            (int) (nsze * ns->blksize / (1024 * 1024)), ns->blksize);
+  }
+}
+
+static int install_nvme(struct unit *unit) {
+  unsigned long bar;
+  unsigned long cap, caphi;
+  unsigned char *id;
+  struct nvme *ctrl;
+  int qsize;
+  int mdts;
+  int nn;
+  int rc;
+
+  // Controller registers are located in memory space at BAR0
+  bar = pci_read_config_dword(unit, PCI_CONFIG_BASE_ADDR_0);
+  if (bar & 1) return -ENODEV;
+  if ((bar & 0x6) == 0x4 && pci_read_config_dword(unit, PCI_CONFIG_BASE_ADDR_1) != 0) {
+    kprintf(KERN_WARNING "nvme: registers mapped above 4GB not supported\n");
+    return -ENODEV;
+  }
+
+  ctrl = (struct nvme *) kmalloc(sizeof(struct nvme));
+  if (!ctrl) return -ENOMEM;
+  memset(ctrl, 0, sizeof(struct nvme));
+  ctrl->unit = unit;
+  ctrl->irq = kdev_get_unit_irq(unit);
+  ctrl->mmio = (unsigned char *) iomap(bar & PCI_BASE_ADDRESS_MEM_MASK, NVME_REGS_SIZE);
+  if (!ctrl->mmio) {
+    kfree(ctrl);
+    return -ENOMEM;
+  }
+  unit->vendorname = "NVMe";
+  unit->productname = "NVMe Controller";
+
+  pci_enable_busmastering(unit);
+
+  cap = nvme_readl(ctrl, NVME_CAP);
+  caphi = nvme_readl(ctrl, NVME_CAP + 4);
+  ctrl->timeout = ((cap >> NVME_CAP_TO_SHIFT) & 0xFF) * 500;
+  if (ctrl->timeout == 0) ctrl->timeout = 500;
+  ctrl->dstrd = caphi & NVME_CAP_DSTRD;
+  if (NVME_DOORBELL + 4 * (4 << ctrl->dstrd) > NVME_REGS_SIZE || ((caphi >> NVME_CAP_MPSMIN_SHIFT) & 0xF) != 0) {
+    kprintf(KERN_WARNING "nvme: unsupported controller capabilities %08X%08X\n", caphi, cap);
+    rc = -ENODEV;
+    goto err_unmap;
+  }
+
+  // Disable controller before configuring admin queue
+  if (nvme_readl(ctrl, NVME_CC) & NVME_CC_EN) {
+    nvme_writel(ctrl, NVME_CC, nvme_readl(ctrl, NVME_CC) & ~NVME_CC_EN);
+  }
+  rc = nvme_wait_ready(ctrl, 0);
+  if (rc < 0) {
+    kprintf(KERN_ERR "nvme: controller reset timeout\n");
+    goto err_unmap;
+  }
+
+  rc = nvme_alloc_queue(ctrl, &ctrl->adminq, 0, NVME_ADMIN_QUEUE_SIZE);
+  if (rc < 0) goto err_unmap;
+
+  // Install interrupt handler, using MSI when the platform supports it
+  kdpc_create(&ctrl->dpc);
+  rc = pci_enable_msi(unit);
+  if (rc >= 0) {
+    ctrl->msi = 1;
+    ctrl->intrno = rc;
+  } else {
+    ctrl->intrno = IRQ2INTR(ctrl->irq);
+  }
+  register_interrupt(&ctrl->intr, ctrl->intrno, nvme_handler, ctrl);
+  if (!ctrl->msi) kpic_enable_irq(ctrl->irq);
+
+  rc = nvme_enable(ctrl);
+  if (rc < 0) {
+    kprintf(KERN_ERR "nvme: controller failed to become ready (status %08X)\n", nvme_readl(ctrl, NVME_CSTS));
+    goto err_intr;
+  }
+
+  // Identify controller
+  id = (unsigned char *) kmem_alloc(1, PFT_KMEM);
+  if (!id) {
+    rc = -ENOMEM;
+    goto err_intr;
+  }
+  rc = nvme_identify(ctrl, NVME_ID_CNS_CTRL, 0, id);
+  if (rc < 0) {
+    kprintf(KERN_ERR "nvme: error %d identifying controller\n", rc);
+    kmem_free(id, 1);
+    goto err_intr;
+  }
+  memcpy(ctrl->serial, id + 4, 20);
+  nvme_fixstring(ctrl->serial, 20);
+  memcpy(ctrl->model, id + 24, 40);
+  nvme_fixstring(ctrl->model, 40);
+  mdts = id[77];
+  nn = *(unsigned long *) (id + 516);
+
+  // Limit transfer size to what both the PRP lists and the controller allow
+  ctrl->maxxfer = NVME_MAX_XFER_SIZE;
+  if (mdts > 0 && mdts < 16 && (PAGESIZE << mdts) < ctrl->maxxfer) ctrl->maxxfer = PAGESIZE << mdts;
+
+  // Create I/O queue pair
+  qsize = NVME_IO_QUEUE_SIZE;
+  if (qsize > (int) (cap & NVME_CAP_MQES) + 1) qsize = (cap & NVME_CAP_MQES) + 1;
+  rc = nvme_create_io_queues(ctrl, qsize);
+  if (rc < 0) {
+    kprintf(KERN_ERR "nvme: error %d creating I/O queues\n", rc);
+    kmem_free(id, 1);
+    goto err_intr;
+  }
+
+  kprintf(KERN_INFO "nvme: %s, serial %s, %d namespaces, queue depth %d, %s\n",
+          ctrl->model, ctrl->serial, nn, qsize - 1, ctrl->msi ? "MSI" : "INTx");
+
+  nvme_setup_namespaces(ctrl, nn, id);
+  kmem_free(id, 1);
+  return 0;
+
+err_intr:
+  // Stop the controller before its queues are freed
+  nvme_writel(ctrl, NVME_INTMS, 1);
+  nvme_disable(ctrl);
+  unregister_interrupt(&ctrl->intr, ctrl->intrno);
+  while (ctrl->dpc.flags & (DPC_QUEUED | DPC_EXECUTING)) kthread_yield();
+
+  nvme_free_queue(&ctrl->ioq);
+  nvme_free_queue(&ctrl->adminq);
+
+err_unmap:
+  iounmap(ctrl->mmio, NVME_REGS_SIZE);
+  kfree(ctrl);
+  return rc;
+}
+
+int __declspec(dllexport) nvme(struct unit *unit, char *opts) {
+  return install_nvme(unit);
+}
+
+void init_nvme() {
+  struct unit *unit;
+
+  // Install driver for all NVMe controllers found by PCI enumeration
+  unit = kdev_lookup_unit_by_class(NULL, PCI_CLASS_STORAGE_NVME, 0xFFFFFF);
+  while (unit) {
+    install_nvme(unit);
+    unit = kdev_lookup_unit_by_class(unit, PCI_CLASS_STORAGE_NVME, 0xFFFFFF);
+  }
+}
@@ -93,6 +93,12 @@ struct virtio_blk_outhdr {
 #define VIRTIO_BLK_S_IOERR   1
 #define VIRTIO_BLK_S_UNSUPP  2
 
+//
+// Maximum number of data segments in one request
+//
+
+#define VIRTIOBLK_MAX_SEGS   64
+
 //
 // Virtual disk device data
 //
@@ -102,6 +108,8 @@ struct virtioblk {
   struct virtio_blk_config config;
   struct virtio_queue vq;
   int capacity;
+  unsigned int size_max;
+  unsigned int seg_max;
   dev_t devno;
 };
 
@@ -116,15 +124,132 @@ struct virtioblk_request {
   unsigned int size;
 };
 
-static void virtioblk_setup_request(struct virtioblk_request *req, struct scatterlist *sg, void *buffer, int size) {
+static int virtioblk_setup_request(struct virtioblk *vblk, struct virtioblk_request *req, struct scatterlist *sg, char *buffer, size_t count, int *nsegs) {
+  unsigned long addr, next;
+  int size, left, n;
+
   req->status = 0;
   req->thread = kthread_self();
   sg[0].data = &req->hdr;
   sg[0].size = sizeof(req->hdr);
-  sg[1].data = buffer;
-  sg[1].size = size;
-  sg[2].data = &req->status;
-  sg[2].size = sizeof(req->status);
+
+  // Split buffer into physically contiguous segments. Pages that follow
+  // each other in physical memory are merged up to the maximum segment size.
+  n = 0;
+  left = count;
+  while (left > 0) {
+    size = PAGESIZE - ((unsigned long) buffer & (PAGESIZE - 1));
+    if (size > left) size = left;
+    addr = kpage_virt2phys(buffer);
+
+    if (n > 0) {
+      next = kpage_virt2phys(sg[n].data) + sg[n].size;
+      if (next == addr && sg[n].size + size <= vblk->size_max) {
+        sg[n].size += size;
+        buffer += size;
+        left -= size;
+        continue;
+      }
+    }
+
+    if (n == vblk->seg_max) break;
+    n++;
+    sg[n].data = buffer;
+    sg[n].size = size;
+    buffer += size;
+    left -= size;
+  }
+
+  // If the buffer did not fit in one request, trim it back so the next
+  // request starts on a sector boundary
+  while (left > 0 && (count - left) % SECTORSIZE != 0) {
+    size = (count - left) % SECTORSIZE;
+    if (sg[n].size > size) {
+      sg[n].size -= size;
+      left += size;
+    } else {
+      left += sg[n].size;
+      n--;
+    }
+  }
+  if (n == 0) return -EINVAL;
+
+  sg[n + 1].data = &req->status;
+  sg[n + 1].size = sizeof(req->status);
+
+  *nsegs = n;
+  return count - left;
+}
+
+static int virtioblk_request(struct virtioblk *vblk, struct scatterlist *sg, int out, int in, struct virtioblk_request *req) {
+  int rc;
+
+  // Issue request
+  rc = virtio_enqueue(&vblk->vq, sg, out, in, req);
+  if (rc < 0) return rc;
+  virtio_kick(&vblk->vq);
+
+  // Wait for request to complete
+  kthread_wait(THREAD_WAIT_DEVIO);
+
+  // Check status code
+  switch (req->status) {
+    case VIRTIO_BLK_S_OK: return 0;
+    case VIRTIO_BLK_S_UNSUPP: return -ENODEV;
+    case VIRTIO_BLK_S_IOERR: return -EIO;
+    default: return -EUNKNOWN;
+  }
+}
+
+static int virtioblk_transfer(struct virtioblk *vblk, int type, char *buffer, size_t count, blkno_t blkno) {
+  struct virtioblk_request req;
+  struct scatterlist sg[VIRTIOBLK_MAX_SEGS + 2];
+  size_t done;
+  int nsegs;
+  int bytes;
+  int rc;
+
+  // Transfer data in requests of up to seg_max segments each
+  done = 0;
+  while (done < count) {
+    bytes = virtioblk_setup_request(vblk, &req, sg, buffer + done, count - done, &nsegs);
+    if (bytes < 0) return bytes;
+
+    req.hdr.type = type;
+    req.hdr.ioprio = 0;
+    req.hdr.sector = blkno + done / SECTORSIZE;
+
+    if (type == VIRTIO_BLK_T_IN) {
+      rc = virtioblk_request(vblk, sg, 1, nsegs + 1, &req);
+    } else {
+      rc = virtioblk_request(vblk, sg, nsegs + 1, 1, &req);
+    }
+    if (rc < 0) return rc;
+
+    done += bytes;
+  }
+
+  return count;
+}
+
+static int virtioblk_flush(struct virtioblk *vblk) {
+  struct virtioblk_request req;
+  struct scatterlist sg[2];
+
+  // Without a write cache all writes are already stable
+  if (!(vblk->vd.features & VIRTIO_BLK_F_FLUSH)) return 0;
+
+  req.status = 0;
+  req.thread = kthread_self();
+  req.hdr.type = VIRTIO_BLK_T_FLUSH;
+  req.hdr.ioprio = 0;
+  req.hdr.sector = 0;
+  sg[0].data = &req.hdr;
+  sg[0].size = sizeof(req.hdr);
+  sg[1].data = &req.status;
+  sg[1].size = sizeof(req.status);
+
+  return virtioblk_request(vblk, sg, 1, 1, &req);
 }
 
 static int virtioblk_ioctl(struct dev *dev, int cmd, void *args, size_t size) {
@@ -148,6 +273,9 @@ static int virtioblk_ioctl(struct dev *dev, int cmd, void *args, size_t size) {
       geom->sectorsize = SECTORSIZE;
       geom->sectors = vblk->capacity;
       return 0;
+
+    case IOCTL_FLUSH:
+      return virtioblk_flush(vblk);
   }
 
   return -ENOSYS;
@@ -155,74 +283,27 @@ static int virtioblk_ioctl(struct dev *dev, int cmd, void *args, size_t size) {
 
 static int virtioblk_read(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
   struct virtioblk *vblk = (struct virtioblk *) dev->privdata;
-  struct virtioblk_request req;
-  struct scatterlist sg[3];
-  int rc;
-
-  // Setup read request
-  virtioblk_setup_request(&req, sg, buffer, count);
-  req.hdr.type = VIRTIO_BLK_T_IN;
-  req.hdr.ioprio = 0;
-  req.hdr.sector = blkno;
-
-  // Issue request
-  rc = virtio_enqueue(&vblk->vq, sg, 1, 2, &req);
-  if (rc < 0) return rc;
-  virtio_kick(&vblk->vq);
-
-  // Wait for request to complete
-  kthread_wait(THREAD_WAIT_DEVIO);
-
-  // Check status code
-  switch (req.status) {
-    case VIRTIO_BLK_S_OK: rc = req.size - 1; break;
-    case VIRTIO_BLK_S_UNSUPP: rc = -ENODEV; break;
-    case VIRTIO_BLK_S_IOERR: rc = -EIO; break;
-    default: rc = -EUNKNOWN; break;
-  }
-
-  return rc;
+  return virtioblk_transfer(vblk, VIRTIO_BLK_T_IN, (char *) buffer, count, blkno);
 }
 
 static int virtioblk_write(struct dev *dev, void *buffer, size_t count, blkno_t blkno, int flags) {
   struct virtioblk *vblk = (struct virtioblk *) dev->privdata;
-  struct virtioblk_request req;
-  struct scatterlist sg[3];
-  int rc;
-
-  // Setup write request
-  virtioblk_setup_request(&req, sg, buffer, count);
-  req.hdr.type = VIRTIO_BLK_T_OUT;
-  req.hdr.ioprio = 0;
-  req.hdr.sector = blkno;
-
-  // Issue request
-  rc = virtio_enqueue(&vblk->vq, sg, 2, 1, &req);
-  if (rc < 0) return rc;
-  virtio_kick(&vblk->vq);
-
-  // Wait for request to complete
-  kthread_wait(THREAD_WAIT_DEVIO);
-
-  // Check status code
-  switch (req.status) {
-    case VIRTIO_BLK_S_OK: rc = req.size - 1; break;
-    case VIRTIO_BLK_S_UNSUPP: rc = -ENODEV; break;
-    case VIRTIO_BLK_S_IOERR: rc = -EIO; break;
-    default: rc = -EUNKNOWN; break;
-  }
-
-  return rc;
+  return virtioblk_transfer(vblk, VIRTIO_BLK_T_OUT, (char *) buffer, count, blkno);
 }
 
 static int virtioblk_callback(struct virtio_queue *vq) {
   struct virtioblk_request *req;
   unsigned int len;
 
-  while ((req = virtio_dequeue(vq, &len)) != NULL) {
-    req->size = len;
-    kthread_ready(req->thread, 1, 2);
-  }
+  // Keep interrupts off while draining the queue, and poll again if more
+  // requests completed while re-enabling them
+  do {
+    virtio_disable_cb(vq);
+    while ((req = virtio_dequeue(vq, &len)) != NULL) {
+      req->size = len;
+      kthread_ready(req->thread, 1, 2);
+    }
+  } while (!virtio_enable_cb(vq));
 
   return 0;
 }
@@ -250,7 +331,8 @@ static int install_virtioblk(struct unit *unit) {
   memset(vblk, 0, sizeof(struct virtioblk));
 
   // Initialize virtual device
-  rc = virtio_device_init(&vblk->vd, unit, VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_GEOMETRY | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH);
+  rc = virtio_device_init(&vblk->vd, unit, VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_GEOMETRY | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH |
+                          VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX);
   if (rc < 0) return rc;
 
   // Get block device configuration
@@ -265,6 +347,22 @@ static int install_virtioblk(struct unit *unit) {
   rc = virtio_queue_init(&vblk->vq, &vblk->vd, 0, virtioblk_callback);
   if (rc < 0) return rc;
 
+  // Determine segment limits for requests. Without indirect descriptors the
+  // header and status also need a descriptor in the ring.
+  vblk->seg_max = VIRTIOBLK_MAX_SEGS;
+  if ((vblk->vd.features & VIRTIO_BLK_F_SEG_MAX) && vblk->config.seg_max > 0 && vblk->config.seg_max < vblk->seg_max) {
+    vblk->seg_max = vblk->config.seg_max;
+  }
+  if (vblk->vd.features & VIRTIO_RING_F_INDIRECT_DESC) {
+    if (vblk->seg_max > VIRTIO_MAX_INDIRECT - 2) vblk->seg_max = VIRTIO_MAX_INDIRECT - 2;
+  } else {
+    if (vblk->seg_max > virtio_queue_size(&vblk->vq) - 2) vblk->seg_max = virtio_queue_size(&vblk->vq) - 2;
+  }
+  vblk->size_max = 0x7FFFFFFF;
+  if ((vblk->vd.features & VIRTIO_BLK_F_SIZE_MAX) && vblk->config.size_max >= PAGESIZE) {
+    vblk->size_max = vblk->config.size_max;
+  }
+
   // Create device
   vblk->devno = kdev_create("vd#", &virtioblk_driver, unit, vblk);
   virtio_setup_complete(&vblk->vd, 1);
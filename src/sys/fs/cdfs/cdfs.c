@@ -38,6 +38,27 @@
 
 #define CDFS_DEFAULT_CACHESIZE 128
 #define CDFS_BLOCKSIZE         2048
+#define CDFS_DIRECT_BLKS       4              // Min. blocks read directly from device
+#define CDFS_MAX_TRANSFER      (64 * 1024)    // Max. size of direct device transfer
+
+//
+// Directory index. Maps file names in a directory to the location of
+// their directory records. Built on first lookup in the directory.
+//
+
+struct cdfs_dirent {
+  unsigned long hash;                 // Hash value of file name
+  int blk;                            // Block containing directory record
+  int offset;                         // Offset of directory record in block
+  int next;                           // Next entry in hash chain, -1 if last
+};
+
+struct cdfs_dirindex {
+  int buckets;                        // Number of hash buckets (power of two)
+  int *hashtab;                       // First entry in each hash chain
+  int entries;                        // Number of directory entries
+  struct cdfs_dirent *dirents;        // Directory entries
+};
 
 struct cdfs {
   dev_t devno;
@@ -49,6 +70,10 @@ struct cdfs {
   unsigned char *path_table_buffer;
   struct iso_pathtable_record **path_table;
   int path_table_records;
+  int path_buckets;
+  int *path_hash;
+  int *path_next;
+  struct cdfs_dirindex **dirindex;
 };
 
 struct cdfs_file {
@@ -75,6 +100,33 @@ static int cdfs_fnmatch(struct cdfs *cdfs, char *fn1, int len1, char *fn2, int l
   }
 }
 
+static unsigned long cdfs_hash(unsigned long hash, char *name, int len) {
+  while (len--) hash = hash * 31 + *(unsigned char *) name++;
+  return hash;
+}
+
+static unsigned long cdfs_rec_hash(struct cdfs *cdfs, unsigned long hash, char *name, int len) {
+  // Hash name from path table or directory record the way cdfs_fnmatch() compares it
+  if (cdfs->joliet) {
+    wchar_t *wname = (wchar_t *) name;
+    int wlen = len / 2;
+    if (wlen > 1 && ntohs(wname[wlen - 2]) == ';') wlen -= 2;
+    if (wlen > 0 && ntohs(wname[wlen - 1]) == '.') wlen -= 1;
+    while (wlen--) hash = hash * 31 + ntohs(*wname++);
+    return hash;
+  } else {
+    if (len > 1 && name[len - 2] == ';') len -= 2;
+    if (len > 0 && name[len - 1] == '.') len -= 1;
+    return cdfs_hash(hash, name, len);
+  }
+}
+
+static int cdfs_hash_buckets(int entries) {
+  int buckets = 16;
+  while (buckets < entries) buckets <<= 1;
+  return buckets;
+}
+
 static int cdfs_read_path_table(struct cdfs *cdfs, struct iso_volume_descriptor *vd) {
   struct buf *buf;
   unsigned char *pt;
@@ -137,14 +189,34 @@ static int cdfs_read_path_table(struct cdfs *cdfs, struct iso_volume_descriptor
     pt += reclen;
   }
 
+  // Build hash index of path table keyed by parent directory and name
+  cdfs->path_buckets = cdfs_hash_buckets(cdfs->path_table_records);
+  cdfs->path_hash = (int *) kmalloc(cdfs->path_buckets * sizeof(int));
+  cdfs->path_next = (int *) kmalloc(cdfs->path_table_records * sizeof(int));
+  cdfs->dirindex = (struct cdfs_dirindex **) kmalloc(cdfs->path_table_records * sizeof(struct cdfs_dirindex *));
+  if (!cdfs->path_hash || !cdfs->path_next || !cdfs->dirindex) return -ENOMEM;
+  memset(cdfs->path_hash, 0, cdfs->path_buckets * sizeof(int));
+  memset(cdfs->dirindex, 0, cdfs->path_table_records * sizeof(struct cdfs_dirindex *));
+
+  // Record 1 is the root directory which is never looked up by name
+  for (n = cdfs->path_table_records - 1; n > 1; n--) {
+    struct iso_pathtable_record *pathrec = cdfs->path_table[n];
+    unsigned long hash = cdfs_rec_hash(cdfs, pathrec->parent, pathrec->name, pathrec->length);
+    int bucket = hash & (cdfs->path_buckets - 1);
+
+    cdfs->path_next[n] = cdfs->path_hash[bucket];
+    cdfs->path_hash[bucket] = n;
+  }
+
   return 0;
 }
 
 static int cdfs_find_dir(struct cdfs *cdfs, char *name, int len) {
   char *p;
   int l;
-  int dir = 2;
+  int dir;
   int parent = 1;
+  unsigned long hash;
 
   while (1) {
     // Skip path separator
@@ -162,33 +234,28 @@ static int cdfs_find_dir(struct cdfs *cdfs, char *name, int len) {
       p++;
     }
 
-    // Find directory for next name part
-    while (dir < cdfs->path_table_records) {
-      if (cdfs->path_table[dir]->parent != parent) return -ENOENT;
-      if (cdfs_fnmatch(cdfs, name, l, cdfs->path_table[dir]->name, cdfs->path_table[dir]->length)) break;
-      dir++;
+    // Find directory for next name part in path table index
+    hash = cdfs_hash(parent, name, l);
+    dir = cdfs->path_hash[hash & (cdfs->path_buckets - 1)];
+    while (dir) {
+      struct iso_pathtable_record *pathrec = cdfs->path_table[dir];
+      if (pathrec->parent == parent && cdfs_fnmatch(cdfs, name, l, pathrec->name, pathrec->length)) break;
+      dir = cdfs->path_next[dir];
     }
 
-    // If we reached the end of the path table the directory does not exist
-    if (dir == cdfs->path_table_records) return -ENOENT;
+    if (!dir) return -ENOENT;
 
     // If we have parsed the whole name return the directory number
     if (l == len) return dir;
 
-    // Go forward in path table until first entry for directory found
-    parent = dir;
-    while (dir < cdfs->path_table_records) {
-      if (cdfs->path_table[dir]->parent == parent) break;
-      dir++;
-    }
-
     // Prepare for next name part
+    parent = dir;
     name = p;
     len -= l;
   }
 }
 
-static int cdfs_find_in_dir(struct cdfs *cdfs, int dir, char *name, int len, struct buf **dirbuf, struct iso_directory_record **dirrec) {
+static int cdfs_scan_dir(struct cdfs *cdfs, int dir, struct cdfs_dirindex *index) {
   struct buf *buf;
   char *p;
   struct iso_directory_record *rec;
@@ -196,8 +263,9 @@ static int cdfs_find_in_dir(struct cdfs *cdfs, int dir, char *name, int len, str
   int left;
   int reclen;
   int namelen;
+  int n;
 
-  // The first two directory records are . (current) and .. (parent)
+  // Count directory records, and add them to the index if one is supplied
   blk = cdfs->path_table[dir]->extent;
   buf = get_buffer(cdfs->cache, blk++);
   if (!buf) return -EIO;
@@ -207,7 +275,7 @@ static int cdfs_find_in_dir(struct cdfs *cdfs, int dir, char *name, int len, str
   rec = (struct iso_directory_record *) p;
   left = isonum_733(rec->size);
 
-  // Find named entry in directory
+  n = 0;
   while (left > 0) {
     // Read next block if all records in current block has been read
     // Directory records never cross block boundaries
@@ -219,16 +287,26 @@ static int cdfs_find_in_dir(struct cdfs *cdfs, int dir, char *name, int len, str
       p = buf->data;
     }
 
-    // Check for match
     rec = (struct iso_directory_record *) p;
     reclen = isonum_711(rec->length);
     namelen = isonum_711(rec->name_len);
 
     if (reclen > 0) {
-      if (cdfs_fnmatch(cdfs, name, len, (char *) rec->name, namelen)) {
-        *dirrec = rec;
-        *dirbuf = buf;
-        return 0;
+      // Skip . and .. entries
+      if (namelen != 1 || (rec->name[0] != 0 && rec->name[0] != 1)) {
+        if (index && n < index->entries) {
+          struct cdfs_dirent *de = &index->dirents[n];
+          int bucket;
+
+          de->hash = cdfs_rec_hash(cdfs, 0, (char *) rec->name, namelen);
+          de->blk = blk - 1;
+          de->offset = p - buf->data;
+
+          bucket = de->hash & (index->buckets - 1);
+          de->next = index->hashtab[bucket];
+          index->hashtab[bucket] = n;
+        }
+        n++;
       }
 
       // Skip to next record
@@ -242,6 +320,70 @@ static int cdfs_find_in_dir(struct cdfs *cdfs, int dir, char *name, int len, str
   }
 
   release_buffer(cdfs->cache, buf);
+  return n;
+}
+
+static struct cdfs_dirindex *cdfs_get_dirindex(struct cdfs *cdfs, int dir) {
+  struct cdfs_dirindex *index;
+  int entries;
+  int buckets;
+
+  if (cdfs->dirindex[dir]) return cdfs->dirindex[dir];
+
+  // Count entries in directory
+  entries = cdfs_scan_dir(cdfs, dir, NULL);
+  if (entries < 0) return NULL;
+
+  // Allocate index with hash table and entries in one block
+  buckets = cdfs_hash_buckets(entries);
+  index = (struct cdfs_dirindex *) kmalloc(sizeof(struct cdfs_dirindex) + buckets * sizeof(int) + entries * sizeof(struct cdfs_dirent));
+  if (!index) return NULL;
+  index->buckets = buckets;
+  index->hashtab = (int *) (index + 1);
+  index->entries = entries;
+  index->dirents = (struct cdfs_dirent *) (index->hashtab + buckets);
+  memset(index->hashtab, 0xFF, buckets * sizeof(int));
+
+  // Add directory records to index
+  if (cdfs_scan_dir(cdfs, dir, index) < 0) {
+    kfree(index);
+    return NULL;
+  }
+
+  cdfs->dirindex[dir] = index;
+  return index;
+}
+
+static int cdfs_find_in_dir(struct cdfs *cdfs, int dir, char *name, int len, struct buf **dirbuf, struct iso_directory_record **dirrec) {
+  struct cdfs_dirindex *index;
+  struct cdfs_dirent *de;
+  struct iso_directory_record *rec;
+  struct buf *buf;
+  unsigned long hash;
+  int n;
+
+  index = cdfs_get_dirindex(cdfs, dir);
+  if (!index) return -EIO;
+
+  // Find named entry in directory index
+  hash = cdfs_hash(0, name, len);
+  for (n = index->hashtab[hash & (index->buckets - 1)]; n >= 0; n = de->next) {
+    de = &index->dirents[n];
+    if (de->hash != hash) continue;
+
+    buf = get_buffer(cdfs->cache, de->blk);
+    if (!buf) return -EIO;
+
+    rec = (struct iso_directory_record *) (buf->data + de->offset);
+    if (cdfs_fnmatch(cdfs, name, len, (char *) rec->name, isonum_711(rec->name_len))) {
+      *dirrec = rec;
+      *dirbuf = buf;
+      return 0;
+    }
+
+    release_buffer(cdfs->cache, buf);
+  }
+
   return -ENOENT;
 }
 
@@ -383,6 +525,7 @@ int cdfs_mount(struct fs *fs, char *opts)
 
     // Device mounted successfully
     fs->data = cdfs;
+    fs->flags |= FS_DCACHE;
     return 0;
 }
 
@@ -396,6 +539,16 @@ int cdfs_umount(struct fs *fs) {
   kdev_close(cdfs->devno);
 
   // Deallocate file system
+  if (cdfs->dirindex) {
+    int n;
+
+    for (n = 0; n < cdfs->path_table_records; n++) {
+      if (cdfs->dirindex[n]) kfree(cdfs->dirindex[n]);
+    }
+    kfree(cdfs->dirindex);
+  }
+  if (cdfs->path_hash) kfree(cdfs->path_hash);
+  if (cdfs->path_next) kfree(cdfs->path_next);
   if (cdfs->path_table_buffer) kfree(cdfs->path_table_buffer);
   if (cdfs->path_table) kfree(cdfs->path_table);
   kfree(cdfs);
@@ -475,7 +628,9 @@ int cdfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
   char *p;
   int iblock;
   int start;
+  int blks;
   int blk;
+  int rc;
   struct buf *buf;
 
   read = 0;
@@ -483,25 +638,40 @@ int cdfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
   while (pos < cdfile->size && size > 0) {
     iblock = (int) pos / CDFS_BLOCKSIZE;
     start = (int) pos % CDFS_BLOCKSIZE;
+    blk = cdfile->extent + iblock;
+    left = cdfile->size - (int) pos;
+
+    // Files are stored in one contiguous extent, so large block aligned
+    // reads are transferred directly from the device bypassing the cache
+    if (start == 0) {
+      count = size < left ? size : left;
+      blks = count / CDFS_BLOCKSIZE;
+      if (blks >= CDFS_DIRECT_BLKS || (blks > 0 && (filp->flags & O_DIRECT))) {
+        if (blks > CDFS_MAX_TRANSFER / CDFS_BLOCKSIZE) blks = CDFS_MAX_TRANSFER / CDFS_BLOCKSIZE;
+        count = blks * CDFS_BLOCKSIZE;
+
+        rc = kdev_read(cdfs->devno, p, count, blk, 0);
+        if (rc != (int) count) return read ? read : -EIO;
+
+        pos += count;
+        p += count;
+        read += count;
+        size -= count;
+        continue;
+      }
+    }
 
     count = CDFS_BLOCKSIZE - start;
     if (count > size) count = size;
-
-    left = cdfile->size - (int) pos;
     if (count > left) count = left;
     if (count <= 0) break;
 
-    blk = cdfile->extent + iblock;
+    if (filp->flags & O_DIRECT) return read;
 
-    if (filp->flags & O_DIRECT) {
-      if (start != 0 || count != CDFS_BLOCKSIZE) return read;
-      if (kdev_read(cdfs->devno, p, count, blk, 0) != (int) count) return read;
-    } else {
-      buf = get_buffer(cdfs->cache, blk);
-      if (!buf) return -EIO;
-      memcpy(p, buf->data + start, count);
-      release_buffer(cdfs->cache, buf);
-    }
+    buf = get_buffer(cdfs->cache, blk);
+    if (!buf) return -EIO;
+    memcpy(p, buf->data + start, count);
+    release_buffer(cdfs->cache, buf);
 
     pos += count;
     p += count;
@@ -557,6 +727,22 @@ int cdfs_fstat(struct file *filp, struct stat64 *buffer) {
   return cdfile->size;
 }
 
+static void cdfs_stat_record(struct cdfs *cdfs, struct iso_directory_record *rec, struct stat64 *buffer) {
+  memset(buffer, 0, sizeof(struct stat64));
+
+  if (rec->flags[0] & 2) {
+    buffer->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+  } else {
+    buffer->st_mode = S_IFREG | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+  }
+
+  buffer->st_ino = isonum_733(rec->extent);
+  buffer->st_nlink = 1;
+  buffer->st_dev = cdfs->devno;
+  buffer->st_atime = buffer->st_mtime = buffer->st_ctime = cdfs_isodate(rec->date);
+  buffer->st_size = isonum_733(rec->size);
+}
+
 int cdfs_stat(struct fs *fs, char *name, struct stat64 *buffer) {
   struct cdfs *cdfs = (struct cdfs *) fs->data;
   struct iso_directory_record *rec;
@@ -568,22 +754,7 @@ int cdfs_stat(struct fs *fs, char *name, struct stat64 *buffer) {
   if (rc < 0) return rc;
 
   size = isonum_733(rec->size);
-
-  if (buffer) {
-    memset(buffer, 0, sizeof(struct stat64));
-
-    if (rec->flags[0] & 2) {
-      buffer->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-    } else {
-      buffer->st_mode = S_IFREG | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-    }
-
-    buffer->st_ino = isonum_733(rec->extent);
-    buffer->st_nlink = 1;
-    buffer->st_dev = cdfs->devno;
-    buffer->st_atime = buffer->st_mtime = buffer->st_ctime = cdfs_isodate(rec->date);
-    buffer->st_size = size;
-  };
+  if (buffer) cdfs_stat_record(cdfs, rec, buffer);
 
   release_buffer(cdfs->cache, buf);
   return size;
@@ -624,7 +795,7 @@ int cdfs_opendir(struct file *filp, char *name) {
   return 0;
 }
 
-int cdfs_readdir(struct file *filp, struct direntry *dirp, int count) {
+static int cdfs_read_dir_entry(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count) {
   struct cdfs_file *cdfile = (struct cdfs_file *) filp->data;
   struct cdfs *cdfs = (struct cdfs *) filp->fs->data;
   struct iso_directory_record *rec;
@@ -686,15 +857,26 @@ recagain:
     dirp->name[namelen] = 0;
   }
 
+  // The attributes are in the directory record itself
+  if (buffer) cdfs_stat_record(cdfs, rec, buffer);
+
   filp->pos += reclen;
   release_buffer(cdfs->cache, buf);
   return 1;
 }
 
+int cdfs_readdir(struct file *filp, struct direntry *dirp, int count) {
+  return cdfs_read_dir_entry(filp, dirp, NULL, count);
+}
+
+int cdfs_readdirplus(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count) {
+  return cdfs_read_dir_entry(filp, dirp, buffer, count);
+}
+
 struct fsops cdfsops = {
   FSOP_OPEN | FSOP_CLOSE | FSOP_FSYNC | FSOP_READ |
   FSOP_TELL | FSOP_LSEEK | FSOP_STAT | FSOP_FSTAT |
-  FSOP_OPENDIR | FSOP_READDIR,
+  FSOP_OPENDIR | FSOP_READDIR | FSOP_READDIRPLUS,
 
   NULL,
   NULL,
@@ -739,7 +921,13 @@ struct fsops cdfsops = {
   NULL,
 
   cdfs_opendir,
-  cdfs_readdir
+  cdfs_readdir,
+
+  NULL,
+
+  NULL,
+
+  cdfs_readdirplus
 };
 
 void init_cdfs() {
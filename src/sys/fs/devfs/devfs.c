@@ -172,7 +172,15 @@ int devfs_close(struct file *filp) {
 }
 
 int devfs_fsync(struct file *filp) {
-  return 0;
+  struct devfile *df = (struct devfile *) filp->data;
+  int rc;
+
+  if (df == DEVROOT) return 0;
+
+  // Flush device write cache, if supported by device
+  rc = kdev_ioctl(df->devno, IOCTL_FLUSH, NULL, 0);
+  if (rc == -ENOSYS) rc = 0;
+  return rc;
 }
 
 int devfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
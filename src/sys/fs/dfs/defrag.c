@@ -0,0 +1,333 @@
+//
+// defrag.c
+//
+// Disk filesystem online defragmentation
+//
+// Copyright (C) 2002 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+//
+
+#include <os/krnl.h>
+#include <os/dfs.h>
+#include <os/buf.h>
+
+//
+// get_block_map
+//
+// Returns the runs of physically contiguous blocks in a file. The number
+// of runs is the number of fragments in the file.
+//
+
+static int get_block_map(struct inode *inode, struct extent **map) {
+  struct extent *runs;
+  struct extent *newruns;
+  unsigned int blocks = inode->desc->blocks;
+  unsigned int iblock;
+  int size;
+  int count;
+  blkno_t blk;
+  int rc;
+
+  size = 16;
+  runs = (struct extent *) kmalloc(size * sizeof(struct extent));
+  if (!runs) return -ENOMEM;
+
+  count = 0;
+  for (iblock = 0; iblock < blocks; iblock += rc) {
+    rc = map_inode_blocks(inode, iblock, blocks - iblock, &blk);
+    if (rc < 0) {
+      kfree(runs);
+      return rc;
+    }
+
+    // Runs can continue across block directory pages
+    if (count > 0 && runs[count - 1].start + runs[count - 1].count == blk) {
+      runs[count - 1].count += rc;
+      continue;
+    }
+
+    if (count == size) {
+      size *= 2;
+      newruns = (struct extent *) krealloc(runs, size * sizeof(struct extent));
+      if (!newruns) {
+        kfree(runs);
+        return -ENOMEM;
+      }
+      runs = newruns;
+    }
+
+    runs[count].iblock = iblock;
+    runs[count].count = rc;
+    runs[count].start = blk;
+    count++;
+  }
+
+  *map = runs;
+  return count;
+}
+
+//
+// copy_blocks
+//
+// Copies the data of the file to the new runs in large clusters. Each
+// cluster is read from the old blocks and written to the new blocks with
+// direct device transfers, which also write back dirty cached copies of
+// the old blocks and drop stale cached copies of the new blocks.
+//
+
+static int copy_blocks(struct file *filp, struct extent *newmap, int nnew) {
+  struct inode *inode = (struct inode *) filp->data;
+  unsigned int maxn = DFS_DEFRAG_CLUSTER / inode->fs->blocksize;
+  unsigned int done;
+  unsigned int n;
+  unsigned int i;
+  char *cluster;
+  blkno_t blk;
+  int rc;
+  int r;
+
+  cluster = (char *) kmalloc(maxn * inode->fs->blocksize);
+  if (!cluster) return -ENOMEM;
+
+  rc = 0;
+  for (r = 0; r < nnew && rc >= 0; r++) {
+    for (done = 0; done < newmap[r].count; done += n) {
+      if (filp->flags & F_CLOSED) {
+        rc = -EINTR;
+        break;
+      }
+
+      n = newmap[r].count - done;
+      if (n > maxn) n = maxn;
+
+      // Gather the cluster from the old runs
+      for (i = 0; i < n; i += rc) {
+        rc = map_inode_blocks(inode, newmap[r].iblock + done + i, n - i, &blk);
+        if (rc < 0) break;
+        if (direct_transfer(inode, blk, rc, cluster + i * inode->fs->blocksize, 0) < 0) {
+          rc = -EIO;
+          break;
+        }
+      }
+      if (rc < 0) break;
+
+      rc = direct_transfer(inode, newmap[r].start + done, n, cluster, 1);
+      if (rc < 0) break;
+    }
+  }
+
+  kfree(cluster);
+  return rc < 0 ? rc : 0;
+}
+
+//
+// block_map_changed
+//
+// Checks whether the block map of the file still matches the runs that
+// were copied. Returns 1 if it has changed, 0 if not.
+//
+
+static int block_map_changed(struct inode *inode, struct extent *oldmap, int nold) {
+  struct extent *map;
+  int changed;
+  int n;
+
+  n = get_block_map(inode, &map);
+  if (n < 0) return n;
+  changed = n != nold || memcmp(map, oldmap, nold * sizeof(struct extent)) != 0;
+  kfree(map);
+  return changed;
+}
+
+int dfs_fraginfo(struct file *filp, struct dfs_fraginfo *info) {
+  struct inode *inode = (struct inode *) filp->data;
+  struct extent *map;
+  int rc;
+
+  rc = get_block_map(inode, &map);
+  if (rc < 0) return rc;
+  kfree(map);
+
+  info->blocks = inode->desc->blocks;
+  info->fragments = rc;
+  info->moved = 0;
+  return 0;
+}
+
+//
+// dfs_defrag
+//
+// Relocates the blocks of a regular file into as few runs of contiguous
+// free blocks as possible while the volume is mounted. The new blocks are
+// reserved in memory and filled, and are then allocated and the block map
+// of the file switched to them in one journal transaction, so a crash
+// during the copy leaves nothing allocated. The copy runs without a
+// journal handle, so commits are not held up while the data is moved; the
+// new blocks are given back if the file was written or changed meanwhile.
+// Only files that are not opened by anyone else can be relocated; lookups
+// of the inode wait until the relocation is finished. Nothing is moved
+// unless the file ends up with fewer fragments than it had.
+//
+
+int dfs_defrag(struct file *filp, struct dfs_fraginfo *info) {
+  struct thread *thread = kthread_self();
+  struct inode *inode = (struct inode *) filp->data;
+  struct filsys *fs = inode->fs;
+  struct extent *oldmap;
+  struct extent *newmap;
+  unsigned int blocks;
+  unsigned int left;
+  blkno_t goal;
+  blkno_t start;
+  off64_t size;
+  struct jhandle h;
+  unsigned int wgen;
+  int claimed;
+  int nold;
+  int nnew;
+  int rc;
+  int n;
+
+  if (!S_ISREG(inode->desc->mode)) return -EINVAL;
+  if (thread->euid != 0 && thread->euid != inode->desc->uid) return -EPERM;
+  if (inode->refcnt > 1 || inode->writers > 0 || (inode->flags & INODE_DEFRAG)) return -EBUSY;
+
+  inode->flags |= INODE_DEFRAG;
+  wgen = inode->write_gen;
+  journal_start(fs, &h);
+  oldmap = newmap = NULL;
+  nnew = 0;
+
+  // Delayed data must have blocks before the file can be relocated
+  rc = flush_delalloc(inode);
+  if (rc < 0) goto out;
+
+  nold = get_block_map(inode, &oldmap);
+  if (nold < 0) {
+    rc = nold;
+    goto out;
+  }
+
+  blocks = inode->desc->blocks;
+  size = inode->desc->size;
+  info->blocks = blocks;
+  info->fragments = nold;
+  info->moved = 0;
+  if (nold <= 1) goto out;
+
+  newmap = (struct extent *) kmalloc(nold * sizeof(struct extent));
+  if (!newmap) {
+    rc = -ENOMEM;
+    goto out;
+  }
+
+  // Reserve runs of free blocks starting in the group of the inode
+  left = blocks;
+  goal = inode->ino / fs->super->inodes_per_group * fs->super->blocks_per_group;
+  while (left > 0) {
+    if (nnew == nold - 1) {
+      rc = -ENOSPC;
+      break;
+    }
+
+    goal = find_free_run(fs, goal, left);
+    if (goal == NOBLOCK) {
+      rc = -ENOSPC;
+      break;
+    }
+
+    n = reserve_blocks(fs, goal, left, &start);
+    if (n < 0) {
+      rc = n;
+      break;
+    }
+
+    newmap[nnew].iblock = blocks - left;
+    newmap[nnew].count = n;
+    newmap[nnew].start = start;
+    nnew++;
+
+    left -= n;
+    goal = start + n;
+  }
+
+  journal_stop(fs, &h);
+
+  // Copy data to the new blocks outside of any transaction
+  if (rc >= 0) rc = copy_blocks(filp, newmap, nnew);
+
+  // Allocate the new blocks and switch the block map, unless the file was
+  // written or changed during the copy
+  journal_start(fs, &h);
+  if (rc >= 0 && (inode->writers > 0 || inode->write_gen != wgen)) rc = -EAGAIN;
+  if (rc >= 0 && (inode->desc->blocks != blocks || inode->desc->size != size)) rc = -EAGAIN;
+  if (rc >= 0) {
+    n = block_map_changed(inode, oldmap, nold);
+    if (n != 0) rc = n < 0 ? n : -EAGAIN;
+  }
+  claimed = 0;
+  while (rc >= 0 && claimed < nnew) {
+    rc = claim_blocks(fs, newmap[claimed].start, newmap[claimed].count);
+    if (rc >= 0) claimed++;
+  }
+  if (rc >= 0) {
+    rc = remap_inode_blocks(inode, oldmap, nold, newmap, nnew);
+    if (rc >= 0) {
+      info->fragments = nnew;
+      info->moved = blocks;
+    }
+  }
+  if (rc < 0) {
+    for (n = 0; n < nnew; n++) {
+      if (n < claimed) {
+        free_extent_blocks(fs, newmap[n].start, newmap[n].count);
+      } else {
+        unreserve_blocks(fs, newmap[n].start, newmap[n].count);
+      }
+    }
+  }
+
+out:
+  journal_stop(fs, &h);
+  if (oldmap) kfree(oldmap);
+  if (newmap) kfree(newmap);
+  inode->flags &= ~INODE_DEFRAG;
+  return rc;
+}
+
+int dfs_freeinfo(struct file *filp, struct dfs_freeinfo *info, int count) {
+  struct filsys *fs = ((struct inode *) filp->data)->fs;
+  unsigned int group;
+  int rc;
+
+  for (group = 0; group < fs->super->group_count && (int) group < count; group++) {
+    rc = get_group_freeinfo(fs, group, info + group);
+    if (rc < 0) return rc;
+  }
+
+  return group;
+}
@@ -38,7 +38,7 @@
 
 struct fsops dfsops = {
   FSOP_READ | FSOP_WRITE | FSOP_IOCTL | FSOP_TELL | FSOP_LSEEK | FSOP_FTRUNCATE |
-  FSOP_FUTIME | FSOP_FSTAT,
+  FSOP_FUTIME | FSOP_FSTAT | FSOP_FALLOCATE | FSOP_SPLICE,
 
   NULL,
   NULL,
@@ -83,7 +83,17 @@ struct fsops dfsops = {
   dfs_unlink,
 
   dfs_opendir,
-  dfs_readdir
+  dfs_readdir,
+
+  dfs_fallocate,
+
+  dfs_splice_read,
+
+  dfs_readdirplus,
+
+  NULL,
+
+  dfs_copy_range
 };
 
 void init_dfs() {
@@ -121,21 +131,7 @@ int dfs_stat(struct fs *fs, char *name, struct stat64 *buffer) {
 
   size = inode->desc->size;
 
-  if (buffer) {
-    memset(buffer, 0, sizeof(struct stat64));
-
-    buffer->st_mode = inode->desc->mode;
-    buffer->st_uid = inode->desc->uid;
-    buffer->st_gid = inode->desc->gid;
-    buffer->st_ino = inode->ino;
-    buffer->st_nlink = inode->desc->linkcount;
-    buffer->st_dev = ((struct filsys *) fs->data)->devno;
-
-    buffer->st_atime = kpit_get_time();
-    buffer->st_mtime = inode->desc->mtime;
-    buffer->st_ctime = inode->desc->ctime;
-    buffer->st_size = inode->desc->size;
-  }
+  if (buffer) stat_inode(inode, buffer);
 
   release_inode(inode);
 
@@ -37,20 +37,618 @@
 
 #define NAME_ALIGN_LEN(l) (((l) + 3) & ~3)
 
+#define DX_MAXLEVELS 2
+
+struct dxframe {
+  struct buf *buf;
+  struct dxnode *node;
+  int pos;
+};
+
+struct dxsort {
+  unsigned int hash;
+  struct dentry *de;
+};
+
+//
+// dirhash
+//
+// FNV-1a hash of a file name. This must match the hash used by mkdfs.
+//
+
+static unsigned int dirhash(char *name, int len) {
+  unsigned int h = 2166136261U;
+
+  while (len-- > 0) {
+    h ^= (unsigned char) *name++;
+    h *= 16777619;
+  }
+
+  return h;
+}
+
+static int is_indexed(struct inode *dir) {
+  return (dir->desc->flags & DFS_INODE_FLAG_DIRINDEX) != 0;
+}
+
+static void dx_init_node(struct filsys *fs, struct dxnode *node) {
+  memset(node, 0, sizeof(struct dxnode));
+  node->ino = NOINODE;
+  node->reclen = fs->blocksize;
+  node->namelen = fs->blocksize - sizeof(struct dentry);
+  node->limit = (fs->blocksize - sizeof(struct dxnode)) / sizeof(struct dxentry);
+}
+
+static void dx_release(struct inode *dir, struct dxframe *frames, int nframes) {
+  while (nframes > 0) {
+    nframes--;
+    release_buffer(dir->fs->cache, frames[nframes].buf);
+  }
+}
+
+//
+// dx_probe
+//
+// Walks the hash index from the root to the leaf block for a hash value.
+// The index blocks on the path are returned locked in frames.
+//
+
+static int dx_probe(struct inode *dir, unsigned int hash, struct dxframe *frames, int *nframes, unsigned int *leaf) {
+  unsigned int block;
+  int levels;
+  int level;
+  blkno_t blk;
+  struct buf *buf;
+  struct dxnode *node;
+  int lo, hi, mid, pos;
+
+  block = 0;
+  levels = 0;
+  level = 0;
+  while (1) {
+    blk = get_inode_block(dir, block);
+    buf = blk == NOBLOCK ? NULL : get_buffer(dir->fs->cache, blk);
+    if (!buf) {
+      dx_release(dir, frames, level);
+      return -EIO;
+    }
+
+    node = (struct dxnode *) buf->data;
+    if (level == 0) levels = node->levels;
+    if (node->ino != NOINODE || node->count == 0 || node->count > node->limit || levels >= DX_MAXLEVELS) {
+      kprintf(KERN_ERR "dfs: corrupt directory index in inode %d\n", dir->ino);
+      release_buffer(dir->fs->cache, buf);
+      dx_release(dir, frames, level);
+      return -EIO;
+    }
+
+    // Find last entry with a hash less than or equal to the hash value
+    pos = 0;
+    lo = 1;
+    hi = node->count - 1;
+    while (lo <= hi) {
+      mid = (lo + hi) / 2;
+      if (node->entry[mid].hash <= hash) {
+        pos = mid;
+        lo = mid + 1;
+      } else {
+        hi = mid - 1;
+      }
+    }
+
+    frames[level].buf = buf;
+    frames[level].node = node;
+    frames[level].pos = pos;
+    block = node->entry[pos].block;
+
+    if (level++ == levels) break;
+  }
+
+  if (block >= dir->desc->blocks) {
+    dx_release(dir, frames, level);
+    return -EIO;
+  }
+
+  *nframes = level;
+  *leaf = block;
+  return 0;
+}
+
+//
+// dx_adjust_entries
+//
+// Updates the name count in the index root. When the last name is removed
+// the directory is truncated, which also removes the index.
+//
+
+static int dx_adjust_entries(struct inode *dir, int delta) {
+  blkno_t blk;
+  struct buf *buf;
+  struct dxnode *root;
+
+  blk = get_inode_block(dir, 0);
+  if (blk == NOBLOCK) return -EIO;
+  buf = get_buffer(dir->fs->cache, blk);
+  if (!buf) return -EIO;
+
+  root = (struct dxnode *) buf->data;
+  root->entries += delta;
+  if (root->entries > 0) {
+    journal_dirty(dir->fs, buf);
+    release_buffer(dir->fs->cache, buf);
+    return 0;
+  }
+
+  mark_buffer_invalid(dir->fs->cache, buf);
+  release_buffer(dir->fs->cache, buf);
+  dir->desc->flags &= ~DFS_INODE_FLAG_DIRINDEX;
+  dir->desc->size = 0;
+  mark_inode_dirty(dir);
+  return truncate_inode(dir, 0);
+}
+
+//
+// dir_range
+//
+// Returns the range of directory blocks that can hold a name. For indexed
+// directories this is the leaf block selected by the hash index.
+//
+
+static int dir_range(struct inode *dir, char *name, int len, unsigned int *first, unsigned int *last) {
+  struct dxframe frames[DX_MAXLEVELS];
+  int nframes;
+  unsigned int leaf;
+  int rc;
+
+  if (!is_indexed(dir)) {
+    *first = 0;
+    *last = dir->desc->blocks;
+    return 0;
+  }
+
+  rc = dx_probe(dir, dirhash(name, len), frames, &nframes, &leaf);
+  if (rc < 0) return rc;
+  dx_release(dir, frames, nframes);
+
+  *first = leaf;
+  *last = leaf + 1;
+  return 0;
+}
+
+//
+// insert_into_block
+//
+// Adds a directory entry to the free space in a directory block
+//
+
+static int insert_into_block(struct filsys *fs, struct buf *buf, char *name, int len, ino_t ino) {
+  char *p;
+  struct dentry *de;
+  struct dentry *newde;
+  unsigned int minlen;
+  unsigned int newlen;
+
+  newlen = sizeof(struct dentry) + NAME_ALIGN_LEN(len);
+  p = buf->data;
+  while (p < buf->data + fs->blocksize) {
+    de = (struct dentry *) p;
+
+    if (de->ino == NOINODE && de->namelen == 0 && de->reclen >= newlen) {
+      // Reuse empty leaf entry
+      de->ino = ino;
+      de->namelen = len;
+      memcpy(de->name, name, len);
+      journal_dirty(fs, buf);
+      return 0;
+    }
+
+    minlen = sizeof(struct dentry) + NAME_ALIGN_LEN(de->namelen);
+    if (de->reclen >= minlen + newlen) {
+      newde = (struct dentry *) (p + minlen);
+
+      newde->ino = ino;
+      newde->reclen = de->reclen - minlen;
+      newde->namelen = len;
+      memcpy(newde->name, name, len);
+
+      de->reclen = minlen;
+
+      journal_dirty(fs, buf);
+      return 0;
+    }
+
+    p += de->reclen;
+  }
+
+  return -ENOSPC;
+}
+
+//
+// write_leaf
+//
+// Fills a leaf block with a list of directory entries
+//
+
+static void write_leaf(struct filsys *fs, char *data, struct dxsort *list, int count) {
+  char *p;
+  struct dentry *de;
+  int i;
+
+  de = (struct dentry *) data;
+  if (count == 0) {
+    de->ino = NOINODE;
+    de->reclen = fs->blocksize;
+    de->namelen = 0;
+    return;
+  }
+
+  p = data;
+  for (i = 0; i < count; i++) {
+    de = (struct dentry *) p;
+    de->ino = list[i].de->ino;
+    de->namelen = list[i].de->namelen;
+    de->reclen = sizeof(struct dentry) + NAME_ALIGN_LEN(de->namelen);
+    memcpy(de->name, list[i].de->name, de->namelen);
+    p += de->reclen;
+  }
+
+  de->reclen += data + fs->blocksize - p;
+}
+
+//
+// dx_insert_entry
+//
+// Inserts an index entry after the selected entry of an index frame
+//
+
+static void dx_insert_entry(struct inode *dir, struct dxframe *frame, unsigned int hash, unsigned int block) {
+  struct dxnode *node = frame->node;
+  int pos = frame->pos + 1;
+
+  memmove(&node->entry[pos + 1], &node->entry[pos], (node->count - pos) * sizeof(struct dxentry));
+  node->entry[pos].hash = hash;
+  node->entry[pos].block = block;
+  node->count++;
+  journal_dirty(dir->fs, frame->buf);
+}
+
+//
+// dx_make_room
+//
+// Makes sure that the index node above the leaf has room for a new entry.
+// A full root is pushed down into a new index node, and a full index node
+// is split in two. The frames are updated to point to the node that now
+// holds the selected entry. The index is valid after each step.
+//
+
+static int dx_make_room(struct inode *dir, struct dxframe *frames, int *nframes) {
+  struct dxframe *frame = &frames[*nframes - 1];
+  struct dxnode *root = frames[0].node;
+  struct dxnode *node;
+  struct dxnode *newnode;
+  struct buf *buf;
+  blkno_t blk;
+  unsigned int block;
+  int half;
+
+  if (frame->node->count < frame->node->limit) return 0;
+
+  if (*nframes == 1) {
+    // Root is full, move root entries into a new index node
+    block = dir->desc->blocks;
+    blk = expand_inode(dir);
+    if (blk == NOBLOCK) return -ENOSPC;
+    buf = alloc_buffer(dir->fs->cache, blk);
+    if (!buf) return -ENOMEM;
+    dir->desc->size += dir->fs->blocksize;
+    mark_inode_dirty(dir);
+
+    newnode = (struct dxnode *) buf->data;
+    dx_init_node(dir->fs, newnode);
+    memcpy(newnode->entry, root->entry, root->count * sizeof(struct dxentry));
+    newnode->count = root->count;
+    journal_dirty(dir->fs, buf);
+
+    root->levels = 1;
+    root->count = 1;
+    root->entry[0].hash = 0;
+    root->entry[0].block = block;
+    journal_dirty(dir->fs, frames[0].buf);
+
+    frames[1].buf = buf;
+    frames[1].node = newnode;
+    frames[1].pos = frames[0].pos;
+    frames[0].pos = 0;
+    *nframes = 2;
+    frame = &frames[1];
+  }
+
+  // Split full index node
+  node = frame->node;
+  if (node->count < node->limit) return 0;
+  if (root->count == root->limit) return -ENOSPC;
+
+  block = dir->desc->blocks;
+  blk = expand_inode(dir);
+  if (blk == NOBLOCK) return -ENOSPC;
+  buf = alloc_buffer(dir->fs->cache, blk);
+  if (!buf) return -ENOMEM;
+  dir->desc->size += dir->fs->blocksize;
+  mark_inode_dirty(dir);
+
+  half = node->count / 2;
+  newnode = (struct dxnode *) buf->data;
+  dx_init_node(dir->fs, newnode);
+  memcpy(newnode->entry, &node->entry[half], (node->count - half) * sizeof(struct dxentry));
+  newnode->count = node->count - half;
+  node->count = half;
+  journal_dirty(dir->fs, buf);
+  journal_dirty(dir->fs, frame->buf);
+
+  dx_insert_entry(dir, &frames[0], newnode->entry[0].hash, block);
+
+  if (frame->pos >= half) {
+    release_buffer(dir->fs->cache, frame->buf);
+    frame->buf = buf;
+    frame->node = newnode;
+    frame->pos -= half;
+  } else {
+    release_buffer(dir->fs->cache, buf);
+  }
+
+  return 0;
+}
+
+//
+// sort_by_hash
+//
+// Insertion sort, a leaf block holds at most a few hundred entries
+//
+
+static void sort_by_hash(struct dxsort *list, int count) {
+  struct dxsort tmp;
+  int i, j;
+
+  for (i = 1; i < count; i++) {
+    tmp = list[i];
+    j = i;
+    while (j > 0 && list[j - 1].hash > tmp.hash) {
+      list[j] = list[j - 1];
+      j--;
+    }
+    list[j] = tmp;
+  }
+}
+
+//
+// dx_split_leaf
+//
+// Splits a full leaf block in two at a hash boundary and adds the new
+// entry to the half it belongs to. Entries with the same hash always stay
+// in the same leaf.
+//
+
+static int dx_split_leaf(struct inode *dir, struct dxframe *frames, int *nframes, struct buf *buf, char *name, int len, ino_t ino) {
+  struct filsys *fs = dir->fs;
+  char *data;
+  char *p;
+  struct dentry *de;
+  struct dentry *newde;
+  struct dxsort *list;
+  struct buf *newbuf;
+  blkno_t blk;
+  unsigned int block;
+  unsigned int total, left, best, diff;
+  int count, split, i;
+  int rc;
+
+  data = (char *) kmalloc(fs->blocksize + sizeof(struct dentry) + NAME_ALIGN_LEN(len));
+  list = (struct dxsort *) kmalloc((fs->blocksize / sizeof(struct dentry) + 1) * sizeof(struct dxsort));
+  if (!data || !list) {
+    kfree(data);
+    kfree(list);
+    return -ENOMEM;
+  }
+
+  // Collect entries from the full leaf and the new entry
+  memcpy(data, buf->data, fs->blocksize);
+  count = 0;
+  total = 0;
+  p = data;
+  while (p < data + fs->blocksize) {
+    de = (struct dentry *) p;
+    if (de->reclen == 0) break;
+    if (de->ino != NOINODE) {
+      list[count].hash = dirhash(de->name, de->namelen);
+      list[count].de = de;
+      total += sizeof(struct dentry) + NAME_ALIGN_LEN(de->namelen);
+      count++;
+    }
+    p += de->reclen;
+  }
+
+  newde = (struct dentry *) (data + fs->blocksize);
+  newde->ino = ino;
+  newde->namelen = len;
+  memcpy(newde->name, name, len);
+  list[count].hash = dirhash(name, len);
+  list[count].de = newde;
+  total += sizeof(struct dentry) + NAME_ALIGN_LEN(len);
+  count++;
+
+  sort_by_hash(list, count);
+
+  // Find the hash boundary closest to the middle where both halves fit
+  split = -1;
+  best = 0;
+  left = 0;
+  for (i = 1; i < count; i++) {
+    left += sizeof(struct dentry) + NAME_ALIGN_LEN(list[i - 1].de->namelen);
+    if (list[i].hash == list[i - 1].hash) continue;
+    if (left > fs->blocksize || total - left > fs->blocksize) continue;
+    diff = left > total / 2 ? left - total / 2 : total / 2 - left;
+    if (split < 0 || diff < best) {
+      split = i;
+      best = diff;
+    }
+  }
+
+  if (split < 0) {
+    rc = -ENOSPC;
+    goto out;
+  }
+
+  // Make room for the new leaf in the index
+  rc = dx_make_room(dir, frames, nframes);
+  if (rc < 0) goto out;
+
+  // Allocate new leaf block
+  block = dir->desc->blocks;
+  blk = expand_inode(dir);
+  if (blk == NOBLOCK) {
+    rc = -ENOSPC;
+    goto out;
+  }
+  newbuf = alloc_buffer(fs->cache, blk);
+  if (!newbuf) {
+    rc = -ENOMEM;
+    goto out;
+  }
+  dir->desc->size += fs->blocksize;
+  mark_inode_dirty(dir);
+
+  // Distribute entries between the two leaves
+  write_leaf(fs, buf->data, list, split);
+  write_leaf(fs, newbuf->data, list + split, count - split);
+  journal_dirty(fs, buf);
+  journal_dirty(fs, newbuf);
+  release_buffer(fs->cache, newbuf);
+
+  dx_insert_entry(dir, &frames[*nframes - 1], list[split].hash, block);
+  rc = 0;
+
+out:
+  kfree(data);
+  kfree(list);
+  return rc;
+}
+
+//
+// dx_add_entry
+//
+
+static int dx_add_entry(struct inode *dir, char *name, int len, ino_t ino) {
+  struct dxframe frames[DX_MAXLEVELS];
+  int nframes;
+  unsigned int leaf;
+  blkno_t blk;
+  struct buf *buf;
+  int rc;
+
+  rc = dx_probe(dir, dirhash(name, len), frames, &nframes, &leaf);
+  if (rc < 0) return rc;
+
+  blk = get_inode_block(dir, leaf);
+  buf = blk == NOBLOCK ? NULL : get_buffer(dir->fs->cache, blk);
+  if (!buf) {
+    dx_release(dir, frames, nframes);
+    return -EIO;
+  }
+
+  rc = insert_into_block(dir->fs, buf, name, len, ino);
+  if (rc == -ENOSPC) rc = dx_split_leaf(dir, frames, &nframes, buf, name, len, ino);
+
+  release_buffer(dir->fs->cache, buf);
+  if (rc == 0) {
+    frames[0].node->entries++;
+    journal_dirty(dir->fs, frames[0].buf);
+  }
+  dx_release(dir, frames, nframes);
+  return rc;
+}
+
+//
+// dx_create_index
+//
+// Converts a single block directory to an indexed directory. The entries
+// are moved to a new leaf block and block 0 becomes the index root.
+//
+
+static int dx_create_index(struct inode *dir) {
+  struct filsys *fs = dir->fs;
+  struct buf *rootbuf;
+  struct buf *leafbuf;
+  struct dxnode *root;
+  struct dentry *de;
+  blkno_t blk;
+  char *p;
+  unsigned int entries;
+
+  blk = get_inode_block(dir, 0);
+  if (blk == NOBLOCK) return -EIO;
+  rootbuf = get_buffer(fs->cache, blk);
+  if (!rootbuf) return -EIO;
+
+  blk = expand_inode(dir);
+  if (blk == NOBLOCK) {
+    release_buffer(fs->cache, rootbuf);
+    return -ENOSPC;
+  }
+  leafbuf = alloc_buffer(fs->cache, blk);
+  if (!leafbuf) {
+    release_buffer(fs->cache, rootbuf);
+    return -ENOMEM;
+  }
+
+  memcpy(leafbuf->data, rootbuf->data, fs->blocksize);
+  journal_dirty(fs, leafbuf);
+
+  entries = 0;
+  p = leafbuf->data;
+  while (p < leafbuf->data + fs->blocksize) {
+    de = (struct dentry *) p;
+    if (de->reclen == 0) break;
+    if (de->ino != NOINODE) entries++;
+    p += de->reclen;
+  }
+  release_buffer(fs->cache, leafbuf);
+
+  root = (struct dxnode *) rootbuf->data;
+  dx_init_node(fs, root);
+  root->entries = entries;
+  root->count = 1;
+  root->entry[0].hash = 0;
+  root->entry[0].block = 1;
+  journal_dirty(fs, rootbuf);
+  release_buffer(fs->cache, rootbuf);
+
+  dir->desc->flags |= DFS_INODE_FLAG_DIRINDEX;
+  dir->desc->size += fs->blocksize;
+  mark_inode_dirty(dir);
+
+  return 0;
+}
+
 int find_dir_entry(struct inode *dir, char *name, int len, ino_t *retval) {
   unsigned int block;
+  unsigned int first;
+  unsigned int last;
   blkno_t blk;
   struct buf *buf;
   char *p;
   struct dentry *de;
   ino_t ino;
+  int rc;
 
   if (len <= 0) return -EINVAL;
   if (len >= MAXPATH) return -ENAMETOOLONG;
   if (!S_ISDIR(dir->desc->mode)) return -ENOTDIR;
   if (checki(dir, S_IEXEC) < 0) return -EACCES;
 
-  for (block = 0; block < dir->desc->blocks; block++) {
+  rc = dir_range(dir, name, len, &first, &last);
+  if (rc < 0) return rc;
+
+  for (block = first; block < last; block++) {
     blk = get_inode_block(dir, block);
     if (blk == NOBLOCK) return -EIO;
 
@@ -82,18 +680,23 @@ int add_dir_entry(struct inode *dir, char *name, int len, ino_t ino) {
   unsigned int block;
   blkno_t blk;
   struct buf *buf;
-  char *p;
-  struct dentry *de;
   struct dentry *newde;
-  unsigned int minlen;
-  unsigned int newlen;
+  int rc;
 
   if (len <= 0) return -EINVAL;
   if (len >= MAXPATH) return -ENAMETOOLONG;
   if (!S_ISDIR(dir->desc->mode)) return -ENOTDIR;
   if (checki(dir, S_IWRITE) < 0) return -EACCES;
 
-  newlen = sizeof(struct dentry) + NAME_ALIGN_LEN(len);
+  if (is_indexed(dir)) {
+    rc = dx_add_entry(dir, name, len, ino);
+    if (rc < 0) return rc;
+
+    dir->desc->mtime = kpit_get_time();
+    mark_inode_dirty(dir);
+    return 0;
+  }
+
   for (block = 0; block < dir->desc->blocks; block++) {
     blk = get_inode_block(dir, block);
     if (blk == NOBLOCK) return -EIO;
@@ -101,34 +704,22 @@ int add_dir_entry(struct inode *dir, char *name, int len, ino_t ino) {
     buf = get_buffer(dir->fs->cache, blk);
     if (!buf) return -EIO;
 
-    p = buf->data;
-    while (p < buf->data + dir->fs->blocksize) {
-      de = (struct dentry *) p;
-      minlen = sizeof(struct dentry) + NAME_ALIGN_LEN(de->namelen);
-
-      if (de->reclen >= minlen + newlen) {
-        newde = (struct dentry *) (p + minlen);
-
-        newde->ino = ino;
-        newde->reclen = de->reclen - minlen;
-        newde->namelen = len;
-        memcpy(newde->name, name, len);
-
-        de->reclen = minlen;
-
-        mark_buffer_updated(dir->fs->cache, buf);
-        release_buffer(dir->fs->cache, buf);
-
-        dir->desc->mtime = kpit_get_time();
-        mark_inode_dirty(dir);
-
-        return 0;
-      }
+    rc = insert_into_block(dir->fs, buf, name, len, ino);
+    release_buffer(dir->fs->cache, buf);
+    if (rc == 0) {
+      dir->desc->mtime = kpit_get_time();
+      mark_inode_dirty(dir);
 
-      p += de->reclen;
+      return 0;
     }
+  }
 
-    release_buffer(dir->fs->cache, buf);
+  // Switch to a hash indexed directory when the first block is full
+  if (dir->desc->blocks == 1 && (dir->fs->super->incompat_features & DFS_INCOMPAT_DIRINDEX)) {
+    rc = dx_create_index(dir);
+    if (rc < 0) return rc;
+
+    return add_dir_entry(dir, name, len, ino);
   }
 
   blk = expand_inode(dir);
@@ -147,25 +738,31 @@ int add_dir_entry(struct inode *dir, char *name, int len, ino_t ino) {
   newde->namelen = len;
   memcpy(newde->name, name, len);
 
-  mark_buffer_updated(dir->fs->cache, buf);
+  rc = journal_dirty(dir->fs, buf);
   release_buffer(dir->fs->cache, buf);
 
-  return 0;
+  return rc;
 }
 
 int modify_dir_entry(struct inode *dir, char *name, int len, ino_t ino, ino_t *oldino) {
   unsigned int block;
+  unsigned int first;
+  unsigned int last;
   blkno_t blk;
   struct buf *buf;
   char *p;
   struct dentry *de;
+  int rc;
 
   if (len <= 0) return -EINVAL;
   if (len >= MAXPATH) return -ENAMETOOLONG;
   if (!S_ISDIR(dir->desc->mode)) return -ENOTDIR;
   if (checki(dir, S_IWRITE) < 0) return -EACCES;
 
-  for (block = 0; block < dir->desc->blocks; block++) {
+  rc = dir_range(dir, name, len, &first, &last);
+  if (rc < 0) return rc;
+
+  for (block = first; block < last; block++) {
     blk = get_inode_block(dir, block);
     if (blk == NOBLOCK) return -EIO;
 
@@ -179,10 +776,10 @@ int modify_dir_entry(struct inode *dir, char *name, int len, ino_t ino, ino_t *o
       if (fnmatch(name, len, de->name, de->namelen)) {
         if (oldino) *oldino = de->ino;
         de->ino = ino;
-        mark_buffer_updated(dir->fs->cache, buf);
+        rc = journal_dirty(dir->fs, buf);
         release_buffer(dir->fs->cache, buf);
 
-        return 0;
+        return rc;
       }
 
       p += de->reclen;
@@ -196,6 +793,8 @@ int modify_dir_entry(struct inode *dir, char *name, int len, ino_t ino, ino_t *o
 
 int delete_dir_entry(struct inode *dir, char *name, int len) {
   unsigned int block;
+  unsigned int first;
+  unsigned int last;
   blkno_t blk;
   blkno_t lastblk;
   struct buf *buf;
@@ -203,12 +802,16 @@ int delete_dir_entry(struct inode *dir, char *name, int len) {
   struct dentry *de;
   struct dentry *prevde;
   struct dentry *nextde;
+  int rc;
 
   if (len <= 0 || len >= MAXPATH) return -ENAMETOOLONG;
   if (!S_ISDIR(dir->desc->mode)) return -ENOTDIR;
   if (checki(dir, S_IWRITE) < 0) return -EACCES;
 
-  for (block = 0; block < dir->desc->blocks; block++) {
+  rc = dir_range(dir, name, len, &first, &last);
+  if (rc < 0) return rc;
+
+  for (block = first; block < last; block++) {
     blk = get_inode_block(dir, block);
     if (blk == NOBLOCK) return -EIO;
 
@@ -225,7 +828,12 @@ int delete_dir_entry(struct inode *dir, char *name, int len) {
           // Merge entry with previous entry
           prevde->reclen += de->reclen;
           memset(de, 0, de->reclen);
-          mark_buffer_updated(dir->fs->cache, buf);
+          journal_dirty(dir->fs, buf);
+        } else if (de->reclen == dir->fs->blocksize && is_indexed(dir)) {
+          // Leaf blocks are referenced from the index, leave an empty entry
+          de->ino = NOINODE;
+          de->namelen = 0;
+          journal_dirty(dir->fs, buf);
         } else if (de->reclen == dir->fs->blocksize) {
           // Block is empty, swap this block with last block and truncate
           if (block != dir->desc->blocks - 1) {
@@ -245,7 +853,7 @@ int delete_dir_entry(struct inode *dir, char *name, int len) {
           de->reclen += nextde->reclen;
           de->namelen = nextde->namelen;
           memmove(de->name, nextde->name, nextde->namelen);
-          mark_buffer_updated(dir->fs->cache, buf);
+          journal_dirty(dir->fs, buf);
         }
 
         release_buffer(dir->fs->cache, buf);
@@ -253,6 +861,7 @@ int delete_dir_entry(struct inode *dir, char *name, int len) {
         dir->desc->mtime = kpit_get_time();
         mark_inode_dirty(dir);
 
+        if (is_indexed(dir)) return dx_adjust_entries(dir, -1);
         return 0;
       }
 
@@ -266,12 +875,51 @@ int delete_dir_entry(struct inode *dir, char *name, int len) {
   return -ENOENT;
 }
 
+//
+// lookup_cached
+//
+// Finds the longest prefix of a path that is in the dentry cache. Returns
+// the length of the prefix or zero if no prefix is cached.
+//
+
+static int lookup_cached(struct filsys *fs, char *name, int len, ino_t *ino, int *flags) {
+  int rc;
+
+  while (len > 0) {
+    rc = dcache_lookup(fs->vfs, name, len, ino, flags);
+    if (rc < 0) return rc;
+    if (rc == DCACHE_HIT) return len;
+
+    // Strip last name part
+    while (len > 0 && name[len - 1] != PS1 && name[len - 1] != PS2) len--;
+    while (len > 0 && (name[len - 1] == PS1 || name[len - 1] == PS2)) len--;
+  }
+
+  return 0;
+}
+
 static int lookup_name(struct filsys *fs, ino_t ino, char *name, int len, ino_t *retval) {
+  char *base;
   char *p;
   int l;
+  int flags;
+  int cache;
+  unsigned long gen;
   struct inode *inode;
   int rc;
 
+  // Start from the deepest directory found in the dentry cache
+  base = name;
+  flags = DCACHE_SEARCH;
+  cache = fs->vfs && ino == DFS_INODE_ROOT;
+  gen = dcache_generation();
+  if (cache) {
+    rc = lookup_cached(fs, name, len, &ino, &flags);
+    if (rc < 0) return rc;
+    name += rc;
+    len -= rc;
+  }
+
   while (1) {
     // Skip path separator
     if (*name == PS1 || *name == PS2) {
@@ -296,9 +944,14 @@ static int lookup_name(struct filsys *fs, ino_t ino, char *name, int len, ino_t
     rc = get_inode(fs, ino, &inode);
     if (rc < 0) return rc;
 
+    if ((inode->desc->mode & 0111) != 0111) flags &= ~DCACHE_SEARCH;
     rc = find_dir_entry(inode, name, l, &ino);
     release_inode(inode);
-    if (rc < 0) return rc;
+    if (rc < 0) {
+      if (cache && rc == -ENOENT) dcache_enter(fs->vfs, base, p - base, NOINODE, flags | DCACHE_NEGATIVE, gen);
+      return rc;
+    }
+    if (cache) dcache_enter(fs->vfs, base, p - base, ino, flags, gen);
 
     // If we have parsed the whole name return the inode number
     if (l == len) {
@@ -395,20 +1048,32 @@ int dfs_readdir(struct file *filp, struct direntry *dirp, int count) {
 
   inode = (struct inode *) filp->data;
   if (count != 1) return -EINVAL;
-  if (filp->pos == inode->desc->size) return 0;
-  if (filp->pos > inode->desc->size) return 0;
 
-  iblock = (unsigned int) filp->pos / inode->fs->blocksize;
-  start = (unsigned int) filp->pos % inode->fs->blocksize;
+  while (1) {
+    if (filp->pos >= inode->desc->size) return 0;
 
-  blk = get_inode_block(inode, iblock);
-  if (blk == NOBLOCK) return -EIO;
+    iblock = (unsigned int) filp->pos / inode->fs->blocksize;
+    start = (unsigned int) filp->pos % inode->fs->blocksize;
 
-  buf = get_buffer(inode->fs->cache, blk);
-  if (!buf) return -EIO;
+    blk = get_inode_block(inode, iblock);
+    if (blk == NOBLOCK) return -EIO;
+
+    buf = get_buffer(inode->fs->cache, blk);
+    if (!buf) return -EIO;
+
+    de = (struct dentry *) (buf->data + start);
+    if (de->reclen == 0 || de->reclen + start > inode->fs->blocksize) {
+      release_buffer(inode->fs->cache, buf);
+      return 0;
+    }
+
+    // Skip index blocks and empty leaf blocks in indexed directories
+    if (de->ino != NOINODE) break;
+    filp->pos += de->reclen;
+    release_buffer(inode->fs->cache, buf);
+  }
 
-  de = (struct dentry *) (buf->data + start);
-  if (de->reclen + start > inode->fs->blocksize || de->namelen <= 0 || de->namelen >= MAXPATH) {
+  if (de->namelen <= 0 || de->namelen >= MAXPATH) {
     release_buffer(inode->fs->cache, buf);
     return 0;
   }
@@ -424,3 +1089,26 @@ int dfs_readdir(struct file *filp, struct direntry *dirp, int count) {
   release_buffer(inode->fs->cache, buf);
   return 1;
 }
+
+int dfs_readdirplus(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count) {
+  struct inode *dir;
+  struct inode *inode;
+  int rc;
+
+  rc = dfs_readdir(filp, dirp, count);
+  if (rc <= 0) return rc;
+
+  // The directory entry is already consumed, so an entry whose inode cannot
+  // be read is returned with its inode number only
+  dir = (struct inode *) filp->data;
+  if (get_inode(dir->fs, dirp->ino, &inode) < 0) {
+    memset(buffer, 0, sizeof(struct stat64));
+    buffer->st_ino = dirp->ino;
+    buffer->st_dev = dir->fs->devno;
+    return 1;
+  }
+
+  stat_inode(inode, buffer);
+  release_inode(inode);
+  return 1;
+}
@@ -35,6 +35,8 @@
 #include <os/dfs.h>
 #include <os/buf.h>
 
+#define FALLOC_ZERO_SIZE        (64 * 1024)
+
 static int open_existing(struct filsys *fs, char *name, struct inode **retval) {
   struct inode *inode;
   int rc;
@@ -312,15 +314,308 @@ int dfs_destroy(struct file *filp) {
 int dfs_fsync(struct file *filp) {
   int rc;
   struct inode *inode = (struct inode *) filp->data;
+  struct jhandle h;
+
+  if (inode->fs->journal) {
+    // Assign blocks to delayed data and write file data in place
+    journal_start(inode->fs, &h);
+    rc = flush_delalloc(inode);
+    journal_stop(inode->fs, &h);
+    if (rc < 0) return rc;
+
+    rc = flush_buffers(inode->fs->cache, 0);
+    if (rc < 0) return rc;
+
+    // Metadata only has to reach the journal
+    rc = journal_commit(inode->fs);
+    if (rc < 0) return rc;
+  } else {
+    // Write back modified inodes
+    rc = sync_inodes(inode->fs);
+    if (rc < 0) return rc;
+
+    // Flush and sync buffer cache for entire file system
+    rc = flush_buffers(inode->fs->cache, 0);
+    if (rc < 0) return rc;
+
+    rc = sync_buffers(inode->fs->cache, 0);
+    if (rc < 0) return rc;
+  }
+
+  // Flush device write cache
+  rc = kdev_ioctl(inode->fs->devno, IOCTL_FLUSH, NULL, 0);
+  if (rc < 0 && rc != -ENOSYS) return rc;
+
+  return 0;
+}
+
+//
+// Direct I/O bypasses the buffer cache. Runs of physically contiguous
+// blocks are transferred between the device and the caller's buffer with
+// one request per run. Partial blocks at the head and tail, and buffers
+// that are not dword aligned, go through a bounce buffer.
+//
+
+int direct_transfer(struct inode *inode, blkno_t blk, int n, char *p, int write) {
+  struct filsys *fs = inode->fs;
+  int bytes = n * fs->blocksize;
+  int rc;
+  int i;
+
+  if (write) {
+    rc = kdev_write(fs->devno, p, bytes, blk * fs->cache->blks_per_buffer, 0);
+
+    // Drop stale copies of the blocks from the buffer cache
+    for (i = 0; i < n; i++) invalidate_buffer(fs->cache, blk + i);
+  } else {
+    // Write back cached modifications before reading from the device
+    for (i = 0; i < n; i++) {
+      rc = sync_buffer(fs->cache, blk + i);
+      if (rc < 0) return rc;
+    }
+
+    rc = kdev_read(fs->devno, p, bytes, blk * fs->cache->blks_per_buffer, 0);
+  }
 
-  // Flush and sync buffer cache for entire file system
-  rc = flush_buffers(inode->fs->cache, 0);
   if (rc < 0) return rc;
+  return rc == bytes ? 0 : -EIO;
+}
+
+static int map_direct_blocks(struct inode *inode, unsigned int iblock, unsigned int count, blkno_t *blk) {
+  if (iblock < inode->desc->blocks) return map_inode_blocks(inode, iblock, count, blk);
+
+  if (iblock == inode->desc->blocks) {
+    *blk = expand_inode(inode);
+    if (*blk == NOBLOCK) return -ENOSPC;
+    return 1;
+  }
 
-  rc = sync_buffers(inode->fs->cache, 0);
+  return -EIO;
+}
+
+//
+// Returns the number of blocks touched by size bytes starting at offset
+// start in a block. The sum is taken in 64 bits, so a huge request
+// cannot wrap around to zero.
+//
+
+static unsigned int span_blocks(struct inode *inode, unsigned int start, size_t size) {
+  return (unsigned int) (((off64_t) start + size + inode->fs->blocksize - 1) / inode->fs->blocksize);
+}
+
+static int dfs_read_direct(struct file *filp, char *p, size_t size, off64_t pos) {
+  struct inode *inode = (struct inode *) filp->data;
+  unsigned int blocksize = inode->fs->blocksize;
+  int aligned = ((unsigned long) p & 3) == 0;
+  char *bounce = NULL;
+  size_t read;
+  size_t count;
+  off64_t left;
+  unsigned int iblock;
+  unsigned int start;
+  unsigned int n, maxn;
+  blkno_t blk;
+  struct jhandle h;
+  int rc;
+
+  left = inode->desc->size - pos;
+  if (left <= 0) return 0;
+  if (size > left) size = (size_t) left;
+
+  // Delayed data must be on disk before it can be read directly
+  journal_start(inode->fs, &h);
+  rc = flush_delalloc(inode);
+  journal_stop(inode->fs, &h);
   if (rc < 0) return rc;
 
-  return 0;
+  read = 0;
+  while (size > 0) {
+    if (filp->flags & F_CLOSED) {
+      rc = -EINTR;
+      break;
+    }
+
+    iblock = (unsigned int) (pos / blocksize);
+    start = (unsigned int) (pos % blocksize);
+
+    rc = map_inode_blocks(inode, iblock, span_blocks(inode, start, size), &blk);
+    if (rc < 0) break;
+    n = rc;
+
+    if (start != 0 || size < blocksize || !aligned) {
+      // Read partial block through bounce buffer
+      count = blocksize - start;
+      if (count > size) count = size;
+
+      if (!bounce) bounce = kmalloc(blocksize);
+      if (!bounce) {
+        rc = -ENOMEM;
+        break;
+      }
+
+      rc = direct_transfer(inode, blk, 1, bounce, 0);
+      if (rc < 0) break;
+      memcpy(p, bounce + start, count);
+    } else {
+      // Read run of contiguous blocks into caller's buffer
+      maxn = size / blocksize;
+      if (n > maxn) n = maxn;
+
+      rc = direct_transfer(inode, blk, n, p, 0);
+      if (rc < 0) break;
+      count = n * blocksize;
+    }
+
+    pos += count;
+    p += count;
+    read += count;
+    size -= count;
+  }
+
+  if (bounce) kfree(bounce);
+  if (rc < 0 && read == 0) return rc;
+  return read;
+}
+
+static int dfs_write_direct(struct file *filp, char *p, size_t size, off64_t pos) {
+  struct inode *inode = (struct inode *) filp->data;
+  unsigned int blocksize = inode->fs->blocksize;
+  int aligned = ((unsigned long) p & 3) == 0;
+  char *bounce = NULL;
+  size_t written;
+  size_t count;
+  unsigned int iblock;
+  unsigned int start;
+  unsigned int n, maxn;
+  blkno_t blk, next;
+  struct jhandle h;
+  int rc;
+
+  // Direct writes go to allocated blocks only
+  journal_start(inode->fs, &h);
+  rc = flush_delalloc(inode);
+  journal_stop(inode->fs, &h);
+  if (rc < 0) return rc;
+
+  inode->writers++;
+  inode->write_gen++;
+  written = 0;
+  while (size > 0) {
+    if (filp->flags & F_CLOSED) {
+      rc = -EINTR;
+      break;
+    }
+
+    iblock = (unsigned int) (pos / blocksize);
+    start = (unsigned int) (pos % blocksize);
+
+    // Blocks are allocated under a journal handle, the data is transferred
+    // without one
+    journal_start(inode->fs, &h);
+    rc = map_direct_blocks(inode, iblock, span_blocks(inode, start, size), &blk);
+    n = rc;
+    if (rc >= 0 && start == 0 && size >= blocksize && aligned) {
+      // Map or allocate run of contiguous blocks
+      maxn = size / blocksize;
+      if (n > maxn) n = maxn;
+      while (n < maxn) {
+        rc = map_direct_blocks(inode, iblock + n, maxn - n, &next);
+        if (rc < 0 || next != blk + n) break;
+        n += rc;
+      }
+      rc = n;
+    }
+    journal_stop(inode->fs, &h);
+    if (rc < 0) break;
+
+    if (start != 0 || size < blocksize || !aligned) {
+      // Update partial block through bounce buffer
+      count = blocksize - start;
+      if (count > size) count = size;
+
+      if (!bounce) bounce = kmalloc(blocksize);
+      if (!bounce) {
+        rc = -ENOMEM;
+        break;
+      }
+
+      if (count != blocksize && (off64_t) iblock * blocksize < inode->desc->size) {
+        rc = direct_transfer(inode, blk, 1, bounce, 0);
+        if (rc < 0) break;
+      } else {
+        memset(bounce, 0, blocksize);
+      }
+      memcpy(bounce + start, p, count);
+
+      rc = direct_transfer(inode, blk, 1, bounce, 1);
+      if (rc < 0) break;
+    } else {
+      // Write run of contiguous blocks from caller's buffer
+      rc = direct_transfer(inode, blk, n, p, 1);
+      if (rc < 0) break;
+      count = n * blocksize;
+    }
+
+    filp->flags |= F_MODIFIED;
+    pos += count;
+    p += count;
+    written += count;
+    size -= count;
+
+    if (pos > inode->desc->size) {
+      journal_start(inode->fs, &h);
+      inode->desc->size = (loff_t) pos;
+      mark_inode_dirty(inode);
+      journal_stop(inode->fs, &h);
+    }
+  }
+  inode->writers--;
+
+  if (bounce) kfree(bounce);
+  if (rc < 0 && written == 0) return rc;
+  return written;
+}
+
+//
+// delalloc_block
+//
+// Returns the delayed data for a block past the last allocated block of a
+// file. If create is set, a new block is added at the end of the delayed
+// data when the limits allow it. Blocks are assigned to the delayed data of
+// the inode when it holds DFS_DELALLOC_MAX blocks, or when all inodes
+// together hold more than the delayed allocation limit of the file system.
+// Delayed data is only accepted while there are enough free blocks to
+// assign to all of it.
+//
+
+static char *delalloc_block(struct inode *inode, unsigned int iblock, int create) {
+  struct filsys *fs = inode->fs;
+  char *data;
+
+  if (iblock - inode->desc->blocks < inode->delalloc_count) return inode->delalloc[iblock - inode->desc->blocks];
+  if (!create || !S_ISREG(inode->desc->mode) || fs->delalloc_limit == 0) return NULL;
+  if (iblock != inode->desc->blocks + inode->delalloc_count) return NULL;
+
+  if (inode->delalloc_count == DFS_DELALLOC_MAX || fs->delalloc_blocks >= fs->delalloc_limit) {
+    if (flush_delalloc(inode) < 0) return NULL;
+    if (iblock != inode->desc->blocks || fs->delalloc_blocks >= fs->delalloc_limit) return NULL;
+  }
+
+  if (fs->super->free_block_count < fs->delalloc_blocks + DFS_DELALLOC_RESERVE) return NULL;
+
+  if (!inode->delalloc) {
+    inode->delalloc = (char **) kmalloc(DFS_DELALLOC_MAX * sizeof(char *));
+    if (!inode->delalloc) return NULL;
+  }
+
+  data = (char *) kmalloc(fs->blocksize);
+  if (!data) return NULL;
+  memset(data, 0, fs->blocksize);
+
+  inode->delalloc[inode->delalloc_count++] = data;
+  fs->delalloc_blocks++;
+
+  return data;
 }
 
 int dfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
@@ -329,13 +624,23 @@ int dfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
   size_t count;
   off64_t left;
   char *p;
+  char *delayed;
   unsigned int iblock;
   unsigned int start;
+  unsigned int run;
   blkno_t blk;
   struct buf *buf;
+  int rc;
+
+  if (filp->flags & O_DIRECT) return dfs_read_direct(filp, (char *) data, size, pos);
 
   inode = (struct inode *) filp->data;
+  left = inode->desc->size - pos;
+  if (left <= 0) return 0;
+  if (size > left) size = (size_t) left;
+
   read = 0;
+  run = 0;
   p = (char *) data;
   while (pos < inode->desc->size && size > 0) {
     if (filp->flags & F_CLOSED) return -EINTR;
@@ -350,17 +655,28 @@ int dfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
     if (count > left) count = (size_t) left;
     if (count <= 0) break;
 
-    blk = get_inode_block(inode, iblock);
-    if (blk == NOBLOCK) return -EIO;
-
-    if (filp->flags & O_DIRECT) {
-      if (start != 0 || count != inode->fs->blocksize) return read;
-      if (kdev_read(inode->fs->devno, p, count, blk, 0) != (int) count) return read;
+    if (iblock >= inode->desc->blocks) {
+      // Read from delayed data
+      run = 0;
+      delayed = delalloc_block(inode, iblock, 0);
+      if (!delayed) return -EIO;
+      memcpy(p, delayed + start, count);
     } else {
+      // Map the run of contiguous blocks covering the rest of the request
+      if (run == 0) {
+        rc = map_inode_blocks(inode, iblock, span_blocks(inode, start, size), &blk);
+        if (rc < 0) return rc;
+        if (rc == 0) return -EIO;
+        run = rc;
+      }
+
       buf = get_buffer(inode->fs->cache, blk);
       if (!buf) return -EIO;
       memcpy(p, buf->data + start, count);
       release_buffer(inode->fs->cache, buf);
+
+      blk++;
+      run--;
     }
 
     pos += count;
@@ -372,15 +688,70 @@ int dfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
   return read;
 }
 
-int dfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
+//
+// Pass file data to the splice actor. The data is copied out of the
+// buffer cache into a private batch of up to DFS_SPLICE_BATCH blocks
+// first, so no cache buffers are held while the actor blocks on a slow
+// output. Each batch is read through the normal read path, which maps
+// the blocks again after the actor has run.
+//
+
+int dfs_splice_read(struct file *filp, off64_t pos, size_t size, splice_actor_t actor, void *arg) {
+  struct inode *inode;
+  struct iovec iov;
+  size_t batch;
+  size_t done;
+  char *data;
+  int n;
+  int rc;
+
+  if (filp->flags & O_DIRECT) return -ENOSYS;
+
+  inode = (struct inode *) filp->data;
+  if (S_ISDIR(inode->desc->mode)) return -EISDIR;
+
+  batch = DFS_SPLICE_BATCH * inode->fs->blocksize;
+  data = (char *) kmalloc(batch);
+  if (!data) return -ENOMEM;
+
+  done = 0;
+  rc = 0;
+  while (size > 0) {
+    n = dfs_read(filp, data, size < batch ? size : batch, pos);
+    if (n <= 0) {
+      rc = n;
+      break;
+    }
+
+    // Stop when the output does not accept the whole batch
+    iov.iov_base = data;
+    iov.iov_len = n;
+    rc = actor(arg, &iov, 1);
+    if (rc < 0) break;
+    done += rc;
+    pos += rc;
+    size -= rc;
+    if (rc != n) break;
+  }
+
+  kfree(data);
+
+  if (done == 0 && rc < 0) return rc;
+  return done;
+}
+
+static int write_file(struct file *filp, void *data, size_t size, off64_t pos) {
   struct inode *inode;
   size_t written;
   size_t count;
   char *p;
+  char *delayed;
   unsigned int iblock;
   unsigned int start;
+  unsigned int run;
   blkno_t blk;
   struct buf *buf;
+  struct jhandle h;
   int rc;
 
   inode = (struct inode *) filp->data;
@@ -394,10 +765,19 @@ int dfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
     if (rc < 0) return rc;
   }
 
+  if (filp->flags & O_DIRECT) return dfs_write_direct(filp, (char *) data, size, pos);
+
+  inode->writers++;
+  inode->write_gen++;
   written = 0;
+  run = 0;
+  rc = 0;
   p = (char *) data;
   while (size > 0) {
-    if (filp->flags & F_CLOSED) return -EINTR;
+    if (filp->flags & F_CLOSED) {
+      rc = -EINTR;
+      break;
+    }
 
     iblock = (unsigned int) pos / inode->fs->blocksize;
     start = (unsigned int) pos % inode->fs->blocksize;
@@ -405,49 +785,191 @@ int dfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
     count = inode->fs->blocksize - start;
     if (count > size) count = size;
 
-    if (iblock < inode->desc->blocks) {
-      blk = get_inode_block(inode, iblock);
-      if (blk == NOBLOCK) return -EIO;
+    // Each block is written under its own journal handle, so a long write
+    // does not keep the running transaction from being committed
+    journal_start(inode->fs, &h);
+
+    delayed = NULL;
+    if (run > 0) {
+      // Next block in mapped run
+      blk++;
+      run--;
+    } else if (iblock < inode->desc->blocks) {
+      rc = map_inode_blocks(inode, iblock, span_blocks(inode, start, size), &blk);
+      if (rc >= 0) run = rc - 1;
+    } else if ((delayed = delalloc_block(inode, iblock, 1)) != NULL) {
+      // Block is assigned when the delayed data is flushed
     } else if (iblock == inode->desc->blocks) {
       blk = expand_inode(inode);
-      if (blk == NOBLOCK) return -ENOSPC;
+      if (blk == NOBLOCK) rc = -ENOSPC;
     } else {
-      return written;
+      rc = -EIO;
     }
 
-    if (filp->flags & O_DIRECT) {
-      if (start != 0 || count != inode->fs->blocksize) return written;
-      if (kdev_write(inode->fs->devno, p, count, blk, 0) != (int) count) return written;
-    } else {
+    if (rc >= 0 && delayed) {
+      memcpy(delayed + start, p, count);
+    } else if (rc >= 0) {
       if (count == inode->fs->blocksize) {
         buf = alloc_buffer(inode->fs->cache, blk);
       } else {
         buf = get_buffer(inode->fs->cache, blk);
       }
-      if (!buf) return -EIO;
 
-      memcpy(buf->data + start, p, count);
+      if (buf) {
+        memcpy(buf->data + start, p, count);
+        mark_buffer_updated(inode->fs->cache, buf);
+        release_buffer(inode->fs->cache, buf);
+      } else {
+        rc = -EIO;
+      }
+    }
 
-      mark_buffer_updated(inode->fs->cache, buf);
-      release_buffer(inode->fs->cache, buf);
+    if (rc >= 0) {
+      filp->flags |= F_MODIFIED;
+      pos += count;
+      p += count;
+      written += count;
+      size -= count;
+
+      if (pos > inode->desc->size) {
+        inode->desc->size = (loff_t) pos;
+        mark_inode_dirty(inode);
+      }
     }
 
-    filp->flags |= F_MODIFIED;
-    pos += count;
-    p += count;
-    written += count;
-    size -= count;
+    journal_stop(inode->fs, &h);
+    if (rc < 0) break;
+  }
+  inode->writers--;
 
-    if (pos > inode->desc->size) {
-      inode->desc->size = (loff_t) pos;
-      mark_inode_dirty(inode);
+  if (rc < 0 && written == 0) return rc;
+  return written;
+}
+
+int dfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
+  return write_file(filp, data, size, pos);
+}
+
+//
+// Copy a byte range between two files on the same volume without going
+// through user space. Block aligned ranges are moved in large clusters
+// that are read and written with one device request each, bypassing the
+// buffer cache. Unaligned heads and tails are copied from the cached
+// source blocks directly into the cached destination blocks.
+//
+
+static int copy_cached(struct file *in, off64_t inpos, struct file *out, off64_t outpos, size_t size) {
+  struct inode *inode = (struct inode *) in->data;
+  unsigned int iblock;
+  unsigned int start;
+  size_t count;
+  char *delayed;
+  blkno_t blk;
+  struct buf *buf;
+  int rc;
+
+  iblock = (unsigned int) (inpos / inode->fs->blocksize);
+  start = (unsigned int) (inpos % inode->fs->blocksize);
+  count = inode->fs->blocksize - start;
+  if (count > size) count = size;
+
+  if (iblock >= inode->desc->blocks) {
+    delayed = delalloc_block(inode, iblock, 0);
+    if (!delayed) return -EIO;
+    return write_file(out, delayed + start, count, outpos);
+  }
+
+  rc = map_inode_blocks(inode, iblock, 1, &blk);
+  if (rc < 0) return rc;
+
+  buf = get_buffer(inode->fs->cache, blk);
+  if (!buf) return -EIO;
+  rc = write_file(out, buf->data + start, count, outpos);
+  release_buffer(inode->fs->cache, buf);
+
+  return rc;
+}
+
+int dfs_copy_range(struct file *in, off64_t inpos, struct file *out, off64_t outpos, size_t count) {
+  struct inode *src = (struct inode *) in->data;
+  struct inode *dst = (struct inode *) out->data;
+  struct filsys *fs = src->fs;
+  unsigned int blocksize = fs->blocksize;
+  char *cluster = NULL;
+  size_t copied;
+  size_t size;
+  off64_t left;
+  struct jhandle h;
+  int rc;
+
+  if (S_ISDIR(src->desc->mode) || S_ISDIR(dst->desc->mode)) return -EISDIR;
+
+  left = src->desc->size - inpos;
+  if (left <= 0) return 0;
+  if (count > left) count = (size_t) left;
+  if (outpos + count > DFS_MAXFILESIZE) return -EFBIG;
+
+  copied = 0;
+  rc = 0;
+  while (copied < count) {
+    if ((in->flags & F_CLOSED) || (out->flags & F_CLOSED)) {
+      rc = -EINTR;
+      break;
     }
+
+    size = count - copied;
+    if (inpos % blocksize == 0 && outpos % blocksize == 0 && size >= DFS_COPY_CLUSTER_MIN) {
+      // Move a cluster of whole blocks with direct device transfers
+      if (size > DFS_COPY_CLUSTER) size = DFS_COPY_CLUSTER;
+      size -= size % blocksize;
+
+      if (!cluster) {
+        cluster = (char *) kmalloc(DFS_COPY_CLUSTER);
+        if (!cluster) {
+          rc = -ENOMEM;
+          break;
+        }
+      }
+
+      rc = dfs_read_direct(in, cluster, size, inpos);
+      if (rc <= 0) break;
+      size = rc;
+
+      if (outpos > dst->desc->size) rc = dfs_ftruncate(out, outpos);
+      if (rc >= 0) rc = dfs_write_direct(out, cluster, size, outpos);
+    } else {
+      // Copy from the source block in the buffer cache
+      journal_start(fs, &h);
+      rc = copy_cached(in, inpos, out, outpos, size);
+      journal_stop(fs, &h);
+    }
+
+    if (rc <= 0) break;
+    inpos += rc;
+    outpos += rc;
+    copied += rc;
   }
 
-  return written;
+  if (cluster) kfree(cluster);
+  if (rc < 0 && copied == 0) return rc;
+  return copied;
 }
 
 int dfs_ioctl(struct file *filp, int cmd, void *data, size_t size) {
+  switch (cmd) {
+    case IOCTL_DFS_FRAGINFO:
+      if (!data || size < sizeof(struct dfs_fraginfo)) return -EINVAL;
+      return dfs_fraginfo(filp, (struct dfs_fraginfo *) data);
+
+    case IOCTL_DFS_DEFRAG:
+      if (!data || size < sizeof(struct dfs_fraginfo)) return -EINVAL;
+      return dfs_defrag(filp, (struct dfs_fraginfo *) data);
+
+    case IOCTL_DFS_FREEINFO:
+      if (!data) return -EINVAL;
+      return dfs_freeinfo(filp, (struct dfs_freeinfo *) data, size / sizeof(struct dfs_freeinfo));
+  }
+
   return -ENOSYS;
 }
 
@@ -475,7 +997,7 @@ off64_t dfs_lseek(struct file *filp, off64_t offset, int origin) {
   return offset;
 }
 
-int dfs_ftruncate(struct file *filp, off64_t size) {
+static int truncate_file(struct file *filp, off64_t size) {
   struct inode *inode;
   int rc;
   unsigned int blocks;
@@ -490,10 +1012,13 @@ int dfs_ftruncate(struct file *filp, off64_t size) {
   if (size < 0) return -EINVAL;
   if (size == inode->desc->size) return 0;
 
+  rc = flush_delalloc(inode);
+  if (rc < 0) return rc;
+
   blocks = ((size_t) size + inode->fs->blocksize - 1) / inode->fs->blocksize;
 
   if (size > inode->desc->size) {
-    while (blocks < inode->desc->blocks) {
+    while (blocks > inode->desc->blocks) {
       blk = expand_inode(inode);
       if (blk == NOBLOCK) return -ENOSPC;
 
@@ -519,6 +1044,104 @@ int dfs_ftruncate(struct file *filp, off64_t size) {
   return 0;
 }
 
+int dfs_ftruncate(struct file *filp, off64_t size) {
+  struct filsys *fs = ((struct inode *) filp->data)->fs;
+  struct jhandle h;
+  int rc;
+
+  journal_start(fs, &h);
+  rc = truncate_file(filp, size);
+  journal_stop(fs, &h);
+
+  return rc;
+}
+
+//
+// dfs_fallocate
+//
+// Allocates blocks for a range of a file. Files have no holes, so blocks
+// are allocated from the end of the file up to the end of the range. The
+// blocks are reserved as one run where possible and zeroed on disk. Unless
+// FALLOC_FL_KEEP_SIZE is set, the file size is extended to cover the range.
+//
+
+static int allocate_file(struct file *filp, int mode, off64_t offset, off64_t len) {
+  struct inode *inode = (struct inode *) filp->data;
+  struct filsys *fs = inode->fs;
+  unsigned int blocks;
+  unsigned int iblock;
+  unsigned int maxn;
+  off64_t end;
+  blkno_t blk;
+  char *zero;
+  int rc, n;
+
+  if (mode & ~FALLOC_FL_KEEP_SIZE) return -EINVAL;
+  if (offset < 0 || len <= 0) return -EINVAL;
+  if (S_ISDIR(inode->desc->mode)) return -EISDIR;
+
+  end = offset + len;
+  if (end > DFS_MAXFILESIZE) return -EFBIG;
+
+  rc = flush_delalloc(inode);
+  if (rc < 0) return rc;
+
+  // Allocate blocks up to the end of the range
+  blocks = (unsigned int) ((end + fs->blocksize - 1) / fs->blocksize);
+  iblock = inode->desc->blocks;
+  while (inode->desc->blocks < blocks) {
+    rc = reserve_inode_blocks(inode, blocks - inode->desc->blocks);
+    if (rc < 0) break;
+
+    if (expand_inode(inode) == NOBLOCK) {
+      rc = -ENOSPC;
+      break;
+    }
+  }
+
+  // Zero the new blocks on disk one run at a time
+  if (iblock < inode->desc->blocks) {
+    maxn = FALLOC_ZERO_SIZE / fs->blocksize;
+    zero = (char *) kmalloc(maxn * fs->blocksize);
+    if (!zero) return -ENOMEM;
+    memset(zero, 0, maxn * fs->blocksize);
+
+    while (iblock < inode->desc->blocks) {
+      n = map_inode_blocks(inode, iblock, inode->desc->blocks - iblock, &blk);
+      if (n > (int) maxn) n = maxn;
+      if (n >= 0 && direct_transfer(inode, blk, n, zero, 1) < 0) n = -EIO;
+      if (n < 0) {
+        rc = n;
+        break;
+      }
+      iblock += n;
+    }
+
+    kfree(zero);
+  }
+  if (rc < 0) return rc;
+
+  if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->desc->size) {
+    inode->desc->size = end;
+    mark_inode_dirty(inode);
+    filp->flags |= F_MODIFIED;
+  }
+
+  return 0;
+}
+
+int dfs_fallocate(struct file *filp, int mode, off64_t offset, off64_t len) {
+  struct filsys *fs = ((struct inode *) filp->data)->fs;
+  struct jhandle h;
+  int rc;
+
+  journal_start(fs, &h);
+  rc = allocate_file(filp, mode, offset, len);
+  journal_stop(fs, &h);
+
+  return rc;
+}
+
 int dfs_futime(struct file *filp, struct utimbuf *times) {
   struct inode *inode;
 
@@ -538,20 +1161,7 @@ int dfs_fstat(struct file *filp, struct stat64 *buffer) {
   inode = (struct inode *) filp->data;
   size = inode->desc->size;
 
-  if (buffer) {
-    memset(buffer, 0, sizeof(struct stat64));
-
-    buffer->st_mode = inode->desc->mode;
-    buffer->st_uid = inode->desc->uid;
-    buffer->st_gid = inode->desc->gid;
-    buffer->st_ino = inode->ino;
-    buffer->st_nlink = inode->desc->linkcount;
-    buffer->st_dev = inode->fs->devno;
-    buffer->st_atime = kpit_get_time();
-    buffer->st_mtime = inode->desc->mtime;
-    buffer->st_ctime = inode->desc->ctime;
-    buffer->st_size = inode->desc->size;
-  }
+  if (buffer) stat_inode(inode, buffer);
 
   return (int) size;
 }
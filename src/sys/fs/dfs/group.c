@@ -36,50 +36,231 @@
 #include <os/buf.h>
 
 static void mark_group_desc_dirty(struct filsys *fs, int group) {
-  mark_buffer_updated(fs->cache, fs->groupdesc_buffers[group / fs->groupdescs_per_block]);
+  journal_dirty(fs, fs->groupdesc_buffers[group / fs->groupdescs_per_block]);
 }
 
-blkno_t new_block(struct filsys *fs, blkno_t goal) {
-  unsigned int group;
+//
+// Free run summaries
+//
+// Each group records up to DFS_GROUP_RUNS runs of free blocks. The runs in
+// the summary are disjoint and never adjacent. When the summary is full,
+// the smallest run is dropped in favour of a larger one. Runs dropped after
+// the summary was built from the bitmap are remembered in runs_lost, and the
+// summary is rebuilt when a request does not fit in any recorded run.
+//
+
+static void remove_run(struct blkgroup *group, int i) {
+  group->runs[i] = group->runs[--group->nruns];
+}
+
+static void add_run(struct blkgroup *group, unsigned int start, unsigned int count) {
+  struct freerun *run;
+  int smallest;
+  int i;
+
+  // Merge with adjacent runs
+  for (i = 0; i < group->nruns; i++) {
+    run = &group->runs[i];
+    if (run->start + run->count == start) {
+      start = run->start;
+      count += run->count;
+      remove_run(group, i--);
+    } else if (start + count == run->start) {
+      count += run->count;
+      remove_run(group, i--);
+    }
+  }
+
+  if (group->nruns < DFS_GROUP_RUNS) {
+    run = &group->runs[group->nruns++];
+    run->start = start;
+    run->count = count;
+    return;
+  }
+
+  // Summary is full, replace the smallest run if the new run is larger
+  smallest = 0;
+  for (i = 1; i < group->nruns; i++) {
+    if (group->runs[i].count < group->runs[smallest].count) smallest = i;
+  }
+
+  if (group->runs[smallest].count < count) {
+    group->runs[smallest].start = start;
+    group->runs[smallest].count = count;
+  }
+
+  group->runs_lost = 1;
+}
+
+static void take_run(struct blkgroup *group, unsigned int start, unsigned int count) {
+  struct freerun run;
+  unsigned int end = start + count;
+  int i;
+
+  for (i = 0; i < group->nruns; i++) {
+    run = group->runs[i];
+    if (run.start >= end || run.start + run.count <= start) continue;
+
+    // Remove the run and put back the parts outside the allocated range
+    remove_run(group, i);
+    if (run.start < start) add_run(group, run.start, start - run.start);
+    if (run.start + run.count > end) add_run(group, end, run.start + run.count - end);
+    i = -1;
+  }
+}
+
+//
+// Withheld blocks
+//
+// Blocks freed by the running transaction must not be reused before the
+// transaction has been committed. Otherwise a crash could leave a block
+// that has been overwritten with new data referenced by the metadata that
+// is recovered from the log. As in JBD, a copy of the block bitmap as of
+// the last commit is kept for each group in which the running transaction
+// has freed blocks, and a block can only be allocated if it is free in
+// both bitmaps. The copies are dropped when the transaction commits.
+//
+// Blocks can also be reserved in memory without changing the bitmap.
+// Reserved blocks are not used by other allocations, and are either
+// claimed later or given back. Nothing is left allocated on disk if the
+// system crashes before the blocks are claimed.
+//
+
+static int block_free(struct blkgroup *group, struct buf *buf, unsigned int block) {
+  if (test_bit(buf->data, block)) return 0;
+  if (group->committed && test_bit(group->committed, block)) return 0;
+  return !group->reserved || !test_bit(group->reserved, block);
+}
+
+static unsigned int next_free_block(struct blkgroup *group, struct buf *buf, unsigned int start) {
+  unsigned int len = group->desc->block_count;
+
+  while (start < len) {
+    start = find_next_zero_bit(buf->data, len, start);
+    if (start >= len) break;
+
+    if (group->committed && test_bit(group->committed, start)) {
+      start = find_next_zero_bit(group->committed, len, start);
+    } else if (group->reserved && test_bit(group->reserved, start)) {
+      start = find_next_zero_bit(group->reserved, len, start);
+    } else {
+      break;
+    }
+  }
+
+  return start;
+}
+
+void release_freed_blocks(struct filsys *fs) {
+  struct blkgroup *g;
   unsigned int i;
+
+  for (i = 0; i < fs->super->group_count; i++) {
+    g = &fs->groups[i];
+    if (!g->committed) continue;
+
+    // The summary is rebuilt from the bitmap on the next allocation
+    kfree(g->committed);
+    g->committed = NULL;
+    g->nruns = -1;
+  }
+}
+
+static void add_freed_run(struct blkgroup *group, unsigned int start, unsigned int count) {
+  // Withheld blocks are added to the summary when the transaction commits
+  if (count > 0 && group->nruns >= 0 && !group->committed) add_run(group, start, count);
+}
+
+static void scan_group(struct blkgroup *group, struct buf *buf) {
+  unsigned int len = group->desc->block_count;
+  unsigned int start;
+  unsigned int end;
+
+  group->nruns = 0;
+  start = next_free_block(group, buf, 0);
+  while (start < len) {
+    end = start + 1;
+    while (end < len && block_free(group, buf, end)) end++;
+    add_run(group, start, end - start);
+    if (end == len) break;
+    start = next_free_block(group, buf, end + 1);
+  }
+
+  // The summary now holds the largest runs in the group
+  group->runs_lost = 0;
+}
+
+static int best_run(struct blkgroup *group, unsigned int count) {
+  int best = -1;
+  int i;
+
+  // Use the smallest run that fits the request, otherwise the largest run
+  for (i = 0; i < group->nruns; i++) {
+    if (best == -1) {
+      best = i;
+    } else if (group->runs[best].count < count) {
+      if (group->runs[i].count > group->runs[best].count) best = i;
+    } else if (group->runs[i].count >= count && group->runs[i].count < group->runs[best].count) {
+      best = i;
+    }
+  }
+
+  return best;
+}
+
+//
+// new_blocks
+//
+// Allocates a run of up to count contiguous blocks. If the goal block is
+// free, the run starts at the goal. Otherwise the free run summaries are
+// searched for a run that can hold the whole request, starting with the
+// group of the goal block. If no group has a large enough run, the largest
+// run in the first group with free blocks is used. Returns the number of
+// blocks allocated. With reserve set, the run is only reserved in memory.
+//
+
+static int alloc_blocks(struct filsys *fs, blkno_t goal, unsigned int count, blkno_t *first, int reserve) {
+  struct blkgroup *g;
+  unsigned int group;
+  unsigned int fallback;
+  unsigned int block;
+  unsigned int i, n;
   struct buf *buf;
-  blkno_t block;
+  int r;
+
+  if (count == 0) return -EINVAL;
 
   if (goal < fs->super->block_count) {
     // Check the goal
     group = goal / fs->super->blocks_per_group;
     block = goal % fs->super->blocks_per_group;
     buf = get_buffer(fs->cache, fs->groups[group].desc->block_bitmap_block);
-    if (!buf) return NOBLOCK;
-    if (!test_bit(buf->data, block)) goto block_found;
-
-    // Try to find first free block in group after goal
-    block = find_next_zero_bit(buf->data, fs->groups[group].desc->block_count, block + 1);
-    if (block != fs->groups[group].desc->block_count) goto block_found;
-
+    if (!buf) return -EIO;
+    if (block_free(&fs->groups[group], buf, block)) goto run_found;
     release_buffer(fs->cache, buf);
   } else {
     group = 0;
   }
 
-  // Try to locate a free block by going through all groups cyclicly
+retry:
+  // Find a recorded run that fits the request by going through all groups cyclicly
+  fallback = -1;
   for (i = 0; i < fs->super->group_count; i++) {
-    if (fs->groups[group].desc->free_block_count > 0) {
-      // Get block bitmap
-      buf = get_buffer(fs->cache, fs->groups[group].desc->block_bitmap_block);
-      if (!buf) return NOBLOCK;
-
-      // Try to find first free block
-      if (fs->groups[group].first_free_block != -1) {
-        block = find_next_zero_bit(buf->data, fs->groups[group].desc->block_count, fs->groups[group].first_free_block);
-      } else {
-        block = find_first_zero_bit(buf->data, fs->groups[group].desc->block_count);
-        fs->groups[group].first_free_block = block;
+    g = &fs->groups[group];
+    if (g->desc->free_block_count > 0) {
+      r = best_run(g, count);
+      if (r == -1 || (g->runs_lost && g->runs[r].count < count)) {
+        buf = get_buffer(fs->cache, g->desc->block_bitmap_block);
+        if (!buf) return -EIO;
+        scan_group(g, buf);
+        release_buffer(fs->cache, buf);
+        r = best_run(g, count);
       }
 
-      if (block != fs->groups[group].desc->block_count) goto block_found;
-
-      release_buffer(fs->cache, buf);
+      if (r != -1) {
+        if (g->runs[r].count >= count) break;
+        if (fallback == -1) fallback = group;
+      }
     }
 
     // Try next group
@@ -87,58 +268,282 @@ blkno_t new_block(struct filsys *fs, blkno_t goal) {
     if (group >= fs->super->group_count) group = 0;
   }
 
-  //panic("disk full");
-  return NOBLOCK;
+  if (i == fs->super->group_count) {
+    //panic("disk full");
+    if (fallback == -1) return -ENOSPC;
+    group = fallback;
+  }
+
+  // The summary may have changed while reading bitmaps
+  g = &fs->groups[group];
+  r = best_run(g, count);
+  if (r == -1) goto retry;
+  block = g->runs[r].start;
+
+  buf = get_buffer(fs->cache, g->desc->block_bitmap_block);
+  if (!buf) return -EIO;
+
+  // Another thread may have taken the run while we were waiting for the bitmap
+  if (!block_free(g, buf, block)) {
+    scan_group(g, buf);
+    release_buffer(fs->cache, buf);
+    goto retry;
+  }
+
+run_found:
+  g = &fs->groups[group];
+  n = 1;
+  while (n < count && block + n < g->desc->block_count && block_free(g, buf, block + n)) n++;
+
+  if (reserve) {
+    if (!g->reserved) {
+      g->reserved = (unsigned char *) kmalloc(fs->blocksize);
+      if (!g->reserved) {
+        release_buffer(fs->cache, buf);
+        return -ENOMEM;
+      }
+      memset(g->reserved, 0, fs->blocksize);
+    }
+    set_bits(g->reserved, block, n);
+    g->nreserved += n;
+  } else {
+    set_bits(buf->data, block, n);
+    journal_dirty(fs, buf);
+
+    fs->super->free_block_count -= n;
+    fs->super_dirty = 1;
+
+    g->desc->free_block_count -= n;
+    mark_group_desc_dirty(fs, group);
+  }
+  if (g->nruns >= 0) take_run(g, block, n);
+
+  release_buffer(fs->cache, buf);
+  *first = block + group * fs->super->blocks_per_group;
+  return n;
+}
+
+int new_blocks(struct filsys *fs, blkno_t goal, unsigned int count, blkno_t *first) {
+  return alloc_blocks(fs, goal, count, first, 0);
+}
+
+int reserve_blocks(struct filsys *fs, blkno_t goal, unsigned int count, blkno_t *first) {
+  return alloc_blocks(fs, goal, count, first, 1);
+}
+
+static void clear_reserved(struct blkgroup *g, unsigned int block, unsigned int count) {
+  unsigned int i;
+
+  for (i = 0; i < count; i++) clear_bit(g->reserved, block + i);
+  g->nreserved -= count;
+  if (g->nreserved == 0) {
+    kfree(g->reserved);
+    g->reserved = NULL;
+  }
+}
+
+//
+// claim_blocks
+//
+// Allocates a run of blocks reserved by reserve_blocks in the running
+// transaction. The run must lie in one group.
+//
+
+int claim_blocks(struct filsys *fs, blkno_t start, unsigned int count) {
+  unsigned int group = start / fs->super->blocks_per_group;
+  unsigned int block = start % fs->super->blocks_per_group;
+  struct blkgroup *g = &fs->groups[group];
+  struct buf *buf;
+  int rc;
 
-block_found:
-  set_bit(buf->data, block);
-  mark_buffer_updated(fs->cache, buf);
+  buf = get_buffer(fs->cache, g->desc->block_bitmap_block);
+  if (!buf) return -EIO;
 
-  fs->super->free_block_count--;
+  clear_reserved(g, block, count);
+  set_bits(buf->data, block, count);
+  rc = journal_dirty(fs, buf);
+
+  fs->super->free_block_count -= count;
   fs->super_dirty = 1;
 
-  if (fs->groups[group].first_free_block == block) fs->groups[group].first_free_block = block + 1;
-  fs->groups[group].desc->free_block_count--;
+  g->desc->free_block_count -= count;
   mark_group_desc_dirty(fs, group);
 
   release_buffer(fs->cache, buf);
-  block += group * fs->super->blocks_per_group;
+  return rc;
+}
+
+//
+// unreserve_blocks
+//
+// Gives back a run of blocks reserved by reserve_blocks.
+//
+
+void unreserve_blocks(struct filsys *fs, blkno_t start, unsigned int count) {
+  unsigned int group = start / fs->super->blocks_per_group;
+  unsigned int block = start % fs->super->blocks_per_group;
+  struct blkgroup *g = &fs->groups[group];
+
+  clear_reserved(g, block, count);
+  add_freed_run(g, block, count);
+}
+
+blkno_t new_block(struct filsys *fs, blkno_t goal) {
+  blkno_t block;
+
+  if (new_blocks(fs, goal, 1, &block) < 0) return NOBLOCK;
   return block;
 }
 
-void free_blocks(struct filsys *fs, blkno_t *blocks, int count) {
+//
+// find_free_run
+//
+// Returns the first block of a free run that can hold count blocks,
+// searching the free run summaries starting with the group of the goal
+// block. If no group has a large enough run, the largest run found is
+// returned. The run is not allocated.
+//
+
+blkno_t find_free_run(struct filsys *fs, blkno_t goal, unsigned int count) {
+  struct blkgroup *g;
+  unsigned int group;
+  unsigned int bestcount;
+  unsigned int i;
+  blkno_t best;
+  struct buf *buf;
+  int r;
+
+  group = goal < fs->super->block_count ? goal / fs->super->blocks_per_group : 0;
+  best = NOBLOCK;
+  bestcount = 0;
+  for (i = 0; i < fs->super->group_count; i++) {
+    g = &fs->groups[group];
+    if (g->desc->free_block_count > 0) {
+      r = best_run(g, count);
+      if (r == -1 || (g->runs_lost && g->runs[r].count < count)) {
+        buf = get_buffer(fs->cache, g->desc->block_bitmap_block);
+        if (!buf) return NOBLOCK;
+        scan_group(g, buf);
+        release_buffer(fs->cache, buf);
+        r = best_run(g, count);
+      }
+
+      if (r != -1 && g->runs[r].count > bestcount) {
+        best = g->runs[r].start + group * fs->super->blocks_per_group;
+        bestcount = g->runs[r].count;
+        if (bestcount >= count) break;
+      }
+    }
+
+    group++;
+    if (group >= fs->super->group_count) group = 0;
+  }
+
+  return best;
+}
+
+//
+// get_group_freeinfo
+//
+// Counts the free blocks and runs of free blocks in a group from the
+// block bitmap.
+//
+
+int get_group_freeinfo(struct filsys *fs, unsigned int group, struct dfs_freeinfo *info) {
+  struct blkgroup *g = &fs->groups[group];
+  unsigned int len = g->desc->block_count;
+  unsigned int start;
+  unsigned int end;
+  struct buf *buf;
+
+  buf = get_buffer(fs->cache, g->desc->block_bitmap_block);
+  if (!buf) return -EIO;
+
+  memset(info, 0, sizeof(struct dfs_freeinfo));
+  info->group = group;
+  info->block_count = len;
+
+  start = find_first_zero_bit(buf->data, len);
+  while (start < len) {
+    end = start + 1;
+    while (end < len && !test_bit(buf->data, end)) end++;
+
+    info->free_blocks += end - start;
+    info->free_runs++;
+    if (end - start > info->largest_run) info->largest_run = end - start;
+
+    if (end == len) break;
+    start = find_next_zero_bit(buf->data, len, end + 1);
+  }
+
+  release_buffer(fs->cache, buf);
+  return 0;
+}
+
+int free_blocks(struct filsys *fs, blkno_t *blocks, int count) {
+  struct blkgroup *g;
   unsigned int group;
   unsigned int prev_group;
   struct buf *buf;
   blkno_t block;
+  unsigned int start;
+  unsigned int n;
   int i;
 
   prev_group = -1;
   buf = NULL;
+  start = 0;
+  n = 0;
 
   for (i = 0; i < count; i++) {
     group = blocks[i] / fs->super->blocks_per_group;
     block = blocks[i] % fs->super->blocks_per_group;
 
     if (group != prev_group) {
+      if (n > 0) add_freed_run(&fs->groups[prev_group], start, n);
+      n = 0;
+
       if (buf) release_buffer(fs->cache, buf);
-      buf = get_buffer(fs->cache, fs->groups[group].desc->block_bitmap_block);
-      if (!buf) return;
+      g = &fs->groups[group];
+      buf = get_buffer(fs->cache, g->desc->block_bitmap_block);
+      if (!buf) return -EIO;
       prev_group = group;
+
+      if (fs->journal && !g->committed) {
+        g->committed = (unsigned char *) kmalloc(fs->blocksize);
+        if (!g->committed) {
+          // Leave the blocks allocated rather than risk reusing them
+          kprintf(KERN_WARNING "dfs: out of memory, %d blocks not freed\n", count - i);
+          release_buffer(fs->cache, buf);
+          return -ENOMEM;
+        }
+        memcpy(g->committed, buf->data, fs->blocksize);
+      }
     }
 
     clear_bit(buf->data, block);
-    mark_buffer_updated(fs->cache, buf);
+    journal_dirty(fs, buf);
+    journal_revoke(fs, blocks[i]);
 
     fs->super->free_block_count++;
     fs->super_dirty = 1;
 
-    if (fs->groups[group].first_free_block > block) fs->groups[group].first_free_block = block;
     fs->groups[group].desc->free_block_count++;
     mark_group_desc_dirty(fs, group);
+
+    // Collect runs of consecutive blocks for the free run summary
+    if (n > 0 && start + n == block) {
+      n++;
+    } else {
+      add_freed_run(g, start, n);
+      start = block;
+      n = 1;
+    }
   }
 
+  if (n > 0) add_freed_run(&fs->groups[prev_group], start, n);
   if (buf) release_buffer(fs->cache, buf);
+  return 0;
 }
 
 ino_t new_inode(struct filsys *fs, ino_t parent, int dir) {
@@ -191,7 +596,7 @@ ino_t new_inode(struct filsys *fs, ino_t parent, int dir) {
 
   // Mark inode as used
   set_bit(buf->data, ino);
-  mark_buffer_updated(fs->cache, buf);
+  journal_dirty(fs, buf);
 
   fs->super->free_inode_count--;
   fs->super_dirty = 1;
@@ -217,7 +622,7 @@ void free_inode(struct filsys *fs, ino_t ino) {
   if (!buf) return;
 
   clear_bit(buf->data, ino);
-  mark_buffer_updated(fs->cache, buf);
+  journal_dirty(fs, buf);
 
   fs->super->free_inode_count++;
   fs->super_dirty = 1;
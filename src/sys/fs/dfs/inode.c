@@ -50,29 +50,541 @@ static void split_levels(struct inode *inode, unsigned int iblock, unsigned int
 }
 
 void mark_inode_dirty(struct inode *inode) {
-  mark_buffer_updated(inode->fs->cache, inode->buf);
+  inode->flags |= INODE_DIRTY;
 }
 
-blkno_t get_inode_block(struct inode *inode, unsigned int iblock) {
+#define EXTENTS(hdr)    ((struct extent *) ((hdr) + 1))
+#define EXTENTIDX(hdr)  ((struct extentidx *) ((hdr) + 1))
+
+struct extentpath {
+  struct buf *buf;
+  struct extenthdr *hdr;
+};
+
+static int is_extent_mapped(struct inode *inode) {
+  return (inode->desc->flags & DFS_INODE_FLAG_EXTENTS) != 0;
+}
+
+static struct extenthdr *extent_root(struct inode *inode) {
+  return (struct extenthdr *) inode->desc->blockdir;
+}
+
+static void init_extent_node(struct extenthdr *hdr, int size, int leaf) {
+  memset(hdr, 0, size);
+  hdr->magic = DFS_EXTENT_MAGIC;
+  hdr->limit = (size - sizeof(struct extenthdr)) / (leaf ? sizeof(struct extent) : sizeof(struct extentidx));
+}
+
+static int bad_extent_node(struct inode *inode, struct extenthdr *hdr, int index) {
+  if (hdr->magic == DFS_EXTENT_MAGIC && hdr->count <= hdr->limit && (!index || hdr->count > 0)) return 0;
+  kprintf(KERN_ERR "dfs: corrupt extent tree in inode %d\n", inode->ino);
+  return 1;
+}
+
+static void mark_extent_node_dirty(struct inode *inode, struct extentpath *path, int level) {
+  if (level == 0) {
+    mark_inode_dirty(inode);
+  } else {
+    journal_dirty(inode->fs, path[level].buf);
+  }
+}
+
+static void release_extent_path(struct inode *inode, struct extentpath *path, int depth) {
+  int d;
+
+  for (d = 1; d <= depth; d++) {
+    if (path[d].buf) release_buffer(inode->fs->cache, path[d].buf);
+  }
+}
+
+//
+// extent_rightmost
+//
+// Walks the extent tree along the last entry in each node from the root to
+// the last leaf. The tree blocks on the path are returned locked.
+//
+
+static int extent_rightmost(struct inode *inode, struct extentpath *path) {
+  struct extenthdr *hdr;
+  int depth = inode->desc->depth;
+  int d;
+
+  for (d = 0; d <= depth; d++) path[d].buf = NULL;
+  path[0].hdr = extent_root(inode);
+
+  for (d = 0; d <= depth; d++) {
+    hdr = path[d].hdr;
+    if (bad_extent_node(inode, hdr, d < depth)) {
+      release_extent_path(inode, path, depth);
+      return -EIO;
+    }
+
+    if (d < depth) {
+      path[d + 1].buf = get_buffer(inode->fs->cache, EXTENTIDX(hdr)[hdr->count - 1].block);
+      if (!path[d + 1].buf) {
+        release_extent_path(inode, path, depth);
+        return -EIO;
+      }
+      path[d + 1].hdr = (struct extenthdr *) path[d + 1].buf->data;
+    }
+  }
+
+  return 0;
+}
+
+//
+// lookup_extent
+//
+// Finds the extent containing a logical block by binary searching each
+// level of the extent tree.
+//
+
+static int lookup_extent(struct inode *inode, unsigned int iblock, struct extent *ext) {
+  struct extenthdr *hdr;
+  struct extent *e;
+  struct buf *buf;
+  int depth = inode->desc->depth;
+  int lo, hi, mid;
+  int d;
+
+  buf = NULL;
+  hdr = extent_root(inode);
+  for (d = 0; d <= depth; d++) {
+    if (bad_extent_node(inode, hdr, d < depth) || hdr->count == 0) break;
+
+    // Find last entry starting at or before the block
+    lo = 0;
+    hi = hdr->count - 1;
+    while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if ((d < depth ? EXTENTIDX(hdr)[mid].iblock : EXTENTS(hdr)[mid].iblock) <= iblock) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+
+    if (d == depth) {
+      e = EXTENTS(hdr) + lo;
+      if (iblock < e->iblock || iblock - e->iblock >= e->count) break;
+      *ext = *e;
+      if (buf) release_buffer(inode->fs->cache, buf);
+      return 0;
+    }
+
+    if (buf) release_buffer(inode->fs->cache, buf);
+    buf = get_buffer(inode->fs->cache, EXTENTIDX(hdr)[lo].block);
+    if (!buf) return -EIO;
+    hdr = (struct extenthdr *) buf->data;
+  }
+
+  if (buf) release_buffer(inode->fs->cache, buf);
+  return -EIO;
+}
+
+void free_extent_blocks(struct filsys *fs, blkno_t start, unsigned int count) {
+  blkno_t blocks[32];
+  unsigned int i, n;
+
+  while (count > 0) {
+    n = count < 32 ? count : 32;
+    for (i = 0; i < n; i++) {
+      blocks[i] = start + i;
+      invalidate_buffer(fs->cache, blocks[i]);
+    }
+    free_blocks(fs, blocks, n);
+
+    start += n;
+    count -= n;
+  }
+}
+
+//
+// Preallocation
+//
+// Blocks for appending to regular files are taken from a window of
+// contiguous blocks reserved for the inode. This keeps files that grow in
+// small steps, or concurrently with other files, physically contiguous.
+// The window doubles each time it is used up, up to the preallocation limit
+// of the file system. Unused blocks in the window are freed when the file
+// is truncated and when the last reference to the inode is released.
+//
+
+static int refill_prealloc(struct inode *inode, blkno_t goal, unsigned int count) {
+  blkno_t start;
+  int n;
+
+  n = new_blocks(inode->fs, goal, count, &start);
+  if (n < 0) return n;
+
+  // Another thread may have refilled the window while we were allocating
+  if (inode->prealloc_count > 0) {
+    free_extent_blocks(inode->fs, start, n);
+    return 0;
+  }
+
+  inode->prealloc_start = start;
+  inode->prealloc_count = n;
+  return 0;
+}
+
+static blkno_t new_file_block(struct inode *inode, blkno_t goal) {
+  struct filsys *fs = inode->fs;
+  unsigned int window;
+
+  if (inode->prealloc_count == 0) {
+    if (!S_ISREG(inode->desc->mode) || fs->prealloc_limit == 0) return new_block(fs, goal);
+
+    window = inode->prealloc_window * 2;
+    if (window < DFS_PREALLOC_MIN) window = DFS_PREALLOC_MIN;
+    if (window > fs->prealloc_limit) window = fs->prealloc_limit;
+    inode->prealloc_window = window;
+
+    if (refill_prealloc(inode, goal, window) < 0) return NOBLOCK;
+  }
+
+  inode->prealloc_count--;
+  return inode->prealloc_start++;
+}
+
+//
+// reserve_inode_blocks
+//
+// Reserves a run of up to count blocks after the last block in the file for
+// the next appends. Nothing is done if the inode already has preallocated
+// blocks.
+//
+
+int reserve_inode_blocks(struct inode *inode, unsigned int count) {
+  struct filsys *fs = inode->fs;
+  blkno_t goal;
+
+  if (inode->prealloc_count > 0 || count == 0) return 0;
+
+  if (inode->desc->blocks == 0 || map_inode_blocks(inode, inode->desc->blocks - 1, 1, &goal) < 0) {
+    goal = inode->ino / fs->super->inodes_per_group * fs->super->blocks_per_group;
+  } else {
+    goal++;
+  }
+
+  return refill_prealloc(inode, goal, count);
+}
+
+static void discard_prealloc(struct inode *inode) {
+  unsigned int count = inode->prealloc_count;
+
+  if (count == 0) return;
+  inode->prealloc_count = 0;
+  free_extent_blocks(inode->fs, inode->prealloc_start, count);
+}
+
+//
+// grow_extent_tree
+//
+// Moves the root of a full extent tree into a new tree block and makes the
+// root an index node with the new block as its only child.
+//
+
+static int grow_extent_tree(struct inode *inode, blkno_t goal) {
+  struct filsys *fs = inode->fs;
+  struct extenthdr *root = extent_root(inode);
+  struct extenthdr *hdr;
+  struct extentidx *idx;
+  struct buf *buf;
+  blkno_t blk;
+  int leaf = inode->desc->depth == 0;
+
+  if (inode->desc->depth >= DFS_MAX_DEPTH - 1) return -EFBIG;
+
+  blk = new_block(fs, goal);
+  if (blk == NOBLOCK) return -ENOSPC;
+
+  buf = alloc_buffer(fs->cache, blk);
+  if (!buf) {
+    free_blocks(fs, &blk, 1);
+    return -EIO;
+  }
+
+  hdr = (struct extenthdr *) buf->data;
+  init_extent_node(hdr, fs->blocksize, leaf);
+  hdr->count = root->count;
+  memcpy(hdr + 1, root + 1, root->count * (leaf ? sizeof(struct extent) : sizeof(struct extentidx)));
+  journal_dirty(fs, buf);
+  release_buffer(fs->cache, buf);
+
+  init_extent_node(root, sizeof(inode->desc->blockdir), 0);
+  idx = EXTENTIDX(root);
+  idx->iblock = 0;
+  idx->block = blk;
+  root->count = 1;
+  inode->desc->depth++;
+  mark_inode_dirty(inode);
+
+  return 0;
+}
+
+//
+// append_extent_block
+//
+// Adds a block at the end of an extent mapped file. The last extent is
+// extended when the block is physically contiguous with it. Otherwise a new
+// extent is added to the last leaf. When the leaf is full, new nodes are
+// added along the right edge of the tree, and the tree grows by one level
+// when all nodes on the right edge are full.
+//
+
+static blkno_t append_extent_block(struct inode *inode, blkno_t block) {
+  struct filsys *fs = inode->fs;
+  struct extentpath path[DFS_MAX_DEPTH + 1];
+  struct extenthdr *hdr;
+  struct extent *last;
+  struct extentidx *idx;
+  struct buf *buf;
+  blkno_t goal;
+  blkno_t blk;
+  int allocated;
+  int depth;
+  int d;
+
+  goal = inode->ino / fs->super->inodes_per_group * fs->super->blocks_per_group;
+  allocated = 0;
+
+  while (1) {
+    depth = inode->desc->depth;
+    if (extent_rightmost(inode, path) < 0) goto error;
+
+    hdr = path[depth].hdr;
+    last = hdr->count > 0 ? EXTENTS(hdr) + hdr->count - 1 : NULL;
+
+    // Allocate new block after the last block in file if requested
+    if (block == NOBLOCK) {
+      block = new_file_block(inode, last ? last->start + last->count : goal);
+      if (block == NOBLOCK) {
+        release_extent_path(inode, path, depth);
+        return NOBLOCK;
+      }
+      allocated = 1;
+    }
+
+    // Extend last extent if the block is contiguous with it
+    if (last && last->start + last->count == block && last->iblock + last->count == inode->desc->blocks) {
+      last->count++;
+      mark_extent_node_dirty(inode, path, depth);
+      break;
+    }
+
+    // Find the lowest node on the right edge with room for a new entry
+    for (d = depth; d >= 0 && path[d].hdr->count == path[d].hdr->limit; d--);
+
+    if (d < 0) {
+      // All nodes on the right edge are full, add a level to the tree
+      release_extent_path(inode, path, depth);
+      if (grow_extent_tree(inode, goal) < 0) goto error;
+      continue;
+    }
+
+    // Add new nodes on the right edge of the tree down to a new leaf
+    while (d < depth) {
+      blk = new_block(fs, goal);
+      buf = blk == NOBLOCK ? NULL : alloc_buffer(fs->cache, blk);
+      if (!buf) {
+        if (blk != NOBLOCK) free_blocks(fs, &blk, 1);
+        release_extent_path(inode, path, depth);
+        goto error;
+      }
+      init_extent_node((struct extenthdr *) buf->data, fs->blocksize, d + 1 == depth);
+
+      idx = EXTENTIDX(path[d].hdr) + path[d].hdr->count++;
+      idx->iblock = inode->desc->blocks;
+      idx->block = blk;
+      mark_extent_node_dirty(inode, path, d);
+
+      d++;
+      if (path[d].buf) release_buffer(fs->cache, path[d].buf);
+      path[d].buf = buf;
+      path[d].hdr = (struct extenthdr *) buf->data;
+      journal_dirty(fs, buf);
+    }
+
+    // Add new extent to the last leaf
+    hdr = path[depth].hdr;
+    last = EXTENTS(hdr) + hdr->count++;
+    last->iblock = inode->desc->blocks;
+    last->count = 1;
+    last->start = block;
+    mark_extent_node_dirty(inode, path, depth);
+    break;
+  }
+
+  release_extent_path(inode, path, depth);
+  inode->desc->blocks++;
+  mark_inode_dirty(inode);
+
+  return block;
+
+error:
+  if (allocated) free_blocks(fs, &block, 1);
+  return NOBLOCK;
+}
+
+//
+// truncate_extents
+//
+// Removes blocks from the end of an extent mapped file. Whole runs are
+// freed at a time, and tree nodes left empty are removed from the right
+// edge of the tree.
+//
+
+static int truncate_extents(struct inode *inode, unsigned int blocks) {
+  struct filsys *fs = inode->fs;
+  struct extentpath path[DFS_MAX_DEPTH + 1];
+  struct extenthdr *hdr;
+  struct extent *last;
+  unsigned int n;
+  int depth;
+  int d;
+  int rc;
+
+  while (inode->desc->blocks > blocks) {
+    depth = inode->desc->depth;
+    rc = extent_rightmost(inode, path);
+    if (rc < 0) return rc;
+
+    hdr = path[depth].hdr;
+    if (hdr->count > 0) {
+      // Remove blocks from the end of the last extent
+      last = EXTENTS(hdr) + hdr->count - 1;
+      n = inode->desc->blocks - blocks;
+      if (n > last->count) n = last->count;
+
+      free_extent_blocks(fs, last->start + last->count - n, n);
+      last->count -= n;
+      inode->desc->blocks -= n;
+      if (last->count == 0) hdr->count--;
+      mark_extent_node_dirty(inode, path, depth);
+    } else if (depth == 0) {
+      kprintf(KERN_ERR "dfs: corrupt extent tree in inode %d\n", inode->ino);
+      return -EIO;
+    }
+
+    // Remove empty nodes from the right edge of the tree
+    for (d = depth; d > 0 && path[d].hdr->count == 0; d--) {
+      free_blocks(fs, &(path[d].buf->blkno), 1);
+      mark_buffer_invalid(fs->cache, path[d].buf);
+      path[d - 1].hdr->count--;
+      mark_extent_node_dirty(inode, path, d - 1);
+    }
+
+    release_extent_path(inode, path, depth);
+  }
+
+  // Reset tree when all blocks have been removed
+  if (extent_root(inode)->count == 0) {
+    init_extent_node(extent_root(inode), sizeof(inode->desc->blockdir), 1);
+    inode->desc->depth = 0;
+  }
+  mark_inode_dirty(inode);
+
+  return 0;
+}
+
+//
+// map_block_dir
+//
+// Maps a logical block through the block directory tree and counts the
+// physically contiguous blocks following it in the same directory page.
+//
+
+static int map_block_dir(struct inode *inode, unsigned int iblock, blkno_t *blk) {
   int d;
   blkno_t block;
+  blkno_t *blocks;
   struct buf *buf;
   unsigned int offsets[DFS_MAX_DEPTH];
+  unsigned int first;
+  unsigned int maxn;
+  unsigned int n;
 
   split_levels(inode, iblock, offsets);
-  block = inode->desc->blockdir[offsets[0]];
+  if (inode->desc->depth == 0 && offsets[0] >= DFS_TOPBLOCKDIR_SIZE) return -EIO;
+
+  buf = NULL;
+  blocks = inode->desc->blockdir;
+  maxn = DFS_TOPBLOCKDIR_SIZE;
+  for (d = 0; d < inode->desc->depth; d++) {
+    block = blocks[offsets[d]];
+    if (buf) release_buffer(inode->fs->cache, buf);
+    buf = block ? get_buffer(inode->fs->cache, block) : NULL;
+    if (!buf) return -EIO;
+
+    blocks = (blkno_t *) buf->data;
+    maxn = inode->fs->blocksize / sizeof(blkno_t);
+  }
 
-  for (d = 1; d <= inode->desc->depth; d++) {
-    buf = get_buffer(inode->fs->cache, block);
-    if (!buf) return NOBLOCK;
+  first = offsets[inode->desc->depth];
+  block = blocks[first];
+  maxn -= first;
+  if (maxn > inode->desc->blocks - iblock) maxn = inode->desc->blocks - iblock;
 
-    block = ((blkno_t *) buf->data)[offsets[d]];
-    release_buffer(inode->fs->cache, buf);
+  n = 1;
+  if (block) {
+    while (n < maxn && blocks[first + n] == block + n) n++;
+  }
 
-    if (!block) return NOBLOCK;
+  if (buf) release_buffer(inode->fs->cache, buf);
+  if (!block) return -EIO;
+
+  *blk = block;
+  return n;
+}
+
+//
+// map_inode_blocks
+//
+// Maps a logical block to a physical block and returns the number of
+// physically contiguous blocks, up to count, starting at the block. The
+// last resolved run is kept in the inode, so sequential access only walks
+// the block map once per run. Truncation and block replacement bump the
+// file system map generation, which invalidates the runs cached by all
+// open files.
+//
+
+int map_inode_blocks(struct inode *inode, unsigned int iblock, unsigned int count, blkno_t *blk) {
+  struct extent ext;
+  unsigned int n;
+  int rc;
+
+  if (iblock >= inode->desc->blocks) return -EIO;
+
+  if (inode->map_count == 0 || inode->map_gen != inode->fs->map_gen ||
+      iblock < inode->map_iblock || iblock - inode->map_iblock >= inode->map_count) {
+    if (is_extent_mapped(inode)) {
+      rc = lookup_extent(inode, iblock, &ext);
+      if (rc < 0) return rc;
+
+      inode->map_iblock = ext.iblock;
+      inode->map_count = ext.count;
+      inode->map_start = ext.start;
+    } else {
+      rc = map_block_dir(inode, iblock, &inode->map_start);
+      if (rc < 0) return rc;
+
+      inode->map_iblock = iblock;
+      inode->map_count = rc;
+    }
+    inode->map_gen = inode->fs->map_gen;
   }
 
-  return block;
+  *blk = inode->map_start + (iblock - inode->map_iblock);
+  n = inode->map_count - (iblock - inode->map_iblock);
+  return n < count ? n : count;
+}
+
+blkno_t get_inode_block(struct inode *inode, unsigned int iblock) {
+  blkno_t blk;
+
+  if (map_inode_blocks(inode, iblock, 1, &blk) < 0) return NOBLOCK;
+  return blk;
 }
 
 blkno_t set_inode_block(struct inode *inode, unsigned int iblock, blkno_t block) {
@@ -82,12 +594,21 @@ blkno_t set_inode_block(struct inode *inode, unsigned int iblock, blkno_t block)
   blkno_t goal;
   unsigned int offsets[DFS_MAX_DEPTH];
 
+  if (is_extent_mapped(inode)) {
+    // Extent mapped files can only grow at the end
+    if (iblock != inode->desc->blocks) return NOBLOCK;
+    return append_extent_block(inode, block);
+  }
+
+  // Replacing a mapped block invalidates cached runs
+  if (iblock < inode->desc->blocks) inode->fs->map_gen++;
+
   goal = inode->ino / inode->fs->super->inodes_per_group * inode->fs->super->blocks_per_group;
 
   if (inode->desc->depth == 0) {
     // Allocate new block in same group as inode if requested
     if (block == NOBLOCK) {
-      block = new_block(inode->fs, goal);
+      block = new_file_block(inode, goal);
       if (block == NOBLOCK) return NOBLOCK;
       inode->desc->blocks++;
     }
@@ -128,7 +649,7 @@ blkno_t set_inode_block(struct inode *inode, unsigned int iblock, blkno_t block)
         dirblock = new_block(inode->fs, goal);
         if (dirblock == NOBLOCK) return NOBLOCK;
         ((blkno_t *) buf->data)[offsets[d]] = dirblock;
-        mark_buffer_updated(inode->fs->cache, buf);
+        journal_dirty(inode->fs, buf);
         release_buffer(inode->fs->cache, buf);
 
         buf = alloc_buffer(inode->fs->cache, dirblock);
@@ -146,7 +667,7 @@ blkno_t set_inode_block(struct inode *inode, unsigned int iblock, blkno_t block)
 
     // Allocate new block near previous block or leaf directory page if requested
     if (block == -1) {
-      block = new_block(inode->fs, offsets[d] == 0 ? dirblock + 1 : ((blkno_t *) buf->data)[offsets[d] - 1] + 1);
+      block = new_file_block(inode, offsets[d] == 0 ? dirblock + 1 : ((blkno_t *) buf->data)[offsets[d] - 1] + 1);
       if (block == NOBLOCK) return NOBLOCK;
       inode->desc->blocks++;
       mark_inode_dirty(inode);
@@ -154,38 +675,353 @@ blkno_t set_inode_block(struct inode *inode, unsigned int iblock, blkno_t block)
 
     // Update leaf with new block
     ((blkno_t *) buf->data)[offsets[d]] = block;
-    mark_buffer_updated(inode->fs->cache, buf);
+    journal_dirty(inode->fs, buf);
     release_buffer(inode->fs->cache, buf);
   }
 
   return block;
 }
 
+//
+// free_extent_tree
+//
+// Frees the index and leaf blocks of a detached extent tree. The data
+// blocks mapped by the tree are freed as well if requested.
+//
+
+static int free_extent_tree(struct inode *inode, struct extenthdr *hdr, int depth, int data) {
+  struct filsys *fs = inode->fs;
+  struct buf *buf;
+  blkno_t blk;
+  int rc;
+  int i;
+
+  if (bad_extent_node(inode, hdr, 0)) return -EIO;
+
+  for (i = 0; i < hdr->count; i++) {
+    if (depth == 0) {
+      if (data) free_extent_blocks(fs, EXTENTS(hdr)[i].start, EXTENTS(hdr)[i].count);
+    } else {
+      blk = EXTENTIDX(hdr)[i].block;
+      buf = get_buffer(fs->cache, blk);
+      if (!buf) return -EIO;
+      rc = free_extent_tree(inode, (struct extenthdr *) buf->data, depth - 1, data);
+      mark_buffer_invalid(fs->cache, buf);
+      release_buffer(fs->cache, buf);
+      if (rc < 0) return rc;
+      free_blocks(fs, &blk, 1);
+    }
+  }
+
+  return 0;
+}
+
+//
+// remap_inode_blocks
+//
+// Replaces the block map of an inode with a new set of runs covering all
+// blocks of the file. The data must already have been copied to the new
+// blocks. On success the old blocks are freed; on failure the old map is
+// restored and the new blocks are freed. The caller must hold a journal
+// handle, so the new map becomes visible in a single transaction.
+//
+
+int remap_inode_blocks(struct inode *inode, struct extent *oldmap, int nold, struct extent *newmap, int nnew) {
+  struct filsys *fs = inode->fs;
+  blkno_t oldroot[DFS_TOPBLOCKDIR_SIZE];
+  unsigned int olddepth;
+  unsigned int blocks;
+  unsigned int i;
+  int failed;
+  int n;
+
+  blocks = inode->desc->blocks;
+  failed = 0;
+  fs->map_gen++;
+
+  if (is_extent_mapped(inode)) {
+    // Build a new extent tree and free the old one
+    memcpy(oldroot, inode->desc->blockdir, sizeof(oldroot));
+    olddepth = inode->desc->depth;
+
+    init_extent_node(extent_root(inode), sizeof(inode->desc->blockdir), 1);
+    inode->desc->depth = 0;
+    inode->desc->blocks = 0;
+    for (n = 0; n < nnew && !failed; n++) {
+      for (i = 0; i < newmap[n].count; i++) {
+        if (append_extent_block(inode, newmap[n].start + i) == NOBLOCK) {
+          failed = 1;
+          break;
+        }
+      }
+    }
+
+    if (failed) {
+      free_extent_tree(inode, extent_root(inode), inode->desc->depth, 0);
+      memcpy(inode->desc->blockdir, oldroot, sizeof(oldroot));
+      inode->desc->depth = olddepth;
+      inode->desc->blocks = blocks;
+    } else {
+      free_extent_tree(inode, (struct extenthdr *) oldroot, olddepth, 1);
+    }
+    mark_inode_dirty(inode);
+  } else {
+    // Update block directory entries in place
+    for (n = 0; n < nnew && !failed; n++) {
+      for (i = 0; i < newmap[n].count; i++) {
+        if (set_inode_block(inode, newmap[n].iblock + i, newmap[n].start + i) == NOBLOCK) {
+          failed = 1;
+          break;
+        }
+      }
+    }
+
+    if (failed) {
+      for (n = 0; n < nold; n++) {
+        for (i = 0; i < oldmap[n].count; i++) set_inode_block(inode, oldmap[n].iblock + i, oldmap[n].start + i);
+      }
+    } else {
+      for (n = 0; n < nold; n++) free_extent_blocks(fs, oldmap[n].start, oldmap[n].count);
+    }
+  }
+
+  if (failed) {
+    for (n = 0; n < nnew; n++) free_extent_blocks(fs, newmap[n].start, newmap[n].count);
+    return -EIO;
+  }
+
+  // Preallocated blocks no longer follow the last block of the file
+  discard_prealloc(inode);
+
+  return 0;
+}
+
+//
+// Delayed allocation
+//
+// Data written past the last allocated block of a regular file is kept in
+// memory in the inode until it is flushed by the lazy writer, by fsync, or
+// when the last reference to the inode is released. Blocks for all the
+// delayed data are then reserved as one run, so files written concurrently
+// or in small pieces are laid out contiguously on disk.
+//
+
+static void discard_delalloc(struct inode *inode) {
+  unsigned int i;
+
+  while (inode->flags & INODE_FLUSHING) kthread_yield();
+
+  for (i = 0; i < inode->delalloc_count; i++) kfree(inode->delalloc[i]);
+  inode->fs->delalloc_blocks -= inode->delalloc_count;
+  inode->delalloc_count = 0;
+
+  if (inode->delalloc) {
+    kfree(inode->delalloc);
+    inode->delalloc = NULL;
+  }
+}
+
+//
+// flush_delalloc
+//
+// Assigns blocks to the delayed data of an inode. Each buffer is allocated
+// before its block is added to the file, and the data is copied to the
+// buffer as soon as the block is mapped. Until then, readers and writers
+// keep using the copy in the inode.
+//
+
+int flush_delalloc(struct inode *inode) {
+  struct filsys *fs = inode->fs;
+  struct buf *buf;
+  blkno_t blk;
+  char *data;
+  int rc;
+
+  // Wait for other thread flushing the inode
+  while (inode->flags & INODE_FLUSHING) kthread_yield();
+  if (inode->delalloc_count == 0) return 0;
+
+  inode->flags |= INODE_FLUSHING;
+  rc = 0;
+  while (inode->delalloc_count > 0) {
+    // Reserve one run of blocks for the rest of the delayed data
+    rc = reserve_inode_blocks(inode, inode->delalloc_count);
+    if (rc < 0) break;
+
+    // The next block is taken from the preallocation window
+    buf = alloc_buffer(fs->cache, inode->prealloc_start);
+    if (!buf) {
+      rc = -EIO;
+      break;
+    }
+
+    blk = expand_inode(inode);
+    if (blk == NOBLOCK) {
+      mark_buffer_invalid(fs->cache, buf);
+      release_buffer(fs->cache, buf);
+      rc = -ENOSPC;
+      break;
+    }
+
+    if (blk != buf->blkno) {
+      mark_buffer_invalid(fs->cache, buf);
+      release_buffer(fs->cache, buf);
+      buf = alloc_buffer(fs->cache, blk);
+      if (!buf) {
+        rc = -EIO;
+        break;
+      }
+    }
+
+    // Move data from the inode to the buffer cache
+    data = inode->delalloc[0];
+    memcpy(buf->data, data, fs->blocksize);
+    mark_buffer_updated(fs->cache, buf);
+    release_buffer(fs->cache, buf);
+
+    inode->delalloc_count--;
+    memmove(inode->delalloc, inode->delalloc + 1, inode->delalloc_count * sizeof(char *));
+    fs->delalloc_blocks--;
+    kfree(data);
+  }
+
+  if (inode->delalloc_count == 0 && inode->delalloc) {
+    kfree(inode->delalloc);
+    inode->delalloc = NULL;
+  }
+  inode->flags &= ~INODE_FLUSHING;
+
+  return rc;
+}
+
+//
+// Inode cache
+//
+// Inodes are cached per file system in a hash table keyed by inode number.
+// Each cached inode holds a copy of the inode descriptor, so opening a file
+// does not pin an inode table buffer. All users of an inode share the
+// cached copy. Modified descriptors are written back to the inode table
+// when the last reference is released and when the buffer cache is synced.
+// Unreferenced inodes are kept on an LRU list and are always clean, so they
+// can be discarded without I/O when the cache is full.
+//
+
+static int inode_hash(ino_t ino) {
+  return ino & (DFS_INODE_HASHSIZE - 1);
+}
+
+static blkno_t inode_table_block(struct filsys *fs, ino_t ino) {
+  unsigned int group = ino / fs->super->inodes_per_group;
+  return fs->groups[group].desc->inode_table_block + (ino % fs->super->inodes_per_group) / fs->inodes_per_block;
+}
+
+static struct inode *lookup_inode(struct filsys *fs, ino_t ino) {
+  struct inode *inode;
+
+  for (inode = fs->inode_hash[inode_hash(ino)]; inode; inode = inode->hash_next) {
+    if (inode->ino == ino) return inode;
+  }
+
+  return NULL;
+}
+
+static void lru_remove(struct filsys *fs, struct inode *inode) {
+  if (inode->lru_prev) {
+    inode->lru_prev->lru_next = inode->lru_next;
+  } else {
+    fs->lru_head = inode->lru_next;
+  }
+
+  if (inode->lru_next) {
+    inode->lru_next->lru_prev = inode->lru_prev;
+  } else {
+    fs->lru_tail = inode->lru_prev;
+  }
+
+  inode->lru_next = inode->lru_prev = NULL;
+}
+
+static void lru_append(struct filsys *fs, struct inode *inode) {
+  inode->lru_next = NULL;
+  inode->lru_prev = fs->lru_tail;
+  if (fs->lru_tail) fs->lru_tail->lru_next = inode;
+  fs->lru_tail = inode;
+  if (!fs->lru_head) fs->lru_head = inode;
+}
+
+static void hash_remove(struct filsys *fs, struct inode *inode) {
+  if (inode->hash_prev) {
+    inode->hash_prev->hash_next = inode->hash_next;
+  } else {
+    fs->inode_hash[inode_hash(inode->ino)] = inode->hash_next;
+  }
+  if (inode->hash_next) inode->hash_next->hash_prev = inode->hash_prev;
+}
+
+static void grab_inode(struct inode *inode) {
+  if (inode->refcnt++ == 0) lru_remove(inode->fs, inode);
+}
+
+//
+// shrink_inode_cache
+//
+// Discards the least recently used unreferenced inodes until the cache is
+// within its size limit. Inodes that could not be written back are skipped.
+//
+
+static void shrink_inode_cache(struct filsys *fs) {
+  struct inode *inode;
+  struct inode *next;
+
+  inode = fs->lru_head;
+  while (inode && fs->inodes_cached > fs->inode_cache_size) {
+    next = inode->lru_next;
+    if (!(inode->flags & INODE_DIRTY) && inode->delalloc_count == 0 && inode->prealloc_count == 0) {
+      lru_remove(fs, inode);
+      hash_remove(fs, inode);
+      fs->inodes_cached--;
+      kfree(inode);
+    }
+    inode = next;
+  }
+}
+
+//
+// write_inode
+//
+// Copies the inode descriptor back to the inode table buffer. The caller
+// must hold a reference to the inode.
+//
+
+static int write_inode(struct inode *inode) {
+  struct filsys *fs = inode->fs;
+  struct buf *buf;
+  int rc;
+
+  buf = get_buffer(fs->cache, inode_table_block(fs, inode->ino));
+  if (!buf) return -EIO;
+
+  memcpy((struct inodedesc *) buf->data + (inode->ino % fs->inodes_per_block), inode->desc, sizeof(struct inodedesc));
+  inode->flags &= ~INODE_DIRTY;
+
+  rc = journal_dirty(fs, buf);
+  release_buffer(fs->cache, buf);
+
+  return rc;
+}
+
 struct inode *alloc_inode(struct inode *parent, unsigned short mode) {
   struct thread *thread = kthread_self();
   ino_t ino;
   struct inode *inode;
-  unsigned int group;
-  unsigned int block;
 
   ino = new_inode(parent->fs, parent->ino, mode & S_IFDIR);
   if (ino == NOINODE) return NULL;
 
-  inode = (struct inode *) kmalloc(sizeof(struct inode));
-  if (!inode) return NULL;
-
-  inode->fs = parent->fs;
-  inode->ino = ino;
-
-  group = ino / inode->fs->super->inodes_per_group;
-  block = inode->fs->groups[group].desc->inode_table_block + (ino % inode->fs->super->inodes_per_group) / inode->fs->inodes_per_block;
-
-  inode->buf = get_buffer(inode->fs->cache, block);
-  if (!inode->buf) {
-    kfree(inode);
+  if (get_inode(parent->fs, ino, &inode) < 0) {
+    free_inode(parent->fs, ino);
     return NULL;
   }
-  inode->desc = (struct inodedesc *) (inode->buf->data) + (ino % inode->fs->inodes_per_block);
 
   memset(inode->desc, 0, sizeof(struct inodedesc));
   inode->desc->mode = mode;
@@ -193,6 +1029,13 @@ struct inode *alloc_inode(struct inode *parent, unsigned short mode) {
   inode->desc->uid = thread->euid;
   inode->desc->gid = thread->egid;
   inode->desc->ctime = inode->desc->mtime = kpit_get_time();
+  inode->map_count = 0;
+
+  // Regular files are extent mapped if the file system supports it
+  if (S_ISREG(mode) && (inode->fs->super->incompat_features & DFS_INCOMPAT_EXTENTS)) {
+    inode->desc->flags |= DFS_INODE_FLAG_EXTENTS;
+    init_extent_node(extent_root(inode), sizeof(inode->desc->blockdir), 1);
+  }
 
   mark_inode_dirty(inode);
 
@@ -210,6 +1053,7 @@ int unlink_inode(struct inode *inode) {
   if (rc < 0) return rc;
 
   memset(inode->desc, 0, sizeof(struct inodedesc));
+  mark_inode_dirty(inode);
 
   if (inode->ino >= inode->fs->super->reserved_inodes) {
     free_inode(inode->fs, inode->ino);
@@ -218,37 +1062,167 @@ int unlink_inode(struct inode *inode) {
   return 0;
 }
 
-int get_inode(struct filsys *fs, ino_t ino, struct inode **retval)
-{
+//
+// get_inode
+//
+// Returns a referenced inode from the inode cache, reading the descriptor
+// from the inode table on a cache miss.
+//
+
+int get_inode(struct filsys *fs, ino_t ino, struct inode **retval) {
   struct inode *inode;
-  unsigned int group;
-  unsigned int block;
+  struct buf *buf;
 
   if (ino >= fs->super->inode_count) return -EINVAL;
 
-  inode = (struct inode *) kmalloc(sizeof(struct inode));
-  if (!inode) return -ENOMEM;
+  inode = lookup_inode(fs, ino);
+  if (!inode) {
+    buf = get_buffer(fs->cache, inode_table_block(fs, ino));
+    if (!buf) return -EIO;
+
+    // Another thread may have loaded the inode while we were waiting for the buffer
+    inode = lookup_inode(fs, ino);
+    if (inode) {
+      release_buffer(fs->cache, buf);
+    } else {
+      inode = (struct inode *) kmalloc(sizeof(struct inode));
+      if (!inode) {
+        release_buffer(fs->cache, buf);
+        return -ENOMEM;
+      }
+      memset(inode, 0, sizeof(struct inode));
 
-  inode->fs = fs;
-  inode->ino = ino;
+      inode->fs = fs;
+      inode->ino = ino;
+      inode->desc = &inode->data;
+      memcpy(inode->desc, (struct inodedesc *) buf->data + (ino % fs->inodes_per_block), sizeof(struct inodedesc));
+      release_buffer(fs->cache, buf);
 
-  group = ino / fs->super->inodes_per_group;
-  block = fs->groups[group].desc->inode_table_block + (ino % fs->super->inodes_per_group) / fs->inodes_per_block;
+      inode->hash_next = fs->inode_hash[inode_hash(ino)];
+      if (inode->hash_next) inode->hash_next->hash_prev = inode;
+      fs->inode_hash[inode_hash(ino)] = inode;
+      fs->inodes_cached++;
 
-  inode->buf = get_buffer(fs->cache, block);
-  if (!inode->buf) {
-    kfree(inode);
-    return -EIO;
+      inode->refcnt = 1;
+      shrink_inode_cache(fs);
+
+      *retval = inode;
+      return 0;
+    }
   }
-  inode->desc = (struct inodedesc *) (inode->buf->data) + (ino % fs->inodes_per_block);
+
+  grab_inode(inode);
+
+  // Wait until the blocks of the file have been relocated
+  while (inode->flags & INODE_DEFRAG) kthread_yield();
 
   *retval = inode;
   return 0;
 }
 
 void release_inode(struct inode *inode) {
-  if (inode->buf) release_buffer(inode->fs->cache, inode->buf);
-  kfree(inode);
+  struct filsys *fs = inode->fs;
+
+  // Assign blocks to delayed data and return unused preallocated blocks
+  if (inode->refcnt == 1 && inode->delalloc_count > 0) {
+    if (flush_delalloc(inode) < 0) kprintf(KERN_ERR "dfs: error allocating blocks for inode %d\n", inode->ino);
+  }
+  if (inode->refcnt == 1) discard_prealloc(inode);
+
+  // Write back descriptor before the last reference goes away. The inode
+  // can be grabbed and modified again while the write is in progress.
+  while (inode->refcnt == 1 && (inode->flags & INODE_DIRTY)) {
+    if (write_inode(inode) < 0) {
+      kprintf(KERN_ERR "dfs: error writing inode %d\n", inode->ino);
+      break;
+    }
+  }
+
+  if (--inode->refcnt > 0) return;
+
+  lru_append(fs, inode);
+  shrink_inode_cache(fs);
+}
+
+void stat_inode(struct inode *inode, struct stat64 *buffer) {
+  memset(buffer, 0, sizeof(struct stat64));
+
+  buffer->st_mode = inode->desc->mode;
+  buffer->st_uid = inode->desc->uid;
+  buffer->st_gid = inode->desc->gid;
+  buffer->st_ino = inode->ino;
+  buffer->st_nlink = inode->desc->linkcount;
+  buffer->st_dev = inode->fs->devno;
+
+  buffer->st_atime = kpit_get_time();
+  buffer->st_mtime = inode->desc->mtime;
+  buffer->st_ctime = inode->desc->ctime;
+  buffer->st_size = inode->desc->size;
+}
+
+//
+// sync_inodes
+//
+// Assigns blocks to delayed data and writes all modified inode descriptors
+// back to the inode table.
+//
+
+int sync_inodes(struct filsys *fs) {
+  struct inode *inode;
+  int i;
+  int rc;
+
+  for (i = 0; i < DFS_INODE_HASHSIZE; i++) {
+    inode = fs->inode_hash[i];
+    while (inode) {
+      if ((inode->flags & INODE_DIRTY) || inode->delalloc_count > 0) {
+        grab_inode(inode);
+        rc = flush_delalloc(inode);
+        if (rc == 0) rc = write_inode(inode);
+        release_inode(inode);
+        if (rc < 0) return rc;
+
+        // The hash chain may have changed while writing, rescan it
+        inode = fs->inode_hash[i];
+      } else {
+        inode = inode->hash_next;
+      }
+    }
+  }
+
+  return 0;
+}
+
+//
+// purge_inodes
+//
+// Writes back and discards all cached inodes when the file system is
+// closed.
+//
+
+void purge_inodes(struct filsys *fs) {
+  struct inode *inode;
+  struct inode *next;
+  int i;
+
+  sync_inodes(fs);
+
+  for (i = 0; i < DFS_INODE_HASHSIZE; i++) {
+    for (inode = fs->inode_hash[i]; inode; inode = next) {
+      next = inode->hash_next;
+      if (inode->refcnt > 0) {
+        kprintf(KERN_WARNING "dfs: inode %d still in use\n", inode->ino);
+        continue;
+      }
+
+      discard_prealloc(inode);
+      discard_delalloc(inode);
+      lru_remove(fs, inode);
+      hash_remove(fs, inode);
+      fs->inodes_cached--;
+      kfree(inode);
+    }
+  }
 }
 
 blkno_t expand_inode(struct inode *inode)
@@ -258,6 +1232,8 @@ blkno_t expand_inode(struct inode *inode)
   unsigned int i;
   struct buf *buf;
 
+  if (is_extent_mapped(inode)) return append_extent_block(inode, NOBLOCK);
+
   // Increase depth of block directory tree if tree is full
   maxblocks = DFS_TOPBLOCKDIR_SIZE * (1 << (inode->desc->depth * inode->fs->log_blkptrs_per_block));
   if (inode->desc->blocks == maxblocks) {
@@ -278,7 +1254,7 @@ blkno_t expand_inode(struct inode *inode)
     inode->desc->blockdir[0] = dirblock;
     inode->desc->depth++;
 
-    mark_buffer_updated(inode->fs->cache, buf);
+    journal_dirty(inode->fs, buf);
     mark_inode_dirty(inode);
     release_buffer(inode->fs->cache, buf);
   }
@@ -309,10 +1285,19 @@ int truncate_inode(struct inode *inode, unsigned int blocks) {
   // Check arguments
   if (blocks > inode->desc->blocks) return -EINVAL;
 
+  // Drop delayed data and preallocated blocks past the end of the file
+  discard_delalloc(inode);
+  discard_prealloc(inode);
+
   // Check for no-op case
   if (blocks == inode->desc->blocks) return 0;
   if (inode->desc->blocks == 0) return 0;
 
+  // Blocks are going away, invalidate cached runs
+  inode->fs->map_gen++;
+
+  if (is_extent_mapped(inode)) return truncate_extents(inode, blocks);
+
   // If depth 0 we just have to free blocks from top directory
   if (inode->desc->depth == 0) {
     remove_blocks(inode->fs, inode->desc->blockdir + blocks, inode->desc->blocks - blocks);
@@ -360,7 +1345,7 @@ int truncate_inode(struct inode *inode, unsigned int blocks) {
           free_blocks(inode->fs, &(buf[d]->blkno), 1);
           mark_buffer_invalid(inode->fs->cache, buf[d]);
         } else {
-          mark_buffer_updated(inode->fs->cache, buf[d]);
+          journal_dirty(inode->fs, buf[d]);
           break;
         }
       }
@@ -373,7 +1358,7 @@ int truncate_inode(struct inode *inode, unsigned int blocks) {
     } else {
       // Remove range of blocks in leaf directory page
       remove_blocks(inode->fs, (blkno_t *) buf[d]->data + offsets[d] + 1 - blocksleft, blocksleft);
-      mark_buffer_updated(inode->fs->cache, buf[d]);
+      journal_dirty(inode->fs, buf[d]);
 
       iblock -= blocksleft;
       blocksleft = 0;
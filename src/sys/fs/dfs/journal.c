@@ -0,0 +1,861 @@
+//
+// journal.c
+//
+// Disk filesystem metadata journal
+//
+// Copyright (C) 2002 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+//
+
+#include <os/krnl.h>
+#include <os/dfs.h>
+#include <os/buf.h>
+
+//
+// Only metadata is journaled: group descriptors, bitmaps, inode table
+// blocks, directory blocks and block map and extent tree nodes. File data
+// is written in place by the buffer cache as before.
+//
+// Metadata buffers changed by the running transaction are pinned in the
+// buffer cache. A commit copies them to the log with one sequential write
+// and unpins them, after which the lazy writer writes them to their home
+// location. When more than half of the log is in use, the journal is
+// checkpointed: all committed metadata is written in place and the log is
+// emptied.
+//
+
+#define JOURNAL_IOSIZE          (64 * 1024)
+
+static unsigned long crctab[256];
+
+static void init_crc() {
+  unsigned long c;
+  int n, k;
+
+  for (n = 0; n < 256; n++) {
+    c = (unsigned long) n;
+    for (k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crctab[n] = c;
+  }
+}
+
+static unsigned long update_crc(unsigned long crc, unsigned char *p, int len) {
+  while (len-- > 0) crc = crctab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+static unsigned int next_pos(struct journal *j, unsigned int pos) {
+  return pos == j->last ? j->first : pos + 1;
+}
+
+static int journal_io(struct filsys *fs, void *data, unsigned int pos, int blocks, int write) {
+  struct journal *j = fs->journal;
+  blkno_t blk = j->block + pos;
+  int size = blocks * fs->blocksize;
+  int rc;
+
+  if (write) {
+    rc = kdev_write(fs->devno, data, size, blk * fs->cache->blks_per_buffer, 0);
+  } else {
+    rc = kdev_read(fs->devno, data, size, blk * fs->cache->blks_per_buffer, 0);
+  }
+
+  if (rc < 0) return rc;
+  return rc == size ? 0 : -EIO;
+}
+
+static int write_journal_super(struct filsys *fs) {
+  struct journal *j = fs->journal;
+
+  j->super->hdr.seq = j->seq;
+  j->super->start = j->start;
+  return journal_io(fs, j->super, 0, 1, 1);
+}
+
+//
+// Block records
+//
+
+static struct jrecord *find_record(struct journal *j, blkno_t block) {
+  struct jrecord *rec = j->records[block % DFS_JOURNAL_HASHSIZE];
+
+  while (rec && rec->block != block) rec = rec->next;
+  return rec;
+}
+
+static struct jrecord *add_record(struct journal *j, blkno_t block) {
+  struct jrecord *rec;
+  int h = block % DFS_JOURNAL_HASHSIZE;
+
+  rec = find_record(j, block);
+  if (rec) return rec;
+
+  rec = (struct jrecord *) kmalloc(sizeof(struct jrecord));
+  if (!rec) return NULL;
+  rec->block = block;
+  rec->seq = 0;
+  rec->revoked = 0;
+  rec->next = j->records[h];
+  j->records[h] = rec;
+
+  return rec;
+}
+
+static void clear_records(struct journal *j) {
+  struct jrecord *rec;
+  struct jrecord *next;
+  int i;
+
+  for (i = 0; i < DFS_JOURNAL_HASHSIZE; i++) {
+    for (rec = j->records[i]; rec; rec = next) {
+      next = rec->next;
+      kfree(rec);
+    }
+    j->records[i] = NULL;
+  }
+}
+
+//
+// Log writing
+//
+// Log blocks are collected in a staging buffer and written to the device
+// when the buffer is full or the log wraps around.
+//
+
+static int flush_log(struct filsys *fs) {
+  struct journal *j = fs->journal;
+  int rc;
+
+  if (j->iocount == 0) return 0;
+  rc = journal_io(fs, j->iobuf, j->iostart, j->iocount, 1);
+  j->iocount = 0;
+  return rc;
+}
+
+static char *append_log(struct filsys *fs) {
+  struct journal *j = fs->journal;
+  char *block;
+
+  if (j->iocount == 0) j->iostart = j->head;
+  block = j->iobuf + j->iocount * fs->blocksize;
+  j->iocount++;
+  j->head = next_pos(j, j->head);
+  j->used++;
+
+  return block;
+}
+
+static int end_log_block(struct filsys *fs, char *block) {
+  struct journal *j = fs->journal;
+
+  j->crc = update_crc(j->crc, (unsigned char *) block, fs->blocksize);
+  if (j->iocount == j->iosize || j->head == j->first) return flush_log(fs);
+  return 0;
+}
+
+static int log_space(struct filsys *fs, int tags, int blocks) {
+  int tags_per_desc = (fs->blocksize - sizeof(struct jdesc)) / sizeof(struct jtag);
+
+  return (tags + tags_per_desc - 1) / tags_per_desc + blocks + 1;
+}
+
+static int log_size(struct journal *j) {
+  return j->last - j->first + 1;
+}
+
+//
+// checkpoint
+//
+// Writes all committed metadata to its home location and empties the log.
+// Must be called by the committer with no buffers pinned.
+//
+
+static int checkpoint(struct filsys *fs) {
+  struct journal *j = fs->journal;
+  int rc;
+
+  rc = flush_buffers(fs->cache, 0);
+  if (rc < 0) return rc;
+
+  rc = sync_buffers(fs->cache, 0);
+  if (rc < 0) return rc;
+
+  rc = kdev_ioctl(fs->devno, IOCTL_FLUSH, NULL, 0);
+  if (rc < 0 && rc != -ENOSYS) return rc;
+
+  j->start = 0;
+  j->used = 0;
+  clear_records(j);
+
+  rc = write_journal_super(fs);
+  if (rc < 0) return rc;
+
+  rc = kdev_ioctl(fs->devno, IOCTL_FLUSH, NULL, 0);
+  if (rc < 0 && rc != -ENOSYS) return rc;
+
+  return 0;
+}
+
+//
+// write_transaction
+//
+// Writes descriptor blocks, block copies and the commit block of the
+// running transaction to the log and unpins the buffers.
+//
+
+static int write_transaction(struct filsys *fs) {
+  struct journal *j = fs->journal;
+  int tags_per_desc = (fs->blocksize - sizeof(struct jdesc)) / sizeof(struct jtag);
+  struct jrecord *rec;
+  struct jdesc *desc;
+  struct jcommit *commit;
+  struct buf *buf;
+  unsigned int start;
+  int blocks;
+  int ntags;
+  int i, r, n;
+  int rc;
+
+  // Drop buffers that have been freed by the transaction
+  n = 0;
+  for (i = 0; i < j->count; i++) {
+    buf = j->bufs[i];
+    rec = find_record(j, buf->blkno);
+    if (buf->state != BUF_STATE_UPDATED || (rec && rec->revoked)) {
+      unpin_buffer(fs->cache, buf);
+    } else {
+      j->bufs[n++] = buf;
+    }
+  }
+  j->count = n;
+
+  if (j->count == 0 && j->nrevokes == 0 && !j->error) return 0;
+
+  // Fall back to writing in place if the transaction does not fit in the log
+  // or some of its changes could not be recorded
+  if (j->error || log_space(fs, j->count + j->nrevokes, j->count) > log_size(j) - (int) j->used) {
+    if (!j->error) kprintf(KERN_WARNING "dfs: transaction %d too large for journal\n", j->seq);
+    for (i = 0; i < j->count; i++) unpin_buffer(fs->cache, j->bufs[i]);
+    j->count = 0;
+    j->nrevokes = 0;
+    j->error = 0;
+    j->seq++;
+    return checkpoint(fs);
+  }
+
+  start = j->head;
+  blocks = 0;
+  j->crc = 0xFFFFFFFF;
+  i = r = 0;
+  rc = 0;
+  while (rc == 0 && (i < j->count || r < j->nrevokes)) {
+    int first = i;
+
+    // Build descriptor block for the next group of tags
+    desc = (struct jdesc *) append_log(fs);
+    memset(desc, 0, fs->blocksize);
+    desc->hdr.magic = DFS_JOURNAL_MAGIC;
+    desc->hdr.type = JOURNAL_DESCRIPTOR;
+    desc->hdr.seq = j->seq;
+    ntags = 0;
+    while (ntags < tags_per_desc && i < j->count) {
+      desc->tag[ntags].block = j->bufs[i++]->blkno;
+      desc->tag[ntags++].flags = 0;
+    }
+    while (ntags < tags_per_desc && i == j->count && r < j->nrevokes) {
+      desc->tag[ntags].block = j->revokes[r++];
+      desc->tag[ntags++].flags = JOURNAL_TAG_REVOKE;
+    }
+    desc->count = ntags;
+    rc = end_log_block(fs, (char *) desc);
+    blocks++;
+
+    // Copy the tagged blocks
+    for (n = first; rc == 0 && n < i; n++) {
+      char *block = append_log(fs);
+
+      memcpy(block, j->bufs[n]->data, fs->blocksize);
+      rc = end_log_block(fs, block);
+      blocks++;
+    }
+  }
+
+  if (rc == 0) {
+    // Commit block is written with the rest of the transaction. A torn write
+    // is detected by the checksum on replay.
+    commit = (struct jcommit *) append_log(fs);
+    memset(commit, 0, fs->blocksize);
+    commit->hdr.magic = DFS_JOURNAL_MAGIC;
+    commit->hdr.type = JOURNAL_COMMIT;
+    commit->hdr.seq = j->seq;
+    commit->blocks = blocks;
+    commit->checksum = (unsigned int) (j->crc ^ 0xFFFFFFFF);
+    j->crc = 0;
+    rc = flush_log(fs);
+  }
+
+  // The first transaction after a checkpoint is recorded in the header
+  if (rc == 0 && j->start == 0) {
+    j->start = start;
+    rc = write_journal_super(fs);
+  }
+
+  if (rc == 0) {
+    rc = kdev_ioctl(fs->devno, IOCTL_FLUSH, NULL, 0);
+    if (rc == -ENOSYS) rc = 0;
+  }
+
+  if (rc < 0) kprintf(KERN_ERR "dfs: error %d writing transaction %d to journal\n", rc, j->seq);
+
+  // Record the logged and revoked blocks and release the buffers
+  for (i = 0; i < j->count; i++) {
+    rec = find_record(j, j->bufs[i]->blkno);
+    if (rec) rec->seq = j->seq;
+    unpin_buffer(fs->cache, j->bufs[i]);
+  }
+  for (r = 0; r < j->nrevokes; r++) {
+    rec = find_record(j, j->revokes[r]);
+    if (rec) {
+      rec->seq = j->seq;
+      rec->revoked = 0;
+    }
+  }
+
+  j->count = 0;
+  j->nrevokes = 0;
+  j->seq++;
+
+  return rc;
+}
+
+//
+// journal_commit
+//
+// Commits the running transaction. Operations that hold the file system
+// lock are kept out by taking the lock, and operations holding a journal
+// handle are allowed to finish first. Modified inodes and delayed data are
+// then written back as part of the transaction.
+//
+
+int journal_commit(struct filsys *fs) {
+  struct journal *j = fs->journal;
+  struct thread *self = kthread_self();
+  int rc;
+
+  if (!j) return 0;
+
+  // Syncing the buffer cache during checkpoint calls back into the commit
+  if (j->committer == self) return 0;
+
+  // Only one commit at a time
+  wait_for_object(&j->commit_lock, INFINITE);
+  j->committer = self;
+
+  if (fs->vfs) wait_for_object(&fs->vfs->exclusive, INFINITE);
+  j->closing = 1;
+  reset_event(&j->open);
+  while (j->handles) wait_for_object(&j->idle, INFINITE);
+
+  rc = sync_inodes(fs);
+  if (rc == 0) rc = write_transaction(fs);
+
+  // Blocks freed by the transaction can now be reused
+  if (rc == 0) release_freed_blocks(fs);
+  if (rc == 0 && j->used > (unsigned int) log_size(j) / 2) rc = checkpoint(fs);
+
+  j->closing = 0;
+  set_event(&j->open);
+  if (fs->vfs) release_mutex(&fs->vfs->exclusive);
+  j->committer = NULL;
+  release_mutex(&j->commit_lock);
+
+  return rc;
+}
+
+//
+// Handles
+//
+// File operations that run without the file system lock hold a handle
+// while they change metadata. Nested handles in the same thread join the
+// outer handle. New handles wait while a transaction is being committed
+// and when the running transaction is full. A full transaction is
+// committed by the last handle to leave it.
+//
+
+void journal_start(struct filsys *fs, struct jhandle *h) {
+  struct journal *j = fs->journal;
+  struct jhandle *outer;
+
+  h->thread = kthread_self();
+  if (!j) return;
+
+  for (outer = j->handles; outer; outer = outer->next) {
+    if (outer->thread == h->thread) break;
+  }
+
+  if (!outer && j->committer != h->thread) {
+    while (j->closing || j->count >= j->limit) {
+      if (j->closing) {
+        wait_for_object(&j->open, INFINITE);
+      } else if (j->handles) {
+        wait_for_object(&j->idle, INFINITE);
+      } else {
+        journal_commit(fs);
+      }
+    }
+  }
+
+  h->next = j->handles;
+  j->handles = h;
+  reset_event(&j->idle);
+}
+
+void journal_stop(struct filsys *fs, struct jhandle *h) {
+  struct journal *j = fs->journal;
+  struct jhandle **hp;
+
+  if (!j) return;
+
+  for (hp = &j->handles; *hp; hp = &(*hp)->next) {
+    if (*hp == h) {
+      *hp = h->next;
+      break;
+    }
+  }
+
+  if (j->handles) return;
+  set_event(&j->idle);
+
+  // The last operation to leave a full transaction commits it
+  if (!j->closing && j->count >= j->limit) journal_commit(fs);
+}
+
+//
+// journal_dirty
+//
+// Marks a metadata buffer as updated and adds it to the running
+// transaction. Without a journal this is the same as mark_buffer_updated.
+// If the buffer cannot be added, the error is returned and the transaction
+// is written in place when it is committed, like a transaction that is too
+// large for the log.
+//
+
+static int transaction_error(struct journal *j, int rc) {
+  if (!j->error) kprintf(KERN_ERR "dfs: error %d adding to journal transaction %d\n", rc, j->seq);
+  j->error = rc;
+  return rc;
+}
+
+int journal_dirty(struct filsys *fs, struct buf *buf) {
+  struct journal *j = fs->journal;
+  struct jrecord *rec;
+  struct buf **bufs;
+  int r;
+
+  mark_buffer_updated(fs->cache, buf);
+  if (!j) return 0;
+
+  rec = add_record(j, buf->blkno);
+  if (!rec) return transaction_error(j, -ENOMEM);
+
+  // A block freed and reused by the same transaction is logged again
+  if (rec->revoked) {
+    for (r = 0; r < j->nrevokes; r++) {
+      if (j->revokes[r] == buf->blkno) {
+        j->revokes[r] = j->revokes[--j->nrevokes];
+        break;
+      }
+    }
+    rec->revoked = 0;
+  }
+
+  // Only the journal pins buffers, so pinned buffers are already in the
+  // running transaction
+  if (buf->pins > 0) return 0;
+
+  if (j->count == j->maxbufs) {
+    bufs = (struct buf **) krealloc(j->bufs, j->maxbufs * 2 * sizeof(struct buf *));
+    if (!bufs) return transaction_error(j, -ENOMEM);
+    j->bufs = bufs;
+    j->maxbufs *= 2;
+  }
+
+  pin_buffer(fs->cache, buf);
+  j->bufs[j->count++] = buf;
+  return 0;
+}
+
+//
+// journal_revoke
+//
+// Called when a block is freed. If the block may have a copy in the log,
+// a revoke tag is added to the running transaction, so the copy is not
+// replayed over whatever the block is used for next.
+//
+
+int journal_revoke(struct filsys *fs, blkno_t block) {
+  struct journal *j = fs->journal;
+  struct jrecord *rec;
+  blkno_t *revokes;
+
+  if (!j) return 0;
+  rec = find_record(j, block);
+  if (!rec || rec->revoked) return 0;
+
+  // Writing the transaction in place empties the log, so a revoke that
+  // cannot be recorded is not needed
+  if (j->nrevokes == j->maxrevokes) {
+    revokes = (blkno_t *) krealloc(j->revokes, j->maxrevokes * 2 * sizeof(blkno_t));
+    if (!revokes) return transaction_error(j, -ENOMEM);
+    j->revokes = revokes;
+    j->maxrevokes *= 2;
+  }
+
+  j->revokes[j->nrevokes++] = block;
+  rec->revoked = 1;
+  return 0;
+}
+
+//
+// Replay
+//
+// The log is scanned from the first transaction for transactions with
+// consecutive sequence numbers and valid checksums. The first pass finds
+// the valid transactions, the second collects revoked blocks and the third
+// writes the block copies to their home locations through the buffer cache.
+//
+
+static int read_log(struct filsys *fs, unsigned int pos, char *data) {
+  return journal_io(fs, data, pos, 1, 0);
+}
+
+static int scan_transaction(struct filsys *fs, unsigned int *pos, unsigned int seq, char *data) {
+  struct journal *j = fs->journal;
+  struct jheader *hdr = (struct jheader *) data;
+  struct jdesc *desc = (struct jdesc *) data;
+  struct jcommit *commit = (struct jcommit *) data;
+  int tags_per_desc = (fs->blocksize - sizeof(struct jdesc)) / sizeof(struct jtag);
+  unsigned long crc = 0xFFFFFFFF;
+  unsigned int p = *pos;
+  unsigned int blocks = 0;
+  unsigned int copies;
+  unsigned int i;
+
+  while (blocks < (unsigned int) log_size(j)) {
+    if (read_log(fs, p, data) < 0) return 0;
+    if (hdr->magic != DFS_JOURNAL_MAGIC || hdr->seq != seq) return 0;
+
+    if (hdr->type == JOURNAL_COMMIT) {
+      if (commit->blocks != blocks || commit->checksum != (unsigned int) (crc ^ 0xFFFFFFFF)) return 0;
+      *pos = next_pos(j, p);
+      return 1;
+    }
+
+    if (hdr->type != JOURNAL_DESCRIPTOR || desc->count > (unsigned int) tags_per_desc) return 0;
+    copies = 0;
+    for (i = 0; i < desc->count; i++) {
+      if (!(desc->tag[i].flags & JOURNAL_TAG_REVOKE)) copies++;
+    }
+    crc = update_crc(crc, (unsigned char *) data, fs->blocksize);
+    p = next_pos(j, p);
+    blocks++;
+
+    while (copies-- > 0) {
+      if (read_log(fs, p, data) < 0) return 0;
+      crc = update_crc(crc, (unsigned char *) data, fs->blocksize);
+      p = next_pos(j, p);
+      blocks++;
+    }
+  }
+
+  return 0;
+}
+
+static int replay_pass(struct filsys *fs, unsigned int seq, unsigned int end, int pass, char *data, char *copy) {
+  struct journal *j = fs->journal;
+  struct jdesc *desc = (struct jdesc *) data;
+  struct jrecord *rec;
+  struct buf *buf;
+  unsigned int pos = j->start;
+  unsigned int i;
+  int replayed = 0;
+  int rc;
+
+  for (; seq != end; seq++) {
+    while (1) {
+      rc = read_log(fs, pos, data);
+      if (rc < 0) return rc;
+      pos = next_pos(j, pos);
+      if (desc->hdr.type == JOURNAL_COMMIT) break;
+
+      for (i = 0; i < desc->count; i++) {
+        if (desc->tag[i].flags & JOURNAL_TAG_REVOKE) {
+          if (pass == 1) {
+            rec = add_record(j, desc->tag[i].block);
+            if (!rec) return -ENOMEM;
+            rec->seq = seq;
+          }
+          continue;
+        }
+
+        if (pass == 2) {
+          // Skip blocks revoked by this or a later transaction
+          rec = find_record(j, desc->tag[i].block);
+          if (!rec || rec->seq < seq) {
+            rc = read_log(fs, pos, copy);
+            if (rc < 0) return rc;
+
+            buf = alloc_buffer(fs->cache, desc->tag[i].block);
+            if (!buf) return -EIO;
+            memcpy(buf->data, copy, fs->blocksize);
+            mark_buffer_updated(fs->cache, buf);
+            release_buffer(fs->cache, buf);
+            replayed++;
+          }
+        }
+        pos = next_pos(j, pos);
+      }
+    }
+  }
+
+  return replayed;
+}
+
+static int replay_journal(struct filsys *fs) {
+  struct journal *j = fs->journal;
+  unsigned int pos;
+  unsigned int seq;
+  unsigned int i;
+  char *data;
+  char *copy;
+  int rc;
+
+  data = (char *) kmalloc(fs->blocksize * 2);
+  if (!data) return -ENOMEM;
+  copy = data + fs->blocksize;
+
+  // Find the last valid transaction
+  pos = j->start;
+  seq = j->seq;
+  while (scan_transaction(fs, &pos, seq, data)) seq++;
+
+  // Collect revoked blocks and replay the valid transactions
+  rc = replay_pass(fs, j->seq, seq, 1, data, copy);
+  if (rc >= 0) rc = replay_pass(fs, j->seq, seq, 2, data, copy);
+  kfree(data);
+  clear_records(j);
+  if (rc < 0) return rc;
+
+  kprintf("dfs: replayed %d blocks from %d transactions\n", rc, seq - j->seq);
+
+  // Free counts in the super block are not journaled
+  fs->super->free_block_count = 0;
+  fs->super->free_inode_count = 0;
+  for (i = 0; i < fs->super->group_count; i++) {
+    fs->super->free_block_count += fs->groups[i].desc->free_block_count;
+    fs->super->free_inode_count += fs->groups[i].desc->free_inode_count;
+  }
+  fs->super_dirty = 1;
+
+  // Skip the sequence number of a transaction that may be partially written
+  j->seq = seq + 1;
+
+  // Write the replayed blocks and empty the log
+  j->committer = kthread_self();
+  rc = checkpoint(fs);
+  j->committer = NULL;
+
+  return rc;
+}
+
+//
+// create_journal
+//
+// Reserves a run of blocks for the journal and writes an empty journal
+// header.
+//
+
+int create_journal(struct filsys *fs, unsigned int blocks) {
+  struct jsuper *jsb;
+  blkno_t start;
+  blkno_t blk;
+  int n;
+  int rc;
+
+  if (blocks > fs->super->block_count / 16) blocks = fs->super->block_count / 16;
+  if (blocks < DFS_JOURNAL_MIN) return -ENOSPC;
+
+  // Place the journal in the middle of the disk, or in the nearest group
+  // with a free run that can hold it
+  start = find_free_run(fs, fs->super->group_count / 2 * fs->super->blocks_per_group, blocks);
+  if (start == NOBLOCK) return -ENOSPC;
+  n = new_blocks(fs, start, blocks, &start);
+  if (n < 0) return n;
+  if ((unsigned int) n < blocks) {
+    for (blk = start; blk < start + n; blk++) free_blocks(fs, &blk, 1);
+    return -ENOSPC;
+  }
+
+  jsb = (struct jsuper *) kmalloc(fs->blocksize);
+  if (!jsb) return -ENOMEM;
+  memset(jsb, 0, fs->blocksize);
+  jsb->hdr.magic = DFS_JOURNAL_MAGIC;
+  jsb->hdr.type = JOURNAL_HEADER;
+  jsb->hdr.seq = 1;
+  jsb->blocksize = fs->blocksize;
+  jsb->first = 1;
+  jsb->last = blocks - 1;
+  jsb->start = 0;
+
+  rc = kdev_write(fs->devno, jsb, fs->blocksize, start * fs->cache->blks_per_buffer, 0);
+  kfree(jsb);
+  if (rc < 0) return rc;
+
+  fs->super->journal_block = start;
+  fs->super->journal_blocks = blocks;
+  set_incompat_feature(fs, DFS_INCOMPAT_JOURNAL);
+
+  return 0;
+}
+
+//
+// open_journal
+//
+// Reads the journal header, replays committed transactions left by an
+// unclean shutdown and starts the first transaction.
+//
+
+static void free_journal(struct filsys *fs) {
+  struct journal *j = fs->journal;
+
+  fs->journal = NULL;
+  clear_records(j);
+  if (j->super) kfree(j->super);
+  if (j->iobuf) kfree(j->iobuf);
+  if (j->bufs) kfree(j->bufs);
+  if (j->revokes) kfree(j->revokes);
+  kfree(j);
+}
+
+int open_journal(struct filsys *fs) {
+  struct journal *j;
+  int rc;
+
+  if (!(fs->super->incompat_features & DFS_INCOMPAT_JOURNAL)) return 0;
+  if (!crctab[1]) init_crc();
+
+  j = (struct journal *) kmalloc(sizeof(struct journal));
+  if (!j) return -ENOMEM;
+  memset(j, 0, sizeof(struct journal));
+  j->block = fs->super->journal_block;
+  init_mutex(&j->commit_lock, 0);
+  init_event(&j->idle, 1, 1);
+  init_event(&j->open, 1, 1);
+
+  j->super = (struct jsuper *) kmalloc(fs->blocksize);
+  j->iosize = JOURNAL_IOSIZE / fs->blocksize;
+  if (j->iosize == 0) j->iosize = 1;
+  j->iobuf = (char *) kmalloc(j->iosize * fs->blocksize);
+  j->maxbufs = 64;
+  j->bufs = (struct buf **) kmalloc(j->maxbufs * sizeof(struct buf *));
+  j->maxrevokes = 64;
+  j->revokes = (blkno_t *) kmalloc(j->maxrevokes * sizeof(blkno_t));
+  fs->journal = j;
+  if (!j->super || !j->iobuf || !j->bufs || !j->revokes) {
+    free_journal(fs);
+    return -ENOMEM;
+  }
+
+  rc = journal_io(fs, j->super, 0, 1, 0);
+  if (rc < 0) {
+    free_journal(fs);
+    return rc;
+  }
+
+  if (j->super->hdr.magic != DFS_JOURNAL_MAGIC || j->super->hdr.type != JOURNAL_HEADER ||
+      j->super->blocksize != fs->blocksize || j->super->first < 1 ||
+      j->super->last >= fs->super->journal_blocks || j->super->first > j->super->last) {
+    kprintf(KERN_ERR "dfs: invalid journal on device %s\n", kdev_get(fs->devno)->name);
+    free_journal(fs);
+    return -EIO;
+  }
+
+  j->first = j->super->first;
+  j->last = j->super->last;
+  j->start = j->super->start;
+  j->seq = j->super->hdr.seq;
+  j->head = j->first;
+
+  // Transactions are limited to a quarter of the log and the buffer cache
+  j->limit = log_size(j) / 4;
+  if (j->limit > fs->cache->poolsize / 4) j->limit = fs->cache->poolsize / 4;
+  if (j->limit < 1) j->limit = 1;
+
+  if (j->start != 0) {
+    if (j->start < j->first || j->start > j->last) {
+      kprintf(KERN_ERR "dfs: invalid journal on device %s\n", kdev_get(fs->devno)->name);
+      free_journal(fs);
+      return -EIO;
+    }
+
+    rc = replay_journal(fs);
+    if (rc < 0) {
+      kprintf(KERN_ERR "dfs: error %d replaying journal on device %s\n", rc, kdev_get(fs->devno)->name);
+      free_journal(fs);
+      return rc;
+    }
+  }
+
+  return 0;
+}
+
+//
+// close_journal
+//
+// Commits the running transaction, checkpoints the log, so the journal is
+// empty on a clean unmount, and frees the journal.
+//
+
+int close_journal(struct filsys *fs) {
+  struct journal *j = fs->journal;
+  int rc;
+
+  if (!j) return 0;
+
+  rc = journal_commit(fs);
+  if (rc == 0 && j->start != 0) {
+    wait_for_object(&j->commit_lock, INFINITE);
+    j->committer = kthread_self();
+    rc = checkpoint(fs);
+    j->committer = NULL;
+    release_mutex(&j->commit_lock);
+  }
+
+  release_freed_blocks(fs);
+  free_journal(fs);
+  return rc;
+}
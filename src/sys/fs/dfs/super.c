@@ -41,6 +41,10 @@
 #define DEFAULT_CACHE_BUFFERS   1024
 #define DEFAULT_RESERVED_BLOCKS 16
 #define DEFAULT_RESERVED_INODES 16
+#define DEFAULT_INODE_CACHE     512
+#define DEFAULT_PREALLOC        64
+#define DEFAULT_DELALLOC        256
+#define DEFAULT_JOURNAL_BLOCKS  1024
 
 #define FORMAT_BLOCKSIZE        (64 * 1024)
 
@@ -62,6 +66,14 @@ static int log2(int n) {
 static void dfs_sync(void *arg) {
   struct filsys *fs = (struct filsys *) arg;
 
+  if (fs->journal) {
+    // Commit modified inodes and metadata to the journal
+    journal_commit(fs);
+  } else {
+    // Write back modified inodes to the inode table
+    sync_inodes(fs);
+  }
+
   // Write super block
   if (fs->super_dirty) {
     kdev_write(fs->devno, fs->super, SECTORSIZE, 1, 0);
@@ -69,17 +81,34 @@ static void dfs_sync(void *arg) {
   }
 }
 
+void set_incompat_feature(struct filsys *fs, unsigned int feature) {
+  fs->super->incompat_features |= feature;
+  fs->super->version = DFS_VERSION;
+  fs->super_dirty = 1;
+}
+
 static int parse_options(char *opts, struct fsoptions *fsopts) {
   fsopts->cache = get_num_option(opts, "cache", 0);
   fsopts->blocksize = get_num_option(opts, "blocksize", DEFAULT_BLOCKSIZE);
   fsopts->inode_ratio = get_num_option(opts, "inoderatio", DEFAULT_INODE_RATIO);
   fsopts->reserved_blocks = get_num_option(opts, "resvblks", DEFAULT_RESERVED_BLOCKS);
   fsopts->reserved_inodes = get_num_option(opts, "resvinodes", DEFAULT_RESERVED_INODES);
+  fsopts->inode_cache = get_num_option(opts, "inodecache", DEFAULT_INODE_CACHE);
+  fsopts->prealloc = get_num_option(opts, "prealloc", DEFAULT_PREALLOC);
+  fsopts->delalloc = get_num_option(opts, "delalloc", DEFAULT_DELALLOC);
+  fsopts->journal = get_num_option(opts, "journal", DEFAULT_JOURNAL_BLOCKS);
+  if (fsopts->journal == 0) fsopts->journal = DEFAULT_JOURNAL_BLOCKS;
 
   fsopts->flags = 0;
   if (get_option(opts, "quick", NULL, 0, NULL)) fsopts->flags |= FSOPT_QUICK;
   if (get_option(opts, "progress", NULL, 0, NULL)) fsopts->flags |= FSOPT_PROGRESS;
   if (get_option(opts, "format", NULL, 0, NULL)) fsopts->flags |= FSOPT_FORMAT;
+  if (get_option(opts, "nodirindex", NULL, 0, NULL)) fsopts->flags |= FSOPT_NODIRINDEX;
+  if (get_option(opts, "dirindex", NULL, 0, NULL)) fsopts->flags |= FSOPT_DIRINDEX;
+  if (get_option(opts, "noextents", NULL, 0, NULL)) fsopts->flags |= FSOPT_NOEXTENTS;
+  if (get_option(opts, "extents", NULL, 0, NULL)) fsopts->flags |= FSOPT_EXTENTS;
+  if (get_option(opts, "nojournal", NULL, 0, NULL)) fsopts->flags |= FSOPT_NOJOURNAL;
+  if (get_option(opts, "journal", NULL, 0, NULL)) fsopts->flags |= FSOPT_JOURNAL;
 
   return 0;
 }
@@ -115,12 +144,17 @@ static struct filsys *create_filesystem(char *devname, struct fsoptions *fsopts)
 
   // Set device number and block size
   fs->devno = devno;
+  fs->inode_cache_size = fsopts->inode_cache;
+  fs->prealloc_limit = fsopts->prealloc;
+  fs->delalloc_limit = fsopts->delalloc;
   fs->blocksize = fsopts->blocksize;
 
   // Set signature, version and block size in super block
   fs->super->signature = DFS_SIGNATURE;
-  fs->super->version = DFS_VERSION;
+  fs->super->version = DFS_VERSION_NOINCOMPAT;
   fs->super->log_block_size = log2(fsopts->blocksize);
+  if (!(fsopts->flags & FSOPT_NODIRINDEX)) set_incompat_feature(fs, DFS_INCOMPAT_DIRINDEX);
+  if (!(fsopts->flags & FSOPT_NOEXTENTS)) set_incompat_feature(fs, DFS_INCOMPAT_EXTENTS);
 
   // Each group has as many blocks as can be represented by the block bitmap block
   fs->super->blocks_per_group = fs->blocksize * 8;
@@ -216,7 +250,7 @@ static struct filsys *create_filesystem(char *devname, struct fsoptions *fsopts)
 
   // Allocate group descriptors
   fs->groupdesc_buffers = (struct buf **) kmalloc(sizeof(struct buf *) * fs->groupdesc_blocks);
-  fs->groups = (struct blkgroup *) kmalloc(sizeof(struct group) * fs->super->group_count);
+  fs->groups = (struct blkgroup *) kmalloc(sizeof(struct blkgroup) * fs->super->group_count);
 
   for (i = 0; i < fs->groupdesc_blocks; i++) {
     fs->groupdesc_buffers[i] = alloc_buffer(fs->cache, fs->super->groupdesc_table_block + i);
@@ -228,8 +262,11 @@ static struct filsys *create_filesystem(char *devname, struct fsoptions *fsopts)
     gd += (i % fs->groupdescs_per_block);
 
     fs->groups[i].desc = gd;
-    fs->groups[i].first_free_block = 0;
     fs->groups[i].first_free_inode = 0;
+    fs->groups[i].nruns = -1;
+    fs->groups[i].committed = NULL;
+    fs->groups[i].reserved = NULL;
+    fs->groups[i].nreserved = 0;
   }
 
   // Reserve inode for root directory
@@ -313,12 +350,19 @@ static struct filsys *create_filesystem(char *devname, struct fsoptions *fsopts)
   root->desc->mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
   root->desc->ctime = root->desc->mtime = kpit_get_time();
   root->desc->linkcount = 1;
-  mark_buffer_updated(fs->cache, root->buf);
+  mark_inode_dirty(root);
   release_inode(root);
 
+  // Reserve blocks for the metadata journal
+  if (!(fsopts->flags & FSOPT_NOJOURNAL) && create_journal(fs, fsopts->journal) < 0) {
+    kprintf(KERN_WARNING "dfs: no room for journal on device %s\n", devname);
+  }
+
   // Reenable buffer cache sync
   fs->cache->nosync = 0;
 
+  if (open_journal(fs) < 0) return NULL;
+
   return fs;
 }
 
@@ -357,15 +401,35 @@ static struct filsys *open_filesystem(char *devname, struct fsoptions *fsopts) {
     return NULL;
   }
 
-  if (fs->super->version != DFS_VERSION) {
+  if (fs->super->version == DFS_VERSION_NOINCOMPAT) {
+    // Version 2 super blocks have no incompatible feature word
+    fs->super->incompat_features = 0;
+  } else if (fs->super->version != DFS_VERSION) {
     kprintf(KERN_ERR "dfs: invalid DFS version on device %s\n", kdev_get(devno)->name);
     free(fs->super);
     free(fs);
     return NULL;
   }
 
+  if (fs->super->incompat_features & ~DFS_INCOMPAT_SUPPORTED) {
+    kprintf(KERN_ERR "dfs: unsupported features %08X on device %s\n",
+            fs->super->incompat_features & ~DFS_INCOMPAT_SUPPORTED, kdev_get(devno)->name);
+    free(fs->super);
+    free(fs);
+    return NULL;
+  }
+
+  // Kernels without the directory index must not mount indexed file systems
+  if (fs->super->features & DFS_FEATURE_DIRINDEX) {
+    fs->super->features &= ~DFS_FEATURE_DIRINDEX;
+    set_incompat_feature(fs, DFS_INCOMPAT_DIRINDEX);
+  }
+
   // Set device number and block size
   fs->devno = devno;
+  fs->inode_cache_size = fsopts->inode_cache;
+  fs->prealloc_limit = fsopts->prealloc;
+  fs->delalloc_limit = fsopts->delalloc;
   fs->blocksize = 1 << fs->super->log_block_size;
   fs->inodes_per_block = fs->blocksize / sizeof(struct inodedesc);
 
@@ -386,7 +450,7 @@ static struct filsys *open_filesystem(char *devname, struct fsoptions *fsopts) {
 
   // Read group descriptors
   fs->groupdesc_buffers = (struct buf **) kmalloc(sizeof(struct buf *) * fs->groupdesc_blocks);
-  fs->groups = (struct blkgroup *) kmalloc(sizeof(struct group) * fs->super->group_count);
+  fs->groups = (struct blkgroup *) kmalloc(sizeof(struct blkgroup) * fs->super->group_count);
   for (i = 0; i < fs->groupdesc_blocks; i++) {
     fs->groupdesc_buffers[i] = get_buffer(fs->cache, fs->super->groupdesc_table_block + i);
     if (!fs->groupdesc_buffers[i]) return NULL;
@@ -397,16 +461,28 @@ static struct filsys *open_filesystem(char *devname, struct fsoptions *fsopts) {
     gd += (i % fs->groupdescs_per_block);
 
     fs->groups[i].desc = gd;
-    fs->groups[i].first_free_block = -1;
     fs->groups[i].first_free_inode = -1;
+    fs->groups[i].nruns = -1;
+    fs->groups[i].committed = NULL;
+    fs->groups[i].reserved = NULL;
+    fs->groups[i].nreserved = 0;
   }
 
+  // Replay committed metadata changes from the journal
+  if (open_journal(fs) < 0) return NULL;
+
   return fs;
 }
 
 static void close_filesystem(struct filsys *fs) {
   unsigned int i;
 
+  // Write back and discard cached inodes
+  purge_inodes(fs);
+
+  // Commit the last transaction and empty the journal
+  close_journal(fs);
+
   // Release all group descriptors
   for (i = 0; i < fs->groupdesc_blocks; i++) release_buffer(fs->cache, fs->groupdesc_buffers[i]);
   kfree(fs->groupdesc_buffers);
@@ -423,6 +499,9 @@ static void close_filesystem(struct filsys *fs) {
   if (fs->super_dirty) kdev_write(fs->devno, fs->super, SECTORSIZE, 1, 0);
   kfree(fs->super);
 
+  // Flush device write cache
+  kdev_ioctl(fs->devno, IOCTL_FLUSH, NULL, 0);
+
   // Close device
   kdev_close(fs->devno);
 
@@ -462,6 +541,43 @@ int dfs_mount(struct fs *fs, char *opts) {
   }
   if (!fs->data) return -EIO;
 
+  // Enable directory indexing on an existing filesystem
+  if (fsopts.flags & FSOPT_DIRINDEX) {
+    struct filsys *filsys = (struct filsys *) fs->data;
+
+    if (!(filsys->super->incompat_features & DFS_INCOMPAT_DIRINDEX)) {
+      set_incompat_feature(filsys, DFS_INCOMPAT_DIRINDEX);
+    }
+  }
+
+  // Enable extent mapped files on an existing filesystem
+  if (fsopts.flags & FSOPT_EXTENTS) {
+    struct filsys *filsys = (struct filsys *) fs->data;
+
+    if (!(filsys->super->incompat_features & DFS_INCOMPAT_EXTENTS)) {
+      set_incompat_feature(filsys, DFS_INCOMPAT_EXTENTS);
+    }
+  }
+
+  // Add a metadata journal to an existing filesystem
+  if (fsopts.flags & FSOPT_JOURNAL) {
+    struct filsys *filsys = (struct filsys *) fs->data;
+
+    if (!(filsys->super->incompat_features & DFS_INCOMPAT_JOURNAL)) {
+      // The journal blocks must be allocated on disk before the journal is used
+      if (create_journal(filsys, fsopts.journal) < 0 ||
+          flush_buffers(filsys->cache, 0) < 0 ||
+          sync_buffers(filsys->cache, 0) < 0 ||
+          open_journal(filsys) < 0) {
+        kprintf(KERN_WARNING "dfs: unable to create journal on device %s\n", fs->mntfrom);
+      }
+    }
+  }
+
+  // All name changes go through the VFS, so names can be cached
+  ((struct filsys *) fs->data)->vfs = fs;
+  fs->flags |= FS_DCACHE;
+
   return 0;
 }
 
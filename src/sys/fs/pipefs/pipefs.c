@@ -33,6 +33,12 @@
 
 #include <os/krnl.h>
 #include <os/dev.h>
+#include <os/vmm.h>
+#include <os/kmalloc.h>
+
+#define PIPE_DEFAULT_SIZE  (16 * 1024)   // Default pipe capacity
+#define PIPE_MAX_SIZE      (1024 * 1024) // Maximum pipe capacity
+#define PIPE_ATOMIC        PAGESIZE      // Writes up to this size are not split
 
 int pipefs_mount(struct fs *fs, char *opts);
 int pipefs_close(struct file *filp);
@@ -94,16 +100,48 @@ struct pipereq {
   struct pipereq *next;
   struct pipe *pipe;
   struct thread *thread;
-  char *buffer;
-  size_t size;
   int rc;
 };
 
+//
+// Pages gifted to the pipe with vmsplice() are detached from the address
+// space of the writer, queued in the read end and copied directly to the
+// reader. The mark records how many bytes
+// had been written to the ring buffer before the gift, so data is read
+// back in the order it was written.
+//
+
+struct pipegift {
+  struct pipegift *next;
+  char *addr;
+  size_t size;
+  char *pos;
+  size_t left;
+  unsigned long mark;
+};
+
+//
+// Each end of the pipe has a pipe structure. Data written to the pipe
+// is buffered in the ring buffer of the read end, so buffered data can
+// still be read after the write end has been closed.
+//
+
 struct pipe {
   struct file *filp;
   struct pipe *peer;
   struct pipereq *waithead;
   struct pipereq *waittail;
+
+  char *ring;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  unsigned long produced;
+  unsigned long consumed;
+
+  struct pipegift *gifthead;
+  struct pipegift *gifttail;
+  size_t gifted;
 };
 
 struct fs *pipefs;
@@ -139,6 +177,164 @@ static void cancel_request(struct pipe *pipe, struct pipereq *req) {
   }
 }
 
+static int wait_pipe(struct pipe *pipe) {
+  struct pipereq req;
+  int rc;
+
+  req.pipe = pipe;
+  req.thread = kthread_self();
+  req.rc = -EINTR;
+  req.next = NULL;
+
+  if (pipe->waittail) {
+    pipe->waittail->next = &req;
+  } else {
+    pipe->waithead = &req;
+  }
+  pipe->waittail = &req;
+
+  rc = kthread_alertable_wait(THREAD_WAIT_PIPE);
+  if (rc < 0) {
+    cancel_request(pipe, &req);
+    return rc;
+  }
+
+  return req.rc;
+}
+
+static void free_gift(struct pipegift *gift) {
+  kmem_free(gift->addr, gift->size / PAGESIZE);
+  kfree(gift);
+}
+
+static int pipe_empty(struct pipe *pipe) {
+  return pipe->count == 0 && pipe->gifthead == NULL;
+}
+
+//
+// Copy data from the ring buffer and gifted pages of the read end
+//
+
+static size_t drain_pipe(struct pipe *pipe, char *p, size_t size) {
+  struct pipegift *gift;
+  size_t bytes;
+  size_t avail;
+  size_t n;
+
+  bytes = 0;
+  while (size > 0) {
+    gift = pipe->gifthead;
+    avail = pipe->count;
+    if (gift && gift->mark - pipe->consumed < avail) avail = gift->mark - pipe->consumed;
+
+    if (avail > 0) {
+      n = pipe->capacity - pipe->head;
+      if (n > avail) n = avail;
+      if (n > size) n = size;
+
+      memcpy(p, pipe->ring + pipe->head, n);
+      pipe->head = (pipe->head + n) % pipe->capacity;
+      pipe->count -= n;
+      pipe->consumed += n;
+    } else if (gift) {
+      n = gift->left;
+      if (n > size) n = size;
+
+      memcpy(p, gift->pos, n);
+      gift->pos += n;
+      gift->left -= n;
+      pipe->gifted -= n;
+
+      if (gift->left == 0) {
+        pipe->gifthead = gift->next;
+        if (!pipe->gifthead) pipe->gifttail = NULL;
+        free_gift(gift);
+      }
+    } else {
+      break;
+    }
+
+    p += n;
+    size -= n;
+    bytes += n;
+  }
+
+  return bytes;
+}
+
+//
+// Copy data into the ring buffer of the read end
+//
+
+static int fill_pipe(struct pipe *pipe, char *p, size_t size) {
+  size_t bytes;
+  size_t space;
+  size_t tail;
+  size_t n;
+
+  if (!pipe->ring) {
+    pipe->ring = (char *) kmalloc(pipe->capacity);
+    if (!pipe->ring) return -ENOMEM;
+  }
+
+  space = pipe->capacity - pipe->count;
+  if (size <= PIPE_ATOMIC && space < size) return 0;
+
+  bytes = 0;
+  while (size > 0 && pipe->count < pipe->capacity) {
+    tail = (pipe->head + pipe->count) % pipe->capacity;
+    n = pipe->capacity - tail;
+    if (n > pipe->capacity - pipe->count) n = pipe->capacity - pipe->count;
+    if (n > size) n = size;
+
+    memcpy(pipe->ring + tail, p, n);
+    pipe->count += n;
+    pipe->produced += n;
+
+    p += n;
+    size -= n;
+    bytes += n;
+  }
+
+  return bytes;
+}
+
+static int resize_pipe(struct pipe *pipe, size_t capacity) {
+  char *ring;
+  size_t n;
+
+  capacity = (capacity + PAGESIZE - 1) & ~(PAGESIZE - 1);
+  if (capacity == 0) capacity = PAGESIZE;
+  if (capacity > PIPE_MAX_SIZE) return -EINVAL;
+  if (capacity < pipe->count) return -EBUSY;
+  if (capacity == pipe->capacity) return capacity;
+
+  if (pipe->ring) {
+    ring = (char *) kmalloc(capacity);
+    if (!ring) return -ENOMEM;
+
+    n = pipe->capacity - pipe->head;
+    if (n > pipe->count) n = pipe->count;
+    memcpy(ring, pipe->ring + pipe->head, n);
+    memcpy(ring + n, pipe->ring, pipe->count - n);
+
+    kfree(pipe->ring);
+    pipe->ring = ring;
+    pipe->head = 0;
+  }
+
+  pipe->capacity = capacity;
+  return capacity;
+}
+
+static void pipe_written(struct pipe *pipe) {
+  struct pipe *rd = pipe->peer;
+
+  set_io_event(&rd->filp->iob, IOEVT_READ);
+  release_all_waiters(rd, 0);
+  if (rd->count == rd->capacity) clear_io_event(&pipe->filp->iob, IOEVT_WRITE);
+}
+
 void init_pipefs() {
   register_filesystem("pipefs", &pipefsops);
   mount("pipefs", "", "", NULL, &pipefs);
@@ -164,15 +360,18 @@ int pipe(struct file **readpipe, struct file **writepipe) {
     return -EMFILE;
   }
 
+  memset(rdp, 0, sizeof(struct pipe));
   rd->data = rdp;
   rdp->filp = rd;
   rdp->peer = wrp;
-  rdp->waithead = rdp->waittail = NULL;
+  rdp->capacity = PIPE_DEFAULT_SIZE;
 
+  memset(wrp, 0, sizeof(struct pipe));
   wr->data = wrp;
   wrp->filp = wr;
   wrp->peer = rdp;
-  wrp->waithead = wrp->waittail = NULL;
+
+  set_io_event(&wr->iob, IOEVT_WRITE);
 
   *readpipe = rd;
   *writepipe = wr;
@@ -188,6 +387,7 @@ int pipefs_mount(struct fs *fs, char *opts) {
 
 int pipefs_close(struct file *filp) {
   struct pipe *pipe = (struct pipe *) filp->data;
+  struct pipegift *gift;
 
   set_io_event(&filp->iob, IOEVT_CLOSE);
   release_all_waiters(pipe, -EINTR);
@@ -204,6 +404,12 @@ int pipefs_close(struct file *filp) {
     pipe->peer = NULL;
   }
 
+  while ((gift = pipe->gifthead) != NULL) {
+    pipe->gifthead = gift->next;
+    free_gift(gift);
+  }
+
+  kfree(pipe->ring);
   kfree(pipe);
 
   return 0;
@@ -215,70 +421,27 @@ int pipefs_fsync(struct file *filp) {
 
 int pipefs_read(struct file *filp, void *data, size_t size, off64_t pos) {
   struct pipe *pipe = (struct pipe *) filp->data;
-  char *p;
-  size_t left;
   size_t count;
+  int rc;
 
   if (size == 0) return 0;
-  if (!pipe->peer) return 0;
 
-  p = (char *) data;
-  left = size;
-  count = 0;
-  while (pipe->peer->waithead && left > 0) {
-    struct pipereq *req = pipe->peer->waithead;
-    size_t bytes = req->size;
-
-    if (bytes > left) bytes = left;
-
-    memcpy(p, req->buffer, bytes);
-    req->buffer += bytes;
-    req->size -= bytes;
-
-    p += bytes;
-    left -= bytes;
-    count += bytes;
-
-    if (req->size == 0) {
-      pipe->peer->waithead = req->next;
-      if (pipe->peer->waithead == NULL) pipe->peer->waittail = NULL;
-      req->rc = 0;
-      kthread_ready(req->thread, 1, 2);
-    }
-  }
+  while (1) {
+    count = drain_pipe(pipe, (char *) data, size);
+    if (count > 0) break;
 
-  if (pipe->peer->waithead == NULL) clear_io_event(&filp->iob, IOEVT_READ);
-
-  if (count == 0) {
-    struct pipereq req;
-    int rc;
-
-    set_io_event(&pipe->peer->filp->iob, IOEVT_WRITE);
+    // End of file when the pipe is empty and the write end is closed
+    if (!pipe->peer) return 0;
     if (filp->flags & O_NONBLOCK) return -EAGAIN;
 
-    req.pipe = pipe;
-    req.thread = kthread_self();
-    req.buffer = p;
-    req.size = left;
-    req.rc = -EINTR;
-    req.next = NULL;
-
-    if (pipe->waittail) {
-      pipe->waittail->next = &req;
-    } else {
-      pipe->waittail = &req;
-    }
-
-    if (!pipe->waithead) pipe->waithead = &req;
-
-    rc = kthread_alertable_wait(THREAD_WAIT_PIPE);
-    if (rc < 0) {
-      cancel_request(pipe, &req);
-      req.rc = rc;
-    }
+    rc = wait_pipe(pipe);
+    if (rc < 0) return rc;
+  }
 
-    if (req.rc < 0) return req.rc;
-    count += req.rc;
+  if (pipe->peer) {
+    if (pipe_empty(pipe)) clear_io_event(&filp->iob, IOEVT_READ);
+    set_io_event(&pipe->peer->filp->iob, IOEVT_WRITE);
+    release_all_waiters(pipe->peer, 0);
   }
 
   return count;
@@ -288,67 +451,161 @@ int pipefs_write(struct file *filp, void *data, size_t size, off64_t pos) {
   struct pipe *pipe = (struct pipe *) filp->data;
   char *p;
   size_t left;
+  int rc;
 
   if (size == 0) return 0;
-  if (!pipe->peer) return -EPIPE;
 
   p = (char *) data;
   left = size;
-  while (pipe->peer->waithead && left > 0) {
-    struct pipereq *req = pipe->peer->waithead;
-    size_t bytes = req->size;
-
-    if (bytes > left) bytes = left;
+  rc = 0;
+  while (left > 0) {
+    if (!pipe->peer) {
+      rc = -EPIPE;
+      break;
+    }
 
-    memcpy(req->buffer, p, bytes);
-    req->rc = bytes;
+    rc = fill_pipe(pipe->peer, p, left);
+    if (rc < 0) break;
+    if (rc > 0) {
+      p += rc;
+      left -= rc;
+      pipe_written(pipe);
+      continue;
+    }
 
-    p += bytes;
-    left -= bytes;
+    // Wait for the reader to make room in the pipe
+    clear_io_event(&filp->iob, IOEVT_WRITE);
+    if (filp->flags & O_NONBLOCK) {
+      rc = -EAGAIN;
+      break;
+    }
 
-    pipe->peer->waithead = req->next;
-    if (pipe->peer->waithead == NULL) pipe->peer->waittail = NULL;
-    kthread_ready(req->thread, 1, 2);
+    rc = wait_pipe(pipe);
+    if (rc < 0) break;
   }
 
-  if (pipe->peer->waithead == NULL) clear_io_event(&filp->iob, IOEVT_WRITE);
+  if (left == size && rc < 0) return rc;
+  return size - left;
+}
 
-  if (left > 0) {
-    struct pipereq req;
-    int rc;
+//
+// vmsplice
+//
+// Write data to a pipe from user memory. With SPLICE_F_GIFT, segments
+// consisting of whole pages are handed over to the pipe instead of
+// being copied. The page frames are taken out of the address space of
+// the caller and are released when the reader has consumed them, so the
+// pages are decommitted after the call.
+// Other segments are copied into the pipe buffer.
+//
 
-    set_io_event(&pipe->peer->filp->iob, IOEVT_READ);
-    if (filp->flags & O_NONBLOCK) return size - left;
+int vmsplice(struct file *filp, struct iovec *iov, int count, int flags) {
+  struct pipe *pipe;
+  struct pipegift *gift;
+  struct pipe *rd;
+  size_t bytes;
+  size_t len;
+  char *base;
+  int rc;
 
-    req.pipe = pipe;
-    req.thread = kthread_self();
-    req.buffer = p;
-    req.size = left;
-    req.rc = -EINTR;
-    req.next = NULL;
+  if (!filp || filp->fs != pipefs || !(filp->flags & O_WRONLY)) return -EBADF;
+  if (count < 0) return -EINVAL;
+  pipe = (struct pipe *) filp->data;
+
+  bytes = 0;
+  rc = 0;
+  while (count > 0) {
+    base = (char *) iov->iov_base;
+    len = iov->iov_len;
+
+    if (!(flags & SPLICE_F_GIFT) || ((unsigned long) base & (PAGESIZE - 1)) || (len & (PAGESIZE - 1))) {
+      rc = pipefs_write(filp, base, len, 0);
+      if (rc < 0) break;
+      bytes += rc;
+      if ((size_t) rc < len) break;
+    } else if (len > 0) {
+      // Wait until the pages gifted earlier have been mostly consumed
+      while ((rd = pipe->peer) != NULL && rd->gifted >= rd->capacity) {
+        if (filp->flags & O_NONBLOCK) {
+          rc = -EAGAIN;
+          break;
+        }
+
+        rc = wait_pipe(pipe);
+        if (rc < 0) break;
+      }
+      if (rc < 0) break;
 
-    if (pipe->waittail) {
-      pipe->waittail->next = &req;
-    } else {
-      pipe->waittail = &req;
-    }
+      if (!rd) {
+        rc = -EPIPE;
+        break;
+      }
 
-    if (!pipe->waithead) pipe->waithead = &req;
+      gift = (struct pipegift *) kmalloc(sizeof(struct pipegift));
+      if (!gift) {
+        rc = -ENOMEM;
+        break;
+      }
 
-    rc = kthread_alertable_wait(THREAD_WAIT_PIPE);
-    if (rc < 0) {
-      cancel_request(pipe, &req);
-      req.rc = rc;
+      gift->addr = (char *) vmdetach(base, len, &rc);
+      if (!gift->addr) {
+        kfree(gift);
+        break;
+      }
+
+      gift->next = NULL;
+      gift->pos = gift->addr;
+      gift->size = gift->left = len;
+      gift->mark = rd->produced;
+
+      if (rd->gifttail) {
+        rd->gifttail->next = gift;
+      } else {
+        rd->gifthead = gift;
+      }
+      rd->gifttail = gift;
+      rd->gifted += len;
+
+      set_io_event(&rd->filp->iob, IOEVT_READ);
+      release_all_waiters(rd, 0);
+
+      bytes += len;
     }
 
-    if (req.rc < 0) return req.rc;
+    iov++;
+    count--;
   }
 
-  return size;
+  if (bytes == 0 && rc < 0) return rc;
+  return bytes;
 }
 
 int pipefs_ioctl(struct file *filp, int cmd, void *data, size_t size) {
-  if (cmd == FIONBIO) return 0;
+  struct pipe *pipe = (struct pipe *) filp->data;
+  struct pipe *rd;
+
+  rd = (filp->flags & O_WRONLY) ? pipe->peer : pipe;
+
+  switch (cmd) {
+    case FIONBIO:
+      return 0;
+
+    case FIONREAD:
+      if (!data || size != sizeof(int)) return -EINVAL;
+      *(int *) data = rd ? rd->count + rd->gifted : 0;
+      return 0;
+
+    case IOCTL_GETPIPE_SZ:
+      if (!rd) return -EPIPE;
+      return rd->capacity;
+
+    case IOCTL_SETPIPE_SZ:
+      if (!data || size != sizeof(int)) return -EINVAL;
+      if (!rd) return -EPIPE;
+      if (*(int *) data <= 0) return -EINVAL;
+      return resize_pipe(rd, *(int *) data);
+  }
+
   return -ENOSYS;
 }
 
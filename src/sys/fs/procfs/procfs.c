@@ -36,12 +36,14 @@
 
 struct proc_inode *proc_list_head;
 struct proc_inode *proc_list_tail;
+struct proc_inode *proc_hash[PROC_HASHSIZE];
 ino_t next_procino = PROC_ROOT_INODE + 1;
 
 int procfs_open(struct file *filp, char *name);
 int procfs_close(struct file *filp);
 
 int procfs_read(struct file *filp, void *data, size_t size, off64_t pos);
+int procfs_ioctl(struct file *filp, int cmd, void *data, size_t size);
 
 off64_t procfs_tell(struct file *filp);
 off64_t procfs_lseek(struct file *filp, off64_t offset, int origin);
@@ -51,9 +53,10 @@ int procfs_stat(struct fs *fs, char *name, struct stat64 *buffer);
 
 int procfs_opendir(struct file *filp, char *name);
 int procfs_readdir(struct file *filp, struct direntry *dirp, int count);
+int procfs_readdirplus(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count);
 
 struct fsops procfsops = {
-  FSOP_OPEN | FSOP_CLOSE | FSOP_READ | FSOP_TELL | FSOP_LSEEK | FSOP_STAT | FSOP_FSTAT | FSOP_OPENDIR | FSOP_READDIR,
+  FSOP_OPEN | FSOP_CLOSE | FSOP_READ | FSOP_IOCTL | FSOP_TELL | FSOP_LSEEK | FSOP_STAT | FSOP_FSTAT | FSOP_OPENDIR | FSOP_READDIR | FSOP_READDIRPLUS,
 
   NULL,
   NULL,
@@ -71,7 +74,7 @@ struct fsops procfsops = {
 
   procfs_read,
   NULL,
-  NULL,
+  procfs_ioctl,
 
   procfs_tell,
   procfs_lseek,
@@ -98,21 +101,82 @@ struct fsops procfsops = {
   NULL,
 
   procfs_opendir,
-  procfs_readdir
+  procfs_readdir,
+
+  NULL,
+
+  NULL,
+
+  procfs_readdirplus
 };
 
+static unsigned long proc_hash_name(char *name, int len) {
+  unsigned long h = 0;
+
+  while (len-- > 0) h = (h << 5) + h + (unsigned char) *name++;
+  return h % PROC_HASHSIZE;
+}
+
 static struct proc_inode *find_proc(char *name) {
-  struct proc_inode *inode = proc_list_head;
+  struct proc_inode *inode;
   int namelen = strlen(name);
 
+  inode = proc_hash[proc_hash_name(name, namelen)];
   while (inode) {
     if (fnmatch(name, namelen, inode->name, inode->namelen)) return inode;
-    inode = inode->next;
+    inode = inode->hash_next;
   }
 
   return NULL;
 }
 
+static void discard_proc_data(struct proc_file *pf) {
+  struct proc_blk *blk;
+  struct proc_blk *next;
+
+  // Keep the first block for the next record
+  if (!pf->blkhead) return;
+  blk = pf->blkhead->next;
+  while (blk) {
+    next = blk->next;
+    kfree(blk);
+    blk = next;
+  }
+
+  pf->blkhead->next = NULL;
+  pf->blkhead->size = 0;
+  pf->blktail = pf->blkhead;
+  pf->size = 0;
+}
+
+static size_t copy_proc_data(struct proc_file *pf, char *ptr, size_t size, size_t pos) {
+  struct proc_blk *blk;
+  size_t start = 0;
+  size_t left = size;
+  size_t count;
+  size_t offset;
+
+  blk = pf->blkhead;
+  while (blk && start + blk->size <= pos) {
+    start += blk->size;
+    blk = blk->next;
+  }
+
+  offset = pos - start;
+  while (left > 0 && blk) {
+    count = blk->size - offset;
+    if (count > left) count = left;
+
+    memcpy(ptr, blk->data + offset, count);
+    ptr += count;
+    left -= count;
+    blk = blk->next;
+    offset = 0;
+  }
+
+  return size - left;
+}
+
 static void free_proc_file(struct proc_file *pf) {
   struct proc_blk *blk;
   struct proc_blk *next;
@@ -132,8 +196,9 @@ void init_procfs() {
   register_filesystem("procfs", &procfsops);
 }
 
-int register_proc_inode(char *name, proc_t proc, void *arg) {
+static int add_proc_inode(char *name, proc_t proc, struct proc_seqops *seqops, void *arg) {
   struct proc_inode *inode;
+  int bucket;
 
   inode = (struct proc_inode *) kmalloc(sizeof(struct proc_inode));
   if (!inode) return -ENOMEM;
@@ -142,8 +207,10 @@ int register_proc_inode(char *name, proc_t proc, void *arg) {
   inode->name = name;
   inode->namelen = strlen(name);
   inode->proc = proc;
+  inode->seqops = seqops;
   inode->arg = arg;
   inode->size = 0;
+  inode->next = NULL;
 
   if (proc_list_tail) {
     proc_list_tail->next = inode;
@@ -152,9 +219,21 @@ int register_proc_inode(char *name, proc_t proc, void *arg) {
     proc_list_head = proc_list_tail = inode;
   }
 
+  bucket = proc_hash_name(name, inode->namelen);
+  inode->hash_next = proc_hash[bucket];
+  proc_hash[bucket] = inode;
+
   return 0;
 }
 
+int register_proc_inode(char *name, proc_t proc, void *arg) {
+  return add_proc_inode(name, proc, NULL, arg);
+}
+
+int register_proc_seq(char *name, struct proc_seqops *ops, void *arg) {
+  return add_proc_inode(name, NULL, ops, arg);
+}
+
 int proc_write(struct proc_file *pf, void *buffer, size_t size) {
   char *ptr = (char *) buffer;
   size_t left = size;
@@ -218,14 +297,21 @@ int procfs_open(struct file *filp, char *name) {
   pf->inode = inode;
   pf->blkhead = pf->blktail = NULL;
   pf->size = 0;
+  pf->recoff = 0;
+  pf->index = 0;
+  pf->binary = 0;
+
+  // Sequence files are generated incrementally on read
+  if (!inode->seqops) {
+    rc = inode->proc(pf, inode->arg);
+    if (rc < 0) {
+      free_proc_file(pf);
+      return rc;
+    }
 
-  rc = inode->proc(pf, inode->arg);
-  if (rc < 0) {
-    free_proc_file(pf);
-    return rc;
+    inode->size = pf->size;
   }
 
-  inode->size = pf->size;
   filp->data = pf;
   filp->mode = S_IFCHR | S_IRUSR | S_IRGRP | S_IROTH;
   return 0;
@@ -240,60 +326,86 @@ int procfs_close(struct file *filp) {
   return 0;
 }
 
-int procfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
-  struct proc_file *pf = filp->data;
-  struct proc_blk *blk;
-  size_t start = 0;
-  char *ptr = (char *) data;
-  int left = size;
-  int count;
-  int offset;
-
-  if (filp->flags & F_DIR) return -EINVAL;
-  if (!size) return 0;
+static int read_proc_seq(struct proc_file *pf, char *data, size_t size, off64_t pos) {
+  struct proc_seqops *ops = pf->inode->seqops;
+  void *v = NULL;
+  char *ptr = data;
+  size_t left = size;
+  size_t count;
+  int rc;
 
-  blk = pf->blkhead;
-  while (blk && start + blk->size <= pos) {
-    start += blk->size;
-    blk = blk->next;
+  // Restart from first record when seeking backwards
+  if (pos < pf->recoff) {
+    discard_proc_data(pf);
+    pf->recoff = 0;
+    pf->index = 0;
   }
 
-  if (blk) {
-    offset = (int) pos - start;
-
-    if (offset < 0 || offset >= PROC_BLKSIZE) {
-      kprintf("invalid proc blk offset %d\n", offset);
-      dbg_break();
+  while (left > 0) {
+    // Copy from buffered record
+    if (pos < pf->recoff + pf->size) {
+      count = copy_proc_data(pf, ptr, left, (size_t) (pos - pf->recoff));
+      ptr += count;
+      left -= count;
+      pos += count;
+      continue;
     }
 
-    if (left < blk->size - offset) {
-      count = left;
-    } else {
-      count = blk->size - offset;
-    }
+    // Generate next record
+    pf->recoff += pf->size;
+    discard_proc_data(pf);
 
-    memcpy(ptr, blk->data + offset, count);
-    ptr += count;
-    left -= count;
-    blk = blk->next;
-  }
+    v = v ? ops->next(pf, v) : ops->start(pf, pf->index);
+    if (!v) break;
+    pf->index++;
 
-  while (left > 0 && blk) {
-    if (left < blk->size) {
-      count = left;
+    if (pf->binary) {
+      rc = v == PROC_SEQ_HEADER ? 0 : ops->record(pf, v);
     } else {
-      count = blk->size;
+      rc = ops->show(pf, v);
     }
 
-    memcpy(ptr, blk->data, count);
-    ptr += count;
-    left -= count;
-    blk = blk->next;
+    if (rc < 0) {
+      if (left == size) return rc;
+      break;
+    }
   }
 
   return size - left;
 }
 
+int procfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
+  struct proc_file *pf = filp->data;
+
+  if (filp->flags & F_DIR) return -EINVAL;
+  if (!size) return 0;
+
+  if (pf->inode->seqops) return read_proc_seq(pf, (char *) data, size, pos);
+  if (pos >= pf->size) return 0;
+
+  return copy_proc_data(pf, (char *) data, size, (size_t) pos);
+}
+
+int procfs_ioctl(struct file *filp, int cmd, void *data, size_t size) {
+  struct proc_file *pf = filp->data;
+
+  if (filp->flags & F_DIR) return -EINVAL;
+
+  switch (cmd) {
+    case IOCTL_PROC_BINARY:
+      // Switch to fixed-layout binary records and restart from the beginning
+      if (!pf->inode->seqops || !pf->inode->seqops->record) return -ENOSYS;
+      pf->binary = 1;
+      discard_proc_data(pf);
+      pf->recoff = 0;
+      pf->index = 0;
+      filp->pos = 0;
+      return 0;
+  }
+
+  return -ENOSYS;
+}
+
 off64_t procfs_tell(struct file *filp) {
   return filp->pos;
 }
@@ -305,6 +417,8 @@ off64_t procfs_lseek(struct file *filp, off64_t offset, int origin) {
 
   switch (origin) {
     case SEEK_END:
+      // The size of a sequence file is not known until it has been read
+      if (pf->inode->seqops) return -EINVAL;
       offset += pf->size;
       break;
 
@@ -312,7 +426,8 @@ off64_t procfs_lseek(struct file *filp, off64_t offset, int origin) {
       offset += filp->pos;
   }
 
-  if (offset < 0 || offset > pf->size) return -EINVAL;
+  if (offset < 0) return -EINVAL;
+  if (!pf->inode->seqops && offset > pf->size) return -EINVAL;
 
   filp->pos = offset;
   return offset;
@@ -320,6 +435,7 @@ off64_t procfs_lseek(struct file *filp, off64_t offset, int origin) {
 
 int procfs_fstat(struct file *filp, struct stat64 *buffer) {
   struct proc_file *pf = filp->data;
+  size_t size;
 
   if (filp->flags & F_DIR) {
     if (buffer) {
@@ -335,6 +451,9 @@ int procfs_fstat(struct file *filp, struct stat64 *buffer) {
     return 0;
   }
 
+  // Sequence files have no size until they have been read
+  size = pf->inode->seqops ? 0 : pf->size;
+
   if (buffer) {
     memset(buffer, 0, sizeof(struct stat64));
     buffer->st_mode = S_IFCHR | S_IRUSR | S_IRGRP | S_IROTH;
@@ -344,10 +463,10 @@ int procfs_fstat(struct file *filp, struct stat64 *buffer) {
     buffer->st_dev = NODEV;
 
     buffer->st_atime = buffer->st_mtime = buffer->st_ctime = kpit_get_time();
-    buffer->st_size = pf->size;
+    buffer->st_size = size;
   }
 
-  return pf->size;
+  return size;
 }
 
 int procfs_stat(struct fs *fs, char *name, struct stat64 *buffer) {
@@ -409,3 +528,21 @@ int procfs_readdir(struct file *filp, struct direntry *dirp, int count) {
   filp->data = inode->next;
   return 1;
 }
+
+int procfs_readdirplus(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count) {
+  struct proc_inode *inode = filp->data;
+
+  if (!inode) return 0;
+
+  memset(buffer, 0, sizeof(struct stat64));
+  buffer->st_mode = S_IFCHR | S_IRUSR | S_IRGRP | S_IROTH;
+
+  buffer->st_ino = inode->ino;
+  buffer->st_nlink = 1;
+  buffer->st_dev = NODEV;
+
+  buffer->st_atime = buffer->st_mtime = buffer->st_ctime = kpit_get_time();
+  buffer->st_size = inode->size;
+
+  return procfs_readdir(filp, dirp, count);
+}
@@ -40,11 +40,22 @@
 #define ROUNDUP(x) (((x) + 3) & ~3)
 
 #define SMB_NAMELEN             256
-#define SMB_DENTRY_CACHESIZE    16
 #define SMB_DIRBUF_SIZE         4096
 
-#define SMB_RAW_CHUNKSIZE       (32 * 1024)
+#define SMB_DEFAULT_CACHESIZE   512         // Default number of cached attribute entries
+#define SMB_DEFAULT_CACHETTL    5           // Default cache entry lifetime in seconds
+#define SMB_DEFAULT_DIRCACHE    16          // Default number of cached directory listings
+#define SMB_DIRLIST_MAXSIZE     (256 * 1024)
+
 #define SMB_NORMAL_CHUNKSIZE    (4 * 1024)
+#define SMB_LARGE_CHUNKSIZE     (60 * 1024)
+
+#define SMB_MAX_MPX             8           // Max outstanding requests per transfer
+#define SMB_READAHEAD_SIZE      (64 * 1024) // Sequential read-ahead window
+#define SMB_WRITEBEHIND_SIZE    (64 * 1024) // Write-behind buffer size
+
+#define SMB_COPYCHUNK_SIZE      (1024 * 1024) // Max bytes per server-side copy chunk
+#define SMB_COPYCHUNK_COUNT     16          // Max chunks per server-side copy request
 
 #define EPOC                    116444736000000000     // 00:00:00 GMT on January 1, 1970
 #define SECTIMESCALE            10000000               // 1 sec resolution
@@ -150,6 +161,15 @@
 #define TRANS2_GET_DFS_REFERRAL         0x10    // Get a DFS referral
 #define TRANS2_REPORT_DFS_INCONSISTENCY 0x11    // Report a DFS knowledge inconsistency
 
+//
+// SMB NT TRANSACT sub commands and file system controls
+//
+
+#define NT_TRANSACT_IOCTL               0x02    // Device or file system control
+
+#define FSCTL_SRV_REQUEST_RESUME_KEY    0x00140078  // Get server-side copy source key
+#define FSCTL_SRV_COPYCHUNK             0x001440F2  // Server-side copy of byte ranges
+
 //
 // SMB protocol capability flags
 //
@@ -166,6 +186,7 @@
 #define SMB_CAP_NT_FIND                 0x0200
 #define SMB_CAP_DFS                     0x1000
 #define SMB_CAP_LARGE_READX             0x4000
+#define SMB_CAP_LARGE_WRITEX            0x8000
 
 //
 // SMB file attributes and flags
@@ -681,6 +702,44 @@ struct smb_trans_response {
   unsigned short setup[1];              // Setup words (# = SetupWordCount)
 };
 
+//
+// SMB NT TRANSACT request parameters
+//
+
+struct smb_nttrans_request {
+  unsigned char max_setup_count;        // Max setup words to return
+  unsigned short reserved;
+  unsigned long total_parameter_count;  // Total parameter bytes being sent
+  unsigned long total_data_count;       // Total data bytes being sent
+  unsigned long max_parameter_count;    // Max parameter bytes to return
+  unsigned long max_data_count;         // Max data bytes to return
+  unsigned long parameter_count;        // Parameter bytes sent this buffer
+  unsigned long parameter_offset;       // Offset (from header start) to Parameters
+  unsigned long data_count;             // Data bytes sent this buffer
+  unsigned long data_offset;            // Offset (from header start) to data
+  unsigned char setup_count;            // Count of setup words
+  unsigned short function;              // NT transaction function code
+  unsigned short setup[1];              // Setup words (# = SetupWordCount)
+};
+
+//
+// SMB NT TRANSACT response parameters
+//
+
+struct smb_nttrans_response {
+  unsigned char reserved[3];
+  unsigned long total_parameter_count;  // Total parameter bytes being sent
+  unsigned long total_data_count;       // Total data bytes being sent
+  unsigned long parameter_count;        // Parameter bytes sent this buffer
+  unsigned long parameter_offset;       // Offset (from header start) to Parameters
+  unsigned long parameter_displacement; // Displacement of these Parameter bytes
+  unsigned long data_count;             // Data bytes sent this buffer
+  unsigned long data_offset;            // Offset (from header start) to data
+  unsigned long data_displacement;      // Displacement of these data bytes
+  unsigned char setup_count;            // Count of setup words
+  unsigned short setup[1];              // Setup words (# = SetupWordCount)
+};
+
 //
 // Server Message Block (SMB)
 //
@@ -715,6 +774,7 @@ struct smb {
       struct smb_read_raw_request readraw;
       struct smb_write_file_request write;
       struct smb_trans_request trans;
+      struct smb_nttrans_request nttrans;
       struct smb_rename_request rename;
       struct smb_delete_request del;
       struct smb_copy_request copy;
@@ -728,6 +788,7 @@ struct smb {
       struct smb_read_file_response read;
       struct smb_write_file_response write;
       struct smb_trans_response trans;
+      struct smb_nttrans_response nttrans;
       struct smb_copy_response copy;
     } rsp;
   } params;
@@ -875,6 +936,35 @@ struct smb_file_directory_info {
   char filename[0];                     // Name of the file
 };
 
+//
+// SMB server-side copy messages
+//
+
+struct smb_resume_key_response {
+  char key[24];                         // Opaque key identifying the source file
+  unsigned long context_length;
+};
+
+struct smb_copychunk {
+  smb_size source_offset;               // Offset in source file
+  smb_size target_offset;               // Offset in target file
+  unsigned long length;                 // Number of bytes to copy
+  unsigned long reserved;
+};
+
+struct smb_copychunk_request {
+  char key[24];                         // Source key from FSCTL_SRV_REQUEST_RESUME_KEY
+  unsigned long chunk_count;            // Number of chunks
+  unsigned long reserved;
+  struct smb_copychunk chunks[SMB_COPYCHUNK_COUNT];
+};
+
+struct smb_copychunk_response {
+  unsigned long chunks_written;         // Number of chunks copied
+  unsigned long chunk_bytes_written;    // Bytes copied of partial chunk
+  unsigned long total_bytes_written;    // Total bytes copied
+};
+
 #pragma pack(pop)
 
 struct smb_share;
@@ -884,8 +974,35 @@ struct smb_share;
 //
 
 struct smb_dentry {
-  char path[MAXPATH];
+  struct smb_dentry *hash_next;         // Next entry in hash chain
+  struct smb_dentry *lru_next;          // Next (less recently used) entry
+  struct smb_dentry *lru_prev;          // Previous (more recently used) entry
+  unsigned long hash;                   // Hash value for path
+  time_t expires;                       // Time when entry becomes stale
   struct stat64 statbuf;
+  char path[MAXPATH];
+};
+
+//
+// SMB cached directory listing
+//
+
+struct smb_dirent {
+  unsigned short reclen;                // Length of record
+  unsigned short namelen;               // Length of file name
+  struct stat64 statbuf;                // File attributes
+  char name[0];                         // File name
+};
+
+struct smb_dirlist {
+  struct smb_dirlist *next;             // Next listing in cache
+  int refs;                             // Reference count (cache and open directories)
+  int gen;                              // Cache generation when listing was started
+  time_t expires;                       // Time when listing becomes stale
+  int size;                             // Bytes used in buffer
+  int bufsize;                          // Size of buffer
+  char *buffer;                         // Directory entries (struct smb_dirent)
+  char path[MAXPATH];                   // Directory path
 };
 
 //
@@ -896,6 +1013,27 @@ struct smb_file {
   unsigned short fid;
   unsigned long attrs;
   struct stat64 statbuf;
+  int readahead;                        // Read-ahead allowed, no other writers
+  int writebehind;                      // Write-behind allowed, no other openers
+  off64_t nextpos;                      // Position following last read
+  char *rabuf;                          // Read-ahead buffer
+  off64_t rapos;                        // File position of read-ahead data
+  int ralen;                            // Bytes in read-ahead buffer
+  char *wbbuf;                          // Write-behind buffer
+  off64_t wbpos;                        // File position of write-behind data
+  int wblen;                            // Bytes in write-behind buffer
+  char path[MAXPATH];                   // File name, for cache invalidation
+};
+
+//
+// SMB multiplexed read/write request
+//
+
+struct smb_mpx {
+  unsigned short mid;                   // Multiplex id of outstanding request
+  int size;                             // Requested bytes (0 if slot is free)
+  char *buf;                            // Data buffer
+  off64_t pos;                          // File position
 };
 
 //
@@ -907,6 +1045,9 @@ struct smb_directory {
   int eos;
   int entries_left;
   struct smb_file_directory_info *fi;
+  struct smb_dirlist *list;             // Cached listing being read
+  int listpos;                          // Read position in cached listing
+  struct smb_dirlist *fill;             // Listing being gathered for the cache
   char path[MAXPATH];
   char buffer[SMB_DIRBUF_SIZE];
 };
@@ -930,6 +1071,9 @@ struct smb_server {
   int tzofs;
   unsigned long server_caps;
   unsigned long max_buffer_size;
+  unsigned short max_mpx;
+  unsigned short next_mid;
+  int no_copychunk;                     // Server does not support server-side copy
   char buffer[SMB_MAX_BUFFER + 4];
   char auxbuf[SMB_MAX_BUFFER + 4];
 };
@@ -944,8 +1088,17 @@ struct smb_share {
   unsigned short tid;
   char sharename[SMB_NAMELEN];
   time_t mounttime;
-  int next_cacheidx;
-  struct smb_dentry dircache[SMB_DENTRY_CACHESIZE];
+  int cache_size;                       // Max number of attribute cache entries
+  int cache_ttl;                        // Cache entry lifetime in seconds
+  int cache_gen;                        // Incremented on every invalidation
+  struct smb_dentry **dentry_hash;      // Attribute cache hash table
+  int dentry_buckets;                   // Number of hash buckets (power of two)
+  int dentry_count;                     // Number of cached attribute entries
+  struct smb_dentry *lru_head;          // Most recently used entry
+  struct smb_dentry *lru_tail;          // Least recently used entry
+  struct smb_dirlist *dirlists;         // Cached directory listings
+  int dirlist_size;                     // Max number of cached directory listings
+  int dirlist_count;                    // Number of cached directory listings
 };
 
 // smbutil.c
@@ -961,10 +1114,20 @@ int smb_errno(struct smb *smb);
 
 // smbcache.c
 
+int smb_init_cache(struct smb_share *share, int cachesize, int ttl, int dircachesize);
+void smb_free_cache(struct smb_share *share);
 void smb_add_to_cache(struct smb_share *share, char *path, char *filename, struct stat64 *statbuf);
 struct smb_dentry *smb_find_in_cache(struct smb_share *share, char *path);
+void smb_invalidate(struct smb_share *share, char *path);
 void smb_clear_cache(struct smb_share *share);
 
+struct smb_dirlist *smb_alloc_dirlist(struct smb_share *share, char *path);
+void smb_free_dirlist(struct smb_dirlist *list);
+int smb_add_dirlist_entry(struct smb_dirlist *list, char *name, struct stat64 *statbuf);
+void smb_commit_dirlist(struct smb_share *share, struct smb_dirlist *list);
+struct smb_dirlist *smb_find_dirlist(struct smb_share *share, char *path);
+void smb_release_dirlist(struct smb_dirlist *list);
+
 // smbproto.c
 
 struct smb *smb_init(struct smb_share *share, int aux);
@@ -973,6 +1136,14 @@ int smb_send(struct smb_share *share, struct smb *smb, unsigned char cmd, int pa
 int smb_recv(struct smb_share *share, struct smb *smb);
 int smb_request(struct smb_share *share, struct smb *smb, unsigned char cmd, int params, char *data, int datasize, int retry);
 
+unsigned short smb_next_mid(struct smb_share *share);
+int smb_send_data(struct smb_share *share, struct smb *smb, unsigned char cmd, int params, char *data, int datasize);
+int smb_recv_header(struct smb_share *share, struct smb *smb, int params, int *left);
+int smb_skip(struct smb_share *share, int len);
+
+int smb_nt_ioctl(struct smb_share *share, unsigned long function, unsigned short fid,
+                 void *indata, int inlen, void *outdata, int *outlen);
+
 int smb_trans(struct smb_share *share,
               unsigned short cmd,
               void *reqparams, int reqparamlen,
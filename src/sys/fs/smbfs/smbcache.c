@@ -31,37 +31,328 @@
 // SUCH DAMAGE.
 // 
 
+
 #include <os/krnl.h>
 #include "smb.h"
 
+//
+// The attribute cache maps paths to file attributes. Entries are kept in
+// a hash table and an LRU list, and expire after cachettl seconds. The
+// directory listing cache holds complete directory listings gathered
+// from FIND_FIRST2/FIND_NEXT2 so repeated directory scans can be served
+// locally. Local modifications invalidate affected entries.
+//
+
+static unsigned long smb_hash(char *path) {
+  unsigned long hash = 0;
+  int c;
+
+  // SMB paths are case insensitive
+  while ((c = *path++) != 0) {
+    if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    hash = hash * 31 + c;
+  }
+
+  return hash;
+}
+
+static char *smb_make_path(char *buf, char *path, char *filename) {
+  if (!filename) return path;
+  if (!*path) return filename;
+  if (strlen(path) + 1 + strlen(filename) >= MAXPATH) return NULL;
+
+  strcpy(buf, path);
+  strcat(buf, "\\");
+  strcat(buf, filename);
+  return buf;
+}
+
+static void smb_unlink_dentry(struct smb_share *share, struct smb_dentry *dentry) {
+  struct smb_dentry **pp;
+
+  // Remove from hash chain
+  pp = &share->dentry_hash[dentry->hash & (share->dentry_buckets - 1)];
+  while (*pp != dentry) pp = &(*pp)->hash_next;
+  *pp = dentry->hash_next;
+
+  // Remove from LRU list
+  if (dentry->lru_prev) {
+    dentry->lru_prev->lru_next = dentry->lru_next;
+  } else {
+    share->lru_head = dentry->lru_next;
+  }
+
+  if (dentry->lru_next) {
+    dentry->lru_next->lru_prev = dentry->lru_prev;
+  } else {
+    share->lru_tail = dentry->lru_prev;
+  }
+
+  share->dentry_count--;
+}
+
+static void smb_link_dentry(struct smb_share *share, struct smb_dentry *dentry) {
+  int bucket = dentry->hash & (share->dentry_buckets - 1);
+
+  dentry->hash_next = share->dentry_hash[bucket];
+  share->dentry_hash[bucket] = dentry;
+
+  dentry->lru_prev = NULL;
+  dentry->lru_next = share->lru_head;
+  if (share->lru_head) share->lru_head->lru_prev = dentry;
+  share->lru_head = dentry;
+  if (!share->lru_tail) share->lru_tail = dentry;
+
+  share->dentry_count++;
+}
+
+static struct smb_dentry *smb_lookup_dentry(struct smb_share *share, char *path, unsigned long hash) {
+  struct smb_dentry *dentry;
+
+  dentry = share->dentry_hash[hash & (share->dentry_buckets - 1)];
+  while (dentry) {
+    if (dentry->hash == hash && stricmp(dentry->path, path) == 0) return dentry;
+    dentry = dentry->hash_next;
+  }
+
+  return NULL;
+}
+
+int smb_init_cache(struct smb_share *share, int cachesize, int ttl, int dircachesize) {
+  int buckets;
+
+  share->cache_size = cachesize;
+  share->cache_ttl = ttl;
+  share->dirlist_size = dircachesize;
+  if (cachesize <= 0) return 0;
+
+  buckets = 1;
+  while (buckets < cachesize) buckets <<= 1;
+
+  share->dentry_hash = (struct smb_dentry **) kmalloc(buckets * sizeof(struct smb_dentry *));
+  if (!share->dentry_hash) return -ENOMEM;
+  memset(share->dentry_hash, 0, buckets * sizeof(struct smb_dentry *));
+  share->dentry_buckets = buckets;
+
+  return 0;
+}
+
+void smb_free_cache(struct smb_share *share) {
+  smb_clear_cache(share);
+  if (share->dentry_hash) kfree(share->dentry_hash);
+  share->dentry_hash = NULL;
+  share->dentry_buckets = 0;
+}
+
 void smb_add_to_cache(struct smb_share *share, char *path, char *filename, struct stat64 *statbuf) {
-  int idx = share->next_cacheidx;
+  struct smb_dentry *dentry;
+  unsigned long hash;
+  char buf[MAXPATH];
 
-  strcpy(share->dircache[idx].path, path);
-  strcat(share->dircache[idx].path, "\\");
-  strcat(share->dircache[idx].path, filename);
+  if (!share->dentry_hash) return;
+  path = smb_make_path(buf, path, filename);
+  if (!path) return;
+  hash = smb_hash(path);
 
-  memcpy(&share->dircache[idx].statbuf, statbuf, sizeof(struct stat64));
+  // Replace existing entry, or recycle the least recently used one if full
+  dentry = smb_lookup_dentry(share, path, hash);
+  if (dentry) {
+    smb_unlink_dentry(share, dentry);
+  } else if (share->dentry_count >= share->cache_size) {
+    dentry = share->lru_tail;
+    smb_unlink_dentry(share, dentry);
+  } else {
+    dentry = (struct smb_dentry *) kmalloc(sizeof(struct smb_dentry));
+    if (!dentry) return;
+  }
+
+  strcpy(dentry->path, path);
+  dentry->hash = hash;
+  dentry->expires = kpit_get_time() + share->cache_ttl;
+  memcpy(&dentry->statbuf, statbuf, sizeof(struct stat64));
 
-  if (++share->next_cacheidx == SMB_DENTRY_CACHESIZE) share->next_cacheidx = 0;
+  smb_link_dentry(share, dentry);
 }
 
 struct smb_dentry *smb_find_in_cache(struct smb_share *share, char *path) {
-  int idx;
+  struct smb_dentry *dentry;
+
+  if (!share->dentry_hash) return NULL;
+
+  dentry = smb_lookup_dentry(share, path, smb_hash(path));
+  if (!dentry) return NULL;
+
+  if (kpit_get_time() >= dentry->expires) {
+    smb_unlink_dentry(share, dentry);
+    kfree(dentry);
+    return NULL;
+  }
+
+  // Move to front of LRU list
+  smb_unlink_dentry(share, dentry);
+  smb_link_dentry(share, dentry);
+
+  return dentry;
+}
 
-  if (share->dircache[share->next_cacheidx].path[0] && strcmp(share->dircache[share->next_cacheidx].path, path) == 0) return &share->dircache[share->next_cacheidx];
+static void smb_remove_dirlist(struct smb_share *share, struct smb_dirlist *list) {
+  struct smb_dirlist **pp;
 
-  for (idx = 0; idx < SMB_DENTRY_CACHESIZE; idx++) {
-    if (share->dircache[idx].path[0] && strcmp(share->dircache[idx].path, path) == 0) {
-      return &share->dircache[idx];
+  pp = &share->dirlists;
+  while (*pp != list) pp = &(*pp)->next;
+  *pp = list->next;
+  share->dirlist_count--;
+
+  list->next = NULL;
+  smb_release_dirlist(list);
+}
+
+void smb_invalidate(struct smb_share *share, char *path) {
+  struct smb_dentry *dentry;
+  struct smb_dirlist *list;
+  struct smb_dirlist *next;
+  char *p;
+  int len;
+
+  // Directory listings being gathered must not be cached
+  share->cache_gen++;
+
+  // Remove attributes for path
+  if (share->dentry_hash) {
+    dentry = smb_lookup_dentry(share, path, smb_hash(path));
+    if (dentry) {
+      smb_unlink_dentry(share, dentry);
+      kfree(dentry);
     }
   }
-  
-  return NULL;
+
+  // Remove listings for the path itself and its parent directory
+  p = strrchr(path, '\\');
+  len = p ? p - path : 0;
+  list = share->dirlists;
+  while (list) {
+    next = list->next;
+    if (stricmp(list->path, path) == 0 || (strlen(list->path) == len && strnicmp(list->path, path, len) == 0)) {
+      smb_remove_dirlist(share, list);
+    }
+    list = next;
+  }
 }
 
 void smb_clear_cache(struct smb_share *share) {
-  int idx;
+  struct smb_dentry *dentry;
+
+  share->cache_gen++;
+
+  while ((dentry = share->lru_head) != NULL) {
+    smb_unlink_dentry(share, dentry);
+    kfree(dentry);
+  }
+
+  while (share->dirlists) smb_remove_dirlist(share, share->dirlists);
+}
+
+struct smb_dirlist *smb_alloc_dirlist(struct smb_share *share, char *path) {
+  struct smb_dirlist *list;
+
+  if (share->dirlist_size <= 0) return NULL;
+
+  list = (struct smb_dirlist *) kmalloc(sizeof(struct smb_dirlist));
+  if (!list) return NULL;
+  memset(list, 0, sizeof(struct smb_dirlist));
+
+  strcpy(list->path, path);
+  list->gen = share->cache_gen;
+  list->refs = 1;
+
+  return list;
+}
+
+void smb_free_dirlist(struct smb_dirlist *list) {
+  if (list->buffer) kfree(list->buffer);
+  kfree(list);
+}
+
+int smb_add_dirlist_entry(struct smb_dirlist *list, char *name, struct stat64 *statbuf) {
+  struct smb_dirent *de;
+  int namelen = strlen(name);
+  int reclen = (sizeof(struct smb_dirent) + namelen + 1 + 3) & ~3;
+
+  // Grow listing buffer
+  if (list->size + reclen > list->bufsize) {
+    int bufsize = list->bufsize ? list->bufsize * 2 : SMB_DIRBUF_SIZE;
+    char *buffer;
+
+    while (list->size + reclen > bufsize) bufsize *= 2;
+    if (bufsize > SMB_DIRLIST_MAXSIZE) return -E2BIG;
+
+    buffer = (char *) kmalloc(bufsize);
+    if (!buffer) return -ENOMEM;
+    if (list->buffer) {
+      memcpy(buffer, list->buffer, list->size);
+      kfree(list->buffer);
+    }
+    list->buffer = buffer;
+    list->bufsize = bufsize;
+  }
+
+  de = (struct smb_dirent *) (list->buffer + list->size);
+  de->reclen = reclen;
+  de->namelen = namelen;
+  memcpy(&de->statbuf, statbuf, sizeof(struct stat64));
+  memcpy(de->name, name, namelen + 1);
+  list->size += reclen;
+
+  return 0;
+}
+
+void smb_commit_dirlist(struct smb_share *share, struct smb_dirlist *list) {
+  struct smb_dirlist *l;
+  struct smb_dirlist *next;
+
+  // Discard listing if the share has been modified while it was gathered
+  if (list->gen != share->cache_gen) return;
+
+  // Replace any existing listing for the directory
+  l = share->dirlists;
+  while (l) {
+    next = l->next;
+    if (stricmp(l->path, list->path) == 0) smb_remove_dirlist(share, l);
+    l = next;
+  }
+
+  // Evict oldest listing if cache is full
+  while (share->dirlist_count >= share->dirlist_size) {
+    l = share->dirlists;
+    while (l->next) l = l->next;
+    smb_remove_dirlist(share, l);
+  }
+
+  list->expires = kpit_get_time() + share->cache_ttl;
+  list->refs++;
+  list->next = share->dirlists;
+  share->dirlists = list;
+  share->dirlist_count++;
+}
+
+struct smb_dirlist *smb_find_dirlist(struct smb_share *share, char *path) {
+  struct smb_dirlist *list;
+
+  for (list = share->dirlists; list; list = list->next) {
+    if (stricmp(list->path, path) == 0) {
+      if (kpit_get_time() >= list->expires) {
+        smb_remove_dirlist(share, list);
+        return NULL;
+      }
+
+      list->refs++;
+      return list;
+    }
+  }
+
+  return NULL;
+}
 
-  for (idx = 0; idx < SMB_DENTRY_CACHESIZE; idx++) share->dircache[idx].path[0] = 0;
+void smb_release_dirlist(struct smb_dirlist *list) {
+  if (--list->refs == 0) smb_free_dirlist(list);
 }
@@ -56,6 +56,9 @@ int smb_mount(struct fs *fs, char *opts) {
   struct smb_share *share;
   int rc;
   unsigned short port;
+  int cachesize;
+  int cachettl;
+  int dircache;
 
   // Get options
   ipaddr.addr = get_num_option(opts, "addr", IP_ADDR_ANY);
@@ -64,6 +67,9 @@ int smb_mount(struct fs *fs, char *opts) {
   get_option(opts, "domain", domain, sizeof(domain), "");
   get_option(opts, "password", password, sizeof(password), "");
   port = get_num_option(opts, "port", 445);
+  cachesize = get_num_option(opts, "cachesize", SMB_DEFAULT_CACHESIZE);
+  cachettl = get_num_option(opts, "cachettl", SMB_DEFAULT_CACHETTL);
+  dircache = get_num_option(opts, "dircache", SMB_DEFAULT_DIRCACHE);
 
   // Check arguments
   if (!fs->mntfrom) return -EINVAL;
@@ -89,9 +95,17 @@ int smb_mount(struct fs *fs, char *opts) {
   memset(share, 0, sizeof(struct smb_share));
   strcpy(share->sharename, fs->mntfrom);
 
+  // Setup attribute and directory cache
+  rc = smb_init_cache(share, cachesize, cachettl, dircache);
+  if (rc < 0) {
+    kfree(share);
+    return rc;
+  }
+
   // Get connection to server
   rc = smb_get_connection(share, &ipaddr, port, domain, username, password);
   if (rc < 0) {
+    smb_free_cache(share);
     kfree(share);
     return rc;
   }
@@ -101,6 +115,7 @@ int smb_mount(struct fs *fs, char *opts) {
   if (rc == -ECONN || rc == -ERST) rc = smb_reconnect(share);
   if (rc < 0) {
     smb_release_connection(share);
+    smb_free_cache(share);
     kfree(share);
     return rc;
   }
@@ -120,6 +135,7 @@ int smb_umount(struct fs *fs) {
   smb_release_connection(share);
 
   // Deallocate share block
+  smb_free_cache(share);
   kfree(share);
 
   return 0;
@@ -277,6 +293,16 @@ int smb_open(struct file *filp, char *name) {
 
   file->fid = smb->params.rsp.create.fid;
   file->attrs = (unsigned short) smb->params.rsp.create.ext_file_attributes;
+  strcpy(file->path, name);
+
+  // Without oplocks, data can only be cached locally when the sharing mode
+  // keeps other clients from changing the file (read-ahead) or from
+  // accessing it at all (write-behind)
+  if ((filp->flags & O_DIRECT) == 0) {
+    file->readahead = (sharing & SMB_FILE_SHARE_WRITE) == 0 && (filp->flags & O_RANDOM) == 0;
+    file->writebehind = (sharing & (SMB_FILE_SHARE_READ | SMB_FILE_SHARE_WRITE)) == 0;
+  }
+  if (filp->flags & (O_CREAT | O_TRUNC)) smb_invalidate(share, name);
 
   if (file->attrs & SMB_FILE_ATTR_DIRECTORY) {
     file->statbuf.st_mode = S_IFDIR;
@@ -309,6 +335,209 @@ int smb_open(struct file *filp, char *name) {
   return 0;
 }
 
+static int smb_send_read(struct smb_share *share, struct smb_file *file, struct smb_mpx *req) {
+  struct smb *smb;
+
+  smb = smb_init(share, 0);
+  smb->mid = req->mid;
+  smb->params.req.read.andx.cmd = 0xFF;
+  smb->params.req.read.fid = file->fid;
+  smb->params.req.read.offset = ((struct smb_pos *) &req->pos)->low_part;
+  smb->params.req.read.max_count = req->size;
+  smb->params.req.read.offset_high = ((struct smb_pos *) &req->pos)->high_part;
+
+  return smb_send(share, smb, SMB_COM_READ_ANDX, 12, NULL, 0);
+}
+
+static int smb_send_write(struct smb_share *share, struct smb_file *file, struct smb_mpx *req) {
+  struct smb *smb;
+
+  smb = smb_init(share, 0);
+  smb->mid = req->mid;
+  smb->params.req.write.andx.cmd = 0xFF;
+  smb->params.req.write.fid = file->fid;
+  smb->params.req.write.offset = ((struct smb_pos *) &req->pos)->low_part;
+  smb->params.req.write.data_length = req->size;
+  smb->params.req.write.data_offset = SMB_HEADER_LEN + 14 * 2;
+  smb->params.req.write.offset_high = ((struct smb_pos *) &req->pos)->high_part;
+
+  return smb_send_data(share, smb, SMB_COM_WRITE_ANDX, 14, req->buf, req->size);
+}
+
+static struct smb_mpx *smb_find_mpx(struct smb_mpx *reqs, unsigned short mid) {
+  int i;
+
+  for (i = 0; i < SMB_MAX_MPX; i++) {
+    if (reqs[i].size != 0 && reqs[i].mid == mid) return &reqs[i];
+  }
+
+  return NULL;
+}
+
+static int smb_recv_read(struct smb_share *share, struct smb_mpx *reqs, struct smb_mpx **done) {
+  struct smb *smb;
+  struct smb_mpx *req;
+  int left;
+  int pad;
+  int len;
+  int rc;
+
+  *done = NULL;
+  smb = (struct smb *) share->server->buffer;
+  rc = smb_recv_header(share, smb, 12, &left);
+  if (rc < 0) return rc;
+
+  req = smb_find_mpx(reqs, smb->mid);
+  if (!req) return -EPROTO;
+  *done = req;
+
+  if (smb->error_class != SMB_SUCCESS) {
+    rc = smb_skip(share, left);
+    if (rc < 0) return rc;
+    return smb_errno(smb);
+  }
+
+  // Receive data directly into the request buffer
+  len = smb->params.rsp.read.data_length;
+  pad = smb->params.rsp.read.data_offset - (SMB_HEADER_LEN + 12 * 2);
+  if (len > req->size || pad < 0 || pad + len > left) return -EPROTO;
+
+  rc = smb_skip(share, pad);
+  if (rc < 0) return rc;
+
+  if (len > 0) {
+    rc = recv_fully(share->server->sock, req->buf, len, 0);
+    if (rc < 0) return rc;
+    if (rc != len) return -EIO;
+  }
+
+  rc = smb_skip(share, left - pad - len);
+  if (rc < 0) return rc;
+
+  return len;
+}
+
+static int smb_recv_write(struct smb_share *share, struct smb_mpx *reqs, struct smb_mpx **done) {
+  struct smb *smb;
+  struct smb_mpx *req;
+  int left;
+  int rc;
+
+  *done = NULL;
+  smb = (struct smb *) share->server->buffer;
+  rc = smb_recv_header(share, smb, 6, &left);
+  if (rc < 0) return rc;
+
+  req = smb_find_mpx(reqs, smb->mid);
+  if (!req) return -EPROTO;
+  *done = req;
+
+  if (smb->error_class != SMB_SUCCESS) {
+    rc = smb_skip(share, left);
+    if (rc < 0) return rc;
+    return smb_errno(smb);
+  }
+
+  rc = smb_skip(share, left);
+  if (rc < 0) return rc;
+
+  return smb->params.rsp.write.count;
+}
+
+static int smb_transfer(struct smb_share *share, struct smb_file *file, char *buf, size_t size, off64_t pos, int write) {
+  struct smb_server *server = share->server;
+  struct smb_mpx reqs[SMB_MAX_MPX];
+  struct smb_mpx *req;
+  size_t issued;
+  size_t end;
+  int outstanding;
+  int chunk;
+  int err;
+  int rc;
+  int i;
+
+  // Use large transfers if the server supports them
+  if (write) {
+    chunk = (server->server_caps & SMB_CAP_LARGE_WRITEX) ? SMB_LARGE_CHUNKSIZE : SMB_NORMAL_CHUNKSIZE;
+  } else {
+    chunk = (server->server_caps & SMB_CAP_LARGE_READX) ? SMB_LARGE_CHUNKSIZE : SMB_NORMAL_CHUNKSIZE;
+  }
+
+  rc = smb_check_connection(share);
+  if (rc < 0) return rc;
+
+  // Keep up to max_mpx requests outstanding and match replies by MID.
+  // Once an error has occurred no new requests are issued, but replies
+  // to outstanding requests are still drained to keep the stream in sync.
+  memset(reqs, 0, sizeof(reqs));
+  issued = 0;
+  end = size;
+  outstanding = 0;
+  err = 0;
+  while (1) {
+    while (!err && outstanding < server->max_mpx && issued < end) {
+      for (i = 0; reqs[i].size != 0; i++);
+      req = &reqs[i];
+
+      req->mid = smb_next_mid(share);
+      req->buf = buf + issued;
+      req->pos = pos + issued;
+      req->size = end - issued < (size_t) chunk ? end - issued : chunk;
+
+      rc = write ? smb_send_write(share, file, req) : smb_send_read(share, file, req);
+      if (rc < 0) {
+        req->size = 0;
+        err = rc;
+        break;
+      }
+
+      issued += req->size;
+      outstanding++;
+    }
+
+    if (outstanding == 0) break;
+
+    rc = write ? smb_recv_write(share, reqs, &req) : smb_recv_read(share, reqs, &req);
+    if (!req) {
+      // Reply stream is out of sync; drop the connection
+      smb_reconnect(share);
+      return rc;
+    }
+
+    if (rc < 0) {
+      if (!err) err = rc;
+    } else if (rc < req->size) {
+      // Short transfer, no data beyond this point
+      if ((size_t) (req->pos - pos) + rc < end) end = (size_t) (req->pos - pos) + rc;
+    }
+
+    req->size = 0;
+    outstanding--;
+  }
+
+  if (err < 0) return err;
+  return end;
+}
+
+static int smb_flush_write_behind(struct smb_share *share, struct smb_file *file) {
+  int rc;
+
+  if (file->wblen == 0) return 0;
+
+  rc = smb_transfer(share, file, file->wbbuf, file->wblen, file->wbpos, 1);
+  file->wblen = 0;
+  if (rc < 0) return rc;
+
+  return 0;
+}
+
+static void smb_free_buffers(struct smb_file *file) {
+  if (file->rabuf) kfree(file->rabuf);
+  if (file->wbbuf) kfree(file->wbbuf);
+  file->rabuf = file->wbbuf = NULL;
+  file->ralen = file->wblen = 0;
+}
+
 int smb_close(struct file *filp) {
   struct smb_share *share = (struct smb_share *) filp->fs->data;
   struct smb *smb;
@@ -317,6 +546,9 @@ int smb_close(struct file *filp) {
   if (filp->flags & F_DIR) {
     struct smb_directory *dir = (struct smb_directory *) filp->data;
 
+    if (dir->list) smb_release_dirlist(dir->list);
+    if (dir->fill) smb_release_dirlist(dir->fill);
+
     if (!dir->eos) {
       smb = smb_init(share, 0);
       smb->params.req.findclose.sid = dir->sid;
@@ -330,18 +562,22 @@ int smb_close(struct file *filp) {
   } else {
     struct smb_file *file = (struct smb_file *) filp->data;
 
+    rc = smb_flush_write_behind(share, file);
+    if (rc < 0) return rc;
+
     smb = smb_init(share, 0);
     smb->params.req.close.fid = file->fid;
 
     rc = smb_request(share, smb, SMB_COM_CLOSE, 3, NULL, 0, 0);
     if (rc < 0) return rc;
 
+    if (filp->flags & F_MODIFIED) smb_invalidate(share, file->path);
+
+    smb_free_buffers(file);
     kfree(file);
     filp->data = NULL;
   }
 
-  smb_clear_cache(share);
-
   return 0;
 }
 
@@ -357,6 +593,9 @@ int smb_fsync(struct file *filp) {
 
   if (filp->flags & F_DIR) return -EBADF;
 
+  rc = smb_flush_write_behind(share, file);
+  if (rc < 0) return rc;
+
   smb = smb_init(share, 0);
   smb->params.req.flush.fid = file->fid;
 
@@ -366,128 +605,73 @@ int smb_fsync(struct file *filp) {
   return 0;
 }
 
-static int smb_read_raw(struct smb_share *share, struct smb_file *file, void *data, size_t size, unsigned long pos) {
-  struct smb *smb;
-  unsigned char hdr[4];
-  int len;
-  int rc;
-
-  smb = smb_init(share, 0);
-  smb->params.req.readraw.fid = file->fid;
-  smb->params.req.readraw.offset = pos;
-  smb->params.req.readraw.max_count = size;
-
-  rc = smb_send(share, smb, SMB_COM_READ_RAW, 8, NULL, 0);
-  if (rc < 0) return rc;
-
-  rc = recv_fully(share->server->sock, (char *) &hdr, 4, 0);
-  if (rc < 0) return rc;
-
-  len = hdr[3] | (hdr[2] << 8) | (hdr[1] << 16) | (hdr[0] << 24);
-  if (len == 0) return 0;
-
-  rc = recv_fully(share->server->sock, data, len, 0);
-  if (rc < 0) return rc;
-
-  return rc;
-}
-
-static int smb_read_normal(struct smb_share *share, struct smb_file *file, void *data, size_t size, off64_t pos) {
-  struct smb *smb;
-  int len;
-  int rc;
-
-  // Read from file
-  smb = smb_init(share, 0);
-  smb->params.req.read.andx.cmd = 0xFF;
-  smb->params.req.read.fid = file->fid;
-  smb->params.req.read.offset = ((struct smb_pos *) &pos)->low_part;
-  smb->params.req.read.max_count = size;
-  smb->params.req.read.offset_high = ((struct smb_pos *) &pos)->high_part;
-
-  rc = smb_request(share, smb, SMB_COM_READ_ANDX, 12, NULL, 0, 0);
-  if (rc < 0) return rc;
-
-  len = smb->params.rsp.read.data_length;
-  if (len) memcpy(data, (char *) smb + smb->params.rsp.read.data_offset + 4, len);
-
-  return len;
-}
-
 int smb_read(struct file *filp, void *data, size_t size, off64_t pos) {
   struct smb_share *share = (struct smb_share *) filp->fs->data;
   struct smb_file *file = (struct smb_file *) filp->data;
   char *p;
   size_t left;
   size_t count;
+  int sequential;
   int rc;
 
   if (filp->flags & F_DIR) return -EBADF;
   if (size == 0) return 0;
 
+  // Make pending writes visible to the read
+  rc = smb_flush_write_behind(share, file);
+  if (rc < 0) return rc;
+
   left = size;
   p = (char *) data;
+  sequential = pos == file->nextpos && file->readahead;
+
+  while (left > 0) {
+    // Copy data from read-ahead buffer
+    if (file->ralen > 0 && pos >= file->rapos && pos < file->rapos + file->ralen) {
+      count = (size_t) (file->rapos + file->ralen - pos);
+      if (count > left) count = left;
+      memcpy(p, file->rabuf + (size_t) (pos - file->rapos), count);
+
+      pos += count;
+      left -= count;
+      p += count;
+      continue;
+    }
 
-  if (filp->pos < file->statbuf.st_size && pos < 0x80000000) {
-    // Read data using raw mode
-    while (1) {
-      count = left;
-      if (count > SMB_RAW_CHUNKSIZE) count = SMB_RAW_CHUNKSIZE;
+    if (pos >= file->statbuf.st_size) break;
 
-      rc = smb_read_raw(share, file, p, count, (unsigned long) pos);
+    if (!sequential || left >= SMB_READAHEAD_SIZE) {
+      // Read directly into caller's buffer
+      rc = smb_transfer(share, file, p, left, pos, 0);
       if (rc < 0) return rc;
-      if (rc == 0) break;
 
       pos += rc;
       left -= rc;
-      p += rc;
-
-      if (left == 0) return size;
+      break;
     }
-  }
 
-  // Read rest using normal mode
-  while (pos < file->statbuf.st_size && left > 0) {
-    count = left;
-    if (count > SMB_NORMAL_CHUNKSIZE) count = SMB_NORMAL_CHUNKSIZE;
+    // Fill read-ahead window starting at the current position
+    if (!file->rabuf) {
+      file->rabuf = (char *) kmalloc(SMB_READAHEAD_SIZE);
+      if (!file->rabuf) return -ENOMEM;
+    }
 
-    rc = smb_read_normal(share, file, p, count, pos);
+    file->ralen = 0;
+    rc = smb_transfer(share, file, file->rabuf, SMB_READAHEAD_SIZE, pos, 0);
     if (rc < 0) return rc;
-    if (rc == 0) return size - left;
+    if (rc == 0) break;
 
-    pos += rc;
-    left -= rc;
-    p += rc;
+    file->rapos = pos;
+    file->ralen = rc;
   }
 
+  file->nextpos = pos;
   return size - left;
 }
 
-static int smb_write_normal(struct smb_share *share, struct smb_file *file, void *data, size_t size, off64_t pos) {
-  struct smb *smb;
-  int rc;
-
-  // Write to file
-  smb = smb_init(share, 0);
-  smb->params.req.write.andx.cmd = 0xFF;
-  smb->params.req.write.fid = file->fid;
-  smb->params.req.write.offset = ((struct smb_pos *) &pos)->low_part;
-  smb->params.req.write.data_length = size;
-  smb->params.req.write.data_offset = SMB_HEADER_LEN + 14 * 2;
-  smb->params.req.write.offset_high = ((struct smb_pos *) &pos)->high_part;
-
-  rc = smb_request(share, smb, SMB_COM_WRITE_ANDX, 14, data, size, 0);
-  if (rc < 0) return rc;
-
-  return smb->params.rsp.write.count;
-}
-
 int smb_write(struct file *filp, void *data, size_t size, off64_t pos) {
   struct smb_share *share = (struct smb_share *) filp->fs->data;
   struct smb_file *file = (struct smb_file *) filp->data;
-  char *p;
-  size_t left;
-  size_t count;
   int rc;
 
   if (filp->flags & F_DIR) return -EBADF;
@@ -495,25 +679,119 @@ int smb_write(struct file *filp, void *data, size_t size, off64_t pos) {
 
   if (filp->flags & O_APPEND) pos = file->statbuf.st_size;
 
-  left = size;
-  p = (char *) data;
+  // Read-ahead data and cached attributes are stale after write
+  file->ralen = 0;
+  if ((filp->flags & F_MODIFIED) == 0) smb_invalidate(share, file->path);
 
-  while (left > 0) {
-    count = left;
-    if (count > SMB_NORMAL_CHUNKSIZE) count = SMB_NORMAL_CHUNKSIZE;
+  // Flush write-behind buffer if this write does not extend it
+  if (file->wblen > 0) {
+    if (pos != file->wbpos + file->wblen || file->wblen + size > SMB_WRITEBEHIND_SIZE) {
+      rc = smb_flush_write_behind(share, file);
+      if (rc < 0) return rc;
+    }
+  }
+
+  if (size < SMB_WRITEBEHIND_SIZE && file->writebehind) {
+    // Collect small sequential writes in write-behind buffer
+    if (!file->wbbuf) {
+      file->wbbuf = (char *) kmalloc(SMB_WRITEBEHIND_SIZE);
+      if (!file->wbbuf) return -ENOMEM;
+    }
 
-    rc = smb_write_normal(share, file, p, count, pos);
+    if (file->wblen == 0) file->wbpos = pos;
+    memcpy(file->wbbuf + file->wblen, data, size);
+    file->wblen += size;
+    rc = size;
+  } else {
+    rc = smb_transfer(share, file, (char *) data, size, pos, 1);
     if (rc < 0) return rc;
+  }
 
-    pos += rc;
-    filp->flags |= F_MODIFIED;
-    left -= rc;
-    p += rc;
+  pos += rc;
+  filp->flags |= F_MODIFIED;
+  if (pos > file->statbuf.st_size) file->statbuf.st_size = pos;
 
-    if (pos > file->statbuf.st_size) file->statbuf.st_size = pos;
+  return rc;
+}
+
+//
+// Copy a byte range between two files on the same share with server-side
+// copy (FSCTL_SRV_COPYCHUNK), so the data never crosses the network. If
+// the server does not support it, -ENOSYS is returned and the caller falls
+// back to copying through the client.
+//
+
+int smb_copy_range(struct file *in, off64_t inpos, struct file *out, off64_t outpos, size_t count) {
+  struct smb_share *share = (struct smb_share *) out->fs->data;
+  struct smb_file *src = (struct smb_file *) in->data;
+  struct smb_file *dst = (struct smb_file *) out->data;
+  struct smb_resume_key_response key;
+  struct smb_copychunk_request req;
+  struct smb_copychunk_response rsp;
+  size_t copied;
+  size_t len;
+  off64_t left;
+  int n;
+  int rsplen;
+  int rc;
+
+  if ((in->flags & F_DIR) || (out->flags & F_DIR)) return -EBADF;
+  if (share->server->no_copychunk) return -ENOSYS;
+  if (in->fs->data != out->fs->data) return -EXDEV;
+
+  left = src->statbuf.st_size - inpos;
+  if (left <= 0) return 0;
+  if (count > left) count = (size_t) left;
+
+  // Pending writes on both files must reach the server first
+  rc = smb_flush_write_behind(share, src);
+  if (rc < 0) return rc;
+  rc = smb_flush_write_behind(share, dst);
+  if (rc < 0) return rc;
+  dst->ralen = 0;
+  if ((out->flags & F_MODIFIED) == 0) smb_invalidate(share, dst->path);
+
+  rsplen = sizeof(key);
+  rc = smb_nt_ioctl(share, FSCTL_SRV_REQUEST_RESUME_KEY, src->fid, NULL, 0, &key, &rsplen);
+  if (rc < 0 || rsplen < 24) {
+    if (rc == -ECONN || rc == -ERST || rc == -ETIMEOUT) return rc;
+    share->server->no_copychunk = 1;
+    return -ENOSYS;
+  }
+
+  copied = 0;
+  while (copied < count) {
+    if (out->flags & F_CLOSED) return copied > 0 ? copied : -EINTR;
+
+    memset(&req, 0, sizeof(req));
+    memcpy(req.key, key.key, sizeof(req.key));
+    n = 0;
+    len = 0;
+    while (n < SMB_COPYCHUNK_COUNT && copied + len < count) {
+      req.chunks[n].source_offset = inpos + copied + len;
+      req.chunks[n].target_offset = outpos + copied + len;
+      req.chunks[n].length = count - copied - len < SMB_COPYCHUNK_SIZE ? count - copied - len : SMB_COPYCHUNK_SIZE;
+      len += req.chunks[n].length;
+      n++;
+    }
+    req.chunk_count = n;
+
+    rsplen = sizeof(rsp);
+    rc = smb_nt_ioctl(share, FSCTL_SRV_COPYCHUNK, dst->fid, &req, 32 + n * sizeof(struct smb_copychunk), &rsp, &rsplen);
+    if (rc < 0 || rsplen < (int) sizeof(rsp)) {
+      if (copied > 0) break;
+      if (rc == -ECONN || rc == -ERST || rc == -ETIMEOUT) return rc;
+      share->server->no_copychunk = 1;
+      return -ENOSYS;
+    }
+
+    copied += rsp.total_bytes_written;
+    out->flags |= F_MODIFIED;
+    if (rsp.total_bytes_written != len) break;
   }
 
-  return size;
+  if (outpos + copied > dst->statbuf.st_size) dst->statbuf.st_size = outpos + copied;
+  return copied;
 }
 
 int smb_ioctl(struct file *filp, int cmd, void *data, size_t size) {
@@ -555,6 +833,11 @@ int smb_ftruncate(struct file *filp, off64_t size) {
   int rc;
   int rsplen;
 
+  rc = smb_flush_write_behind(share, file);
+  if (rc < 0) return rc;
+  file->ralen = 0;
+  smb_invalidate(share, file->path);
+
   memset(&req, 0, sizeof(req));
   req.fid = file->fid;
   req.infolevel = 0x104;
@@ -579,6 +862,10 @@ int smb_futime(struct file *filp, struct utimbuf *times) {
   int rc;
   int rsplen;
 
+  rc = smb_flush_write_behind(share, file);
+  if (rc < 0) return rc;
+  smb_invalidate(share, file->path);
+
   memset(&req, 0, sizeof(req));
   req.fid = file->fid;
   req.infolevel = 0x101;
@@ -617,10 +904,16 @@ int smb_utime(struct fs *fs, char *name, struct utimbuf *times) {
 }
 
 int smb_fstat(struct file *filp, struct stat64 *buffer) {
+  struct smb_share *share = (struct smb_share *) filp->fs->data;
   struct smb_file *file = (struct smb_file *) filp->data;
+  int rc;
 
   if (filp->flags & F_DIR) return -EBADF;
 
+  // Report errors from pending writes
+  rc = smb_flush_write_behind(share, file);
+  if (rc < 0) return rc;
+
   if (buffer) memcpy(buffer, &file->statbuf, sizeof(struct stat64));
 
   return (int) file->statbuf.st_size;
@@ -699,6 +992,8 @@ int smb_stat(struct fs *fs, char *name, struct stat64 *buffer) {
     buffer->st_mtime = ft2time(rspb.last_write_time);
     buffer->st_ctime = ft2time(rspb.creation_time);
     buffer->st_size = rsps.end_of_file;
+
+    smb_add_to_cache(share, name, NULL, buffer);
   }
 
   return (int) rsps.end_of_file;
@@ -721,6 +1016,7 @@ int smb_mkdir(struct fs *fs, char *name, int mode) {
   *p++ = 4;
   p = addstrz(p, name);
 
+  smb_invalidate(share, name);
   rc = smb_request(share, smb, SMB_COM_CREATE_DIRECTORY, 0, namebuf, p - namebuf, 1);
   if (rc < 0) return rc;
 
@@ -744,6 +1040,7 @@ int smb_rmdir(struct fs *fs, char *name) {
   *p++ = 4;
   p = addstrz(p, name);
 
+  smb_invalidate(share, name);
   rc = smb_request(share, smb, SMB_COM_DELETE_DIRECTORY, 0, namebuf, p - namebuf, 1);
   if (rc < 0) return rc;
 
@@ -772,6 +1069,8 @@ int smb_rename(struct fs *fs, char *oldname, char *newname) {
   *p++ = 4;
   p = addstrz(p, newname);
 
+  // Cached entries below a renamed directory would become stale
+  smb_clear_cache(share);
   rc = smb_request(share, smb, SMB_COM_RENAME, 1, namebuf, p - namebuf, 1);
   if (rc < 0) return rc;
 
@@ -799,6 +1098,7 @@ int smb_unlink(struct fs *fs, char *name) {
   *p++ = 4;
   p = addstrz(p, name);
 
+  smb_invalidate(share, name);
   rc = smb_request(share, smb, SMB_COM_DELETE, 1, namebuf, p - namebuf, 1);
   if (rc < 0) return rc;
 
@@ -819,6 +1119,18 @@ int smb_opendir(struct file *filp, char *name) {
 
   dir = (struct smb_directory *) kmalloc(sizeof(struct smb_directory));
   if (!dir) return -ENOMEM;
+  strcpy(dir->path, name);
+  dir->fill = NULL;
+  dir->listpos = 0;
+
+  // Use cached directory listing if available
+  dir->list = smb_find_dirlist(share, name);
+  if (dir->list) {
+    dir->eos = 1;
+    dir->entries_left = 0;
+    filp->data = dir;
+    return 0;
+  }
 
   memset(&req, 0, sizeof(req));
   req.search_attributes = SMB_FILE_ATTR_SYSTEM | SMB_FILE_ATTR_HIDDEN | SMB_FILE_ATTR_DIRECTORY;
@@ -840,19 +1152,38 @@ int smb_opendir(struct file *filp, char *name) {
   dir->eos = rsp.end_of_search;
   dir->entries_left = rsp.search_count;
   dir->fi = (struct smb_file_directory_info *) dir->buffer;
-  strcpy(dir->path, name);
+
+  // Gather listing for the directory cache while reading
+  dir->fill = smb_alloc_dirlist(share, name);
 
   filp->data = dir;
   return 0;
 }
 
-int smb_readdir(struct file *filp, struct direntry *dirp, int count) {
+static int smb_read_dir_entry(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count) {
   struct smb_share *share = (struct smb_share *) filp->fs->data;
   struct smb_directory *dir = (struct smb_directory *) filp->data;
   struct stat64 statbuf;
 
   if (count != 1) return -EINVAL;
 
+  // Return entry from cached listing
+  if (dir->list) {
+    struct smb_dirent *de;
+
+    if (dir->listpos >= dir->list->size) return 0;
+    de = (struct smb_dirent *) (dir->list->buffer + dir->listpos);
+    dir->listpos += de->reclen;
+
+    dirp->ino = 0;
+    dirp->namelen = de->namelen;
+    dirp->reclen = sizeof(struct direntry) - MAXPATH + dirp->namelen + 1;
+    memcpy(dirp->name, de->name, de->namelen + 1);
+
+    if (buffer) memcpy(buffer, &de->statbuf, sizeof(struct stat64));
+    return 1;
+  }
+
 again:
   if (dir->entries_left == 0) {
     struct smb_findnext_request req;
@@ -861,7 +1192,15 @@ again:
     int buflen;
     int rc;
 
-    if (dir->eos) return 0;
+    if (dir->eos) {
+      // Listing is complete; add it to the directory cache
+      if (dir->fill) {
+        smb_commit_dirlist(share, dir->fill);
+        smb_release_dirlist(dir->fill);
+        dir->fill = NULL;
+      }
+      return 0;
+    }
 
     memset(&req, 0, sizeof(req));
     req.sid = dir->sid;
@@ -905,6 +1244,12 @@ again:
 
   smb_add_to_cache(share, dir->path, dir->fi->filename, &statbuf);
 
+  if (dir->fill && smb_add_dirlist_entry(dir->fill, dir->fi->filename, &statbuf) < 0) {
+    // Directory too large to cache
+    smb_release_dirlist(dir->fill);
+    dir->fill = NULL;
+  }
+
   dirp->ino = 0;
   dirp->namelen = strlen(dir->fi->filename);
   dirp->reclen = sizeof(struct direntry) - MAXPATH + dirp->namelen + 1;
@@ -913,9 +1258,20 @@ again:
   dir->entries_left--;
   dir->fi = (struct smb_file_directory_info *) ((char *) dir->fi + dir->fi->next_entry_offset);
 
+  // The find response already holds the attributes for the entry
+  if (buffer) memcpy(buffer, &statbuf, sizeof(struct stat64));
+
   return 1;
 }
 
+int smb_readdir(struct file *filp, struct direntry *dirp, int count) {
+  return smb_read_dir_entry(filp, dirp, NULL, count);
+}
+
+int smb_readdirplus(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count) {
+  return smb_read_dir_entry(filp, dirp, buffer, count);
+}
+
 struct fsops smbfsops = {
   0,
 
@@ -962,7 +1318,17 @@ struct fsops smbfsops = {
   smb_unlink,
 
   smb_opendir,
-  smb_readdir
+  smb_readdir,
+
+  NULL,
+
+  NULL,
+
+  smb_readdirplus,
+
+  NULL,
+
+  smb_copy_range
 };
 
 void init_smbfs() {
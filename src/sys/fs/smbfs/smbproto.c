@@ -130,6 +130,102 @@ int smb_request(struct smb_share *share, struct smb *smb, unsigned char cmd, int
   return 0;
 }
 
+unsigned short smb_next_mid(struct smb_share *share) {
+  struct smb_server *server = share->server;
+
+  // MID 0xFFFF is reserved for oplock break notifications
+  if (++server->next_mid == 0xFFFF) server->next_mid = 1;
+  return server->next_mid;
+}
+
+int smb_send_data(struct smb_share *share, struct smb *smb, unsigned char cmd, int params, char *data, int datasize) {
+  struct iovec iov[2];
+  int hdrlen;
+  int len;
+  int rc;
+  char *p;
+
+  // Send header from the message buffer and data directly from the caller's buffer
+  hdrlen = SMB_HEADER_LEN + params * 2;
+  len = hdrlen + datasize;
+
+  smb->len[0] = (len & 0xFF000000) >> 24;
+  smb->len[1] = (len & 0xFF0000) >> 16;
+  smb->len[2] = (len & 0xFF00) >> 8;
+  smb->len[3] = (len & 0xFF);
+
+  smb->protocol[0] = 0xFF;
+  smb->protocol[1] = 'S';
+  smb->protocol[2] = 'M';
+  smb->protocol[3] = 'B';
+
+  smb->cmd = cmd;
+  smb->tid = share->tid;
+  smb->uid = share->server->uid;
+  smb->wordcount = (unsigned char) params;
+  smb->flags = (1 << 3);
+  smb->flags2 = 1;
+
+  p = (char *) smb->params.words + params * 2;
+  *((unsigned short *) p) = (unsigned short) datasize;
+
+  iov[0].iov_base = smb;
+  iov[0].iov_len = hdrlen + 4;
+  iov[1].iov_base = data;
+  iov[1].iov_len = datasize;
+
+  rc = sendv(share->server->sock, iov, datasize ? 2 : 1);
+  if (rc < 0) return rc;
+  if (rc != len + 4) return -EIO;
+
+  return 0;
+}
+
+int smb_recv_header(struct smb_share *share, struct smb *smb, int params, int *left) {
+  int len;
+  int hdrlen;
+  int rc;
+
+  // Receive message header and parameter words, leaving the data in the socket.
+  // The caller must check the error class and consume the remaining bytes.
+  rc = recv_fully(share->server->sock, (char *) smb, 4, 0);
+  if (rc < 0) return rc;
+  if (rc != 4) return -EIO;
+
+  len = smb->len[3] | (smb->len[2] << 8) | (smb->len[1] << 16) | (smb->len[0] << 24);
+  if (len < 4 || len > SMB_LARGE_CHUNKSIZE + SMB_MAX_BUFFER) return -EMSGSIZE;
+
+  hdrlen = SMB_HEADER_LEN + params * 2;
+  if (hdrlen > len) hdrlen = len;
+
+  rc = recv_fully(share->server->sock, (char *) &smb->protocol, hdrlen, 0);
+  if (rc < 0) return rc;
+  if (rc != hdrlen) return -EIO;
+  if (smb->protocol[0] != 0xFF || smb->protocol[1] != 'S' || smb->protocol[2] != 'M' || smb->protocol[3] != 'B') return -EPROTO;
+
+  *left = len - hdrlen;
+  return 0;
+}
+
+int smb_skip(struct smb_share *share, int len) {
+  struct smb_server *server = share->server;
+  int count;
+  int rc;
+
+  while (len > 0) {
+    count = len;
+    if (count > sizeof(server->auxbuf)) count = sizeof(server->auxbuf);
+
+    rc = recv_fully(server->sock, server->auxbuf, count, 0);
+    if (rc < 0) return rc;
+    if (rc != count) return -EIO;
+
+    len -= count;
+  }
+
+  return 0;
+}
+
 int smb_trans_send(struct smb_share *share, unsigned short cmd,
                    void *params, int paramlen,
                    void *data, int datalen,
@@ -283,6 +379,56 @@ int smb_trans(struct smb_share *share,
   return 0;
 }
 
+//
+// Issue a file system control on an open file through NT_TRANSACT_IOCTL.
+// Only small requests and replies that fit in a single message are
+// supported, which is all the server-side copy controls need.
+//
+
+int smb_nt_ioctl(struct smb_share *share, unsigned long function, unsigned short fid,
+                 void *indata, int inlen, void *outdata, int *outlen) {
+  struct smb *smb;
+  int wordcount = 19 + 4;
+  int dataofs = ROUNDUP(SMB_HEADER_LEN + 2 * wordcount + 2);
+  int pad = dataofs - (SMB_HEADER_LEN + 2 * wordcount + 2);
+  char data[4 + sizeof(struct smb_copychunk_request)];
+  int datacnt;
+  int rc;
+
+  if (pad + inlen > (int) sizeof(data)) return -EINVAL;
+
+  smb = smb_init(share, 0);
+  smb->params.req.nttrans.max_setup_count = 0;
+  smb->params.req.nttrans.total_parameter_count = 0;
+  smb->params.req.nttrans.total_data_count = inlen;
+  smb->params.req.nttrans.max_parameter_count = 0;
+  smb->params.req.nttrans.max_data_count = *outlen;
+  smb->params.req.nttrans.parameter_count = 0;
+  smb->params.req.nttrans.parameter_offset = dataofs;
+  smb->params.req.nttrans.data_count = inlen;
+  smb->params.req.nttrans.data_offset = dataofs;
+  smb->params.req.nttrans.setup_count = 4;
+  smb->params.req.nttrans.function = NT_TRANSACT_IOCTL;
+  smb->params.req.nttrans.setup[0] = (unsigned short) (function & 0xFFFF);
+  smb->params.req.nttrans.setup[1] = (unsigned short) (function >> 16);
+  smb->params.req.nttrans.setup[2] = fid;
+  smb->params.req.nttrans.setup[3] = 1; // IsFsctl
+
+  memset(data, 0, pad);
+  if (inlen) memcpy(data + pad, indata, inlen);
+
+  rc = smb_request(share, smb, SMB_COM_NT_TRANSACT, wordcount, data, pad + inlen, 1);
+  if (rc < 0) return rc;
+
+  datacnt = smb->params.rsp.nttrans.data_count;
+  if (datacnt != smb->params.rsp.nttrans.total_data_count) return -EBUF;
+  if (datacnt > *outlen) return -EBUF;
+  if (datacnt) memcpy(outdata, (char *) smb + smb->params.rsp.nttrans.data_offset + 4, datacnt);
+  *outlen = datacnt;
+
+  return 0;
+}
+
 int smb_connect_tree(struct smb_share *share) {
   struct smb *smb;
   int rc;
@@ -354,6 +500,8 @@ int smb_connect(struct smb_share *share) {
   server->server_caps = smb->params.rsp.negotiate.capabilities;
   server->max_buffer_size = smb->params.rsp.negotiate.max_buffer_size;
   max_mpx_count = smb->params.rsp.negotiate.max_mpx_count;
+  server->max_mpx = max_mpx_count < SMB_MAX_MPX ? max_mpx_count : SMB_MAX_MPX;
+  if (server->max_mpx == 0) server->max_mpx = 1;
 
   // Setup session
   smb = smb_init(share, 1);
@@ -362,7 +510,7 @@ int smb_connect(struct smb_share *share) {
   smb->params.req.setup.max_mpx_count = max_mpx_count;
   smb->params.req.setup.ansi_password_length = strlen(server->password);
   smb->params.req.setup.unicode_password_length = 0;
-  smb->params.req.setup.capabilities = SMB_CAP_NT_SMBS;
+  smb->params.req.setup.capabilities = SMB_CAP_NT_SMBS | SMB_CAP_LARGE_READX | SMB_CAP_LARGE_WRITEX;
 
   p = buf;
   p = addstr(p, server->password);
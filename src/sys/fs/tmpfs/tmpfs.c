@@ -0,0 +1,1226 @@
+//
+// tmpfs.c
+//
+// RAM Filesystem
+//
+// Copyright (C) 2002 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+//
+
+#include <os/krnl.h>
+#include <os/vmm.h>
+#include <os/kmem.h>
+#include <os/kmalloc.h>
+#include <os/dev.h>
+#include <os/user.h>
+#include <stdlib.h>
+
+#define TMPFS_ROOT_INODE     1
+#define TMPFS_MIN_BUCKETS    8       // Initial size of directory hash table
+#define TMPFS_MIN_PAGEVEC    8       // Initial size of file page vector
+#define TMPFS_RESERVE        256     // Pages always left for the rest of the system
+#define TMPFS_DEFAULT_NODES  8192    // Default maximum number of files
+
+// No file can hold more pages than the whole file system
+#define TMPFS_MAXFILESIZE(tfs) ((off64_t) (tfs)->max_pages * PAGESIZE)
+
+int tmpfs_mount(struct fs *fs, char *opts);
+int tmpfs_umount(struct fs *fs);
+int tmpfs_statfs(struct fs *fs, struct statfs *buf);
+
+int tmpfs_open(struct file *filp, char *name);
+int tmpfs_close(struct file *filp);
+int tmpfs_destroy(struct file *filp);
+int tmpfs_fsync(struct file *filp);
+
+int tmpfs_read(struct file *filp, void *data, size_t size, off64_t pos);
+int tmpfs_write(struct file *filp, void *data, size_t size, off64_t pos);
+
+off64_t tmpfs_tell(struct file *filp);
+off64_t tmpfs_lseek(struct file *filp, off64_t offset, int origin);
+int tmpfs_ftruncate(struct file *filp, off64_t size);
+
+int tmpfs_futime(struct file *filp, struct utimbuf *times);
+int tmpfs_utime(struct fs *fs, char *name, struct utimbuf *times);
+
+int tmpfs_fstat(struct file *filp, struct stat64 *buffer);
+int tmpfs_stat(struct fs *fs, char *name, struct stat64 *buffer);
+
+int tmpfs_access(struct fs *fs, char *name, int mode);
+
+int tmpfs_fchmod(struct file *filp, int mode);
+int tmpfs_chmod(struct fs *fs, char *name, int mode);
+int tmpfs_fchown(struct file *filp, int owner, int group);
+int tmpfs_chown(struct fs *fs, char *name, int owner, int group);
+
+int tmpfs_mkdir(struct fs *fs, char *name, int mode);
+int tmpfs_rmdir(struct fs *fs, char *name);
+
+int tmpfs_rename(struct fs *fs, char *oldname, char *newname);
+int tmpfs_link(struct fs *fs, char *oldname, char *newname);
+int tmpfs_unlink(struct fs *fs, char *name);
+
+int tmpfs_opendir(struct file *filp, char *name);
+int tmpfs_readdir(struct file *filp, struct direntry *dirp, int count);
+int tmpfs_readdirplus(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count);
+
+int tmpfs_fallocate(struct file *filp, int mode, off64_t offset, off64_t len);
+int tmpfs_map_page(struct file *filp, off64_t offset, unsigned long *pfn);
+
+struct fsops tmpfsops = {
+  FSOP_READ | FSOP_WRITE | FSOP_TELL | FSOP_LSEEK | FSOP_FSTAT | FSOP_STAT |
+  FSOP_ACCESS | FSOP_READDIR | FSOP_READDIRPLUS,
+
+  NULL,
+  NULL,
+
+  NULL,
+  tmpfs_mount,
+  tmpfs_umount,
+
+  tmpfs_statfs,
+
+  tmpfs_open,
+  tmpfs_close,
+  tmpfs_destroy,
+  tmpfs_fsync,
+
+  tmpfs_read,
+  tmpfs_write,
+  NULL,
+
+  tmpfs_tell,
+  tmpfs_lseek,
+  tmpfs_ftruncate,
+
+  tmpfs_futime,
+  tmpfs_utime,
+
+  tmpfs_fstat,
+  tmpfs_stat,
+
+  tmpfs_access,
+
+  tmpfs_fchmod,
+  tmpfs_chmod,
+  tmpfs_fchown,
+  tmpfs_chown,
+
+  tmpfs_mkdir,
+  tmpfs_rmdir,
+
+  tmpfs_rename,
+  tmpfs_link,
+  tmpfs_unlink,
+
+  tmpfs_opendir,
+  tmpfs_readdir,
+
+  tmpfs_fallocate,
+
+  NULL,
+
+  tmpfs_readdirplus,
+
+  tmpfs_map_page
+};
+
+//
+// Each file or directory is a node. File data is kept in a vector of
+// pages that are allocated when first written, so holes use no memory.
+// Directories keep their entries in a hash table for lookup and in a
+// list in creation order for readdir. A node is freed when it has no
+// more directory entries and no open files.
+//
+
+struct tmpfs_dirent {
+  struct tmpfs_dirent *hashnext;
+  struct tmpfs_dirent *next;
+  struct tmpfs_dirent *prev;
+  struct tmpfs_node *node;
+  unsigned long hash;
+  unsigned long seq;
+  int namelen;
+  char name[1];
+};
+
+struct tmpfs_node {
+  ino_t ino;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  int nlink;
+  int refs;
+  int maps;
+  time_t atime;
+  time_t mtime;
+  time_t ctime;
+  off64_t size;
+
+  // Regular files
+  char **pages;
+  unsigned int pagevec;
+
+  // Directories
+  struct tmpfs_node *parent;
+  struct tmpfs_dirent **buckets;
+  unsigned int nbuckets;
+  unsigned int entries;
+  struct tmpfs_dirent *first;
+  struct tmpfs_dirent *last;
+  unsigned long nextseq;
+  unsigned long gen;
+};
+
+struct tmpfs {
+  struct tmpfs_node *root;
+  ino_t nextino;
+  unsigned int max_pages;
+  unsigned int used_pages;
+  unsigned int max_nodes;
+  unsigned int nodes;
+};
+
+//
+// Per open file state. Directory readers remember the last entry
+// returned, which stays valid as long as no entry has been removed
+// from the directory (gen is unchanged).
+//
+
+struct tmpfs_file {
+  struct tmpfs_node *node;
+  int mapped;
+  struct tmpfs_dirent *cursor;
+  unsigned long gen;
+};
+
+static unsigned long namehash(char *name, int len) {
+  unsigned long h = 0;
+
+  while (len-- > 0) h = (h << 5) + h + (unsigned char) *name++;
+  return h;
+}
+
+static void stat_node(struct tmpfs_node *node, struct stat64 *buffer) {
+  memset(buffer, 0, sizeof(struct stat64));
+
+  buffer->st_mode = node->mode;
+  buffer->st_uid = node->uid;
+  buffer->st_gid = node->gid;
+  buffer->st_ino = node->ino;
+  buffer->st_nlink = node->nlink;
+  buffer->st_dev = NODEV;
+
+  buffer->st_atime = node->atime;
+  buffer->st_mtime = node->mtime;
+  buffer->st_ctime = node->ctime;
+  buffer->st_size = node->size;
+}
+
+static struct tmpfs_node *alloc_node(struct tmpfs *tfs, int mode) {
+  struct thread *thread = kthread_self();
+  struct tmpfs_node *node;
+
+  if (tfs->nodes >= tfs->max_nodes) return NULL;
+
+  node = (struct tmpfs_node *) kmalloc(sizeof(struct tmpfs_node));
+  if (!node) return NULL;
+  memset(node, 0, sizeof(struct tmpfs_node));
+
+  node->ino = tfs->nextino++;
+  node->mode = mode;
+  node->uid = thread->euid;
+  node->gid = thread->egid;
+  node->atime = node->mtime = node->ctime = kpit_get_time();
+
+  tfs->nodes++;
+  return node;
+}
+
+//
+// Page management
+//
+
+static char *alloc_page(struct tmpfs *tfs) {
+  struct meminfo info;
+  char *page;
+
+  if (tfs->used_pages >= tfs->max_pages) return NULL;
+  mem_sysinfo(&info);
+  if (info.physmem_avail < TMPFS_RESERVE * PAGESIZE) return NULL;
+
+  page = (char *) kmem_alloc(1, PFT_TMPFS);
+  if (!page) return NULL;
+
+  memset(page, 0, PAGESIZE);
+  tfs->used_pages++;
+  return page;
+}
+
+static void free_pages(struct tmpfs *tfs, struct tmpfs_node *node, unsigned int first) {
+  unsigned int i;
+
+  for (i = first; i < node->pagevec; i++) {
+    if (node->pages[i]) {
+      kmem_free(node->pages[i], 1);
+      node->pages[i] = NULL;
+      tfs->used_pages--;
+    }
+  }
+}
+
+static char *get_page(struct tmpfs *tfs, struct tmpfs_node *node, unsigned int index, int alloc) {
+  char **pages;
+  unsigned int n;
+
+  if (index >= node->pagevec) {
+    if (!alloc || index >= tfs->max_pages) return NULL;
+
+    n = node->pagevec ? node->pagevec : TMPFS_MIN_PAGEVEC;
+    while (n <= index) n *= 2;
+
+    pages = (char **) kmalloc(n * sizeof(char *));
+    if (!pages) return NULL;
+    memset(pages, 0, n * sizeof(char *));
+    if (node->pages) {
+      memcpy(pages, node->pages, node->pagevec * sizeof(char *));
+      kfree(node->pages);
+    }
+    node->pages = pages;
+    node->pagevec = n;
+  }
+
+  if (!node->pages[index] && alloc) node->pages[index] = alloc_page(tfs);
+  return node->pages[index];
+}
+
+static int truncate_node(struct tmpfs *tfs, struct tmpfs_node *node, off64_t size) {
+  unsigned int keep;
+  unsigned int offset;
+  char *page;
+
+  if (size < node->size) {
+    // Mapped page frames must stay valid until the mapping is gone
+    if (node->maps > 0) return -EBUSY;
+
+    keep = (unsigned int) ((size + PAGESIZE - 1) / PAGESIZE);
+    free_pages(tfs, node, keep);
+
+    // Clear the tail of the last page so a later extension reads zeros
+    offset = (unsigned int) (size % PAGESIZE);
+    if (offset != 0) {
+      page = get_page(tfs, node, keep - 1, 0);
+      if (page) memset(page + offset, 0, PAGESIZE - offset);
+    }
+  }
+
+  node->size = size;
+  node->mtime = node->ctime = kpit_get_time();
+  return 0;
+}
+
+//
+// Directory management
+//
+
+static struct tmpfs_dirent *find_entry(struct tmpfs_node *dir, char *name, int len) {
+  struct tmpfs_dirent *de;
+  unsigned long hash;
+
+  if (!dir->buckets) return NULL;
+
+  hash = namehash(name, len);
+  de = dir->buckets[hash & (dir->nbuckets - 1)];
+  while (de) {
+    if (de->hash == hash && fnmatch(name, len, de->name, de->namelen)) return de;
+    de = de->hashnext;
+  }
+
+  return NULL;
+}
+
+static int grow_buckets(struct tmpfs_node *dir) {
+  struct tmpfs_dirent **buckets;
+  struct tmpfs_dirent *de;
+  unsigned int n;
+  unsigned int b;
+
+  n = dir->nbuckets ? dir->nbuckets * 2 : TMPFS_MIN_BUCKETS;
+  buckets = (struct tmpfs_dirent **) kmalloc(n * sizeof(struct tmpfs_dirent *));
+  if (!buckets) return -ENOMEM;
+  memset(buckets, 0, n * sizeof(struct tmpfs_dirent *));
+
+  for (de = dir->first; de; de = de->next) {
+    b = de->hash & (n - 1);
+    de->hashnext = buckets[b];
+    buckets[b] = de;
+  }
+
+  if (dir->buckets) kfree(dir->buckets);
+  dir->buckets = buckets;
+  dir->nbuckets = n;
+  return 0;
+}
+
+static int add_entry(struct tmpfs_node *dir, char *name, int len, struct tmpfs_node *node) {
+  struct tmpfs_dirent *de;
+  unsigned int b;
+  int rc;
+
+  if (len <= 0 || len >= MAXPATH) return -EINVAL;
+
+  // Keep the load factor of the hash table below two
+  if (dir->entries >= dir->nbuckets * 2) {
+    rc = grow_buckets(dir);
+    if (rc < 0 && !dir->buckets) return rc;
+  }
+
+  de = (struct tmpfs_dirent *) kmalloc(sizeof(struct tmpfs_dirent) + len);
+  if (!de) return -ENOMEM;
+
+  memcpy(de->name, name, len);
+  de->name[len] = 0;
+  de->namelen = len;
+  de->hash = namehash(name, len);
+  de->seq = ++dir->nextseq;
+  de->node = node;
+
+  b = de->hash & (dir->nbuckets - 1);
+  de->hashnext = dir->buckets[b];
+  dir->buckets[b] = de;
+
+  de->next = NULL;
+  de->prev = dir->last;
+  if (dir->last) {
+    dir->last->next = de;
+  } else {
+    dir->first = de;
+  }
+  dir->last = de;
+  dir->entries++;
+
+  node->nlink++;
+  node->ctime = kpit_get_time();
+  if (S_ISDIR(node->mode)) node->parent = dir;
+  dir->mtime = dir->ctime = node->ctime;
+
+  return 0;
+}
+
+static void remove_entry(struct tmpfs_node *dir, struct tmpfs_dirent *de) {
+  struct tmpfs_dirent **pde;
+
+  pde = &dir->buckets[de->hash & (dir->nbuckets - 1)];
+  while (*pde != de) pde = &(*pde)->hashnext;
+  *pde = de->hashnext;
+
+  if (de->prev) {
+    de->prev->next = de->next;
+  } else {
+    dir->first = de->next;
+  }
+  if (de->next) {
+    de->next->prev = de->prev;
+  } else {
+    dir->last = de->prev;
+  }
+  dir->entries--;
+  dir->gen++;
+
+  de->node->nlink--;
+  de->node->ctime = kpit_get_time();
+  dir->mtime = dir->ctime = de->node->ctime;
+
+  kfree(de);
+}
+
+//
+// Nodes are released when the last directory entry has been removed and
+// the last file referencing it has been closed.
+//
+
+static void release_node(struct tmpfs *tfs, struct tmpfs_node *node) {
+  if (node->nlink > 0 || node->refs > 0) return;
+
+  free_pages(tfs, node, 0);
+  if (node->pages) kfree(node->pages);
+  if (node->buckets) kfree(node->buckets);
+  kfree(node);
+  tfs->nodes--;
+}
+
+static void free_tree(struct tmpfs *tfs, struct tmpfs_node *dir) {
+  struct tmpfs_dirent *de;
+  struct tmpfs_dirent *next;
+  struct tmpfs_node *node;
+
+  de = dir->first;
+  while (de) {
+    next = de->next;
+    node = de->node;
+    if (S_ISDIR(node->mode)) free_tree(tfs, node);
+    if (--node->nlink == 0) {
+      node->refs = 0;
+      release_node(tfs, node);
+    }
+    kfree(de);
+    de = next;
+  }
+
+  dir->first = dir->last = NULL;
+  dir->entries = 0;
+}
+
+//
+// Name lookup
+//
+
+static int lookup(struct tmpfs *tfs, char *name, int len, struct tmpfs_node **retval) {
+  struct tmpfs_node *node;
+  struct tmpfs_dirent *de;
+  char *p;
+  int l;
+
+  node = tfs->root;
+  while (1) {
+    // Skip path separator
+    while (len > 0 && (*name == PS1 || *name == PS2)) {
+      name++;
+      len--;
+    }
+
+    if (len == 0) {
+      *retval = node;
+      return 0;
+    }
+
+    if (!S_ISDIR(node->mode)) return -ENOTDIR;
+    if (check(node->mode, node->uid, node->gid, S_IEXEC) < 0) return -EACCES;
+
+    // Find next part of name
+    p = name;
+    l = 0;
+    while (l < len && *p != PS1 && *p != PS2) {
+      l++;
+      p++;
+    }
+
+    de = find_entry(node, name, l);
+    if (!de) return -ENOENT;
+
+    node = de->node;
+    name += l;
+    len -= l;
+  }
+}
+
+static int lookup_parent(struct tmpfs *tfs, char **name, int *len, struct tmpfs_node **dir) {
+  char *start;
+  char *p;
+  int rc;
+
+  start = *name;
+  while (*len > 0 && (start[*len - 1] == PS1 || start[*len - 1] == PS2)) (*len)--;
+  if (*len == 0) return -EEXIST;
+
+  p = start + *len - 1;
+  while (p > start && *p != PS1 && *p != PS2) p--;
+
+  if (p == start) {
+    if (*p == PS1 || *p == PS2) {
+      (*name)++;
+      (*len)--;
+    }
+    *dir = tfs->root;
+  } else {
+    rc = lookup(tfs, start, p - start, dir);
+    if (rc < 0) return rc;
+    *name = p + 1;
+    *len -= p - start + 1;
+  }
+
+  if (!S_ISDIR((*dir)->mode)) return -ENOTDIR;
+  if (check((*dir)->mode, (*dir)->uid, (*dir)->gid, S_IEXEC) < 0) return -EACCES;
+  return 0;
+}
+
+static int get_size_option(char *opts, char *name, unsigned int pages) {
+  char buffer[32];
+  char *end;
+  unsigned long value;
+
+  if (!get_option(opts, name, buffer, sizeof(buffer), NULL)) return pages;
+
+  value = strtol(buffer, &end, 0);
+  switch (*end) {
+    case 'k': case 'K': return value / (PAGESIZE / 1024);
+    case 'm': case 'M': return value * (1024 * 1024 / PAGESIZE);
+    case 'g': case 'G': return value * (1024 * 1024 / PAGESIZE) * 1024;
+  }
+
+  return value / PAGESIZE;
+}
+
+//
+// File system operations
+//
+
+int tmpfs_mount(struct fs *fs, char *opts) {
+  struct tmpfs *tfs;
+  struct meminfo info;
+  char buffer[16];
+  int mode;
+
+  tfs = (struct tmpfs *) kmalloc(sizeof(struct tmpfs));
+  if (!tfs) return -ENOMEM;
+  memset(tfs, 0, sizeof(struct tmpfs));
+  tfs->nextino = TMPFS_ROOT_INODE;
+
+  // Size limit defaults to half of physical memory
+  mem_sysinfo(&info);
+  tfs->max_pages = get_size_option(opts, "size", info.physmem_total / PAGESIZE / 2);
+  tfs->max_nodes = get_num_option(opts, "nodes", TMPFS_DEFAULT_NODES);
+
+  mode = fs->mode & S_IRWXUGO;
+  if (get_option(opts, "mode", buffer, sizeof(buffer), NULL)) mode = strtol(buffer, NULL, 8) & S_IRWXUGO;
+
+  tfs->root = alloc_node(tfs, S_IFDIR | mode);
+  if (!tfs->root) {
+    kfree(tfs);
+    return -ENOMEM;
+  }
+  tfs->root->uid = get_num_option(opts, "uid", fs->uid);
+  tfs->root->gid = get_num_option(opts, "gid", fs->gid);
+  tfs->root->nlink = 1;
+  tfs->root->parent = tfs->root;
+
+  fs->data = tfs;
+  fs->flags |= FS_DCACHE;
+  return 0;
+}
+
+int tmpfs_umount(struct fs *fs) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+
+  free_tree(tfs, tfs->root);
+  tfs->root->nlink = 0;
+  release_node(tfs, tfs->root);
+  kfree(tfs);
+
+  return 0;
+}
+
+int tmpfs_statfs(struct fs *fs, struct statfs *buf) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+
+  buf->bsize = PAGESIZE;
+  buf->iosize = PAGESIZE;
+  buf->blocks = tfs->max_pages;
+  buf->bfree = tfs->max_pages - tfs->used_pages;
+  buf->files = tfs->max_nodes;
+  buf->ffree = tfs->max_nodes - tfs->nodes;
+  buf->cachesize = 0;
+
+  return 0;
+}
+
+int tmpfs_open(struct file *filp, char *name) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpfs_node *dir;
+  struct tmpfs_node *node;
+  struct tmpfs_dirent *de;
+  struct tmpfs_file *tf;
+  int len;
+  int rc;
+
+  if (filp->flags & O_SPECIAL) return -EINVAL;
+
+  tf = (struct tmpfs_file *) kmalloc(sizeof(struct tmpfs_file));
+  if (!tf) return -ENOMEM;
+  memset(tf, 0, sizeof(struct tmpfs_file));
+
+  len = strlen(name);
+  rc = lookup_parent(tfs, &name, &len, &dir);
+  if (rc == -EEXIST) {
+    // Opening the root directory
+    rc = 0;
+    dir = NULL;
+    node = tfs->root;
+  } else if (rc == 0) {
+    de = find_entry(dir, name, len);
+    node = de ? de->node : NULL;
+  }
+
+  if (rc == 0) {
+    if (node) {
+      if ((filp->flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+        rc = -EEXIST;
+      } else if (S_ISDIR(node->mode) && (filp->flags & (O_WRONLY | O_RDWR | O_TRUNC))) {
+        rc = -EISDIR;
+      } else if (filp->flags & O_TRUNC) {
+        rc = truncate_node(tfs, node, 0);
+        filp->flags |= F_MODIFIED;
+      }
+    } else if (!(filp->flags & O_CREAT)) {
+      rc = -ENOENT;
+    } else if (check(dir->mode, dir->uid, dir->gid, S_IWRITE) < 0) {
+      rc = -EACCES;
+    } else {
+      node = alloc_node(tfs, S_IFREG | (filp->mode & S_IRWXUGO));
+      if (!node) {
+        rc = -ENOSPC;
+      } else {
+        rc = add_entry(dir, name, len, node);
+        if (rc < 0) release_node(tfs, node);
+        filp->flags |= F_MODIFIED;
+      }
+    }
+  }
+
+  if (rc < 0) {
+    kfree(tf);
+    return rc;
+  }
+
+  node->refs++;
+  tf->node = node;
+  if (filp->flags & O_APPEND) filp->pos = node->size;
+
+  filp->data = tf;
+  filp->mode = node->mode;
+  filp->owner = node->uid;
+  filp->group = node->gid;
+
+  return 0;
+}
+
+int tmpfs_close(struct file *filp) {
+  struct tmpfs_file *tf = (struct tmpfs_file *) filp->data;
+
+  if (filp->flags & F_MODIFIED) tf->node->mtime = kpit_get_time();
+  if (filp->flags & O_TEMPORARY) unlink(filp->path);
+
+  return 0;
+}
+
+int tmpfs_destroy(struct file *filp) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpfs_file *tf = (struct tmpfs_file *) filp->data;
+
+  if (tf->mapped) tf->node->maps--;
+  tf->node->refs--;
+  release_node(tfs, tf->node);
+  kfree(tf);
+
+  return 0;
+}
+
+int tmpfs_fsync(struct file *filp) {
+  return 0;
+}
+
+int tmpfs_read(struct file *filp, void *data, size_t size, off64_t pos) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpfs_node *node = ((struct tmpfs_file *) filp->data)->node;
+  char *p = (char *) data;
+  unsigned int start;
+  size_t count;
+  size_t read;
+  char *page;
+
+  if (S_ISDIR(node->mode)) return -EISDIR;
+
+  read = 0;
+  while (pos < node->size && size > 0) {
+    start = (unsigned int) (pos % PAGESIZE);
+    count = PAGESIZE - start;
+    if (count > size) count = size;
+    if (count > node->size - pos) count = (size_t) (node->size - pos);
+
+    // Holes read as zeros
+    page = get_page(tfs, node, (unsigned int) (pos / PAGESIZE), 0);
+    if (page) {
+      memcpy(p, page + start, count);
+    } else {
+      memset(p, 0, count);
+    }
+
+    pos += count;
+    p += count;
+    read += count;
+    size -= count;
+  }
+
+  node->atime = kpit_get_time();
+  return read;
+}
+
+int tmpfs_write(struct file *filp, void *data, size_t size, off64_t pos) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpfs_node *node = ((struct tmpfs_file *) filp->data)->node;
+  char *p = (char *) data;
+  unsigned int start;
+  size_t count;
+  size_t written;
+  char *page;
+
+  if (S_ISDIR(node->mode)) return -EISDIR;
+  if (filp->flags & O_APPEND) pos = node->size;
+  if (pos >= TMPFS_MAXFILESIZE(tfs)) return size > 0 ? -EFBIG : 0;
+  if (size > TMPFS_MAXFILESIZE(tfs) - pos) size = (size_t) (TMPFS_MAXFILESIZE(tfs) - pos);
+
+  written = 0;
+  while (size > 0) {
+    start = (unsigned int) (pos % PAGESIZE);
+    count = PAGESIZE - start;
+    if (count > size) count = size;
+
+    page = get_page(tfs, node, (unsigned int) (pos / PAGESIZE), 1);
+    if (!page) {
+      if (written > 0) break;
+      return -ENOSPC;
+    }
+    memcpy(page + start, p, count);
+
+    pos += count;
+    p += count;
+    written += count;
+    size -= count;
+  }
+
+  if (pos > node->size) node->size = pos;
+  if (written > 0) filp->flags |= F_MODIFIED;
+  return written;
+}
+
+off64_t tmpfs_tell(struct file *filp) {
+  return filp->pos;
+}
+
+off64_t tmpfs_lseek(struct file *filp, off64_t offset, int origin) {
+  struct tmpfs_node *node = ((struct tmpfs_file *) filp->data)->node;
+
+  switch (origin) {
+    case SEEK_END:
+      offset += node->size;
+      break;
+
+    case SEEK_CUR:
+      offset += filp->pos;
+  }
+
+  if (offset < 0) return -EINVAL;
+
+  filp->pos = offset;
+  return offset;
+}
+
+int tmpfs_ftruncate(struct file *filp, off64_t size) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpfs_node *node = ((struct tmpfs_file *) filp->data)->node;
+
+  if (S_ISDIR(node->mode)) return -EISDIR;
+  if (size < 0) return -EINVAL;
+  if (size > TMPFS_MAXFILESIZE(tfs)) return -EFBIG;
+
+  filp->flags |= F_MODIFIED;
+  return truncate_node(tfs, node, size);
+}
+
+int tmpfs_futime(struct file *filp, struct utimbuf *times) {
+  struct tmpfs_node *node = ((struct tmpfs_file *) filp->data)->node;
+
+  if (times->ctime != -1) node->ctime = times->ctime;
+  if (times->modtime != -1) node->mtime = times->modtime;
+  if (times->actime != -1) node->atime = times->actime;
+  filp->flags &= ~F_MODIFIED;
+
+  return 0;
+}
+
+int tmpfs_utime(struct fs *fs, char *name, struct utimbuf *times) {
+  struct tmpfs_node *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+
+  if (times->ctime != -1) node->ctime = times->ctime;
+  if (times->modtime != -1) node->mtime = times->modtime;
+  if (times->actime != -1) node->atime = times->actime;
+
+  return 0;
+}
+
+int tmpfs_fstat(struct file *filp, struct stat64 *buffer) {
+  struct tmpfs_node *node = ((struct tmpfs_file *) filp->data)->node;
+
+  if (buffer) stat_node(node, buffer);
+  return (int) node->size;
+}
+
+int tmpfs_stat(struct fs *fs, char *name, struct stat64 *buffer) {
+  struct tmpfs_node *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+
+  if (buffer) stat_node(node, buffer);
+  return (int) node->size;
+}
+
+int tmpfs_access(struct fs *fs, char *name, int mode) {
+  struct thread *thread = kthread_self();
+  struct tmpfs_node *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+
+  if (mode != 0) {
+    if (thread->euid == 0) {
+      rc = mode != 1 || node->mode & 0111 ? 0 : -EACCES;
+    } else {
+      if (thread->euid != node->uid) {
+        mode >>= 3;
+        if (thread->egid != node->gid) mode >>= 3;
+      }
+      if ((mode & node->mode) == 0) rc = -EACCES;
+    }
+  }
+
+  return rc;
+}
+
+static int chmod_node(struct tmpfs_node *node, int mode) {
+  struct thread *thread = kthread_self();
+
+  if (thread->euid != 0 && thread->euid != node->uid) return -EPERM;
+  node->mode = (node->mode & ~S_IRWXUGO) | (mode & S_IRWXUGO);
+  node->ctime = kpit_get_time();
+  return 0;
+}
+
+static int chown_node(struct tmpfs_node *node, int owner, int group) {
+  struct thread *thread = kthread_self();
+
+  if (thread->euid != 0) return -EPERM;
+  if (owner != -1) node->uid = owner;
+  if (group != -1) node->gid = group;
+  node->ctime = kpit_get_time();
+  return 0;
+}
+
+int tmpfs_fchmod(struct file *filp, int mode) {
+  return chmod_node(((struct tmpfs_file *) filp->data)->node, mode);
+}
+
+int tmpfs_chmod(struct fs *fs, char *name, int mode) {
+  struct tmpfs_node *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+
+  return chmod_node(node, mode);
+}
+
+int tmpfs_fchown(struct file *filp, int owner, int group) {
+  return chown_node(((struct tmpfs_file *) filp->data)->node, owner, group);
+}
+
+int tmpfs_chown(struct fs *fs, char *name, int owner, int group) {
+  struct tmpfs_node *node;
+  int rc;
+
+  rc = lookup((struct tmpfs *) fs->data, name, strlen(name), &node);
+  if (rc < 0) return rc;
+
+  return chown_node(node, owner, group);
+}
+
+int tmpfs_mkdir(struct fs *fs, char *name, int mode) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+  struct tmpfs_node *parent;
+  struct tmpfs_node *dir;
+  int len;
+  int rc;
+
+  len = strlen(name);
+  rc = lookup_parent(tfs, &name, &len, &parent);
+  if (rc < 0) return rc;
+
+  if (find_entry(parent, name, len)) return -EEXIST;
+  if (check(parent->mode, parent->uid, parent->gid, S_IWRITE) < 0) return -EACCES;
+
+  dir = alloc_node(tfs, S_IFDIR | (mode & S_IRWXUGO));
+  if (!dir) return -ENOSPC;
+
+  rc = add_entry(parent, name, len, dir);
+  if (rc < 0) {
+    release_node(tfs, dir);
+    return rc;
+  }
+
+  return 0;
+}
+
+int tmpfs_rmdir(struct fs *fs, char *name) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+  struct tmpfs_node *parent;
+  struct tmpfs_node *dir;
+  struct tmpfs_dirent *de;
+  int len;
+  int rc;
+
+  len = strlen(name);
+  rc = lookup_parent(tfs, &name, &len, &parent);
+  if (rc == -EEXIST) return -EPERM;
+  if (rc < 0) return rc;
+
+  de = find_entry(parent, name, len);
+  if (!de) return -ENOENT;
+
+  dir = de->node;
+  if (!S_ISDIR(dir->mode)) return -ENOTDIR;
+  if (dir->entries > 0) return -ENOTEMPTY;
+  if (check(parent->mode, parent->uid, parent->gid, S_IWRITE) < 0) return -EACCES;
+
+  remove_entry(parent, de);
+  release_node(tfs, dir);
+  return 0;
+}
+
+int tmpfs_rename(struct fs *fs, char *oldname, char *newname) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+  struct tmpfs_node *oldparent;
+  struct tmpfs_node *newparent;
+  struct tmpfs_node *node;
+  struct tmpfs_node *p;
+  struct tmpfs_dirent *de;
+  int oldlen;
+  int newlen;
+  int rc;
+
+  oldlen = strlen(oldname);
+  rc = lookup_parent(tfs, &oldname, &oldlen, &oldparent);
+  if (rc < 0) return rc;
+
+  de = find_entry(oldparent, oldname, oldlen);
+  if (!de) return -ENOENT;
+  node = de->node;
+
+  newlen = strlen(newname);
+  rc = lookup_parent(tfs, &newname, &newlen, &newparent);
+  if (rc < 0) return rc;
+
+  if (find_entry(newparent, newname, newlen)) {
+    if (oldparent == newparent && fnmatch(oldname, oldlen, newname, newlen)) return 0;
+    return -EEXIST;
+  }
+
+  if (check(oldparent->mode, oldparent->uid, oldparent->gid, S_IWRITE) < 0) return -EACCES;
+  if (check(newparent->mode, newparent->uid, newparent->gid, S_IWRITE) < 0) return -EACCES;
+
+  // A directory cannot be moved into its own subtree
+  if (S_ISDIR(node->mode)) {
+    for (p = newparent; p != tfs->root; p = p->parent) {
+      if (p == node) return -EINVAL;
+    }
+  }
+
+  rc = add_entry(newparent, newname, newlen, node);
+  if (rc < 0) return rc;
+
+  remove_entry(oldparent, de);
+  return 0;
+}
+
+int tmpfs_link(struct fs *fs, char *oldname, char *newname) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+  struct tmpfs_node *node;
+  struct tmpfs_node *parent;
+  int len;
+  int rc;
+
+  rc = lookup(tfs, oldname, strlen(oldname), &node);
+  if (rc < 0) return rc;
+  if (S_ISDIR(node->mode)) return -EPERM;
+
+  len = strlen(newname);
+  rc = lookup_parent(tfs, &newname, &len, &parent);
+  if (rc < 0) return rc;
+
+  if (find_entry(parent, newname, len)) return -EEXIST;
+  if (check(parent->mode, parent->uid, parent->gid, S_IWRITE) < 0) return -EACCES;
+
+  return add_entry(parent, newname, len, node);
+}
+
+int tmpfs_unlink(struct fs *fs, char *name) {
+  struct tmpfs *tfs = (struct tmpfs *) fs->data;
+  struct tmpfs_node *dir;
+  struct tmpfs_node *node;
+  struct tmpfs_dirent *de;
+  int len;
+  int rc;
+
+  len = strlen(name);
+  rc = lookup_parent(tfs, &name, &len, &dir);
+  if (rc == -EEXIST) return -EISDIR;
+  if (rc < 0) return rc;
+
+  de = find_entry(dir, name, len);
+  if (!de) return -ENOENT;
+
+  node = de->node;
+  if (S_ISDIR(node->mode)) return -EISDIR;
+  if (check(dir->mode, dir->uid, dir->gid, S_IWRITE) < 0) return -EACCES;
+
+  // The pages are returned now unless the file is still open
+  remove_entry(dir, de);
+  release_node(tfs, node);
+  return 0;
+}
+
+int tmpfs_opendir(struct file *filp, char *name) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpfs_node *node;
+  struct tmpfs_file *tf;
+  int rc;
+
+  rc = lookup(tfs, name, strlen(name), &node);
+  if (rc < 0) return rc;
+  if (!S_ISDIR(node->mode)) return -ENOTDIR;
+
+  tf = (struct tmpfs_file *) kmalloc(sizeof(struct tmpfs_file));
+  if (!tf) return -ENOMEM;
+  memset(tf, 0, sizeof(struct tmpfs_file));
+
+  node->refs++;
+  tf->node = node;
+  tf->gen = node->gen;
+
+  filp->data = tf;
+  filp->mode = node->mode;
+  filp->owner = node->uid;
+  filp->group = node->gid;
+
+  return 0;
+}
+
+static int read_dir_entry(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count) {
+  struct tmpfs_file *tf = (struct tmpfs_file *) filp->data;
+  struct tmpfs_node *dir = tf->node;
+  struct tmpfs_dirent *de;
+
+  if (count != 1) return -EINVAL;
+
+  // Continue after the last entry returned, or find the first entry
+  // created after it if entries have been removed since
+  if (tf->cursor && tf->gen == dir->gen) {
+    de = tf->cursor->next;
+  } else {
+    de = dir->first;
+    while (de && de->seq <= filp->pos) de = de->next;
+  }
+  if (!de) return 0;
+
+  dirp->ino = de->node->ino;
+  dirp->namelen = de->namelen;
+  dirp->reclen = sizeof(struct direntry) - MAXPATH + de->namelen + 1;
+  memcpy(dirp->name, de->name, de->namelen + 1);
+  if (buffer) stat_node(de->node, buffer);
+
+  tf->cursor = de;
+  tf->gen = dir->gen;
+  filp->pos = de->seq;
+  return 1;
+}
+
+int tmpfs_readdir(struct file *filp, struct direntry *dirp, int count) {
+  return read_dir_entry(filp, dirp, NULL, count);
+}
+
+int tmpfs_readdirplus(struct file *filp, struct direntry *dirp, struct stat64 *buffer, int count) {
+  return read_dir_entry(filp, dirp, buffer, count);
+}
+
+int tmpfs_fallocate(struct file *filp, int mode, off64_t offset, off64_t len) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpfs_node *node = ((struct tmpfs_file *) filp->data)->node;
+  unsigned int first;
+  unsigned int last;
+  unsigned int i;
+
+  if (S_ISDIR(node->mode)) return -EISDIR;
+  if (offset < 0 || len <= 0) return -EINVAL;
+  if (mode & ~FALLOC_FL_KEEP_SIZE) return -EOPNOTSUPP;
+  if (offset > TMPFS_MAXFILESIZE(tfs) - len) return -EFBIG;
+
+  first = (unsigned int) (offset / PAGESIZE);
+  last = (unsigned int) ((offset + len - 1) / PAGESIZE);
+  if (last - first + 1 > tfs->max_pages - tfs->used_pages) return -ENOSPC;
+
+  for (i = first; i <= last; i++) {
+    if (!get_page(tfs, node, i, 1)) return -ENOSPC;
+  }
+
+  if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > node->size) {
+    node->size = offset + len;
+    filp->flags |= F_MODIFIED;
+  }
+
+  return 0;
+}
+
+int tmpfs_map_page(struct file *filp, off64_t offset, unsigned long *pfn) {
+  struct tmpfs *tfs = (struct tmpfs *) filp->fs->data;
+  struct tmpfs_file *tf = (struct tmpfs_file *) filp->data;
+  struct tmpfs_node *node = tf->node;
+  char *page;
+
+  if (S_ISDIR(node->mode)) return -EISDIR;
+  if (offset >= node->size) return -ENXIO;
+
+  page = get_page(tfs, node, (unsigned int) (offset / PAGESIZE), 1);
+  if (!page) return -ENOSPC;
+
+  // Keep the page frames of the file while it can be mapped
+  if (!tf->mapped) {
+    tf->mapped = 1;
+    node->maps++;
+  }
+
+  *pfn = BTOP(kpage_virt2phys(page));
+  return 0;
+}
+
+void init_tmpfs() {
+  register_filesystem("tmpfs", &tmpfsops);
+}
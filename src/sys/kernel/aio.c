@@ -0,0 +1,255 @@
+//
+// aio.c
+//
+// Asynchronous file I/O
+//
+// Copyright (C) 2002 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#include <os/krnl.h>
+#include <os/vfs.h>
+#include <os/kmalloc.h>
+
+//
+// Asynchronous requests are executed by a small pool of kernel worker
+// threads. Each request is an I/O object that is signaled with IOEVT_READ
+// when it completes, so it can be waited on directly or dispatched to an
+// iomux together with sockets and files.
+//
+// Requests from user space never let the workers touch user memory. Write
+// data is copied into a kernel bounce buffer when the request is submitted,
+// and read data is copied back by aio_result in the context of the caller.
+// The number of outstanding requests and the size of each user request
+// are limited, since every request holds kernel memory until it is closed.
+//
+
+#define AIO_WORKERS       4
+#define AIO_MAX_REQUESTS  64
+#define AIO_MAX_SIZE      (256 * 1024)
+
+static struct aio *aio_head;
+static struct aio *aio_tail;
+static struct sem aio_pending;
+static int aio_started = 0;
+static int aio_count = 0;
+
+static void complete_aio(struct aio *aio, int result) {
+  aio->result = result;
+  aio->state = AIO_DONE;
+  set_io_event(&aio->iob, IOEVT_READ);
+  orel(aio->filp);
+}
+
+static int execute_aio(struct aio *aio) {
+  // Fail requests for files that have been closed while the request was queued
+  if (aio->filp->iob.object.handle_count == 0) return -EBADF;
+
+  switch (aio->op) {
+    case AIO_READ:
+      return pread(aio->filp, aio->buffer, aio->size, aio->offset);
+
+    case AIO_WRITE:
+      return pwrite(aio->filp, aio->buffer, aio->size, aio->offset);
+
+    case AIO_FSYNC:
+      return fsync(aio->filp);
+  }
+
+  return -EINVAL;
+}
+
+static void aioworker_task(void *arg) {
+  struct aio *aio;
+
+  while (1) {
+    if (wait_for_object(&aio_pending, INFINITE) < 0) continue;
+
+    // The request may have been cancelled after the semaphore was released
+    aio = aio_head;
+    if (!aio) continue;
+    aio_head = aio->next;
+    if (!aio_head) aio_tail = NULL;
+    aio->next = NULL;
+
+    aio->state = AIO_RUNNING;
+    complete_aio(aio, execute_aio(aio));
+    orel(aio);
+  }
+}
+
+static void start_aio_workers() {
+  int i;
+
+  init_sem(&aio_pending, 0);
+  for (i = 0; i < AIO_WORKERS; i++) {
+    kthread_create_kland(aioworker_task, NULL, PRIORITY_NORMAL, "aioworker");
+  }
+  aio_started = 1;
+}
+
+static int unlink_aio(struct aio *aio) {
+  struct aio *prev = NULL;
+  struct aio *a = aio_head;
+
+  while (a && a != aio) {
+    prev = a;
+    a = a->next;
+  }
+  if (!a) return 0;
+
+  if (prev) {
+    prev->next = aio->next;
+  } else {
+    aio_head = aio->next;
+  }
+  if (aio_tail == aio) aio_tail = prev;
+  aio->next = NULL;
+
+  return 1;
+}
+
+static struct aio *new_aio(struct file *filp, int op, void *buffer, size_t size, off64_t offset) {
+  struct aio *aio;
+
+  aio = (struct aio *) kmalloc(sizeof(struct aio));
+  if (!aio) return NULL;
+  memset(aio, 0, sizeof(struct aio));
+  init_ioobject(&aio->iob, OBJECT_AIO);
+
+  aio->op = op;
+  aio->state = AIO_PENDING;
+  aio->filp = filp;
+  aio->buffer = buffer;
+  aio->size = size;
+  aio->offset = offset;
+  aio_count++;
+
+  return aio;
+}
+
+static void queue_aio(struct aio *aio) {
+  // The worker holds a lock on both the file and the request until completion
+  aio->filp->iob.object.lock_count++;
+  aio->iob.object.lock_count++;
+
+  if (aio_tail) {
+    aio_tail->next = aio;
+  } else {
+    aio_head = aio;
+  }
+  aio_tail = aio;
+  release_sem(&aio_pending, 1);
+}
+
+int submit_aio(struct file *filp, int op, void *buffer, size_t size, off64_t offset, struct aio **retval) {
+  struct aio *aio;
+
+  if (op != AIO_READ && op != AIO_WRITE && op != AIO_FSYNC) return -EINVAL;
+  if (aio_count >= AIO_MAX_REQUESTS) return -EAGAIN;
+  if (!aio_started) start_aio_workers();
+
+  aio = new_aio(filp, op, buffer, size, offset);
+  if (!aio) return -ENOMEM;
+  queue_aio(aio);
+
+  *retval = aio;
+  return 0;
+}
+
+//
+// submit_user_aio
+//
+// Submits a request for a user buffer, which the caller has checked. The
+// data is moved through a bounce buffer owned by the request, so the user
+// buffer can be released before the request completes. Large requests are
+// shortened to AIO_MAX_SIZE bytes.
+//
+
+int submit_user_aio(struct file *filp, int op, void *data, size_t size, off64_t offset, struct aio **retval) {
+  struct aio *aio;
+  char *bounce;
+
+  if (op != AIO_READ && op != AIO_WRITE && op != AIO_FSYNC) return -EINVAL;
+  if (aio_count >= AIO_MAX_REQUESTS) return -EAGAIN;
+  if (!aio_started) start_aio_workers();
+
+  bounce = NULL;
+  if (op != AIO_FSYNC) {
+    if (size > AIO_MAX_SIZE) size = AIO_MAX_SIZE;
+    bounce = (char *) kmalloc(size > 0 ? size : 1);
+    if (!bounce) return -ENOMEM;
+    if (op == AIO_WRITE) memcpy(bounce, data, size);
+  }
+
+  aio = new_aio(filp, op, bounce, size, offset);
+  if (!aio) {
+    if (bounce) kfree(bounce);
+    return -ENOMEM;
+  }
+  aio->bounce = bounce;
+  if (op == AIO_READ) aio->user = data;
+  queue_aio(aio);
+
+  *retval = aio;
+  return 0;
+}
+
+int cancel_aio(struct aio *aio) {
+  switch (aio->state) {
+    case AIO_PENDING:
+      unlink_aio(aio);
+      complete_aio(aio, -EINTR);
+      orel(aio);
+      return 0;
+
+    case AIO_RUNNING:
+      return -EBUSY;
+  }
+
+  return -EALREADY;
+}
+
+int close_aio(struct aio *aio) {
+  if (aio->state == AIO_PENDING) {
+    // Drop the worker lock without destroying the request, the caller
+    // destroys it when the last lock has been released
+    unlink_aio(aio);
+    complete_aio(aio, -EINTR);
+    aio->iob.object.lock_count--;
+  }
+
+  detach_ioobject(&aio->iob);
+  return 0;
+}
+
+int destroy_aio(struct aio *aio) {
+  if (aio->bounce) kfree(aio->bounce);
+  aio_count--;
+  kfree(aio);
+  return 0;
+}
@@ -86,36 +86,73 @@ static int bufpools_proc(struct proc_file *pf, void *arg) {
 }
 
 //
-// bufstats_proc
+// bufstats
 //
 
-static int bufstats_proc(struct proc_file *pf, void *arg) {
-  struct bufpool *pool;
-  int hitratio;
+static void *bufstats_start(struct proc_file *pf, int index) {
+  struct bufpool *pool = bufpools;
 
-  pprintf(pf, "device      reads   writes   hits%%   alloc    free  update    lazy    sync\n");
-  pprintf(pf, "-------- -------- -------- ------- ------- ------- ------- ------- -------\n");
+  if (index == 0) return PROC_SEQ_HEADER;
+  while (pool && --index > 0) pool = pool->next;
+  return pool;
+}
 
-  pool = bufpools;
-  while (pool) {
-    if (pool->cache_hits + pool->cache_misses == 0) {
-      hitratio = 0;
-    } else {
-      hitratio = pool->cache_hits * 100 / (pool->cache_hits + pool->cache_misses);
-    }
+static void *bufstats_next(struct proc_file *pf, void *v) {
+  if (v == PROC_SEQ_HEADER) return bufpools;
+  return ((struct bufpool *) v)->next;
+}
 
-    pprintf(pf, "%-8s %8d %8d %6d%% %7d %7d %7d %7d %7d\n",
-      kdev_get(pool->devno)->name,
-      pool->blocks_read, pool->blocks_written, hitratio,
-      pool->blocks_allocated, pool->blocks_freed,
-      pool->blocks_updated, pool->blocks_lazywrite, pool->blocks_synched);
+static int bufstats_show(struct proc_file *pf, void *v) {
+  struct bufpool *pool = (struct bufpool *) v;
+  int hitratio;
 
-    pool = pool->next;
+  if (v == PROC_SEQ_HEADER) {
+    pprintf(pf, "device      reads   writes   hits%%   alloc    free  update    lazy    sync\n");
+    pprintf(pf, "-------- -------- -------- ------- ------- ------- ------- ------- -------\n");
+    return 0;
   }
 
+  if (pool->cache_hits + pool->cache_misses == 0) {
+    hitratio = 0;
+  } else {
+    hitratio = pool->cache_hits * 100 / (pool->cache_hits + pool->cache_misses);
+  }
+
+  pprintf(pf, "%-8s %8d %8d %6d%% %7d %7d %7d %7d %7d\n",
+    kdev_get(pool->devno)->name,
+    pool->blocks_read, pool->blocks_written, hitratio,
+    pool->blocks_allocated, pool->blocks_freed,
+    pool->blocks_updated, pool->blocks_lazywrite, pool->blocks_synched);
+
   return 0;
 }
 
+static int bufstats_record(struct proc_file *pf, void *v) {
+  struct bufpool *pool = (struct bufpool *) v;
+  struct proc_bufstat rec;
+
+  memset(&rec, 0, sizeof(rec));
+  strncpy(rec.device, kdev_get(pool->devno)->name, sizeof(rec.device) - 1);
+  rec.blocks_read = pool->blocks_read;
+  rec.blocks_written = pool->blocks_written;
+  rec.cache_hits = pool->cache_hits;
+  rec.cache_misses = pool->cache_misses;
+  rec.blocks_allocated = pool->blocks_allocated;
+  rec.blocks_freed = pool->blocks_freed;
+  rec.blocks_updated = pool->blocks_updated;
+  rec.blocks_lazywrite = pool->blocks_lazywrite;
+  rec.blocks_synched = pool->blocks_synched;
+
+  return proc_write(pf, &rec, sizeof(rec));
+}
+
+static struct proc_seqops bufstats_seqops = {
+  bufstats_start,
+  bufstats_next,
+  bufstats_show,
+  bufstats_record
+};
+
 //
 // bufhash
 //
@@ -523,7 +560,7 @@ struct bufpool *init_buffer_pool(dev_t devno, int poolsize, int bufsize, void (*
     lazywriter_started = 1;
 
     register_proc_inode("bufpools", bufpools_proc, NULL);
-    register_proc_inode("bufstats", bufstats_proc, NULL);
+    register_proc_seq("bufstats", &bufstats_seqops, NULL);
   }
 
   return pool;
@@ -705,6 +742,28 @@ void release_buffer(struct bufpool *pool, struct buf *buf)
   }
 }
 
+//
+// pin_buffer
+//
+// A pinned buffer is kept locked and is not written to the device until it
+// is unpinned. This is used for buffers that must not reach the disk before
+// they have been written somewhere else, e.g. to a journal.
+//
+
+void pin_buffer(struct bufpool *pool, struct buf *buf) {
+  buf->locks++;
+  buf->pins++;
+}
+
+//
+// unpin_buffer
+//
+
+void unpin_buffer(struct bufpool *pool, struct buf *buf) {
+  buf->pins--;
+  release_buffer(pool, buf);
+}
+
 //
 // invalidate_buffer
 //
@@ -721,6 +780,36 @@ void invalidate_buffer(struct bufpool *pool, blkno_t blkno) {
   release_buffer(pool, buf);
 }
 
+//
+// sync_buffer
+//
+
+int sync_buffer(struct bufpool *pool, blkno_t blkno) {
+  struct buf *buf;
+  int rc;
+
+  // Find buffer without locking it; only dirty buffers need to be written
+  buf = pool->hashtable[bufhash(blkno) % BUFPOOL_HASHSIZE];
+  while (buf && buf->blkno != blkno) buf = buf->bucket.next;
+  if (!buf || buf->state != BUF_STATE_DIRTY) return 0;
+
+  // Write buffer to device
+  rc = write_buffer(pool, buf, 1);
+  if (rc < 0) return rc;
+
+  // Move buffer to clean list if it is not locked
+  if (buf->locks == 0) {
+    change_state(pool, buf, BUF_STATE_CLEAN);
+    buf->chain.next = NULL;
+    buf->chain.prev = pool->clean.tail;
+    if (pool->clean.tail) pool->clean.tail->chain.next = buf;
+    pool->clean.tail = buf;
+    if (!pool->clean.head) pool->clean.head = buf;
+  }
+
+  return 0;
+}
+
 //
 // flush_buffers
 //
@@ -781,11 +870,11 @@ int sync_buffers(struct bufpool *pool, int interruptable) {
     return 0;
   }
 
-  // Find all updated buffers
+  // Find all updated buffers that are not pinned
   pool->ioactive = 0;
   buf = pool->bufbase;
   for (i = 0; i < pool->poolsize; i++) {
-    if (buf->state == BUF_STATE_UPDATED) {
+    if (buf->state == BUF_STATE_UPDATED && buf->pins == 0) {
       // Check for interrupt
       if (interruptable && pool->ioactive) return -EINTR;
 
@@ -0,0 +1,337 @@
+//
+// dcache.c
+//
+// Directory entry cache
+//
+// Copyright (C) 2013-2014 Bruno Ribeiro.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+//
+
+#include <os/krnl.h>
+#include <os/vfs.h>
+#include <os/kmalloc.h>
+
+//
+// The dentry cache maps (filesystem, path) pairs to inode numbers. Negative
+// entries record names known not to exist. Entries are hashed on the path
+// relative to the mount point and kept on an LRU list that is trimmed when
+// the cache grows beyond its limit.
+//
+
+#define DCACHE_HASHSIZE    512
+#define DCACHE_MAXENTRIES  2048
+
+struct dcentry {
+  struct dcentry *hnext;
+  struct dcentry *hprev;
+  struct dcentry *lrunext;
+  struct dcentry *lruprev;
+  struct fs *fs;
+  unsigned long hash;
+  ino_t ino;
+  uid_t uid;
+  int flags;
+  int len;
+  char name[1];
+};
+
+static struct dcentry *dchash[DCACHE_HASHSIZE];
+static struct dcentry *lruhead;
+static struct dcentry *lrutail;
+static int dcache_entries;
+static int dcache_maxentries = DCACHE_MAXENTRIES;
+static unsigned long dcache_gen;
+
+static unsigned long dcache_hits;
+static unsigned long dcache_neghits;
+static unsigned long dcache_misses;
+static unsigned long dcache_evictions;
+static unsigned long dcache_invalidations;
+
+//
+// dchashname
+//
+
+static unsigned long dchashname(struct fs *fs, char *name, int len) {
+  unsigned long h = (unsigned long) fs;
+
+  while (len-- > 0) h = (h << 5) + h + (unsigned char) *name++;
+  return h;
+}
+
+//
+// normalize
+//
+// Cache keys never start with a path separator
+//
+
+static char *normalize(char *name, int *len) {
+  while (*len > 0 && (*name == PS1 || *name == PS2)) {
+    name++;
+    (*len)--;
+  }
+
+  return name;
+}
+
+//
+// unlink_entry
+//
+
+static void unlink_entry(struct dcentry *de) {
+  int slot = de->hash % DCACHE_HASHSIZE;
+
+  if (de->hnext) de->hnext->hprev = de->hprev;
+  if (de->hprev) de->hprev->hnext = de->hnext;
+  if (dchash[slot] == de) dchash[slot] = de->hnext;
+
+  if (de->lrunext) de->lrunext->lruprev = de->lruprev;
+  if (de->lruprev) de->lruprev->lrunext = de->lrunext;
+  if (lruhead == de) lruhead = de->lrunext;
+  if (lrutail == de) lrutail = de->lruprev;
+
+  dcache_entries--;
+  kfree(de);
+}
+
+//
+// touch_entry
+//
+
+static void touch_entry(struct dcentry *de) {
+  if (lruhead == de) return;
+
+  // Remove from LRU list
+  if (de->lrunext) de->lrunext->lruprev = de->lruprev;
+  if (de->lruprev) de->lruprev->lrunext = de->lrunext;
+  if (lrutail == de) lrutail = de->lruprev;
+
+  // Insert at head of LRU list
+  de->lruprev = NULL;
+  de->lrunext = lruhead;
+  if (lruhead) lruhead->lruprev = de;
+  lruhead = de;
+  if (!lrutail) lrutail = de;
+}
+
+//
+// find_entry
+//
+
+static struct dcentry *find_entry(struct fs *fs, char *name, int len, unsigned long hash) {
+  struct dcentry *de;
+
+  de = dchash[hash % DCACHE_HASHSIZE];
+  while (de) {
+    if (de->hash == hash && de->fs == fs && fnmatch(de->name, de->len, name, len)) return de;
+    de = de->hnext;
+  }
+
+  return NULL;
+}
+
+//
+// dcache_generation
+//
+// Returns the invalidation generation. Callers sample it before asking the
+// filesystem and pass it to dcache_enter(), so a result that raced with an
+// invalidation is never cached.
+//
+
+unsigned long dcache_generation() {
+  return dcache_gen;
+}
+
+//
+// dcache_lookup
+//
+// Returns DCACHE_HIT and the inode number for positive entries, -ENOENT
+// for negative entries and DCACHE_MISS if the name is not cached. Entries
+// whose path is not searchable by everybody are only used by the user that
+// resolved them (and root).
+//
+
+int dcache_lookup(struct fs *fs, char *name, int len, ino_t *ino, int *flags) {
+  struct dcentry *de;
+  struct thread *thread = kthread_self();
+
+  name = normalize(name, &len);
+  if (len > DCACHE_MAXNAME) return DCACHE_MISS;
+
+  de = find_entry(fs, name, len, dchashname(fs, name, len));
+  if (!de || (!(de->flags & DCACHE_SEARCH) && thread->euid != 0 && thread->euid != de->uid)) {
+    dcache_misses++;
+    return DCACHE_MISS;
+  }
+
+  touch_entry(de);
+  if (flags) *flags = de->flags;
+
+  if (de->flags & DCACHE_NEGATIVE) {
+    dcache_neghits++;
+    return -ENOENT;
+  }
+
+  dcache_hits++;
+  if (ino) *ino = de->ino;
+  return DCACHE_HIT;
+}
+
+//
+// dcache_enter
+//
+
+void dcache_enter(struct fs *fs, char *name, int len, ino_t ino, int flags, unsigned long gen) {
+  struct dcentry *de;
+  unsigned long hash;
+  int slot;
+
+  if (gen != dcache_gen) return;
+  name = normalize(name, &len);
+  if (len > DCACHE_MAXNAME) return;
+
+  hash = dchashname(fs, name, len);
+  de = find_entry(fs, name, len, hash);
+  if (de && (de->flags & flags & DCACHE_NEGATIVE)) {
+    // Keep the searchable flag if the name was already known not to exist
+    de->flags |= flags;
+    touch_entry(de);
+    return;
+  }
+
+  if (!de) {
+    // Evict least recently used entries if cache is full
+    while (dcache_entries >= dcache_maxentries && lrutail) {
+      unlink_entry(lrutail);
+      dcache_evictions++;
+    }
+
+    de = (struct dcentry *) kmalloc(sizeof(struct dcentry) + len);
+    if (!de) return;
+
+    de->fs = fs;
+    de->hash = hash;
+    de->len = len;
+    memcpy(de->name, name, len);
+    de->name[len] = 0;
+
+    slot = hash % DCACHE_HASHSIZE;
+    de->hprev = NULL;
+    de->hnext = dchash[slot];
+    if (dchash[slot]) dchash[slot]->hprev = de;
+    dchash[slot] = de;
+
+    de->lruprev = de->lrunext = NULL;
+    if (!lruhead) lruhead = lrutail = de;
+    dcache_entries++;
+  }
+
+  de->ino = ino;
+  de->flags = flags;
+  de->uid = kthread_self()->euid;
+  touch_entry(de);
+}
+
+//
+// dcache_invalidate
+//
+// Removes the entry for a name. If subtree is set all entries below the
+// name are removed as well, which is needed when a directory is renamed,
+// removed or has its permissions changed.
+//
+
+void dcache_invalidate(struct fs *fs, char *name, int len, int subtree) {
+  struct dcentry *de;
+  struct dcentry *next;
+
+  dcache_gen++;
+  dcache_invalidations++;
+  name = normalize(name, &len);
+
+  if (!subtree) {
+    if (len > DCACHE_MAXNAME) return;
+    de = find_entry(fs, name, len, dchashname(fs, name, len));
+    if (de) unlink_entry(de);
+    return;
+  }
+
+  de = lruhead;
+  while (de) {
+    next = de->lrunext;
+    if (de->fs == fs) {
+      if (len == 0 || (de->len >= len && fnmatch(de->name, len, name, len) &&
+                       (de->len == len || de->name[len] == PS1 || de->name[len] == PS2))) {
+        unlink_entry(de);
+      }
+    }
+    de = next;
+  }
+}
+
+//
+// dcache_purge
+//
+// Removes all entries for a filesystem, or the whole cache if fs is NULL
+//
+
+void dcache_purge(struct fs *fs) {
+  struct dcentry *de;
+  struct dcentry *next;
+
+  dcache_gen++;
+  de = lruhead;
+  while (de) {
+    next = de->lrunext;
+    if (!fs || de->fs == fs) unlink_entry(de);
+    de = next;
+  }
+}
+
+//
+// dcache_proc
+//
+
+static int dcache_proc(struct proc_file *pf, void *arg) {
+  pprintf(pf, "entries      : %d (max %d)\n", dcache_entries, dcache_maxentries);
+  pprintf(pf, "hits         : %lu\n", dcache_hits);
+  pprintf(pf, "negative hits: %lu\n", dcache_neghits);
+  pprintf(pf, "misses       : %lu\n", dcache_misses);
+  pprintf(pf, "evictions    : %lu\n", dcache_evictions);
+  pprintf(pf, "invalidations: %lu\n", dcache_invalidations);
+  return 0;
+}
+
+//
+// init_dcache
+//
+
+int init_dcache() {
+  dcache_maxentries = get_num_option(krnlopts, "dcache", DCACHE_MAXENTRIES);
+  register_proc_inode("dcache", dcache_proc, NULL);
+  return 0;
+}
@@ -50,6 +50,8 @@ unsigned int num_devs = 0;
 static int units_proc(struct proc_file *pf, void *arg);
 static int devices_proc(struct proc_file *pf, void *arg);
 static int devstat_proc(struct proc_file *pf, void *arg);
+static int disklatency_proc(struct proc_file *pf, void *arg);
+static struct proc_seqops diskstats_seqops;
 
 static char *busnames[] = {"HOST", "PCI", "ISA", "?", "?"};
 static char *devtypenames[] = {"?", "stream", "block", "packet"};
@@ -531,6 +533,8 @@ void install_drivers()
     register_proc_inode("units", units_proc, NULL);
     register_proc_inode("devices", devices_proc, NULL);
     register_proc_inode("devstat", devstat_proc, NULL);
+    register_proc_seq("diskstats", &diskstats_seqops, NULL);
+    register_proc_inode("disklatency", disklatency_proc, NULL);
 
     // Parse driver binding database
     parse_bindings();
@@ -659,8 +663,46 @@ int kdev_ioctl(dev_t devno, int cmd, void *args, size_t size)
     return dev->driver->ioctl(dev, cmd, args, size);
 }
 
+//
+// Block I/O accounting. Kernel threads are not preempted, so the counters
+// can be updated without locking.
+//
+
+static unsigned long long io_begin(struct dev *dev) {
+  unsigned long long now = kmach_rdtsc64();
+
+  if (dev->inflight++ == 0) dev->busystart = now;
+  return now;
+}
+
+static void io_end(struct dev *dev, struct iostat *stat, unsigned long long start, int rc) {
+  unsigned long long now = kmach_rdtsc64();
+  unsigned long us;
+  int bucket;
+
+  if (--dev->inflight == 0) dev->busy += now - dev->busystart;
+
+  if (rc < 0) {
+    stat->errors++;
+  } else {
+    stat->bytes += rc;
+  }
+  stat->ops++;
+  stat->cycles += now - start;
+
+  us = (unsigned long) ((now - start) / (cpuInfo.mhz ? cpuInfo.mhz : 1));
+  bucket = 0;
+  while (us && bucket < DEV_LAT_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  stat->hist[bucket]++;
+}
+
 int kdev_read(dev_t devno, void *buffer, size_t count, blkno_t blkno, int flags) {
   struct dev *dev;
+  unsigned long long start;
+  int rc;
 
   if (devno < 0 || devno >= num_devs) return -ENODEV;
   dev = devtab[devno];
@@ -668,19 +710,43 @@ int kdev_read(dev_t devno, void *buffer, size_t count, blkno_t blkno, int flags)
   dev->reads++;
   dev->input += count;
 
-  return dev->driver->read(dev, buffer, count, blkno, flags);
+  if (dev->driver->type != DEV_TYPE_BLOCK) return dev->driver->read(dev, buffer, count, blkno, flags);
+
+  start = io_begin(dev);
+  rc = dev->driver->read(dev, buffer, count, blkno, flags);
+  io_end(dev, &dev->rdstat, start, rc);
+  return rc;
 }
 
 int kdev_write(dev_t devno, void *buffer, size_t count, blkno_t blkno, int flags) {
   struct dev *dev;
+  unsigned long long start;
+  int rc;
 
   if (devno < 0 || devno >= num_devs) return -ENODEV;
   dev = devtab[devno];
-  if (!dev->driver->read) return -ENOSYS;
+  if (!dev->driver->write) return -ENOSYS;
   dev->writes++;
   dev->output += count;
 
-  return dev->driver->write(dev, buffer, count, blkno, flags);
+  if (dev->driver->type != DEV_TYPE_BLOCK) return dev->driver->write(dev, buffer, count, blkno, flags);
+
+  start = io_begin(dev);
+  rc = dev->driver->write(dev, buffer, count, blkno, flags);
+  io_end(dev, &dev->wrstat, start, rc);
+  return rc;
+}
+
+void kdev_merged(dev_t devno, int write, int count) {
+  struct dev *dev;
+
+  if (devno < 0 || devno >= num_devs) return;
+  dev = devtab[devno];
+  if (write) {
+    dev->wrstat.merges += count;
+  } else {
+    dev->rdstat.merges += count;
+  }
 }
 
 int kdev_attach(dev_t devno, struct netif *netif, int (*receive)(struct netif *netif, struct pbuf *p)) {
@@ -859,3 +925,111 @@ static int devstat_proc(struct proc_file *pf, void *arg) {
 
   return 0;
 }
+
+static unsigned long cycles_to_ms(unsigned long long cycles) {
+  return (unsigned long) (cycles / ((cpuInfo.mhz ? cpuInfo.mhz : 1) * 1000));
+}
+
+//
+// One line per block device with the same fields as Linux /proc/diskstats:
+// reads, merged reads, sectors read, ms reading, writes, merged writes,
+// sectors written, ms writing, requests in flight, ms doing I/O, and
+// weighted ms doing I/O.
+//
+
+static void *diskstats_next_dev(dev_t devno) {
+  // Records are pointers into the device table
+  for (; devno < num_devs; devno++) {
+    if (devtab[devno]->driver->type == DEV_TYPE_BLOCK) return &devtab[devno];
+  }
+
+  return NULL;
+}
+
+static void *diskstats_start(struct proc_file *pf, int index) {
+  struct dev **d = diskstats_next_dev(0);
+
+  while (d && index-- > 0) d = diskstats_next_dev(d - devtab + 1);
+  return d;
+}
+
+static void *diskstats_next(struct proc_file *pf, void *v) {
+  return diskstats_next_dev((struct dev **) v - devtab + 1);
+}
+
+static void get_diskstat(dev_t devno, struct proc_diskstat *ds) {
+  struct dev *dev = devtab[devno];
+  unsigned long long busy;
+
+  busy = dev->busy;
+  if (dev->inflight > 0) busy += kmach_rdtsc64() - dev->busystart;
+
+  memset(ds, 0, sizeof(struct proc_diskstat));
+  ds->devno = devno;
+  strncpy(ds->name, dev->name, sizeof(ds->name) - 1);
+  ds->rd_ios = dev->rdstat.ops;
+  ds->rd_merges = dev->rdstat.merges;
+  ds->rd_sectors = (unsigned long) (dev->rdstat.bytes / SECTORSIZE);
+  ds->rd_ms = cycles_to_ms(dev->rdstat.cycles);
+  ds->wr_ios = dev->wrstat.ops;
+  ds->wr_merges = dev->wrstat.merges;
+  ds->wr_sectors = (unsigned long) (dev->wrstat.bytes / SECTORSIZE);
+  ds->wr_ms = cycles_to_ms(dev->wrstat.cycles);
+  ds->inflight = dev->inflight;
+  ds->io_ms = cycles_to_ms(busy);
+  ds->weighted_ms = cycles_to_ms(dev->rdstat.cycles + dev->wrstat.cycles);
+}
+
+static int diskstats_show(struct proc_file *pf, void *v) {
+  struct proc_diskstat ds;
+
+  get_diskstat((struct dev **) v - devtab, &ds);
+  pprintf(pf, "%4d %-8s %lu %lu %lu %lu %lu %lu %lu %lu %d %lu %lu\n",
+          ds.devno, ds.name,
+          ds.rd_ios, ds.rd_merges, ds.rd_sectors, ds.rd_ms,
+          ds.wr_ios, ds.wr_merges, ds.wr_sectors, ds.wr_ms,
+          ds.inflight, ds.io_ms, ds.weighted_ms);
+
+  return 0;
+}
+
+static int diskstats_record(struct proc_file *pf, void *v) {
+  struct proc_diskstat ds;
+
+  get_diskstat((struct dev **) v - devtab, &ds);
+  return proc_write(pf, &ds, sizeof(ds));
+}
+
+static struct proc_seqops diskstats_seqops = {
+  diskstats_start,
+  diskstats_next,
+  diskstats_show,
+  diskstats_record
+};
+
+static void print_latency(struct proc_file *pf, struct dev *dev, char *op, struct iostat *stat) {
+  int i;
+
+  pprintf(pf, "%-8s %s", dev->name, op);
+  for (i = 0; i < DEV_LAT_BUCKETS; i++) pprintf(pf, " %lu", stat->hist[i]);
+  pprintf(pf, "\n");
+}
+
+//
+// Latency histograms for block devices; bucket n counts requests that
+// completed in less than 2^n microseconds, the last bucket the rest.
+//
+
+static int disklatency_proc(struct proc_file *pf, void *arg) {
+  dev_t devno;
+  struct dev *dev;
+
+  for (devno = 0; devno < num_devs; devno++) {
+    dev = devtab[devno];
+    if (dev->driver->type != DEV_TYPE_BLOCK) continue;
+    print_latency(pf, dev, "read", &dev->rdstat);
+    print_latency(pf, dev, "write", &dev->wrstat);
+  }
+
+  return 0;
+}
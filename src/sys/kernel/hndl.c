@@ -242,7 +242,7 @@ int orel(object_t hobj) {
 #define FRAQ 2310
 
 static int handles_proc(struct proc_file *pf, void *arg) {
-  static char *objtype[OBJECT_TYPES] = {"THREAD", "EVENT", "TIMER", "MUTEX", "SEM", "FILE", "SOCKET", "IOMUX", "FILEMAP"};
+  static char *objtype[OBJECT_TYPES] = {"THREAD", "EVENT", "TIMER", "MUTEX", "SEM", "FILE", "SOCKET", "IOMUX", "FILEMAP", "AIO"};
 
   int h;
   int i;
@@ -208,6 +208,10 @@ int enter_object(struct object *obj) {
     case OBJECT_FILEMAP:
       obj->signaled = 0;
       break;
+
+    case OBJECT_AIO:
+      // Do nothing
+      break;
   }
 
   return rc;
@@ -546,6 +550,9 @@ int close_object(struct object *o) {
 
     case OBJECT_IOMUX:
       return close_iomux((struct iomux *) o);
+
+    case OBJECT_AIO:
+      return close_aio((struct aio *) o);
   }
 
   return -EBADF;
@@ -573,6 +580,9 @@ int destroy_object(struct object *o) {
       kfree(o);
       return 0;
 
+    case OBJECT_AIO:
+      return destroy_aio((struct aio *) o);
+
     case OBJECT_FILE:
       return destroy((struct file *) o);
   }
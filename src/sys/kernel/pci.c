@@ -32,6 +32,21 @@
 //
 
 #include <os/pci.h>
+#include <os/cpu.h>
+
+//
+// Local APIC registers used for MSI delivery
+//
+
+#define LAPIC_BASE      0xFEE00000
+#define LAPIC_VERSION   0x30
+#define LAPIC_EOI       0xB0
+#define LAPIC_SVR       0xF0
+
+#define LAPIC_SVR_ENABLE 0x100
+
+static unsigned char *lapic;
+static int next_msi_vector = PCI_MSI_VECTOR_LAST;
 
 struct {
   int classcode;
@@ -365,6 +380,59 @@ void enum_pci_bus(struct bus *bus) {
   }
 }
 
+//
+// Message signalled interrupts are delivered through the local APIC. The
+// kernel routes legacy interrupts through the 8259 PIC, so MSI can only be
+// used when the firmware has left the local APIC software-enabled in
+// virtual wire mode. Returns the interrupt vector assigned to the device.
+//
+
+int pci_enable_msi(struct unit *unit) {
+  unsigned short flags;
+  unsigned short cmd;
+  int pos;
+  int vector;
+
+  if (unit->bus->bustype != BUSTYPE_PCI) return -EINVAL;
+  if (!(cpuInfo.features & CPU_FEATURE_APIC)) return -ENOSYS;
+
+  pos = pci_find_capability(unit, PCI_CAP_ID_MSI);
+  if (!pos) return -ENOSYS;
+
+  if (!lapic) {
+    lapic = (unsigned char *) iomap(LAPIC_BASE, PAGESIZE);
+    if (!lapic) return -ENOMEM;
+  }
+  if (*(volatile unsigned long *) (lapic + LAPIC_VERSION) == 0xFFFFFFFF) return -ENOSYS;
+  if (!(*(volatile unsigned long *) (lapic + LAPIC_SVR) & LAPIC_SVR_ENABLE)) return -ENOSYS;
+
+  if (next_msi_vector < PCI_MSI_VECTOR_FIRST) return -EBUSY;
+  vector = next_msi_vector--;
+
+  // Single message, fixed delivery to the boot processor, edge triggered
+  flags = pci_read_config_word(unit, pos + PCI_MSI_FLAGS);
+  flags &= ~(PCI_MSI_FLAGS_ENABLE | PCI_MSI_FLAGS_QSIZE);
+  pci_write_config_word(unit, pos + PCI_MSI_FLAGS, flags);
+  pci_write_config_dword(unit, pos + PCI_MSI_ADDRESS_LO, LAPIC_BASE);
+  if (flags & PCI_MSI_FLAGS_64BIT) {
+    pci_write_config_dword(unit, pos + PCI_MSI_ADDRESS_HI, 0);
+    pci_write_config_word(unit, pos + PCI_MSI_DATA_64, vector);
+  } else {
+    pci_write_config_word(unit, pos + PCI_MSI_DATA_32, vector);
+  }
+  pci_write_config_word(unit, pos + PCI_MSI_FLAGS, flags | PCI_MSI_FLAGS_ENABLE);
+
+  // Stop the device from also asserting its INTx line
+  cmd = pci_read_config_word(unit, PCI_CONFIG_CMD);
+  pci_write_config_word(unit, PCI_CONFIG_CMD, cmd | PCI_COMMAND_INTX_DISABLE);
+
+  return vector;
+}
+
+void pci_msi_eoi() {
+  *(volatile unsigned long *) (lapic + LAPIC_EOI) = 0;
+}
+
 unsigned long get_pci_hostbus_unitcode() {
   unsigned long value;
   unsigned long vendorid;
@@ -103,7 +103,7 @@ static struct
     { NULL,   NULL },
     { NULL,   NULL },
     { NULL,   NULL },
-    { NULL,   NULL },
+    { "TMPF", "R" },
     { NULL,   NULL },
     { NULL,   NULL },
     { NULL,   NULL },
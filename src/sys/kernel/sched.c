@@ -988,48 +988,104 @@ void ksched_idle()
 }
 
 
-static int threads_proc(struct proc_file *pf, void *arg) {
-    static char *threadstatename[] = {"init", "ready", "run", "wait", "term", "susp", "trans"};
-    static char *waitreasonname[] = {"wait", "fileio", "taskq", "sockio", "sleep", "pipe", "devio"};
+static void *threads_start(struct proc_file *pf, int index)
+{
     struct thread *t = threadlist;
-    char *state;
-    unsigned long stksiz;
 
-    pprintf(pf, "tid tcb      hndl state  prio s #h   user kernel ctxtsw stksiz name\n");
-    pprintf(pf, "--- -------- ---- ------ ---- - -- ------ ------ ------ ------ --------------\n");
-    while (1)
+    if (index == 0) return PROC_SEQ_HEADER;
+    while (--index > 0)
     {
-        if (t->state == THREAD_STATE_WAITING)
-        {
-            state = waitreasonname[t->wait_reason];
-        }
-        else
-        {
-            state = threadstatename[t->state];
-        }
+        t = t->next;
+        if (t == threadlist) return NULL;
+    }
 
-        if (t->tib)
-        {
-            stksiz = (char *) (t->tib->stacktop) - (char *) (t->tib->stacklimit);
-        } else {
-            stksiz = 0;
-        }
+    return t;
+}
 
-        pprintf(pf,"%3d %p %4d %-6s %2d%+2d %1d %2d%7d%7d%7d%6dK %s\n",
-        t->id, t, t->hndl, state, t->base_priority, t->priority - t->base_priority,
-        t->suspend_count, t->object.handle_count,
-        t->utime, t->stime, t->context_switches,
-        stksiz / 1024,
-        t->name);
 
-        t = t->next;
-        if (t == threadlist) break;
+static void *threads_next(struct proc_file *pf, void *v)
+{
+    struct thread *t = (struct thread *) v;
+
+    if (v == PROC_SEQ_HEADER) return threadlist;
+    return t->next == threadlist ? NULL : t->next;
+}
+
+
+static unsigned long thread_stack_size(struct thread *t)
+{
+    if (!t->tib) return 0;
+    return (char *) (t->tib->stacktop) - (char *) (t->tib->stacklimit);
+}
+
+
+static int threads_show(struct proc_file *pf, void *v)
+{
+    static char *threadstatename[] = {"init", "ready", "run", "wait", "term", "susp", "trans"};
+    static char *waitreasonname[] = {"wait", "fileio", "taskq", "sockio", "sleep", "pipe", "devio"};
+    struct thread *t = (struct thread *) v;
+    char *state;
+
+    if (v == PROC_SEQ_HEADER)
+    {
+        pprintf(pf, "tid tcb      hndl state  prio s #h   user kernel ctxtsw stksiz name\n");
+        pprintf(pf, "--- -------- ---- ------ ---- - -- ------ ------ ------ ------ --------------\n");
+        return 0;
+    }
+
+    if (t->state == THREAD_STATE_WAITING)
+    {
+        state = waitreasonname[t->wait_reason];
+    }
+    else
+    {
+        state = threadstatename[t->state];
     }
 
+    pprintf(pf,"%3d %p %4d %-6s %2d%+2d %1d %2d%7d%7d%7d%6dK %s\n",
+    t->id, t, t->hndl, state, t->base_priority, t->priority - t->base_priority,
+    t->suspend_count, t->object.handle_count,
+    t->utime, t->stime, t->context_switches,
+    thread_stack_size(t) / 1024,
+    t->name);
+
     return 0;
 }
 
 
+static int threads_record(struct proc_file *pf, void *v)
+{
+    struct thread *t = (struct thread *) v;
+    struct proc_thread rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.tid = t->id;
+    rec.hndl = t->hndl;
+    rec.state = t->state;
+    rec.wait_reason = t->wait_reason;
+    rec.base_priority = t->base_priority;
+    rec.priority = t->priority;
+    rec.suspend_count = t->suspend_count;
+    rec.handle_count = t->object.handle_count;
+    rec.utime = t->utime;
+    rec.stime = t->stime;
+    rec.context_switches = t->context_switches;
+    rec.stacksize = thread_stack_size(t);
+    strncpy(rec.name, t->name, sizeof(rec.name) - 1);
+
+    return proc_write(pf, &rec, sizeof(rec));
+}
+
+
+static struct proc_seqops threads_seqops =
+{
+    threads_start,
+    threads_next,
+    threads_show,
+    threads_record
+};
+
+
 static int dpcs_proc(struct proc_file *pf, void *arg)
 {
     pprintf(pf, "dpc time   : %8d\n", dpc_time);
@@ -1065,7 +1121,7 @@ void ksched_init()
     init_task_queue(&sys_task_queue, PRIORITY_NORMAL /*PRIORITY_SYSTEM*/, INFINITE, "systask");
 
     // Register /proc/threads and /proc/dpcs
-    register_proc_inode("threads", threads_proc, NULL);
+    register_proc_seq("threads", &threads_seqops, NULL);
     register_proc_inode("dpcs", dpcs_proc, NULL);
 }
 
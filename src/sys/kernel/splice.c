@@ -0,0 +1,235 @@
+//
+// splice.c
+//
+// Kernel-side data transfer between files, pipes and sockets
+//
+// Copyright (C) 2002 Michael Ringgaard. All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+//
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+// SUCH DAMAGE.
+//
+
+#include <os/krnl.h>
+#include <os/vfs.h>
+#include <os/kmalloc.h>
+#include <net/socket.h>
+
+#define SPLICE_BUFSIZE  (64 * 1024)
+
+struct splicedesc {
+  struct object *out;
+  off64_t *outpos;
+};
+
+//
+// Only regular files can be read at an explicit position. Data read
+// from pipes, sockets and devices cannot be pushed back if the output
+// does not accept all of it.
+//
+
+static int seekable(struct object *o) {
+  struct stat64 st;
+
+  if (o->type != OBJECT_FILE) return 0;
+  if (fstat((struct file *) o, &st) < 0) return 0;
+  return S_ISREG(st.st_mode);
+}
+
+static int read_object(struct object *o, void *data, size_t size, off64_t *pos) {
+  if (o->type == OBJECT_SOCKET) return recv((struct socket *) o, data, size, 0);
+  if (pos) return pread((struct file *) o, data, size, *pos);
+  return read((struct file *) o, data, size);
+}
+
+static int write_object(struct object *o, struct iovec *iov, int count, off64_t *pos) {
+  int bytes;
+  int rc;
+  int i;
+
+  if (o->type == OBJECT_SOCKET) return sendv((struct socket *) o, iov, count);
+  if (!pos) return writev((struct file *) o, iov, count);
+
+  bytes = 0;
+  for (i = 0; i < count; i++) {
+    rc = pwrite((struct file *) o, iov[i].iov_base, iov[i].iov_len, *pos);
+    if (rc < 0) return bytes > 0 ? bytes : rc;
+    *pos += rc;
+    bytes += rc;
+    if (rc < (int) iov[i].iov_len) break;
+  }
+
+  return bytes;
+}
+
+static int splice_actor(void *arg, struct iovec *iov, int count) {
+  struct splicedesc *sd = (struct splicedesc *) arg;
+
+  return write_object(sd->out, iov, count, sd->outpos);
+}
+
+//
+// splice
+//
+// Moves up to count bytes from one file, pipe or socket to another
+// without copying the data through user space. If inpos or outpos
+// are given, the file is accessed at that position and the position
+// is advanced instead of the file pointer.
+//
+// If the input file system provides splice_read, it feeds the output
+// itself in large batches. Otherwise data is moved through a kernel
+// buffer.
+//
+
+int splice(struct object *in, off64_t *inpos, struct object *out, off64_t *outpos, size_t count, int flags) {
+  struct file *filp;
+  struct splicedesc sd;
+  struct iovec iov;
+  off64_t pos;
+  off64_t *ppos;
+  char *buffer;
+  size_t bufsize;
+  size_t total;
+  int rewind;
+  int bytes;
+  int written;
+  int rc;
+
+  if (flags != 0) return -EINVAL;
+  if (in->type != OBJECT_FILE && in->type != OBJECT_SOCKET) return -EBADF;
+  if (out->type != OBJECT_FILE && out->type != OBJECT_SOCKET) return -EBADF;
+  if (in->type == OBJECT_FILE && (((struct file *) in)->flags & O_TEXT)) return -EINVAL;
+  if (out->type == OBJECT_FILE && (((struct file *) out)->flags & O_TEXT)) return -EINVAL;
+  if (count == 0) return 0;
+
+  rewind = seekable(in);
+  if (inpos && !rewind) return -ESPIPE;
+  if (outpos && !seekable(out)) return -ESPIPE;
+
+  // Data read from a stream must be written in full, which a
+  // non-blocking socket cannot guarantee
+  if (!rewind && out->type == OBJECT_SOCKET && (((struct socket *) out)->flags & SOCK_NBIO)) return -EINVAL;
+
+  if (rewind) {
+    filp = (struct file *) in;
+    pos = inpos ? *inpos : filp->pos;
+    ppos = &pos;
+  } else {
+    filp = NULL;
+    ppos = NULL;
+  }
+
+  sd.out = out;
+  sd.outpos = outpos;
+
+  // Send directly from the input file system cache if possible
+  if (filp) {
+    rc = splice_read(filp, pos, count, splice_actor, &sd);
+    if (rc != -ENOSYS) {
+      if (rc > 0) {
+        if (inpos) *inpos += rc; else filp->pos += rc;
+      }
+      return rc;
+    }
+  }
+
+  // Move data through a kernel buffer
+  bufsize = count < SPLICE_BUFSIZE ? count : SPLICE_BUFSIZE;
+  buffer = kmalloc(bufsize);
+  if (!buffer) return -ENOMEM;
+
+  total = 0;
+  rc = 0;
+  while (total < count) {
+    bytes = read_object(in, buffer, count - total < bufsize ? count - total : bufsize, ppos);
+    if (bytes <= 0) {
+      rc = bytes;
+      break;
+    }
+
+    iov.iov_base = buffer;
+    iov.iov_len = bytes;
+    while (iov.iov_len > 0) {
+      rc = write_object(out, &iov, 1, outpos);
+      if (rc <= 0) break;
+      iov.iov_base = (char *) iov.iov_base + rc;
+      iov.iov_len -= rc;
+      if (rewind) break;
+    }
+
+    written = bytes - iov.iov_len;
+    total += written;
+    if (rewind) pos += written;
+    if (iov.iov_len > 0) break;
+  }
+
+  kfree(buffer);
+
+  if (filp) {
+    if (inpos) *inpos = pos; else filp->pos = pos;
+  }
+
+  if (total == 0 && rc < 0) return rc;
+  return total;
+}
+
+//
+// copy_file_range
+//
+// Copies up to count bytes between two regular files inside the kernel.
+// If both files are on the same file system and it can copy the range
+// itself (copy_range), for example by moving disk blocks in large
+// clusters or by asking a file server to copy the data, this is used.
+// Otherwise the data is spliced from the input file cache to the output.
+//
+
+int copy_file_range(struct file *in, off64_t *inpos, struct file *out, off64_t *outpos, size_t count, int flags) {
+  off64_t ipos;
+  off64_t opos;
+  int rc;
+
+  if (flags != 0) return -EINVAL;
+  if (((struct object *) in)->type != OBJECT_FILE || ((struct object *) out)->type != OBJECT_FILE) return -EBADF;
+  if ((in->flags & O_TEXT) || (out->flags & O_TEXT)) return -EINVAL;
+  if (out->flags & O_APPEND) return -EBADF;
+  if (!seekable((struct object *) in) || !seekable((struct object *) out)) return -EINVAL;
+  if (count == 0) return 0;
+
+  ipos = inpos ? *inpos : in->pos;
+  opos = outpos ? *outpos : out->pos;
+  if (ipos < 0 || opos < 0) return -EINVAL;
+
+  // Overlapping ranges in the same file are not supported
+  if (in == out && ipos < opos + (off64_t) count && opos < ipos + (off64_t) count) return -EINVAL;
+
+  rc = -ENOSYS;
+  if (in->fs == out->fs) rc = copy_range(in, ipos, out, opos, count);
+  if (rc == -ENOSYS) rc = splice((struct object *) in, &ipos, (struct object *) out, &opos, count, 0);
+  if (rc <= 0) return rc;
+
+  if (inpos) *inpos += rc; else in->pos += rc;
+  if (outpos) *outpos += rc; else out->pos += rc;
+
+  return rc;
+}
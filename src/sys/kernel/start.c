@@ -115,6 +115,10 @@ int pipe(struct file **readpipe, struct file **writepipe);
 
 void init_cdfs();
 
+// tmpfs.c
+
+void init_tmpfs();
+
 // cons.c
 
 extern int serial_console;
@@ -142,6 +146,14 @@ void init_fd();
 
 void init_vblk();
 
+// ahci.c
+
+void init_ahci();
+
+// nvme.c
+
+void init_nvme();
+
 // apm.c
 
 void apm_power_off();
@@ -278,6 +290,8 @@ static void init_filesystem()
     char rootfs[32];
     char *rootfsopts;
     char fsoptbuf[128];
+    char *tmpfsopts;
+    char tmpoptbuf[128];
 
     // Initialize built-in file systems
     init_vfs();
@@ -287,6 +301,7 @@ static void init_filesystem()
     init_pipefs();
     init_smbfs();
     init_cdfs();
+    init_tmpfs();
 
     // Determine boot device
     if ((syspage->ldrparams.bootdrv & 0xF0) == 0xF0)
@@ -330,6 +345,14 @@ static void init_filesystem()
 
     rc = mount("procfs", "/proc", NULL, NULL, NULL);
     if (rc < 0) panic("error mounting proc filesystem");
+
+    // Mount RAM file system on /tmp if the root file system has a /tmp
+    if (!get_option(krnlopts, "notmpfs", NULL, 0, NULL))
+    {
+        tmpfsopts = get_option(krnlopts, "tmpopts", tmpoptbuf, sizeof(tmpoptbuf), NULL);
+        rc = mount("tmpfs", "/tmp", NULL, tmpfsopts, NULL);
+        if (rc < 0 && rc != -ENOENT) kprintf(KERN_WARNING "mount: unable to mount tmpfs on /tmp (%d)\n", rc);
+    }
 }
 
 static int version_proc(struct proc_file *pf, void *arg) {
@@ -546,6 +569,8 @@ void main(void *arg)
     init_hd();
     init_fd();
     init_vblk();
+    init_ahci();
+    init_nvme();
 
     // Initialize file systems
     init_filesystem();
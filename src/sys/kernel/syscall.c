@@ -507,6 +507,217 @@ static int sys_ftruncate(char *params) {
   return rc;
 }
 
+static int sys_fallocate(char *params) {
+  struct file *f;
+  handle_t h;
+  int mode;
+  off64_t offset;
+  off64_t len;
+  int rc;
+
+  h = *(handle_t *) params;
+  mode = *(int *) (params + 4);
+  offset = *(off64_t *) (params + 8);
+  len = *(off64_t *) (params + 16);
+
+  f = (struct file *) olock(h, OBJECT_FILE);
+  if (!f) return -EBADF;
+
+  rc = fallocate(f, mode, offset, len);
+
+  orel(f);
+
+  return rc;
+}
+
+static int sys_splice(char *params) {
+  handle_t hin;
+  handle_t hout;
+  off64_t *inpos;
+  off64_t *outpos;
+  size_t count;
+  int flags;
+  struct object *in;
+  struct object *out;
+  int rc;
+
+  hin = *(handle_t *) params;
+  inpos = *(off64_t **) (params + 4);
+  hout = *(handle_t *) (params + 8);
+  outpos = *(off64_t **) (params + 12);
+  count = *(size_t *) (params + 16);
+  flags = *(int *) (params + 20);
+
+  if (inpos && lock_buffer(inpos, sizeof(off64_t), 1) < 0) return -EFAULT;
+  if (outpos && lock_buffer(outpos, sizeof(off64_t), 1) < 0) {
+    if (inpos) unlock_buffer(inpos, sizeof(off64_t));
+    return -EFAULT;
+  }
+
+  in = olock(hin, OBJECT_ANY);
+  out = olock(hout, OBJECT_ANY);
+  if (!in || !out) {
+    rc = -EBADF;
+  } else {
+    rc = splice(in, inpos, out, outpos, count, flags);
+  }
+
+  if (in) orel(in);
+  if (out) orel(out);
+  if (inpos) unlock_buffer(inpos, sizeof(off64_t));
+  if (outpos) unlock_buffer(outpos, sizeof(off64_t));
+
+  return rc;
+}
+
+static int sys_copy_file_range(char *params) {
+  handle_t hin;
+  handle_t hout;
+  off64_t *inpos;
+  off64_t *outpos;
+  size_t count;
+  int flags;
+  struct file *in;
+  struct file *out;
+  int rc;
+
+  hin = *(handle_t *) params;
+  inpos = *(off64_t **) (params + 4);
+  hout = *(handle_t *) (params + 8);
+  outpos = *(off64_t **) (params + 12);
+  count = *(size_t *) (params + 16);
+  flags = *(int *) (params + 20);
+
+  if (inpos && lock_buffer(inpos, sizeof(off64_t), 1) < 0) return -EFAULT;
+  if (outpos && lock_buffer(outpos, sizeof(off64_t), 1) < 0) {
+    if (inpos) unlock_buffer(inpos, sizeof(off64_t));
+    return -EFAULT;
+  }
+
+  in = (struct file *) olock(hin, OBJECT_FILE);
+  out = (struct file *) olock(hout, OBJECT_FILE);
+  if (!in || !out) {
+    rc = -EBADF;
+  } else {
+    rc = copy_file_range(in, inpos, out, outpos, count, flags);
+  }
+
+  if (in) orel(in);
+  if (out) orel(out);
+  if (inpos) unlock_buffer(inpos, sizeof(off64_t));
+  if (outpos) unlock_buffer(outpos, sizeof(off64_t));
+
+  return rc;
+}
+
+static int submit_aio_request(handle_t h, int op, void *data, int size, off64_t offset) {
+  struct file *filp;
+  struct aio *aio;
+  handle_t ah;
+  int rc;
+
+  if (data && lock_buffer(data, size, op == AIO_READ) < 0) return -EFAULT;
+
+  filp = (struct file *) olock(h, OBJECT_FILE);
+  if (!filp) {
+    if (data) unlock_buffer(data, size);
+    return -EBADF;
+  }
+
+  rc = submit_user_aio(filp, op, data, size, offset, &aio);
+  orel(filp);
+  if (data) unlock_buffer(data, size);
+  if (rc < 0) return rc;
+
+  ah = halloc(&aio->iob.object);
+  if (ah < 0) {
+    cancel_aio(aio);
+    return ah;
+  }
+
+  return ah;
+}
+
+static int sys_aio_read(char *params) {
+  handle_t h;
+  void *data;
+  int size;
+  off64_t offset;
+
+  h = *(handle_t *) params;
+  data = *(void **) (params + 4);
+  size = *(int *) (params + 8);
+  offset = *(off64_t *) (params + 12);
+
+  if (!data) return -EFAULT;
+  return submit_aio_request(h, AIO_READ, data, size, offset);
+}
+
+static int sys_aio_write(char *params) {
+  handle_t h;
+  void *data;
+  int size;
+  off64_t offset;
+
+  h = *(handle_t *) params;
+  data = *(void **) (params + 4);
+  size = *(int *) (params + 8);
+  offset = *(off64_t *) (params + 12);
+
+  if (!data) return -EFAULT;
+  return submit_aio_request(h, AIO_WRITE, data, size, offset);
+}
+
+static int sys_aio_fsync(char *params) {
+  handle_t h;
+
+  h = *(handle_t *) params;
+
+  return submit_aio_request(h, AIO_FSYNC, NULL, 0, 0);
+}
+
+static int sys_aio_result(char *params) {
+  handle_t h;
+  struct aio *aio;
+  int rc;
+
+  h = *(handle_t *) params;
+
+  aio = (struct aio *) olock(h, OBJECT_AIO);
+  if (!aio) return -EBADF;
+
+  rc = aio->state == AIO_DONE ? aio->result : -EINPROGRESS;
+
+  // Read data is passed back through the bounce buffer of the request
+  if (rc > 0 && aio->user) {
+    if (lock_buffer(aio->user, rc, 1) < 0) {
+      rc = -EFAULT;
+    } else {
+      memcpy(aio->user, aio->bounce, rc);
+      unlock_buffer(aio->user, rc);
+    }
+  }
+
+  orel(aio);
+  return rc;
+}
+
+static int sys_aio_cancel(char *params) {
+  handle_t h;
+  struct aio *aio;
+  int rc;
+
+  h = *(handle_t *) params;
+
+  aio = (struct aio *) olock(h, OBJECT_AIO);
+  if (!aio) return -EBADF;
+
+  rc = cancel_aio(aio);
+
+  orel(aio);
+  return rc;
+}
+
 static int sys_futime(char *params) {
   struct file *f;
   handle_t h;
@@ -744,6 +955,33 @@ static int sys_readdir(char *params) {
   return rc;
 }
 
+static int sys_readdirplus(char *params) {
+  handle_t h;
+  struct file *f;
+  int rc;
+  struct direntplus *buf;
+  size_t size;
+
+  h = *(handle_t *) params;
+  buf = *(struct direntplus **) (params + 4);
+  size = *(size_t *) (params + 8);
+
+  f = (struct file *) olock(h, OBJECT_FILE);
+  if (f == NULL) return -EBADF;
+
+  if (lock_buffer(buf, size, 1) < 0) {
+    orel(f);
+    return -EFAULT;
+  }
+
+  rc = readdirplus(f, buf, size);
+
+  unlock_buffer(buf, size);
+  orel(f);
+
+  return rc;
+}
+
 static int sys_vmalloc(char *params) {
   char *addr;
   unsigned long size;
@@ -1707,6 +1945,37 @@ static int sys_send(char *params) {
   return rc;
 }
 
+static int sys_sendfile(char *params) {
+  handle_t hs;
+  handle_t hf;
+  struct socket *s;
+  struct file *f;
+  off64_t *offset;
+  size_t count;
+  int rc;
+
+  hs = *(handle_t *) params;
+  hf = *(handle_t *) (params + 4);
+  offset = *(off64_t **) (params + 8);
+  count = *(size_t *) (params + 12);
+
+  if (offset && lock_buffer(offset, sizeof(off64_t), 1) < 0) return -EFAULT;
+
+  s = (struct socket *) olock(hs, OBJECT_SOCKET);
+  f = (struct file *) olock(hf, OBJECT_FILE);
+  if (!s || !f) {
+    rc = -EBADF;
+  } else {
+    rc = splice(&f->iob.object, offset, &s->iob.object, NULL, count, 0);
+  }
+
+  if (s) orel(s);
+  if (f) orel(f);
+  if (offset) unlock_buffer(offset, sizeof(off64_t));
+
+  return rc;
+}
+
 static int sys_sendto(char *params) {
   handle_t h;
   struct socket *s;
@@ -2077,6 +2346,7 @@ static int sys_select(char *params) {
 
 // TODO: we don't have this prototype in any kernel include?
 int pipe(struct file **readpipe, struct file **writepipe);
+int vmsplice(struct file *filp, struct iovec *iov, int count, int flags);
 
 static int sys_pipe(char *params) {
   handle_t *fildes;
@@ -2109,6 +2379,35 @@ static int sys_pipe(char *params) {
   return rc;
 }
 
+static int sys_vmsplice(char *params) {
+  handle_t h;
+  struct file *f;
+  struct iovec *iov;
+  int count;
+  int flags;
+  int rc;
+
+  h = *(handle_t *) params;
+  iov = *(struct iovec **) (params + 4);
+  count = *(int *) (params + 8);
+  flags = *(int *) (params + 12);
+
+  f = (struct file *) olock(h, OBJECT_FILE);
+  if (!f) return -EBADF;
+
+  if (lock_iovec(iov, count, 0) < 0) {
+    orel(f);
+    return -EFAULT;
+  }
+
+  rc = vmsplice(f, iov, count, flags);
+
+  unlock_iovec(iov, count);
+  orel(f);
+
+  return rc;
+}
+
 static int sys_setmode(char *params) {
   handle_t h;
   struct file *f;
@@ -2661,6 +2960,17 @@ struct syscall_entry syscalltab[] = {
   {"alarm", 4, "%d", sys_alarm},
   {"vmmap", 24, "%p,%d,%x,%d,%d-%d", sys_vmmap},
   {"vmsync", 8, "%p,%d", sys_vmsync},
+  {"fallocate", 24, "%d,%d,%d-%d,%d-%d", sys_fallocate},
+  {"sendfile", 16, "%d,%d,%p,%d", sys_sendfile},
+  {"splice", 24, "%d,%p,%d,%p,%d,%x", sys_splice},
+  {"vmsplice", 16, "%d,%p,%d,%x", sys_vmsplice},
+  {"readdirplus", 12, "%d,%p,%d", sys_readdirplus},
+  {"copy_file_range", 24, "%d,%p,%d,%p,%d,%x", sys_copy_file_range},
+  {"aio_read", 20, "%d,%p,%d,%d-%d", sys_aio_read},
+  {"aio_write", 20, "%d,%p,%d,%d-%d", sys_aio_write},
+  {"aio_fsync", 4, "%d", sys_aio_fsync},
+  {"aio_result", 4, "%d", sys_aio_result},
+  {"aio_cancel", 4, "%d", sys_aio_cancel},
 };
 
 int syscall(int syscallno, char *params, struct context *ctxt) {
@@ -40,6 +40,10 @@ struct filesystem *fslist = NULL;
 struct fs *mountlist = NULL;
 char pathsep = '/';
 
+#define MNTHASH_SIZE 64
+
+static struct fs *mnthash[MNTHASH_SIZE];
+
 #define LFBUFSIZ 1025
 #define CR '\r'
 #define LF '\n'
@@ -117,6 +121,51 @@ int fnmatch(char *fn1, int len1, char *fn2, int len2)
     return 1;
 }
 
+static unsigned long mntkey(char *name, int len)
+{
+    unsigned long h = 0;
+
+    while (len-- > 0) h = (h << 5) + h + (unsigned char) *name++;
+    return h % MNTHASH_SIZE;
+}
+
+static char *mntname(struct fs *fs)
+{
+    char *q = fs->mntto;
+
+    if (*q == PS1 || *q == PS2) q++;
+    return q;
+}
+
+static void mnthash_insert(struct fs *fs)
+{
+    int slot;
+
+    // Filesystems without a mount point can not be looked up by name
+    if (!fs->mntto[0]) return;
+
+    slot = mntkey(mntname(fs), strlen(mntname(fs)));
+    fs->hashnext = mnthash[slot];
+    mnthash[slot] = fs;
+}
+
+static void mnthash_remove(struct fs *fs)
+{
+    struct fs **pfs;
+
+    pfs = &mnthash[mntkey(mntname(fs), strlen(mntname(fs)))];
+    while (*pfs)
+    {
+        if (*pfs == fs)
+        {
+            *pfs = fs->hashnext;
+            break;
+        }
+        pfs = &(*pfs)->hashnext;
+    }
+    fs->hashnext = NULL;
+}
+
 int fslookup(char *name, int full, struct fs **mntfs, char **rest)
 {
     struct fs *fs;
@@ -132,39 +181,33 @@ int fslookup(char *name, int full, struct fs **mntfs, char **rest)
     if (*p == PS1 || *p == PS2) p++;
     n = strlen(p);
 
-    // Find matching filesystem in mount list
-    fs = mountlist;
-    while (fs)
+    // Find the longest prefix of the path that is a mount point. Only prefixes
+    // ending at a path separator (or the whole name for full lookups) are tried.
+    m = n;
+    while (1)
     {
-        q = fs->mntto;
-
-        if (*q)
+        if (m == 0 || p[m] == PS1 || p[m] == PS2 || (full && m == n))
         {
-            if (*q == PS1 || *q == PS2) q++;
-
-            if (!*q)
+            fs = mnthash[mntkey(p, m)];
+            while (fs)
             {
-                rc = check(fs->mode, fs->uid, fs->gid, S_IEXEC);
-                if (rc < 0) return rc;
-                if (rest) *rest = p;
-                *mntfs = fs;
-
-                return 0;
-            }
-
-            m = strlen(q);
-            if (n >= m && fnmatch(p, m, q, m) && (p[m] == PS1 || p[m] == PS2 || full && p[m] == 0)) {
-            rc = check(fs->mode, fs->uid, fs->gid, S_IEXEC);
-            if (rc < 0) return rc;
-
-            if (rest) *rest = p + m;
-            *mntfs = fs;
-
-            return 0;
+                q = mntname(fs);
+                if (fnmatch(p, m, q, strlen(q)))
+                {
+                    rc = check(fs->mode, fs->uid, fs->gid, S_IEXEC);
+                    if (rc < 0) return rc;
+
+                    if (rest) *rest = p + m;
+                    *mntfs = fs;
+
+                    return 0;
+                }
+                fs = fs->hashnext;
             }
         }
 
-        fs = fs->next;
+        if (m == 0) break;
+        m--;
     }
 
     return -ENOENT;
@@ -188,6 +231,24 @@ void __inline unlock_fs(struct fs *fs, int fsop) {
   }
 }
 
+//
+// Dentry cache helpers. Only filesystems that set FS_DCACHE have their
+// names cached; for others the namespace can change behind our back.
+//
+
+static __inline int dcache_noent(struct fs *fs, char *rest) {
+  if (!(fs->flags & FS_DCACHE)) return 0;
+  return dcache_lookup(fs, rest, strlen(rest), NULL, NULL) == -ENOENT;
+}
+
+static __inline void dcache_enter_noent(struct fs *fs, char *rest, int rc, unsigned long gen) {
+  if (rc == -ENOENT && (fs->flags & FS_DCACHE)) dcache_enter(fs, rest, strlen(rest), 0, DCACHE_NEGATIVE, gen);
+}
+
+static __inline void dcache_changed(struct fs *fs, char *rest, int subtree) {
+  if (fs->flags & FS_DCACHE) dcache_invalidate(fs, rest, strlen(rest), subtree);
+}
+
 static int files_proc(struct proc_file *pf, void *arg) {
   int h;
   struct object *o;
@@ -237,6 +298,7 @@ int init_vfs() {
   if (!peb) panic("peb not initialized in vfs");
   peb->pathsep = pathsep;
   register_proc_inode("files", files_proc, NULL);
+  init_dcache();
   return 0;
 }
 
@@ -404,6 +466,10 @@ int mount(char *type, char *mntto, char *mntfrom, char *opts, struct fs **newfs)
         if (mountlist) mountlist->prev = fs;
         mountlist = fs;
     }
+    mnthash_insert(fs);
+
+    // Names below the mount point now resolve to the new filesystem
+    dcache_purge(NULL);
 
     if (newfs) *newfs = fs;
     return 0;
@@ -445,6 +511,8 @@ int umount(char *name)
     if (fs->next) fs->next->prev = fs->prev;
     if (fs->prev) fs->prev->next = fs->next;
     if (mountlist == fs) mountlist = fs->next;
+    mnthash_remove(fs);
+    dcache_purge(fs);
     kfree(fs);
 
     return 0;
@@ -463,6 +531,8 @@ int umount_all() {
   }
 
   mountlist = NULL;
+  memset(mnthash, 0, sizeof(mnthash));
+  dcache_purge(NULL);
   return 0;
 }
 
@@ -540,6 +610,7 @@ int statfs(char *name, struct statfs *buf) {
 int open(char *name, int flags, int mode, struct file **retval) {
   struct fs *fs;
   struct file *filp;
+  unsigned long gen;
   int rc;
   char *rest;
   char path[MAXPATH];
@@ -550,6 +621,8 @@ int open(char *name, int flags, int mode, struct file **retval) {
   rc = fslookup(path, 0, &fs, &rest);
   if (rc < 0) return rc;
 
+  if (!(flags & O_CREAT) && dcache_noent(fs, rest)) return -ENOENT;
+
   filp = newfile(fs, path, flags, mode);
   if (!filp) return -EMFILE;
 
@@ -562,7 +635,13 @@ int open(char *name, int flags, int mode, struct file **retval) {
       return -ETIMEOUT;
     }
 
+    gen = dcache_generation();
     rc = fs->ops->open(filp, rest);
+    if (flags & (O_CREAT | O_TRUNC)) {
+      dcache_changed(fs, rest, 0);
+    } else {
+      dcache_enter_noent(fs, rest, rc, gen);
+    }
     if (rc == 0) {
       int access;
 
@@ -929,6 +1008,65 @@ int ftruncate(struct file *filp, off64_t size) {
   return rc;
 }
 
+int fallocate(struct file *filp, int mode, off64_t offset, off64_t len) {
+  int rc;
+
+  if (!filp) return -EINVAL;
+  if ((filp->flags & O_ACCMODE) == O_RDONLY) return -EACCES;
+
+  if (!filp->fs->ops->fallocate) return -ENOSYS;
+  if (lock_fs(filp->fs, FSOP_FALLOCATE) < 0) return -ETIMEOUT;
+  rc = filp->fs->ops->fallocate(filp, mode, offset, len);
+  unlock_fs(filp->fs, FSOP_FALLOCATE);
+  return rc;
+}
+
+int splice_read(struct file *filp, off64_t pos, size_t size, splice_actor_t actor, void *arg) {
+  int rc;
+
+  if (!filp || !actor) return -EINVAL;
+  if (filp->flags & O_WRONLY) return -EACCES;
+
+  // The actor can block, so only file systems that can run it without
+  // holding the file system lock should provide splice_read
+  if (!filp->fs->ops->splice_read) return -ENOSYS;
+  if (lock_fs(filp->fs, FSOP_SPLICE) < 0) return -ETIMEOUT;
+  rc = filp->fs->ops->splice_read(filp, pos, size, actor, arg);
+  unlock_fs(filp->fs, FSOP_SPLICE);
+  return rc;
+}
+
+int copy_range(struct file *in, off64_t inpos, struct file *out, off64_t outpos, size_t count) {
+  int rc;
+
+  if (!in || !out) return -EINVAL;
+  if (in->flags & O_WRONLY) return -EACCES;
+  if (out->flags == O_RDONLY) return -EACCES;
+  if (in->fs != out->fs) return -EXDEV;
+
+  // Copying within the file system is done under the write lock
+  if (!out->fs->ops->copy_range) return -ENOSYS;
+  if (lock_fs(out->fs, FSOP_WRITE) < 0) return -ETIMEOUT;
+  rc = out->fs->ops->copy_range(in, inpos, out, outpos, count);
+  unlock_fs(out->fs, FSOP_WRITE);
+  return rc;
+}
+
+int map_page(struct file *filp, off64_t offset, unsigned long *pfn) {
+  int rc;
+
+  if (!filp || !pfn) return -EINVAL;
+  if (filp->flags & O_WRONLY) return -EACCES;
+
+  // The page frame stays owned by the file system, so only file systems
+  // that keep file data in memory provide map_page
+  if (!filp->fs->ops->map_page) return -ENOSYS;
+  if (lock_fs(filp->fs, FSOP_READ) < 0) return -ETIMEOUT;
+  rc = filp->fs->ops->map_page(filp, offset, pfn);
+  unlock_fs(filp->fs, FSOP_READ);
+  return rc;
+}
+
 int futime(struct file *filp, struct utimbuf *times) {
   int rc;
 
@@ -985,6 +1123,7 @@ int stat(char *name, struct stat64 *buffer)
 {
     struct fs *fs;
     char *rest;
+    unsigned long gen;
     int rc;
     char path[MAXPATH];
 
@@ -995,6 +1134,7 @@ int stat(char *name, struct stat64 *buffer)
     if (rc < 0) return rc;
 
     if (!fs->ops->stat) return -ENOSYS;
+    if (dcache_noent(fs, rest)) return -ENOENT;
     fs->locks++;
     if (lock_fs(fs, FSOP_STAT) < 0)
     {
@@ -1002,7 +1142,9 @@ int stat(char *name, struct stat64 *buffer)
         return -ETIMEOUT;
     }
 
+    gen = dcache_generation();
     rc = fs->ops->stat(fs, rest, buffer);
+    dcache_enter_noent(fs, rest, rc, gen);
     unlock_fs(fs, FSOP_STAT);
     fs->locks--;
     return rc;
@@ -1011,6 +1153,7 @@ int stat(char *name, struct stat64 *buffer)
 int access(char *name, int mode) {
   struct fs *fs;
   char *rest;
+  unsigned long gen;
   int rc;
   char path[MAXPATH];
 
@@ -1020,6 +1163,8 @@ int access(char *name, int mode) {
   rc = fslookup(path, 0, &fs, &rest);
   if (rc < 0) return rc;
 
+  if (dcache_noent(fs, rest)) return -ENOENT;
+
   if (!fs->ops->access) {
     struct thread *thread = kthread_self();
     struct stat64 buf;
@@ -1051,7 +1196,9 @@ int access(char *name, int mode) {
     fs->locks--;
     return -ETIMEOUT;
   }
+  gen = dcache_generation();
   rc = fs->ops->access(fs, rest, mode);
+  dcache_enter_noent(fs, rest, rc, gen);
   unlock_fs(fs, FSOP_ACCESS);
   fs->locks--;
   return rc;
@@ -1089,6 +1236,7 @@ int chmod(char *name, int mode) {
     return -ETIMEOUT;
   }
   rc = fs->ops->chmod(fs, rest, mode);
+  dcache_changed(fs, rest, 1);
   unlock_fs(fs, FSOP_CHMOD);
   fs->locks--;
   return rc;
@@ -1126,6 +1274,7 @@ int chown(char *name, int owner, int group) {
     return -ETIMEOUT;
   }
   rc = fs->ops->chown(fs, rest, owner, group);
+  dcache_changed(fs, rest, 1);
   unlock_fs(fs, FSOP_CHOWN);
   fs->locks--;
   return rc;
@@ -1134,6 +1283,7 @@ int chown(char *name, int owner, int group) {
 int chdir(char *name) {
   struct fs *fs;
   char *rest;
+  unsigned long gen;
   int rc;
   char path[MAXPATH];
   char newdir[MAXPATH];
@@ -1147,12 +1297,15 @@ int chdir(char *name) {
   if (rc < 0) return rc;
 
   if (fs->ops->stat) {
+    if (dcache_noent(fs, rest)) return -ENOENT;
     fs->locks++;
     if (lock_fs(fs, FSOP_STAT) < 0) {
       fs->locks--;
       return -ETIMEOUT;
     }
+    gen = dcache_generation();
     rc = fs->ops->stat(fs, rest, &buffer);
+    dcache_enter_noent(fs, rest, rc, gen);
     unlock_fs(fs, FSOP_STAT);
     fs->locks--;
 
@@ -1192,6 +1345,7 @@ int mkdir(char *name, int mode) {
     return -ETIMEOUT;
   }
   rc = fs->ops->mkdir(fs, rest, mode & ~(peb ? peb->umaskval : 0));
+  dcache_changed(fs, rest, 0);
   unlock_fs(fs, FSOP_MKDIR);
   fs->locks--;
   return rc;
@@ -1216,6 +1370,7 @@ int rmdir(char *name) {
     return -ETIMEOUT;
   }
   rc = fs->ops->rmdir(fs, rest);
+  dcache_changed(fs, rest, 1);
   unlock_fs(fs, FSOP_RMDIR);
   fs->locks--;
   return rc;
@@ -1251,6 +1406,8 @@ int rename(char *oldname, char *newname) {
     return -ETIMEOUT;
   }
   rc = oldfs->ops->rename(oldfs, oldrest, newrest);
+  dcache_changed(oldfs, oldrest, 1);
+  dcache_changed(oldfs, newrest, 1);
   unlock_fs(oldfs, FSOP_RENAME);
   oldfs->locks--;
   return rc;
@@ -1286,6 +1443,7 @@ int link(char *oldname, char *newname) {
     return -ETIMEOUT;
   }
   rc = oldfs->ops->link(oldfs, oldrest, newrest);
+  dcache_changed(oldfs, newrest, 0);
   unlock_fs(oldfs, FSOP_LINK);
   oldfs->locks--;
   return rc;
@@ -1310,6 +1468,7 @@ int unlink(char *name) {
     return -ETIMEOUT;
   }
   rc = fs->ops->unlink(fs, rest);
+  dcache_changed(fs, rest, 0);
   fs->locks--;
   unlock_fs(fs, FSOP_UNLINK);
   return rc;
@@ -1318,6 +1477,7 @@ int unlink(char *name) {
 int opendir(char *name, struct file **retval) {
   struct fs *fs;
   struct file *filp;
+  unsigned long gen;
   int rc;
   char *rest;
   char path[MAXPATH];
@@ -1329,6 +1489,7 @@ int opendir(char *name, struct file **retval) {
   if (rc < 0) return rc;
 
   if (!fs->ops->opendir) return -ENOSYS;
+  if (dcache_noent(fs, rest)) return -ENOENT;
 
   filp = (struct file *) kmalloc(sizeof(struct file));
   if (!filp) return -ENOMEM;
@@ -1347,7 +1508,9 @@ int opendir(char *name, struct file **retval) {
     kfree(filp);
     return -ETIMEOUT;
   }
+  gen = dcache_generation();
   rc = fs->ops->opendir(filp, rest);
+  dcache_enter_noent(fs, rest, rc, gen);
   unlock_fs(fs, FSOP_OPENDIR);
   if (rc != 0) {
     fs->locks--;
@@ -1373,3 +1536,68 @@ int readdir(struct file *filp, struct direntry *dirp, int count) {
   unlock_fs(filp->fs, FSOP_READDIR);
   return rc;
 }
+
+static int readdirplus_entry(struct file *filp, struct direntry *dirp, struct stat64 *buffer) {
+  char path[MAXPATH];
+  int len;
+  int rc;
+
+  // Use the native implementation if the file system can return the
+  // attributes directly from the directory scan
+  if (filp->fs->ops->readdirplus) {
+    if (lock_fs(filp->fs, FSOP_READDIRPLUS) < 0) return -ETIMEOUT;
+    rc = filp->fs->ops->readdirplus(filp, dirp, buffer, 1);
+    unlock_fs(filp->fs, FSOP_READDIRPLUS);
+    return rc;
+  }
+
+  // Otherwise read the entry and look it up by name
+  rc = readdir(filp, dirp, 1);
+  if (rc <= 0) return rc;
+
+  len = strlen(filp->path);
+  if (len + dirp->namelen + 2 > MAXPATH) return -ENAMETOOLONG;
+  memcpy(path, filp->path, len);
+  if (len == 0 || (path[len - 1] != PS1 && path[len - 1] != PS2)) path[len++] = PS1;
+  memcpy(path + len, dirp->name, dirp->namelen + 1);
+
+  rc = stat(path, buffer);
+  if (rc < 0) {
+    if (rc != -ENOENT) return rc;
+    memset(buffer, 0, sizeof(struct stat64));
+  }
+  if (buffer->st_ino == 0) buffer->st_ino = dirp->ino;
+
+  return 1;
+}
+
+int readdirplus(struct file *filp, struct direntplus *buf, size_t size) {
+  struct direntry dirent;
+  struct direntplus *dp;
+  size_t filled;
+  int rc;
+
+  if (!filp) return -EINVAL;
+  if (!buf) return -EINVAL;
+  if (!(filp->flags & F_DIR)) return -EINVAL;
+  if (size < sizeof(struct direntplus)) return -EINVAL;
+  if (!filp->fs->ops->readdirplus && !filp->fs->ops->readdir) return -ENOSYS;
+
+  // Only read an entry when there is room for a maximum size record, so no
+  // entry is consumed from the directory without being returned
+  filled = 0;
+  while (size - filled >= sizeof(struct direntplus)) {
+    dp = (struct direntplus *) ((char *) buf + filled);
+    rc = readdirplus_entry(filp, &dirent, &dp->stat);
+    if (rc < 0) return filled > 0 ? (int) filled : rc;
+    if (rc == 0) break;
+
+    dp->namelen = dirent.namelen;
+    dp->reclen = DIRENTPLUS_RECLEN(dirent.namelen);
+    memcpy(dp->name, dirent.name, dirent.namelen);
+    dp->name[dirent.namelen] = 0;
+    filled += dp->reclen;
+  }
+
+  return filled;
+}
@@ -35,11 +35,36 @@
 
 #include <os/krnl.h>
 #include <os/kmalloc.h>
+#include <os/kmem.h>
 #include <os/virtio.h>
 #include <os/queue.h>
 #include <os/pic.h>
 #include <os/dev.h>
 
+//
+// Memory barriers for ordering ring updates against the host. A compiler
+// barrier is enough for load/load and store/store ordering on x86, but
+// our stores must be visible before we read the event index of the host,
+// which requires a full fence.
+//
+
+static __inline void virtio_barrier() {
+  __asm__ __volatile__("" : : : "memory");
+}
+
+static __inline void virtio_mb() {
+  __asm__ __volatile__("lock or dword ptr [esp], 0;" : : : "memory");
+}
+
+//
+// Check if the host should be notified about new buffers or the guest
+// about used buffers, when event index is used (see virtio spec 2.4.7).
+//
+
+static __inline int vring_need_event(unsigned short event, unsigned short new_idx, unsigned short old_idx) {
+  return (unsigned short) (new_idx - event - 1) < (unsigned short) (new_idx - old_idx);
+}
+
 void virtio_dpc(void *arg) {
   struct virtio_device *vd = (struct virtio_device *) arg;
   struct virtio_queue *vq = vd->queues;
@@ -120,9 +145,9 @@ static int init_queue(struct virtio_queue *vq, int index, int size) {
   char *buffer;
   int i;
 
-  // Initialize vring structure
+  // Initialize vring structure. The ring must be physically contiguous.
   len = vring_size(size);
-  buffer = kmalloc(len);
+  buffer = kmem_alloc_linear(PAGES(len), PFT_KMEM);
   if (!buffer) return -ENOMEM;
   memset(buffer, 0, len);
   vring_init(&vq->vring, size, buffer);
@@ -160,6 +185,11 @@ int virtio_queue_init(struct virtio_queue *vq, struct virtio_device *vd, int ind
   if (!vq->data) return -ENOSPC;
   memset(vq->data, 0, sizeof(void *) * size);
 
+  // Allocate space for indirect descriptor tables
+  vq->indirect = (struct vring_desc **) kmalloc(sizeof(struct vring_desc *) * size);
+  if (!vq->indirect) return -ENOSPC;
+  memset(vq->indirect, 0, sizeof(struct vring_desc *) * size);
+
   // Initialize buffer available event
   init_event(&vq->bufavail, 0, 1);
 
@@ -179,36 +209,78 @@ int virtio_queue_size(struct virtio_queue *vq) {
   return vq->vring.size;
 }
 
+static struct vring_desc *alloc_indirect(struct scatterlist sg[], unsigned int out, unsigned int in) {
+  struct vring_desc *desc;
+  unsigned int i, n;
+
+  // Only use indirect descriptors for chains that fit in one kmalloc chunk
+  n = out + in;
+  if (n < 2 || n > VIRTIO_MAX_INDIRECT) return NULL;
+  desc = (struct vring_desc *) kmalloc(sizeof(struct vring_desc) * n);
+  if (!desc) return NULL;
+
+  // Fill in the table; it is chained by index like the main ring
+  for (i = 0; i < n; i++) {
+    desc[i].flags = VRING_DESC_F_NEXT;
+    if (i >= out) desc[i].flags |= VRING_DESC_F_WRITE;
+    desc[i].addr = kpage_virt2phys(sg[i].data);
+    desc[i].len = sg[i].size;
+    desc[i].next = i + 1;
+  }
+  desc[n - 1].flags &= ~VRING_DESC_F_NEXT;
+
+  return desc;
+}
+
 int virtio_enqueue(struct virtio_queue *vq, struct scatterlist sg[], unsigned int out, unsigned int in, void *data) {
+  struct vring_desc *indirect = NULL;
+  unsigned int needed;
   int i, avail;
   int head, tail;
 
+  // Use an indirect descriptor table if the host supports it, so that the
+  // whole chain only consumes a single entry in the ring
+  if (vq->vd->features & VIRTIO_RING_F_INDIRECT_DESC) indirect = alloc_indirect(sg, out, in);
+  needed = indirect ? 1 : out + in;
+  if (needed > vq->vring.size) return -EINVAL;
+
   // Wait for available buffers
-  while (vq->num_free < out + in) {
-    if (wait_for_object(&vq->bufavail, INFINITE) < 0) return -ENOSPC;
+  while (vq->num_free < needed) {
+    if (wait_for_object(&vq->bufavail, INFINITE) < 0) {
+      kfree(indirect);
+      return -ENOSPC;
+    }
   }
 
   // Remove buffers from the free list
-  vq->num_free -= out + in;
+  vq->num_free -= needed;
   head = vq->free_head;
-  for (i = vq->free_head; out; i = vq->vring.desc[i].next, out--) {
-    vq->vring.desc[i].flags = VRING_DESC_F_NEXT;
-    vq->vring.desc[i].addr = kpage_virt2phys(sg->data);
-    vq->vring.desc[i].len = sg->size;
-    tail = i;
-    sg++;
-  }
-  for (; in; i = vq->vring.desc[i].next, in--) {
-    vq->vring.desc[i].flags = VRING_DESC_F_NEXT | VRING_DESC_F_WRITE;
-    vq->vring.desc[i].addr = kpage_virt2phys(sg->data);
-    vq->vring.desc[i].len = sg->size;
-    tail = i;
-    sg++;
+  if (indirect) {
+    vq->vring.desc[head].flags = VRING_DESC_F_INDIRECT;
+    vq->vring.desc[head].addr = kpage_virt2phys(indirect);
+    vq->vring.desc[head].len = (out + in) * sizeof(struct vring_desc);
+    vq->indirect[head] = indirect;
+    i = vq->vring.desc[head].next;
+  } else {
+    for (i = vq->free_head; out; i = vq->vring.desc[i].next, out--) {
+      vq->vring.desc[i].flags = VRING_DESC_F_NEXT;
+      vq->vring.desc[i].addr = kpage_virt2phys(sg->data);
+      vq->vring.desc[i].len = sg->size;
+      tail = i;
+      sg++;
+    }
+    for (; in; i = vq->vring.desc[i].next, in--) {
+      vq->vring.desc[i].flags = VRING_DESC_F_NEXT | VRING_DESC_F_WRITE;
+      vq->vring.desc[i].addr = kpage_virt2phys(sg->data);
+      vq->vring.desc[i].len = sg->size;
+      tail = i;
+      sg++;
+    }
+
+    // No continue on last buffer
+    vq->vring.desc[tail].flags &= ~VRING_DESC_F_NEXT;
   }
 
-  // No continue on last buffer
-  vq->vring.desc[tail].flags &= ~VRING_DESC_F_NEXT;
-
   // Update free pointer
   vq->free_head = i;
 
@@ -231,6 +303,12 @@ static void virtio_release(struct virtio_queue *vq, unsigned int head) {
   // Clear callback data token
   vq->data[head] = NULL;
 
+  // Free indirect descriptor table
+  if (vq->indirect[head]) {
+    kfree(vq->indirect[head]);
+    vq->indirect[head] = NULL;
+  }
+
   // Put buffers back on the free list; first find the end
   i = head;
   while (vq->vring.desc[i].flags & VRING_DESC_F_NEXT) {
@@ -248,14 +326,55 @@ static void virtio_release(struct virtio_queue *vq, unsigned int head) {
 }
 
 void virtio_kick(struct virtio_queue *vq) {
-  // Make new entries available to host
-  vq->vring.avail->idx += vq->num_added;
+  unsigned short old_idx, new_idx;
+  int notify;
+
+  // Nothing to do if no buffers have been added since last kick
+  if (vq->num_added == 0) return;
+
+  // Make new entries available to host. Descriptors must be visible
+  // before the index is updated.
+  virtio_barrier();
+  old_idx = vq->vring.avail->idx;
+  new_idx = old_idx + vq->num_added;
+  vq->vring.avail->idx = new_idx;
   vq->num_added = 0;
 
-  // Notify host
-  if (!(vq->vring.used->flags & VRING_USED_F_NO_NOTIFY)) {
-    outpw(vq->vd->iobase + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+  // The host may be processing the ring concurrently, so it must see the
+  // new index before we check if it wants to be notified
+  virtio_mb();
+
+  // Only notify host if it has asked for it
+  if (vq->vd->features & VIRTIO_RING_F_EVENT_IDX) {
+    notify = vring_need_event(vring_avail_event(&vq->vring), new_idx, old_idx);
+  } else {
+    notify = !(vq->vring.used->flags & VRING_USED_F_NO_NOTIFY);
   }
+  if (notify) outpw(vq->vd->iobase + VIRTIO_PCI_QUEUE_NOTIFY, vq->index);
+}
+
+void virtio_disable_cb(struct virtio_queue *vq) {
+  // With event index the host only interrupts when it passes used_event,
+  // so just leaving used_event behind suppresses further interrupts.
+  // Drivers using event index must call virtio_enable_cb() after draining
+  // the queue to receive further interrupts.
+  if (!(vq->vd->features & VIRTIO_RING_F_EVENT_IDX)) {
+    vq->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+  }
+}
+
+int virtio_enable_cb(struct virtio_queue *vq) {
+  // Ask for an interrupt when the next buffer is used
+  if (vq->vd->features & VIRTIO_RING_F_EVENT_IDX) {
+    vring_used_event(&vq->vring) = vq->last_used_idx;
+  } else {
+    vq->vring.avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+  }
+
+  // Buffers used before interrupts were enabled will not raise an
+  // interrupt, so tell caller to poll the queue again
+  virtio_mb();
+  return vq->last_used_idx == vq->vring.used->idx;
 }
 
 static int more_used(struct virtio_queue *vq) {
@@ -269,7 +388,8 @@ void *virtio_dequeue(struct virtio_queue *vq, unsigned int *len) {
   // Return NULL if there are no more completed buffers in the queue
   if (!more_used(vq)) return NULL;
 
-  // Get next completed buffer
+  // Get next completed buffer; read entry only after used index
+  virtio_barrier();
   e = &vq->vring.used->ring[vq->last_used_idx % vq->vring.size];
   *len = e->len;
   data = vq->data[e->id];
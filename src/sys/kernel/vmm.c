@@ -46,9 +46,11 @@
 #define VMEM_START (64 * 1024)
 
 struct rmap_t *vmap;
+static struct filemap *filemaps;  // Mappings backed by file system pages
 
 extern uint32_t freeCount;         // from 'pframe.c'
 extern uint32_t useableCount;      // from 'pframe.c'
+extern struct rmap_t *osvmap;      // from 'kmem.c'
 
 
 static int valid_range(void *addr, int size)
@@ -272,6 +274,73 @@ void *vmalloc(
     return address;
 }
 
+//
+// Files on file systems that keep their data in memory (map_page) are
+// mapped directly to the page frames of the file. The pages are marked
+// with PT_FILE so vmfree() unmaps them without freeing the frames, and
+// the filemap keeps the file open until the last page has been unmapped.
+//
+
+static struct filemap *find_filemap(char *vaddr) {
+  struct filemap *fm;
+
+  for (fm = filemaps; fm; fm = fm->next) {
+    if (vaddr >= fm->addr && vaddr < fm->addr + PAGES(fm->size) * PAGESIZE) return fm;
+  }
+
+  return NULL;
+}
+
+static void release_filemap(struct filemap *fm) {
+  struct filemap **pfm;
+
+  for (pfm = &filemaps; *pfm; pfm = &(*pfm)->next) {
+    if (*pfm == fm) {
+      *pfm = fm->next;
+      break;
+    }
+  }
+
+  hunprotect(fm->file);
+  hfree(fm->file);
+  hunprotect(fm->self);
+  hfree(fm->self);
+}
+
+static int map_file_pages(struct filemap *fm, struct file *filp, unsigned long flags) {
+  unsigned long pfn;
+  char *vaddr;
+  int i;
+  int rc;
+
+  if (fm->offset % PAGESIZE != 0) return -EINVAL;
+  if ((flags & PT_WRITABLE) && (filp->flags & (O_WRONLY | O_RDWR)) == 0) return -EACCES;
+
+  vaddr = fm->addr;
+  for (i = 0; i < fm->pages; i++) {
+    rc = map_page(filp, fm->offset + i * PAGESIZE, &pfn);
+    if (rc < 0) break;
+
+    kpage_map(vaddr, pfn, flags | PT_FILE | PT_PRESENT);
+    vaddr += PAGESIZE;
+  }
+
+  // Pages past the end of the file are left unmapped
+  if (i < fm->pages && (rc != -ENXIO || i == 0)) {
+    while (i > 0) {
+      vaddr -= PAGESIZE;
+      kpage_unmap(vaddr);
+      i--;
+    }
+    return rc;
+  }
+
+  fm->pages = i;
+  fm->next = filemaps;
+  filemaps = fm;
+  return 0;
+}
+
 void *vmmap(void *addr, unsigned long size, int protect, struct file *filp, off64_t offset, int *rc) {
   int pages = PAGES(size);
   unsigned long flags = pte_flags_from_protect(protect);
@@ -320,6 +389,18 @@ void *vmmap(void *addr, unsigned long size, int protect, struct file *filp, off6
   fm->size = size;
   fm->protect = flags | PT_FILE;
 
+  if (filp->fs->ops->map_page) {
+    int err = map_file_pages(fm, filp, flags);
+    if (err < 0) {
+      release_filemap(fm);
+      krmap_free(vmap, BTOP(addr), pages);
+      if (rc) *rc = err;
+      return NULL;
+    }
+
+    return addr;
+  }
+
   vaddr = (char *) addr;
   flags = (flags & ~PT_USER) | PT_FILE;
   for (i = 0; i < pages; i++) {
@@ -411,7 +492,12 @@ int vmfree(void *addr, unsigned long size, int type) {
           fm->pages--;
           kpage_unmap(vaddr);
           if (flags & PT_PRESENT) kpframe_free(pfn);
-        } else */ if (flags & PT_PRESENT) {
+        } else */ if ((flags & (PT_FILE | PT_PRESENT)) == (PT_FILE | PT_PRESENT)) {
+          // Page frame is owned by the file system
+          fm = find_filemap(vaddr);
+          kpage_unmap(vaddr);
+          if (fm && --fm->pages == 0) release_filemap(fm);
+        } else if (flags & PT_PRESENT) {
           kpage_unmap(vaddr);
           kpframe_free(pfn);
         }
@@ -435,6 +521,60 @@ int vmfree(void *addr, unsigned long size, int type) {
   return 0;
 }
 
+//
+// vmdetach
+//
+// Takes the page frames of a committed range of user memory away from
+// the user address space and maps them into kernel space. The user range
+// stays reserved but is decommitted, so the owner can neither reach nor
+// free the frames afterwards. Only present, private pages can be
+// detached. The returned kernel address is released with kmem_free().
+//
+
+void *vmdetach(void *addr, unsigned long size, int *rc) {
+  int pages = PAGES(size);
+  char *vaddr;
+  char *kaddr;
+  pte_t flags;
+  int i;
+
+  *rc = 0;
+  if (size == 0 || PGOFF(addr) != 0 || !valid_range(addr, size)) {
+    *rc = -EINVAL;
+    return NULL;
+  }
+
+  vaddr = (char *) addr;
+  for (i = 0; i < pages; i++) {
+    if (!kpage_is_mapped(vaddr)) {
+      *rc = -EFAULT;
+      return NULL;
+    }
+
+    flags = kpage_get_flags(vaddr);
+    if ((flags & (PT_FILE | PT_GUARD)) || !(flags & PT_USER)) {
+      *rc = -EINVAL;
+      return NULL;
+    }
+    vaddr += PAGESIZE;
+  }
+
+  kaddr = (char *) PTOB(krmap_alloc(osvmap, pages));
+  if (!kaddr) {
+    *rc = -ENOMEM;
+    return NULL;
+  }
+
+  vaddr = (char *) addr;
+  for (i = 0; i < pages; i++) {
+    kpage_map(kaddr + PTOB(i), BTOP(kpage_virt2phys(vaddr)), PT_PRESENT);
+    kpage_unmap(vaddr);
+    vaddr += PAGESIZE;
+  }
+
+  return kaddr;
+}
+
 void *vmrealloc(void *addr, unsigned long oldsize, unsigned long newsize, int type, int protect, unsigned long tag) {
   return NULL;
 }
@@ -0,0 +1,212 @@
+//
+// chksum.c
+//
+// Internet checksum primitives
+//
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+#ifdef KERNEL
+#include <net/net.h>
+#endif
+
+//
+// The Internet checksum is the one's complement sum of all 16-bit words in
+// the data. Because the sum is independent of byte order and of the order
+// in which the words are added, the data can be summed 32 bits at a time
+// into a 64-bit accumulator and folded to 16 bits at the end. Data that
+// starts on an odd address is summed as if shifted by one byte, and the
+// result is byte swapped back.
+//
+// These routines do not include any kernel headers in the host build, so
+// utils/inetbench can test and time them outside the kernel.
+//
+
+#define SWAP16(x) ((((x) & 0xFF) << 8) | (((x) >> 8) & 0xFF))
+
+static unsigned long fold(unsigned long long acc) {
+  acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+  acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+  acc = (acc & 0xFFFF) + (acc >> 16);
+  acc = (acc & 0xFFFF) + (acc >> 16);
+  acc = (acc & 0xFFFF) + (acc >> 16);
+  return (unsigned long) acc;
+}
+
+//
+// chksum
+//
+// Returns the 16-bit one's complement sum of the data, not complemented.
+//
+
+unsigned long chksum(void *data, int len) {
+  unsigned char *p = (unsigned char *) data;
+  unsigned long long acc = 0;
+  unsigned long sum;
+  int odd;
+
+  if (len <= 0) return 0;
+
+  // Align to a 16-bit boundary
+  odd = (unsigned long) p & 1;
+  if (odd) {
+    acc = (unsigned long) *p++ << 8;
+    len--;
+  }
+
+  // Align to a 32-bit boundary
+  if (((unsigned long) p & 2) && len >= 2) {
+    acc += *(unsigned short *) p;
+    p += 2;
+    len -= 2;
+  }
+
+  // Sum 32 bytes per iteration
+  while (len >= 32) {
+    acc += ((unsigned int *) p)[0];
+    acc += ((unsigned int *) p)[1];
+    acc += ((unsigned int *) p)[2];
+    acc += ((unsigned int *) p)[3];
+    acc += ((unsigned int *) p)[4];
+    acc += ((unsigned int *) p)[5];
+    acc += ((unsigned int *) p)[6];
+    acc += ((unsigned int *) p)[7];
+    p += 32;
+    len -= 32;
+  }
+
+  while (len >= 4) {
+    acc += *(unsigned int *) p;
+    p += 4;
+    len -= 4;
+  }
+
+  if (len >= 2) {
+    acc += *(unsigned short *) p;
+    p += 2;
+    len -= 2;
+  }
+
+  // Add up any odd byte
+  if (len == 1) acc += *p;
+
+  sum = fold(acc);
+  return odd ? SWAP16(sum) : sum;
+}
+
+//
+// chksum_copy
+//
+// Copies data and returns the checksum of the copied data, as computed by
+// chksum(), in a single pass over the source.
+//
+
+unsigned long chksum_copy(void *dst, void *src, int len) {
+  unsigned char *s = (unsigned char *) src;
+  unsigned char *d = (unsigned char *) dst;
+  unsigned long long acc = 0;
+  unsigned long long acc2 = 0;
+  unsigned long sum;
+  unsigned int w0, w1, w2, w3;
+  int odd;
+
+  if (len <= 0) return 0;
+
+  // Align source to a 16-bit boundary
+  odd = (unsigned long) s & 1;
+  if (odd) {
+    *d++ = *s;
+    acc = (unsigned long) *s++ << 8;
+    len--;
+  }
+
+  // Align source to a 32-bit boundary
+  if (((unsigned long) s & 2) && len >= 2) {
+    *(unsigned short *) d = *(unsigned short *) s;
+    acc += *(unsigned short *) s;
+    s += 2;
+    d += 2;
+    len -= 2;
+  }
+
+  // Copy and sum 16 bytes per iteration, using two accumulators to keep
+  // the additions independent of each other
+  while (len >= 16) {
+    w0 = ((unsigned int *) s)[0];
+    w1 = ((unsigned int *) s)[1];
+    w2 = ((unsigned int *) s)[2];
+    w3 = ((unsigned int *) s)[3];
+    ((unsigned int *) d)[0] = w0;
+    ((unsigned int *) d)[1] = w1;
+    ((unsigned int *) d)[2] = w2;
+    ((unsigned int *) d)[3] = w3;
+    acc += (unsigned long long) w0 + w1;
+    acc2 += (unsigned long long) w2 + w3;
+    s += 16;
+    d += 16;
+    len -= 16;
+  }
+  acc += acc2;
+
+  while (len >= 4) {
+    w0 = *(unsigned int *) s;
+    *(unsigned int *) d = w0;
+    acc += w0;
+    s += 4;
+    d += 4;
+    len -= 4;
+  }
+
+  if (len >= 2) {
+    *(unsigned short *) d = *(unsigned short *) s;
+    acc += *(unsigned short *) s;
+    s += 2;
+    d += 2;
+    len -= 2;
+  }
+
+  if (len == 1) {
+    *d = *s;
+    acc += *s;
+  }
+
+  sum = fold(acc);
+  return odd ? SWAP16(sum) : sum;
+}
+
+//
+// chksum_add
+//
+// Adds the checksum of a block that starts at the given byte offset to the
+// checksum of the data in front of it.
+//
+
+unsigned long chksum_add(unsigned long sum, unsigned long partial, int offset) {
+  if (offset & 1) partial = SWAP16(partial);
+  sum += partial;
+  return (sum & 0xFFFF) + (sum >> 16);
+}
@@ -36,26 +36,37 @@
 #include <net/net.h>
 
 //
-// chksum
+// chksum_pbuf
 //
-// Sums up all 16 bit words in a memory portion. Also includes any odd byte.
-// This function is used by the other checksum functions.
-//
-// For now, this is not optimized. Must be optimized for the particular processor
-// arcitecture on which it is to run. Preferebly coded in assembler.
+// Sums up the data in a pbuf chain. Each pbuf is summed separately and
+// byte swapped if it starts at an odd offset in the chain.
 //
 
-static unsigned long chksum(void *dataptr, int len) {
+static unsigned long chksum_pbuf(struct pbuf *p) {
   unsigned long acc;
-// WARNING:
-  for (acc = 0; len > 1; len -= 2)
-    acc += (*((unsigned short *) dataptr))++;
+  struct pbuf *q;
+  int offset;
+
+  acc = 0;
+  offset = 0;
+  for (q = p; q != NULL; q = q->next) {
+    acc = chksum_add(acc, chksum(q->payload, q->len), offset);
+    offset += q->len;
+  }
 
-  // Add up any odd byte
-  if (len == 1) acc += *(unsigned char *) dataptr;
+  return acc;
+}
+
+static unsigned long chksum_pseudo(unsigned long acc, struct ip_addr *src, struct ip_addr *dest,
+                                   unsigned char proto, unsigned short proto_len) {
+  acc += (src->addr & 0xFFFF);
+  acc += ((src->addr >> 16) & 0xFFFF);
+  acc += (dest->addr & 0xFFFF);
+  acc += ((dest->addr >> 16) & 0xFFFF);
+  acc += (unsigned long) htons((unsigned short) proto);
+  acc += (unsigned long) htons(proto_len);
 
-  acc = (acc >> 16) + (acc & 0xFFFF);
-  if ((acc & 0xFFFF0000) != 0) acc = (acc >> 16) + (acc & 0xFFFF);
+  while (acc >> 16) acc = (acc & 0xFFFF) + (acc >> 16);
 
   return acc;
 }
@@ -69,31 +80,27 @@ static unsigned long chksum(void *dataptr, int len) {
 unsigned short inet_chksum_pseudo(struct pbuf *p, struct ip_addr *src, struct ip_addr *dest,
                                   unsigned char proto, unsigned short proto_len) {
   unsigned long acc;
-  struct pbuf *q;
-  int swapped;
 
-  acc = 0;
-  swapped = 0;
-  for (q = p; q != NULL; q = q->next) {
-    acc += chksum(q->payload, q->len);
-    while (acc >> 16) acc = (acc & 0xFFFF) + (acc >> 16);
+  acc = chksum_pseudo(chksum_pbuf(p), src, dest, proto, proto_len);
 
-    if (q->len % 2 != 0) {
-      swapped = 1 - swapped;
-      acc = ((acc & 0xFF) << 8) | ((acc & 0xFF00) >> 8);
-    }
-  }
+  return (unsigned short) ~(acc & 0xFFFF);
+}
 
-  if (swapped) acc = ((acc & 0xFF) << 8) | ((acc & 0xFF00) >> 8);
+//
+// inet_chksum_pseudo_partial
+//
+// Calculates the pseudo Internet checksum for a transport header followed
+// by data that has already been summed, e.g. by tcp_enqueue() when the data
+// was copied into the segment.
+//
 
-  acc += (src->addr & 0xFFFF);
-  acc += ((src->addr >> 16) & 0xFFFF);
-  acc += (dest->addr & 0xFFFF);
-  acc += ((dest->addr >> 16) & 0xFFFF);
-  acc += (unsigned long) htons((unsigned short) proto);
-  acc += (unsigned long) htons(proto_len);
+unsigned short inet_chksum_pseudo_partial(void *hdr, int hdrlen, unsigned long datasum,
+                                          struct ip_addr *src, struct ip_addr *dest,
+                                          unsigned char proto, unsigned short proto_len) {
+  unsigned long acc;
 
-  while (acc >> 16) acc = (acc & 0xFFFF) + (acc >> 16);
+  acc = chksum_add(chksum(hdr, hdrlen), datasum, hdrlen);
+  acc = chksum_pseudo(acc, src, dest, proto, proto_len);
 
   return (unsigned short) ~(acc & 0xFFFF);
 }
@@ -109,29 +116,14 @@ unsigned short inet_chksum(void *dataptr, int len) {
   unsigned long acc;
 
   acc = chksum(dataptr, len);
-  while (acc >> 16) acc = (acc & 0xFFFF) + (acc >> 16);
 
   return (unsigned short) ~(acc & 0xFFFF);
 }
 
 unsigned short inet_chksum_pbuf(struct pbuf *p) {
   unsigned long acc;
-  struct pbuf *q;
-  int swapped;
-
-  acc = 0;
-  swapped = 0;
-  for (q = p; q != NULL; q = q->next) {
-    acc += chksum(q->payload, q->len);
-    while (acc >> 16) acc = (acc & 0xFFFF) + (acc >> 16);
-
-    if (q->len % 2 != 0) {
-      swapped = 1 - swapped;
-      acc = ((acc & 0xFF) << 8) | ((acc & 0xFF00) >> 8);
-    }
-  }
 
-  if (swapped) acc = ((acc & 0xFF) << 8) | ((acc & 0xFF00) >> 8);
+  acc = chksum_pbuf(p);
 
   return (unsigned short) ~(acc & 0xFFFF);
 }
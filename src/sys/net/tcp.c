@@ -56,6 +56,22 @@ struct tcp_pcb_listen *tcp_listen_pcbs; // TCP PCBs in LISTEN state
 struct tcp_pcb *tcp_active_pcbs;        // TCP PCBs that are in a state in which they accept or send data
 struct tcp_pcb *tcp_tw_pcbs;            // TCP PCBs in TIME-WAIT
 
+// TCP PCB hash tables
+
+#define TCP_HASH_SIZE  4096     // Buckets for active and TIME-WAIT PCBs
+#define TCP_PORT_HASH  256      // Buckets for listeners and local ports
+
+struct tcp_port {
+  struct tcp_port *next;
+  unsigned short port;
+  int refs;
+};
+
+static struct tcp_pcb *tcp_conn_hash[TCP_HASH_SIZE];    // Active and TIME-WAIT PCBs
+static struct tcp_pcb *tcp_listen_hash[TCP_PORT_HASH];  // PCBs in LISTEN state
+static struct tcp_port *tcp_port_hash[TCP_PORT_HASH];   // Local ports in use
+static struct tcp_pcb *tcp_last_pcb;                    // Last PCB found by tcp_lookup()
+
 #define MIN(x,y) ((x) < (y) ? (x): (y))
 
 //
@@ -85,30 +101,184 @@ static int tcpstat_proc(struct proc_file *pf, void *arg) {
 }
 
 //
-// tcp_new_port
+// tcp_hash
 //
-// A nastly hack featuring 'goto' statements that allocates a
-// new TCP local port.
+// Hashes the remote address and ports of a connection. The local address
+// is not part of the hash because it is only filled in when the first
+// segment is sent on connections bound to the any address.
 //
 
-static unsigned short tcp_new_port() {
-  struct tcp_pcb *pcb;
+static __inline int tcp_hash(struct ip_addr *remote_ip, unsigned short local_port, unsigned short remote_port) {
+  unsigned long h;
 
-again:
-  if (++tcp_next_port > 0x7FFF) tcp_next_port = 4096;
+  h = remote_ip->addr ^ ((unsigned long) remote_port << 16) ^ local_port;
+  h ^= h >> 16;
+  h ^= h >> 8;
+  return h & (TCP_HASH_SIZE - 1);
+}
 
-  for (pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
-    if (pcb->local_port == tcp_next_port) goto again;
+static struct tcp_port *tcp_find_port(unsigned short port) {
+  struct tcp_port *tp;
+
+  for (tp = tcp_port_hash[port % TCP_PORT_HASH]; tp != NULL; tp = tp->next) {
+    if (tp->port == port) return tp;
   }
 
-  for (pcb = tcp_tw_pcbs; pcb != NULL; pcb = pcb->next) {
-    if (pcb->local_port == tcp_next_port) goto again;
+  return NULL;
+}
+
+static void tcp_ref_port(unsigned short port) {
+  struct tcp_port *tp;
+
+  tp = tcp_find_port(port);
+  if (tp == NULL) {
+    tp = (struct tcp_port *) kmalloc(sizeof(struct tcp_port));
+    if (tp == NULL) {
+      kprintf(KERN_ERR "tcp: unable to allocate port entry for port %d\n", port);
+      return;
+    }
+
+    tp->port = port;
+    tp->refs = 0;
+    tp->next = tcp_port_hash[port % TCP_PORT_HASH];
+    tcp_port_hash[port % TCP_PORT_HASH] = tp;
+  }
+
+  tp->refs++;
+}
+
+static void tcp_unref_port(unsigned short port) {
+  struct tcp_port **ptp;
+  struct tcp_port *tp;
+
+  for (ptp = &tcp_port_hash[port % TCP_PORT_HASH]; (tp = *ptp) != NULL; ptp = &tp->next) {
+    if (tp->port == port) {
+      if (--tp->refs == 0) {
+        *ptp = tp->next;
+        kfree(tp);
+      }
+      return;
+    }
+  }
+}
+
+//
+// tcp_hash_insert
+//
+// Inserts a PCB in the hash table for its state. Called by TCP_REG.
+//
+
+void tcp_hash_insert(struct tcp_pcb *pcb) {
+  struct tcp_pcb **bucket;
+
+  if (pcb->state == LISTEN) {
+    bucket = &tcp_listen_hash[pcb->local_port % TCP_PORT_HASH];
+  } else {
+    bucket = &tcp_conn_hash[tcp_hash(&pcb->remote_ip, pcb->local_port, pcb->remote_port)];
+  }
+
+  pcb->hashnext = *bucket;
+  *bucket = pcb;
+  tcp_ref_port(pcb->local_port);
+}
+
+//
+// tcp_hash_remove
+//
+// Removes a PCB from its hash table. Called by TCP_RMV.
+//
+
+void tcp_hash_remove(struct tcp_pcb *pcb) {
+  struct tcp_pcb **ppcb;
+
+  if (pcb->state == LISTEN) {
+    ppcb = &tcp_listen_hash[pcb->local_port % TCP_PORT_HASH];
+  } else {
+    ppcb = &tcp_conn_hash[tcp_hash(&pcb->remote_ip, pcb->local_port, pcb->remote_port)];
+  }
+
+  while (*ppcb != NULL) {
+    if (*ppcb == pcb) {
+      *ppcb = pcb->hashnext;
+      pcb->hashnext = NULL;
+      tcp_unref_port(pcb->local_port);
+      break;
+    }
+    ppcb = &(*ppcb)->hashnext;
+  }
+
+  if (tcp_last_pcb == pcb) tcp_last_pcb = NULL;
+}
+
+//
+// tcp_lookup
+//
+// Finds the active or TIME-WAIT PCB for a connection. Active connections
+// take precedence over connections in TIME-WAIT. The last PCB found is
+// remembered, since segments tend to arrive in bursts for the same
+// connection.
+//
+
+struct tcp_pcb *tcp_lookup(struct ip_addr *local_ip, unsigned short local_port, struct ip_addr *remote_ip, unsigned short remote_port) {
+  struct tcp_pcb *pcb;
+  struct tcp_pcb *twpcb;
+
+  pcb = tcp_last_pcb;
+  if (pcb != NULL &&
+      pcb->remote_port == remote_port &&
+      pcb->local_port == local_port &&
+      ip_addr_cmp(&pcb->remote_ip, remote_ip) &&
+      ip_addr_cmp(&pcb->local_ip, local_ip)) {
+    return pcb;
   }
 
-  for (pcb = (struct tcp_pcb *)tcp_listen_pcbs; pcb != NULL; pcb = pcb->next) {
-    if (pcb->local_port == tcp_next_port) goto again;
+  twpcb = NULL;
+  for (pcb = tcp_conn_hash[tcp_hash(remote_ip, local_port, remote_port)]; pcb != NULL; pcb = pcb->hashnext) {
+    if (pcb->remote_port == remote_port &&
+        pcb->local_port == local_port &&
+        ip_addr_cmp(&pcb->remote_ip, remote_ip) &&
+        ip_addr_cmp(&pcb->local_ip, local_ip)) {
+      if (pcb->state != TIME_WAIT) {
+        tcp_last_pcb = pcb;
+        return pcb;
+      }
+      if (twpcb == NULL) twpcb = pcb;
+    }
+  }
+
+  return twpcb;
+}
+
+//
+// tcp_lookup_listen
+//
+// Finds a PCB listening for connections on a local address and port.
+//
+
+struct tcp_pcb *tcp_lookup_listen(struct ip_addr *local_ip, unsigned short local_port) {
+  struct tcp_pcb *pcb;
+
+  for (pcb = tcp_listen_hash[local_port % TCP_PORT_HASH]; pcb != NULL; pcb = pcb->hashnext) {
+    if ((ip_addr_isany(&pcb->local_ip) || ip_addr_cmp(&pcb->local_ip, local_ip)) &&
+        pcb->local_port == local_port) {
+      return pcb;
+    }
   }
 
+  return NULL;
+}
+
+//
+// tcp_new_port
+//
+// Allocates a new TCP local port.
+//
+
+static unsigned short tcp_new_port() {
+  do {
+    if (++tcp_next_port > 0x7FFF) tcp_next_port = 4096;
+  } while (tcp_find_port(tcp_next_port) != NULL);
+
   return tcp_next_port;
 }
 
@@ -221,22 +391,24 @@ err_t tcp_bind(struct tcp_pcb *pcb, struct ip_addr *ipaddr, unsigned short port)
   if (port == 0) port = tcp_new_port();
 
   // Check if the address already is in use
-  for (cpcb = (struct tcp_pcb *) tcp_listen_pcbs; cpcb != NULL; cpcb = cpcb->next) {
-    if (cpcb->local_port == port) {
-      if (ip_addr_isany(&cpcb->local_ip) ||
-          ip_addr_isany(ipaddr) ||
-          ip_addr_cmp(&cpcb->local_ip, ipaddr)) {
-        return -EADDRINUSE;
+  if (tcp_find_port(port) != NULL) {
+    for (cpcb = (struct tcp_pcb *) tcp_listen_pcbs; cpcb != NULL; cpcb = cpcb->next) {
+      if (cpcb->local_port == port) {
+        if (ip_addr_isany(&cpcb->local_ip) ||
+            ip_addr_isany(ipaddr) ||
+            ip_addr_cmp(&cpcb->local_ip, ipaddr)) {
+          return -EADDRINUSE;
+        }
       }
     }
-  }
 
-  for (cpcb = tcp_active_pcbs; cpcb != NULL; cpcb = cpcb->next) {
-    if (cpcb->local_port == port) {
-      if (ip_addr_isany(&cpcb->local_ip) ||
-          ip_addr_isany(ipaddr) ||
-          ip_addr_cmp(&cpcb->local_ip, ipaddr)) {
-        return -EADDRINUSE;
+    for (cpcb = tcp_active_pcbs; cpcb != NULL; cpcb = cpcb->next) {
+      if (cpcb->local_port == port) {
+        if (ip_addr_isany(&cpcb->local_ip) ||
+            ip_addr_isany(ipaddr) ||
+            ip_addr_cmp(&cpcb->local_ip, ipaddr)) {
+          return -EADDRINUSE;
+        }
       }
     }
   }
@@ -412,6 +584,7 @@ void tcp_slowtmr(void *arg) {
       } else {
         tcp_active_pcbs = pcb->next;
       }
+      tcp_hash_remove(pcb);
 
       if (pcb->errf != NULL) {
         pcb->errf(pcb->callback_arg, -EABORT);
@@ -453,6 +626,7 @@ void tcp_slowtmr(void *arg) {
       } else {
         tcp_tw_pcbs = pcb->next;
       }
+      tcp_hash_remove(pcb);
 
       pcb2 = pcb->next;
       kfree(pcb);
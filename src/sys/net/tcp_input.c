@@ -51,7 +51,7 @@ static void tcp_parseopt(struct tcp_seg *seg, struct tcp_pcb *pcb);
 
 err_t tcp_input(struct pbuf *p, struct netif *inp) {
   struct tcp_hdr *tcphdr;
-  struct tcp_pcb *pcb, *prev;
+  struct tcp_pcb *pcb;
   struct ip_hdr *iphdr;
   int offset;
   err_t err;
@@ -108,60 +108,11 @@ err_t tcp_input(struct pbuf *p, struct netif *inp) {
   //tcp_debug_print_flags(TCPH_FLAGS(tcphdr));
   //kprintf("\n");
 
-  // Demultiplex an incoming segment. First, we check if it is destined for an active connection
-  prev = NULL;
-  for (pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
-    if (pcb->remote_port == tcphdr->src &&
-        pcb->local_port == tcphdr->dest &&
-        ip_addr_cmp(&pcb->remote_ip, &iphdr->src) &&
-        ip_addr_cmp(&pcb->local_ip, &iphdr->dest)) {
-      // Move this PCB to the front of the list so that subsequent
-      // lookups will be faster (we exploit locality in TCP segment arrivals).
-      if (prev != NULL) {
-        prev->next = pcb->next;
-        pcb->next = tcp_active_pcbs;
-        tcp_active_pcbs = pcb;
-      }
-      break;
-    }
-
-    prev = pcb;
-  }
-
-  // If it did not go to an active connection, we check the connections in the TIME-WAIT state
-  if (pcb == NULL) {
-    for (pcb = tcp_tw_pcbs; pcb != NULL; pcb = pcb->next) {
-      if (pcb->remote_port == tcphdr->src &&
-          pcb->local_port == tcphdr->dest &&
-          ip_addr_cmp(&pcb->remote_ip, &iphdr->src) &&
-          ip_addr_cmp(&pcb->local_ip, &iphdr->dest)) {
-        // We don't really care enough to move this PCB to the front
-        // of the list since we are not very likely to receive that
-        // many segments for connections in TIME-WAIT.
-        break;
-      }
-    }
-
-    // Finally, if we still did not get a match, we check all PCBs that are LISTENing for incomming connections
-    prev = NULL;
-    if (pcb == NULL) {
-      for (pcb = (struct tcp_pcb *) tcp_listen_pcbs; pcb != NULL; pcb = pcb->next) {
-        if ((ip_addr_isany(&pcb->local_ip) || ip_addr_cmp(&pcb->local_ip, &iphdr->dest)) &&
-             pcb->local_port == tcphdr->dest) {
-          // Move this PCB to the front of the list so that subsequent
-          // lookups will be faster (we exploit locality in TCP segment
-          // arrivals)
-          if (prev != NULL) {
-            prev->next = pcb->next;
-            pcb->next = (struct tcp_pcb *) tcp_listen_pcbs;
-            tcp_listen_pcbs = (struct tcp_pcb_listen *) pcb;
-          }
-          break;
-        }
-        prev = pcb;
-      }
-    }
-  }
+  // Demultiplex an incoming segment. First, we check if it is destined for an
+  // active connection or a connection in TIME-WAIT, then we check the PCBs
+  // that are LISTENing for incoming connections.
+  pcb = tcp_lookup(&iphdr->dest, tcphdr->dest, &iphdr->src, tcphdr->src);
+  if (pcb == NULL) pcb = tcp_lookup_listen(&iphdr->dest, tcphdr->dest);
 
   if (pcb != NULL) {
     struct tcp_seg seg;
@@ -83,6 +83,7 @@ err_t tcp_enqueue(struct tcp_pcb *pcb, void *data, int len, int flags, unsigned
   int size;
   void *ptr;
   int queuelen;
+  unsigned long sum;
 
   left = len;
   ptr = data;
@@ -121,6 +122,8 @@ err_t tcp_enqueue(struct tcp_pcb *pcb, void *data, int len, int flags, unsigned
       if (buflen > 0) {
         //kprintf("tcp_enqueue: add %d bytes to segment\n", buflen);
         memcpy((char *) p->payload + p->len, ptr, buflen);
+        sum = chksum((char *) p->payload + p->len, buflen);
+        useg->datasum = chksum_add(useg->datasum, sum, useg->len);
         p->len += buflen;
         useg->p->tot_len += buflen;
         useg->len += buflen;
@@ -146,6 +149,7 @@ err_t tcp_enqueue(struct tcp_pcb *pcb, void *data, int len, int flags, unsigned
       }
       seg->next = NULL;
       seg->p = NULL;
+      seg->datasum = 0;
 
       if (queue == NULL) {
         queue = seg;
@@ -180,7 +184,10 @@ err_t tcp_enqueue(struct tcp_pcb *pcb, void *data, int len, int flags, unsigned
 
         queuelen++;
 
-        if (data != NULL) memcpy(seg->p->payload, ptr, seglen);
+        if (data != NULL) {
+          memcpy(seg->p->payload, ptr, seglen);
+          seg->datasum = chksum(seg->p->payload, seglen);
+        }
         seg->dataptr = seg->p->payload;
       }
 
@@ -242,6 +249,7 @@ err_t tcp_enqueue(struct tcp_pcb *pcb, void *data, int len, int flags, unsigned
       // Remove TCP header from first segment
       pbuf_header(queue->p, -TCP_HLEN);
       pbuf_chain(useg->p, queue->p);
+      useg->datasum = chksum_add(useg->datasum, queue->datasum, useg->len);
       useg->len += queue->len;
       useg->next = queue->next;
 
@@ -377,6 +385,7 @@ static err_t tcp_send_ack(struct tcp_pcb *pcb) {
 
 static void tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb) {
   struct netif *netif;
+  int hdrlen;
 
   if (seg->p->ref > 1) {
     kprintf(KERN_ERR "tcp_output_segment: packet not transmitted, already in tx queue\n");
@@ -429,7 +438,14 @@ static void tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb) {
 
   seg->tcphdr->chksum = 0;
   if ((netif->flags & NETIF_TCP_TX_CHECKSUM_OFFLOAD) == 0) {
-    seg->tcphdr->chksum = inet_chksum_pseudo(seg->p, &pcb->local_ip, &pcb->remote_ip, IP_PROTO_TCP, seg->p->tot_len);
+    // The data was summed when it was copied into the segment, so only
+    // the header needs to be summed here
+    hdrlen = (char *) seg->dataptr - (char *) seg->tcphdr;
+    if (seg->p->tot_len == hdrlen + seg->len) {
+      seg->tcphdr->chksum = inet_chksum_pseudo_partial(seg->tcphdr, hdrlen, seg->datasum, &pcb->local_ip, &pcb->remote_ip, IP_PROTO_TCP, seg->p->tot_len);
+    } else {
+      seg->tcphdr->chksum = inet_chksum_pseudo(seg->p, &pcb->local_ip, &pcb->remote_ip, IP_PROTO_TCP, seg->p->tot_len);
+    }
   }
   stats.tcp.xmit++;
 
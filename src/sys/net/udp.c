@@ -35,7 +35,10 @@
 #include <net/net.h>
 #include <os/kmalloc.h>
 
+#define UDP_HASH_SIZE 256
+
 static struct udp_pcb *udp_pcbs = NULL;
+static struct udp_pcb *udp_hash[UDP_HASH_SIZE];  // Bound PCBs by local port
 
 int udp_debug_print(struct udp_hdr *udphdr);
 
@@ -60,11 +63,55 @@ void udp_init() {
   register_proc_inode("udpstat", udpstat_proc, NULL);
 }
 
+//
+// udp_register
+//
+// Puts a PCB on the list of active UDP PCBs and in the port hash table.
+//
+
+static void udp_register(struct udp_pcb *pcb) {
+  struct udp_pcb **bucket = &udp_hash[pcb->local_port % UDP_HASH_SIZE];
+
+  pcb->hashnext = *bucket;
+  *bucket = pcb;
+
+  pcb->next = udp_pcbs;
+  udp_pcbs = pcb;
+
+  pcb->flags |= UDP_FLAGS_BOUND;
+}
+
+//
+// udp_unregister
+//
+// Removes a PCB from the list of active UDP PCBs and the port hash table.
+//
+
+static void udp_unregister(struct udp_pcb *pcb) {
+  struct udp_pcb **ppcb;
+
+  for (ppcb = &udp_hash[pcb->local_port % UDP_HASH_SIZE]; *ppcb != NULL; ppcb = &(*ppcb)->hashnext) {
+    if (*ppcb == pcb) {
+      *ppcb = pcb->hashnext;
+      break;
+    }
+  }
+
+  for (ppcb = &udp_pcbs; *ppcb != NULL; ppcb = &(*ppcb)->next) {
+    if (*ppcb == pcb) {
+      *ppcb = pcb->next;
+      break;
+    }
+  }
+
+  pcb->next = pcb->hashnext = NULL;
+  pcb->flags &= ~UDP_FLAGS_BOUND;
+}
+
 //
 // udp_new_port
 //
-// A nastly hack featuring 'goto' statements that allocates a
-// new UDP local port.
+// Allocates a new UDP local port.
 //
 
 static unsigned short udp_new_port() {
@@ -72,9 +119,9 @@ static unsigned short udp_new_port() {
   static unsigned short port = 4096;
 
 again:
-  if(++port > 0x7FFF) port = 4096;
+  if (++port > 0x7FFF) port = 4096;
 
-  for (pcb = udp_pcbs; pcb != NULL; pcb = pcb->next) {
+  for (pcb = udp_hash[port % UDP_HASH_SIZE]; pcb != NULL; pcb = pcb->hashnext) {
     if (pcb->local_port == port) goto again;
   }
 
@@ -119,7 +166,7 @@ err_t udp_input(struct pbuf *p, struct netif *inp) {
   dest = NTOHS(udphdr->dest);
 
   // Demultiplex packet. First, go for a perfect match
-  for (pcb = udp_pcbs; pcb != NULL; pcb = pcb->next) {
+  for (pcb = udp_hash[dest % UDP_HASH_SIZE]; pcb != NULL; pcb = pcb->hashnext) {
     if (pcb->remote_port == src && pcb->local_port == dest &&
         (ip_addr_isany(&pcb->remote_ip) || ip_addr_cmp(&pcb->remote_ip, &iphdr->src)) &&
         (ip_addr_isany(&pcb->local_ip) || ip_addr_cmp(&pcb->local_ip, &iphdr->dest))) {
@@ -129,7 +176,7 @@ err_t udp_input(struct pbuf *p, struct netif *inp) {
 
   if (pcb == NULL) {
     // No fully matching pcb found, look for an unconnected pcb
-    for (pcb = udp_pcbs; pcb != NULL; pcb = pcb->next) {
+    for (pcb = udp_hash[dest % UDP_HASH_SIZE]; pcb != NULL; pcb = pcb->hashnext) {
       if (!(pcb->flags & UDP_FLAGS_CONNECTED) &&
           pcb->local_port == dest &&
           (ip_addr_isany(&pcb->remote_ip) || ip_addr_cmp(&pcb->remote_ip, &iphdr->src)) &&
@@ -217,26 +264,19 @@ err_t udp_send(struct udp_pcb *pcb, struct pbuf *p, struct ip_addr *dst_ip, unsi
 }
 
 err_t udp_bind(struct udp_pcb *pcb, struct ip_addr *ipaddr, unsigned short port) {
-  struct udp_pcb *ipcb;
-
   if (!ip_addr_isany(ipaddr) && !ip_ownaddr(ipaddr)) return -EADDRNOTAVAIL;
   ip_addr_set(&pcb->local_ip, ipaddr);
 
+  // Rebinding changes the local port, so the PCB must be rehashed
+  if (pcb->flags & UDP_FLAGS_BOUND) udp_unregister(pcb);
+
   if (port != 0) {
     pcb->local_port = port;
   } else {
     pcb->local_port = udp_new_port();
   }
 
-  // Insert UDP PCB into the list of active UDP PCBs
-  for (ipcb = udp_pcbs; ipcb != NULL; ipcb = ipcb->next) {
-    // If it is already on the list, just return
-    if (pcb == ipcb) return 0;
-  }
-
-  // We need to place the PCB on the list
-  pcb->next = udp_pcbs;
-  udp_pcbs = pcb;
+  udp_register(pcb);
 
   //kprintf("udp_bind: bound to port %d\n", port);
 
@@ -244,22 +284,13 @@ err_t udp_bind(struct udp_pcb *pcb, struct ip_addr *ipaddr, unsigned short port)
 }
 
 err_t udp_connect(struct udp_pcb *pcb, struct ip_addr *ipaddr, unsigned short port) {
-  struct udp_pcb *ipcb;
-
   ip_addr_set(&pcb->remote_ip, ipaddr);
   pcb->remote_port = port;
   pcb->flags |= UDP_FLAGS_CONNECTED;
   if (pcb->local_port == 0) pcb->local_port = udp_new_port();
 
-  // Insert UDP PCB into the list of active UDP PCBs
-  for (ipcb = udp_pcbs; ipcb != NULL; ipcb = ipcb->next) {
-    // If it is already on the list, just return
-    if (pcb == ipcb) return 0;
-  }
-
-  // We need to place the PCB on the list
-  pcb->next = udp_pcbs;
-  udp_pcbs = pcb;
+  // Insert UDP PCB into the list of active UDP PCBs unless it is already there
+  if (!(pcb->flags & UDP_FLAGS_BOUND)) udp_register(pcb);
 
   return 0;
 }
@@ -272,19 +303,7 @@ void udp_recv(struct udp_pcb *pcb,
 }
 
 void udp_remove(struct udp_pcb *pcb) {
-  struct udp_pcb *pcb2;
-
-  if (udp_pcbs == pcb) {
-    udp_pcbs = udp_pcbs->next;
-  } else {
-    for (pcb2 = udp_pcbs; pcb2 != NULL; pcb2 = pcb2->next) {
-      if (pcb2->next != NULL && pcb2->next == pcb) {
-        pcb2->next = pcb->next;
-        break;
-      }
-    }
-  }
-
+  if (pcb->flags & UDP_FLAGS_BOUND) udp_unregister(pcb);
   kfree(pcb);
 }
 
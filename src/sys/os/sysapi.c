@@ -230,6 +230,38 @@ int ftruncate(handle_t f, loff_t size) {
   return ftruncate64(f, size);
 }
 
+int fallocate(handle_t f, int mode, off64_t offset, off64_t len) {
+  return syscall(SYSCALL_FALLOCATE, &f);
+}
+
+int splice(handle_t in, off64_t *inpos, handle_t out, off64_t *outpos, size_t count, int flags) {
+  return syscall(SYSCALL_SPLICE, &in);
+}
+
+int copy_file_range(handle_t in, off64_t *inpos, handle_t out, off64_t *outpos, size_t count, int flags) {
+  return syscall(SYSCALL_COPY_FILE_RANGE, &in);
+}
+
+handle_t aio_read(handle_t f, void *data, size_t size, off64_t offset) {
+  return syscall(SYSCALL_AIO_READ, &f);
+}
+
+handle_t aio_write(handle_t f, const void *data, size_t size, off64_t offset) {
+  return syscall(SYSCALL_AIO_WRITE, &f);
+}
+
+handle_t aio_fsync(handle_t f) {
+  return syscall(SYSCALL_AIO_FSYNC, &f);
+}
+
+int aio_result(handle_t req) {
+  return syscall(SYSCALL_AIO_RESULT, &req);
+}
+
+int aio_cancel(handle_t req) {
+  return syscall(SYSCALL_AIO_CANCEL, &req);
+}
+
 int futime(handle_t f, struct utimbuf *times) {
   return syscall(SYSCALL_FUTIME, &f);
 }
@@ -342,6 +374,10 @@ int _readdir(handle_t f, struct direntry *dirp, int count) {
   return syscall(SYSCALL_READDIR, &f);
 }
 
+int _readdirplus(handle_t f, struct direntplus *buf, size_t size) {
+  return syscall(SYSCALL_READDIRPLUS, &f);
+}
+
 void *vmalloc(void *addr, unsigned long size, int type, int protect, unsigned long tag) {
   return (void *) syscall(SYSCALL_VMALLOC, &addr);
 }
@@ -474,6 +510,10 @@ int send(int s, const void *data, int size, unsigned int flags) {
   return syscall(SYSCALL_SEND, &s);
 }
 
+int sendfile(int s, handle_t f, off64_t *offset, size_t count) {
+  return syscall(SYSCALL_SENDFILE, &s);
+}
+
 int sendto(int s, const void *data, int size, unsigned int flags, const struct sockaddr *to, int tolen) {
   return syscall(SYSCALL_SENDTO, &s);
 }
@@ -518,6 +558,10 @@ int pipe(handle_t fildes[2]) {
   return syscall(SYSCALL_PIPE, (void *) &fildes);
 }
 
+int vmsplice(handle_t f, struct iovec *iov, int count, int flags) {
+  return syscall(SYSCALL_VMSPLICE, &f);
+}
+
 handle_t dup2(handle_t h1, handle_t h2) {
   return syscall(SYSCALL_DUP2, (void *) &h1);
 }
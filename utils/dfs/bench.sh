@@ -0,0 +1,30 @@
+#!/bin/bash
+#
+# Time building a reference image with mkdfs
+#
+# usage: bench.sh [source directory] [image size]
+#
+
+MKDFS=${MKDFS:-build/tools/mkdfs}
+SOURCE=${1:-build/install}
+SIZE=${2:-256M}
+IMAGE=${TMPDIR:-/tmp}/mkdfs-bench.$$
+ROUNDS=3
+
+run() {
+	local name="$1"
+	shift
+	for i in $(seq $ROUNDS); do
+		rm -f $IMAGE
+		$MKDFS -d $IMAGE -c $SIZE -i -f -m -S $SOURCE "$@" | grep "^total" | sed "s/^total/$name/"
+	done
+	echo "$name: $(du -k $IMAGE | cut -f1) KB allocated"
+}
+
+run "raw"
+run "raw-nosparse" -s
+run "raw-4readers" -j 4
+run "vmdk" -t vmdk
+run "vmdk-4readers" -t vmdk -j 4
+
+rm -f $IMAGE
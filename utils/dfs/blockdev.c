@@ -25,6 +25,7 @@ extern struct blockdriver bdrv_vmdk;
 struct rawdev
 {
   int fd;
+  unsigned char *written;  // Sectors written to sparse device
 };
 
 static int raw_probe(const uint8_t *buf, int buf_size, const char *filename)
@@ -57,6 +58,14 @@ static int raw_open(struct blockdevice *bs, const char *filename)
   bs->total_sectors = size / 512;
   s->fd = fd;
 
+  // Keep track of which sectors have been written to a sparse device. Only
+  // zero sectors that have never been written can be skipped.
+  if (bs->flags & BDRV_SPARSE)
+  {
+    s->written = calloc((size_t) (bs->total_sectors / 8 + 1), 1);
+    if (!s->written) bs->flags &= ~BDRV_SPARSE;
+  }
+
   return 0;
 }
 
@@ -73,7 +82,7 @@ static int raw_read(struct blockdevice *bs, int64_t sector_num,  uint8_t *buf, i
   return 0;
 }
 
-static int raw_write(struct blockdevice *bs, int64_t sector_num,  const uint8_t *buf, int nb_sectors)
+static int raw_write_sectors(struct blockdevice *bs, int64_t sector_num,  const uint8_t *buf, int nb_sectors)
 {
   struct rawdev *s = bs->opaque;
   int64_t pos = sector_num * 512;
@@ -88,10 +97,51 @@ static int raw_write(struct blockdevice *bs, int64_t sector_num,  const uint8_t
   return 0;
 }
 
+static int is_hole(struct rawdev *s, int64_t sector_num, const uint8_t *buf)
+{
+  if (s->written[sector_num >> 3] & (1 << (sector_num & 7))) return 0;
+  return bdrv_zero_sectors(buf, 1);
+}
+
+static int raw_write(struct blockdevice *bs, int64_t sector_num,  const uint8_t *buf, int nb_sectors)
+{
+  struct rawdev *s = bs->opaque;
+  int skip;
+  int n, i;
+
+  if (!(bs->flags & BDRV_SPARSE) || sector_num + nb_sectors > bs->total_sectors)
+  {
+    return raw_write_sectors(bs, sector_num, buf, nb_sectors);
+  }
+
+  // Split the request into runs of sectors to write and holes to skip
+  while (nb_sectors > 0)
+  {
+    skip = is_hole(s, sector_num, buf);
+    for (n = 1; n < nb_sectors; n++)
+    {
+      if (is_hole(s, sector_num + n, buf + n * 512) != skip) break;
+    }
+
+    if (!skip)
+    {
+      if (raw_write_sectors(bs, sector_num, buf, n) < 0) return -1;
+      for (i = 0; i < n; i++) s->written[(sector_num + i) >> 3] |= 1 << ((sector_num + i) & 7);
+    }
+
+    sector_num += n;
+    buf += n * 512;
+    nb_sectors -= n;
+  }
+
+  return 0;
+}
+
 static void raw_close(struct blockdevice *bs)
 {
   struct rawdev *s = bs->opaque;
   close(s->fd);
+  if (s->written) free(s->written);
 }
 
 #ifdef WIN32
@@ -268,3 +318,12 @@ int bdrv_write(struct blockdevice *bs, int64_t sector_num, uint8_t *buf, int nb_
 {
   return bs->drv->bdrv_write(bs, sector_num, buf, nb_sectors);
 }
+
+int bdrv_zero_sectors(const uint8_t *buf, int nb_sectors)
+{
+  const uint32_t *p = (const uint32_t *) buf;
+  const uint32_t *end = p + nb_sectors * 512 / sizeof(uint32_t);
+
+  while (p < end) if (*p++) return 0;
+  return 1;
+}
@@ -7,6 +7,8 @@ struct blockdevice;
 
 #define O_BINARY   0
 
+#define BDRV_SPARSE 1   // Device is known to be zero filled, skip writing zero sectors
+
 struct blockdriver 
 {
   const char *format_name;
@@ -26,6 +28,7 @@ struct blockdevice
   int64_t total_sectors;
   struct blockdriver *drv;
   void *opaque;
+  int flags;
   char filename[1024];
   
   // NOTE: the following infos are only hints for real hardware drivers. 
@@ -41,5 +44,6 @@ int bdrv_open(struct blockdevice *bs, const char *filename, struct blockdriver *
 void bdrv_close(struct blockdevice *bs);
 int bdrv_read(struct blockdevice *bs, int64_t sector_num, uint8_t *buf, int nb_sectors);
 int bdrv_write(struct blockdevice *bs, int64_t sector_num, uint8_t *buf, int nb_sectors);
+int bdrv_zero_sectors(const uint8_t *buf, int nb_sectors);
 
 #endif
@@ -93,12 +93,20 @@ static void remove_from_hashtable(struct bufpool *pool, struct buf *buf)
   buf->bucket.prev = NULL;
 }
 
-static struct buf *lookup_buffer(struct bufpool *pool, vfs_blkno_t blkno)
+static struct buf *find_buffer(struct bufpool *pool, vfs_blkno_t blkno)
 {
   struct buf *buf;
 
   buf = pool->hashtable[bufhash(blkno) % BUFPOOL_HASHSIZE];
   while (buf && buf->blkno != blkno) buf = buf->bucket.next;
+  return buf;
+}
+
+static struct buf *lookup_buffer(struct bufpool *pool, vfs_blkno_t blkno)
+{
+  struct buf *buf;
+
+  buf = find_buffer(pool, blkno);
   if (!buf) return NULL;
 
   switch (buf->state)
@@ -224,6 +232,63 @@ static void write_buffer(struct bufpool *pool, struct buf *buf)
   buf->waiters = NULL;
 }
 
+static int is_dirty(struct buf *buf)
+{
+  return buf && buf->state == BUF_STATE_DIRTY;
+}
+
+static void write_cluster(struct bufpool *pool, struct buf *buf)
+{
+  struct buf *first;
+  struct buf *next;
+  int maxbufs;
+  int count;
+  int i;
+
+  // Find the run of dirty buffers with consecutive block numbers around the buffer
+  maxbufs = pool->iobuf ? BUFPOOL_CLUSTER_SIZE / pool->bufsize : 1;
+  first = buf;
+  count = 1;
+  while (count < maxbufs && first->blkno > 0 && is_dirty(find_buffer(pool, first->blkno - 1)))
+  {
+    first = find_buffer(pool, first->blkno - 1);
+    count++;
+  }
+  while (count < maxbufs && is_dirty(find_buffer(pool, first->blkno + count))) count++;
+
+  if (count == 1)
+  {
+    write_buffer(pool, buf);
+    return;
+  }
+
+  // Gather the buffers and write them to the device in one request
+  for (i = 0; i < count; i++)
+  {
+    next = find_buffer(pool, first->blkno + i);
+    memcpy(pool->iobuf + i * pool->bufsize, next->data, pool->bufsize);
+  }
+  dev_write(pool->devno, pool->iobuf, count * pool->bufsize, first->blkno * pool->blks_per_buffer);
+
+  // Move the buffers from the dirty list to the clean list
+  for (i = 0; i < count; i++)
+  {
+    next = find_buffer(pool, first->blkno + i);
+
+    if (next->chain.next) next->chain.next->chain.prev = next->chain.prev;
+    if (next->chain.prev) next->chain.prev->chain.next = next->chain.next;
+    if (pool->dirty.head == next) pool->dirty.head = next->chain.next;
+    if (pool->dirty.tail == next) pool->dirty.tail = next->chain.prev;
+
+    next->state = BUF_STATE_CLEAN;
+    next->chain.next = NULL;
+    next->chain.prev = pool->clean.tail;
+    if (pool->clean.tail) pool->clean.tail->chain.next = next;
+    pool->clean.tail = next;
+    if (!pool->clean.head) pool->clean.head = next;
+  }
+}
+
 static struct buf *get_new_buffer(struct bufpool *pool)
 {
   struct buf *buf;
@@ -266,8 +331,10 @@ static struct buf *get_new_buffer(struct bufpool *pool)
     {
       buf = pool->dirty.head;
 
-      // Write the least recently changed buffer to the device
-      write_buffer(pool, buf);
+      // Write the least recently changed buffer to the device together with
+      // its dirty neighbors. The written buffers are moved to the clean list.
+      write_cluster(pool, buf);
+      if (buf->state == BUF_STATE_CLEAN) continue;
 
       // Only use the buffer if it has not been locked by other buffer waiters
       if (buf->locks == 0)
@@ -317,6 +384,9 @@ struct bufpool *init_buffer_pool(vfs_devno_t devno, int poolsize, int bufsize)
   }
   memset(pool->database, 0, poolsize * bufsize);
 
+  // The staging buffer for clustered writes is optional
+  if (poolsize * bufsize >= BUFPOOL_CLUSTER_SIZE) pool->iobuf = (char *) malloc(BUFPOOL_CLUSTER_SIZE);
+
   buf = pool->bufbase;
   data = pool->database;
 
@@ -343,6 +413,7 @@ struct bufpool *init_buffer_pool(vfs_devno_t devno, int poolsize, int bufsize)
 
 void free_buffer_pool(struct bufpool *pool)
 {
+  if (pool->iobuf) free(pool->iobuf);
   free(pool->database);
   free(pool->bufbase);
   free(pool);
@@ -488,8 +559,9 @@ void flush_buffers(struct bufpool *pool)
     // Get next buffer from dirty list
     buf = pool->dirty.head;
 
-    // Flush buffer to device
-    write_buffer(pool, buf);
+    // Flush buffer and its dirty neighbors to device
+    write_cluster(pool, buf);
+    if (buf->state == BUF_STATE_CLEAN) continue;
 
     // Move buffer to clean list if it is not locked
     if (buf->locks == 0)
@@ -8,6 +8,7 @@ struct thread
 };
 
 #define BUFPOOL_HASHSIZE 512
+#define BUFPOOL_CLUSTER_SIZE (4 * 1024 * 1024)
 
 #define BUF_STATE_FREE      0
 #define BUF_STATE_CLEAN     1
@@ -56,6 +57,7 @@ struct bufpool
   struct buflist dirty;  // List of dirty buffers (head is least recently changed)
   struct buflist clean;  // List of clean buffers (head is least recently used)
   struct buf *freelist;  // List of free buffers
+  char *iobuf;           // Staging buffer for clustered writes
 
   struct buf *hashtable[BUFPOOL_HASHSIZE];
 };
@@ -19,6 +19,7 @@ int dfs_write(struct file *filp, void *data, size_t size);
 vfs_loff_t dfs_tell(struct file *filp);
 vfs_loff_t dfs_lseek(struct file *filp, vfs_loff_t offset, int origin);
 int dfs_chsize(struct file *filp, vfs_loff_t size);
+int dfs_allocate(struct file *filp, vfs_loff_t size);
 
 int dfs_futime(struct file *filp, struct vfs_utimbuf *times);
 
@@ -51,6 +52,7 @@ struct fsops dfsops =
   dfs_tell,
   dfs_lseek,
   dfs_chsize,
+  dfs_allocate,
   
   dfs_futime,
 
@@ -2,7 +2,8 @@
 #define DFS_H
 
 #define DFS_SIGNATURE              0x00534644
-#define DFS_VERSION                2
+#define DFS_VERSION                3
+#define DFS_VERSION_NOINCOMPAT     2
 
 #define DFS_TOPBLOCKDIR_SIZE       16
 #define DFS_MAX_DEPTH              16
@@ -12,6 +13,38 @@
 
 #define DFS_MAXFNAME               255
 
+#define NOINODE                    ((vfs_ino_t) -1)
+
+//
+// Compatible features. DFS_FEATURE_DIRINDEX was used for directory indexing
+// before it became an incompatible feature and is converted on open.
+//
+
+#define DFS_FEATURE_DIRINDEX       0x00000001
+
+//
+// Incompatible features. File systems with unknown incompatible features
+// are refused. DFS_INCOMPAT_EXTENTS marks file systems that may contain
+// extent mapped files. DFS_INCOMPAT_JOURNAL marks file systems with a
+// metadata journal, which the kernel replays on mount.
+// DFS_INCOMPAT_DIRINDEX marks file systems that may contain hash indexed
+// directories. Version 2 file systems have no incompatible feature word;
+// enabling the first incompatible feature moves them to version 3.
+//
+
+#define DFS_INCOMPAT_EXTENTS       0x00000001
+#define DFS_INCOMPAT_JOURNAL       0x00000002
+#define DFS_INCOMPAT_DIRINDEX      0x00000004
+
+#define DFS_INCOMPAT_SUPPORTED     (DFS_INCOMPAT_EXTENTS | DFS_INCOMPAT_JOURNAL | DFS_INCOMPAT_DIRINDEX)
+
+#define DFS_JOURNAL_MAGIC          0x4A534644
+
+#define DFS_INODE_FLAG_DIRINDEX    0x0001
+#define DFS_INODE_FLAG_EXTENTS     0x0002
+
+#define DFS_EXTENT_MAGIC           0xE5E5
+
 struct superblock
 {
   unsigned int signature;
@@ -29,6 +62,23 @@ struct superblock
   vfs_blkno_t first_reserved_block;
   unsigned int reserved_blocks;
   unsigned int cache_buffers;
+  unsigned int compress_offset;
+  unsigned int compress_size;
+  unsigned int features;
+  vfs_blkno_t journal_block;
+  unsigned int journal_blocks;
+  unsigned int incompat_features;
+};
+
+struct jsuper
+{
+  unsigned int magic;
+  unsigned int type;
+  unsigned int seq;
+  unsigned int blocksize;
+  unsigned int first;
+  unsigned int last;
+  unsigned int start;
 };
 
 struct groupdesc
@@ -47,7 +97,7 @@ struct inodedesc
   unsigned short mode;
   unsigned short uid;
   unsigned short gid;
-  unsigned short resv;
+  unsigned short flags;
   vfs_time_t atime;
   vfs_time_t ctime;
   vfs_time_t mtime;
@@ -67,6 +117,61 @@ struct dentry
   char name[0];
 };
 
+//
+// Hash index for directories. Block 0 of an indexed directory is the index
+// root, which points to leaf blocks or, with one index level, to index
+// nodes. Index blocks start with an unused directory entry that covers the
+// whole block, so linear directory scans skip them.
+//
+
+struct dxentry
+{
+  unsigned int hash;
+  unsigned int block;
+};
+
+struct dxnode
+{
+  vfs_ino_t ino;                // NOINODE
+  unsigned int reclen;          // Block size
+  unsigned int namelen;         // Block size minus directory entry header
+  unsigned int entries;         // Number of names in directory (root only)
+  unsigned short levels;        // Number of index node levels below root (root only)
+  unsigned short count;
+  unsigned short limit;
+  unsigned short reserved;
+  struct dxentry entry[0];
+};
+
+//
+// Extent tree for regular files. In an extent mapped inode the block
+// directory holds the root node of the tree and the inode depth is the
+// number of index levels. Leaf nodes hold runs of physically contiguous
+// blocks; index nodes hold the first logical block and tree block of each
+// child. Blocks are only added at the end of the file.
+//
+
+struct extenthdr
+{
+  unsigned short magic;         // DFS_EXTENT_MAGIC
+  unsigned short count;         // Number of entries in node
+  unsigned short limit;         // Maximum number of entries in node
+  unsigned short reserved;
+};
+
+struct extent
+{
+  unsigned int iblock;          // First logical block
+  unsigned int count;           // Number of blocks
+  vfs_blkno_t start;            // First physical block
+};
+
+struct extentidx
+{
+  unsigned int iblock;          // First logical block covered by child
+  vfs_blkno_t block;            // Tree block for child
+};
+
 struct group
 {
   struct groupdesc *desc;
@@ -106,12 +211,14 @@ typedef int (*filldir_t)(char *name, int len, vfs_ino_t ino, void *data);
 void dfs_init();
 
 // super.c
-struct filsys *create_filesystem(vfs_devno_t devno, int blocksize, int inode_ratio, int quick);
+struct filsys *create_filesystem(vfs_devno_t devno, int blocksize, int inode_ratio, int quick, int dirindex, int extents);
 struct filsys *open_filesystem(vfs_devno_t devno);
 void close_filesystem(struct filsys *fs);
+void set_incompat_feature(struct filsys *fs, unsigned int feature);
 
 // group.c
 vfs_blkno_t new_block(struct filsys *fs, vfs_blkno_t goal);
+int new_blocks(struct filsys *fs, vfs_blkno_t goal, unsigned int count, vfs_blkno_t *first);
 void free_blocks(struct filsys *fs, vfs_blkno_t *blocks, int count);
 
 vfs_ino_t new_inode(struct filsys *fs, vfs_ino_t parent, int flags);
@@ -126,6 +233,7 @@ int unlink_inode(struct inode *inode);
 struct inode *get_inode(struct filsys *fs, vfs_ino_t ino);
 void release_inode(struct inode *inode);
 vfs_blkno_t expand_inode(struct inode *inode);
+int preallocate_inode(struct inode *inode, unsigned int count);
 int truncate_inode(struct inode *inode, unsigned int blocks);
 
 // dir.c
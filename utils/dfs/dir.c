@@ -1,5 +1,6 @@
 #include <time.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "types.h"
 #include "buf.h"
@@ -8,9 +9,562 @@
 
 #define NAME_ALIGN_LEN(l) (((l) + 3) & ~3)
 
+#define DX_MAXLEVELS 2
+
+struct dxframe
+{
+  struct buf *buf;
+  struct dxnode *node;
+  int pos;
+};
+
+struct dxsort
+{
+  unsigned int hash;
+  struct dentry *de;
+};
+
+//
+// FNV-1a hash of a file name. This must match the hash used by the kernel.
+//
+
+static unsigned int dirhash(char *name, int len)
+{
+  unsigned int h = 2166136261U;
+
+  while (len-- > 0)
+  {
+    h ^= (unsigned char) *name++;
+    h *= 16777619;
+  }
+
+  return h;
+}
+
+static int is_indexed(struct inode *dir)
+{
+  return (dir->desc->flags & DFS_INODE_FLAG_DIRINDEX) != 0;
+}
+
+static void dx_init_node(struct filsys *fs, struct dxnode *node)
+{
+  memset(node, 0, sizeof(struct dxnode));
+  node->ino = NOINODE;
+  node->reclen = fs->blocksize;
+  node->namelen = fs->blocksize - sizeof(struct dentry);
+  node->limit = (fs->blocksize - sizeof(struct dxnode)) / sizeof(struct dxentry);
+}
+
+static void dx_release(struct inode *dir, struct dxframe *frames, int nframes)
+{
+  while (nframes > 0)
+  {
+    nframes--;
+    release_buffer(dir->fs->cache, frames[nframes].buf);
+  }
+}
+
+//
+// Walk the hash index from the root to the leaf block for a hash value
+//
+
+static int dx_probe(struct inode *dir, unsigned int hash, struct dxframe *frames, int *nframes, unsigned int *leaf)
+{
+  unsigned int block;
+  int levels;
+  int level;
+  struct buf *buf;
+  struct dxnode *node;
+  int lo, hi, mid, pos;
+
+  block = 0;
+  levels = 0;
+  level = 0;
+  while (1)
+  {
+    buf = get_buffer(dir->fs->cache, get_inode_block(dir, block));
+    if (!buf)
+    {
+      dx_release(dir, frames, level);
+      return -1;
+    }
+
+    node = (struct dxnode *) buf->data;
+    if (level == 0) levels = node->levels;
+    if (node->ino != NOINODE || node->count == 0 || node->count > node->limit || levels >= DX_MAXLEVELS)
+    {
+      release_buffer(dir->fs->cache, buf);
+      dx_release(dir, frames, level);
+      return -1;
+    }
+
+    pos = 0;
+    lo = 1;
+    hi = node->count - 1;
+    while (lo <= hi)
+    {
+      mid = (lo + hi) / 2;
+      if (node->entry[mid].hash <= hash)
+      {
+        pos = mid;
+        lo = mid + 1;
+      }
+      else
+        hi = mid - 1;
+    }
+
+    frames[level].buf = buf;
+    frames[level].node = node;
+    frames[level].pos = pos;
+    block = node->entry[pos].block;
+
+    if (level++ == levels) break;
+  }
+
+  if (block >= dir->desc->blocks)
+  {
+    dx_release(dir, frames, level);
+    return -1;
+  }
+
+  *nframes = level;
+  *leaf = block;
+  return 0;
+}
+
+static int dx_adjust_entries(struct inode *dir, int delta)
+{
+  struct buf *buf;
+  struct dxnode *root;
+
+  buf = get_buffer(dir->fs->cache, get_inode_block(dir, 0));
+  if (!buf) return -1;
+
+  root = (struct dxnode *) buf->data;
+  root->entries += delta;
+  if (root->entries > 0)
+  {
+    mark_buffer_updated(buf);
+    release_buffer(dir->fs->cache, buf);
+    return 0;
+  }
+
+  // Last name removed, truncate directory and drop the index
+  mark_buffer_invalid(buf);
+  release_buffer(dir->fs->cache, buf);
+  dir->desc->flags &= ~DFS_INODE_FLAG_DIRINDEX;
+  dir->desc->size = 0;
+  mark_inode_dirty(dir);
+  return truncate_inode(dir, 0);
+}
+
+static int dir_range(struct inode *dir, char *name, int len, unsigned int *first, unsigned int *last)
+{
+  struct dxframe frames[DX_MAXLEVELS];
+  int nframes;
+  unsigned int leaf;
+
+  if (!is_indexed(dir))
+  {
+    *first = 0;
+    *last = dir->desc->blocks;
+    return 0;
+  }
+
+  if (dx_probe(dir, dirhash(name, len), frames, &nframes, &leaf) < 0) return -1;
+  dx_release(dir, frames, nframes);
+
+  *first = leaf;
+  *last = leaf + 1;
+  return 0;
+}
+
+static int insert_into_block(struct filsys *fs, struct buf *buf, char *name, int len, vfs_ino_t ino)
+{
+  char *p;
+  struct dentry *de;
+  struct dentry *newde;
+  unsigned int minlen;
+  unsigned int newlen;
+
+  newlen = sizeof(struct dentry) + NAME_ALIGN_LEN(len);
+  p = buf->data;
+  while (p < buf->data + fs->blocksize)
+  {
+    de = (struct dentry *) p;
+
+    if (de->ino == NOINODE && de->namelen == 0 && de->reclen >= newlen)
+    {
+      // Reuse empty leaf entry
+      de->ino = ino;
+      de->namelen = len;
+      memcpy(de->name, name, len);
+      mark_buffer_updated(buf);
+      return 0;
+    }
+
+    minlen = sizeof(struct dentry) + NAME_ALIGN_LEN(de->namelen);
+    if (de->reclen >= minlen + newlen)
+    {
+      newde = (struct dentry *) (p + minlen);
+
+      newde->ino = ino;
+      newde->reclen = de->reclen - minlen;
+      newde->namelen = len;
+      memcpy(newde->name, name, len);
+
+      de->reclen = minlen;
+
+      mark_buffer_updated(buf);
+      return 0;
+    }
+
+    p += de->reclen;
+  }
+
+  return -1;
+}
+
+static void write_leaf(struct filsys *fs, char *data, struct dxsort *list, int count)
+{
+  char *p;
+  struct dentry *de;
+  int i;
+
+  de = (struct dentry *) data;
+  if (count == 0)
+  {
+    de->ino = NOINODE;
+    de->reclen = fs->blocksize;
+    de->namelen = 0;
+    return;
+  }
+
+  p = data;
+  for (i = 0; i < count; i++)
+  {
+    de = (struct dentry *) p;
+    de->ino = list[i].de->ino;
+    de->namelen = list[i].de->namelen;
+    de->reclen = sizeof(struct dentry) + NAME_ALIGN_LEN(de->namelen);
+    memcpy(de->name, list[i].de->name, de->namelen);
+    p += de->reclen;
+  }
+
+  de->reclen += data + fs->blocksize - p;
+}
+
+static void dx_insert_entry(struct dxframe *frame, unsigned int hash, unsigned int block)
+{
+  struct dxnode *node = frame->node;
+  int pos = frame->pos + 1;
+
+  memmove(&node->entry[pos + 1], &node->entry[pos], (node->count - pos) * sizeof(struct dxentry));
+  node->entry[pos].hash = hash;
+  node->entry[pos].block = block;
+  node->count++;
+  mark_buffer_updated(frame->buf);
+}
+
+//
+// Make sure the index node above the leaf has room for a new entry by
+// pushing a full root down into a new index node or splitting a full node
+//
+
+static int dx_make_room(struct inode *dir, struct dxframe *frames, int *nframes)
+{
+  struct dxframe *frame = &frames[*nframes - 1];
+  struct dxnode *root = frames[0].node;
+  struct dxnode *node;
+  struct dxnode *newnode;
+  struct buf *buf;
+  vfs_blkno_t blk;
+  unsigned int block;
+  int half;
+
+  if (frame->node->count < frame->node->limit) return 0;
+
+  if (*nframes == 1)
+  {
+    block = dir->desc->blocks;
+    blk = expand_inode(dir);
+    if (blk == -1) return -1;
+    buf = alloc_buffer(dir->fs->cache, blk);
+    if (!buf) return -1;
+    dir->desc->size += dir->fs->blocksize;
+    mark_inode_dirty(dir);
+
+    newnode = (struct dxnode *) buf->data;
+    dx_init_node(dir->fs, newnode);
+    memcpy(newnode->entry, root->entry, root->count * sizeof(struct dxentry));
+    newnode->count = root->count;
+    mark_buffer_updated(buf);
+
+    root->levels = 1;
+    root->count = 1;
+    root->entry[0].hash = 0;
+    root->entry[0].block = block;
+    mark_buffer_updated(frames[0].buf);
+
+    frames[1].buf = buf;
+    frames[1].node = newnode;
+    frames[1].pos = frames[0].pos;
+    frames[0].pos = 0;
+    *nframes = 2;
+    frame = &frames[1];
+  }
+
+  node = frame->node;
+  if (node->count < node->limit) return 0;
+  if (root->count == root->limit) return -1;
+
+  block = dir->desc->blocks;
+  blk = expand_inode(dir);
+  if (blk == -1) return -1;
+  buf = alloc_buffer(dir->fs->cache, blk);
+  if (!buf) return -1;
+  dir->desc->size += dir->fs->blocksize;
+  mark_inode_dirty(dir);
+
+  half = node->count / 2;
+  newnode = (struct dxnode *) buf->data;
+  dx_init_node(dir->fs, newnode);
+  memcpy(newnode->entry, &node->entry[half], (node->count - half) * sizeof(struct dxentry));
+  newnode->count = node->count - half;
+  node->count = half;
+  mark_buffer_updated(buf);
+  mark_buffer_updated(frame->buf);
+
+  dx_insert_entry(&frames[0], newnode->entry[0].hash, block);
+
+  if (frame->pos >= half)
+  {
+    release_buffer(dir->fs->cache, frame->buf);
+    frame->buf = buf;
+    frame->node = newnode;
+    frame->pos -= half;
+  }
+  else
+    release_buffer(dir->fs->cache, buf);
+
+  return 0;
+}
+
+static void sort_by_hash(struct dxsort *list, int count)
+{
+  struct dxsort tmp;
+  int i, j;
+
+  for (i = 1; i < count; i++)
+  {
+    tmp = list[i];
+    j = i;
+    while (j > 0 && list[j - 1].hash > tmp.hash)
+    {
+      list[j] = list[j - 1];
+      j--;
+    }
+    list[j] = tmp;
+  }
+}
+
+//
+// Split a full leaf block in two at a hash boundary and add the new entry
+//
+
+static int dx_split_leaf(struct inode *dir, struct dxframe *frames, int *nframes, struct buf *buf, char *name, int len, vfs_ino_t ino)
+{
+  struct filsys *fs = dir->fs;
+  char *data;
+  char *p;
+  struct dentry *de;
+  struct dentry *newde;
+  struct dxsort *list;
+  struct buf *newbuf;
+  vfs_blkno_t blk;
+  unsigned int block;
+  unsigned int total, left, best, diff;
+  int count, split, i;
+  int rc;
+
+  data = (char *) malloc(fs->blocksize + sizeof(struct dentry) + NAME_ALIGN_LEN(len));
+  list = (struct dxsort *) malloc((fs->blocksize / sizeof(struct dentry) + 1) * sizeof(struct dxsort));
+  if (!data || !list)
+  {
+    free(data);
+    free(list);
+    return -1;
+  }
+
+  memcpy(data, buf->data, fs->blocksize);
+  count = 0;
+  total = 0;
+  p = data;
+  while (p < data + fs->blocksize)
+  {
+    de = (struct dentry *) p;
+    if (de->reclen == 0) break;
+    if (de->ino != NOINODE)
+    {
+      list[count].hash = dirhash(de->name, de->namelen);
+      list[count].de = de;
+      total += sizeof(struct dentry) + NAME_ALIGN_LEN(de->namelen);
+      count++;
+    }
+    p += de->reclen;
+  }
+
+  newde = (struct dentry *) (data + fs->blocksize);
+  newde->ino = ino;
+  newde->namelen = len;
+  memcpy(newde->name, name, len);
+  list[count].hash = dirhash(name, len);
+  list[count].de = newde;
+  total += sizeof(struct dentry) + NAME_ALIGN_LEN(len);
+  count++;
+
+  sort_by_hash(list, count);
+
+  // Find the hash boundary closest to the middle where both halves fit
+  split = -1;
+  best = 0;
+  left = 0;
+  for (i = 1; i < count; i++)
+  {
+    left += sizeof(struct dentry) + NAME_ALIGN_LEN(list[i - 1].de->namelen);
+    if (list[i].hash == list[i - 1].hash) continue;
+    if (left > fs->blocksize || total - left > fs->blocksize) continue;
+    diff = left > total / 2 ? left - total / 2 : total / 2 - left;
+    if (split < 0 || diff < best)
+    {
+      split = i;
+      best = diff;
+    }
+  }
+
+  rc = -1;
+  if (split < 0) goto out;
+  if (dx_make_room(dir, frames, nframes) < 0) goto out;
+
+  block = dir->desc->blocks;
+  blk = expand_inode(dir);
+  if (blk == -1) goto out;
+  newbuf = alloc_buffer(fs->cache, blk);
+  if (!newbuf) goto out;
+  dir->desc->size += fs->blocksize;
+  mark_inode_dirty(dir);
+
+  write_leaf(fs, buf->data, list, split);
+  write_leaf(fs, newbuf->data, list + split, count - split);
+  mark_buffer_updated(buf);
+  mark_buffer_updated(newbuf);
+  release_buffer(fs->cache, newbuf);
+
+  dx_insert_entry(&frames[*nframes - 1], list[split].hash, block);
+  rc = 0;
+
+out:
+  free(data);
+  free(list);
+  return rc;
+}
+
+static int dx_add_entry(struct inode *dir, char *name, int len, vfs_ino_t ino)
+{
+  struct dxframe frames[DX_MAXLEVELS];
+  int nframes;
+  unsigned int leaf;
+  struct buf *buf;
+  int rc;
+
+  if (dx_probe(dir, dirhash(name, len), frames, &nframes, &leaf) < 0) return -1;
+
+  buf = get_buffer(dir->fs->cache, get_inode_block(dir, leaf));
+  if (!buf)
+  {
+    dx_release(dir, frames, nframes);
+    return -1;
+  }
+
+  rc = insert_into_block(dir->fs, buf, name, len, ino);
+  if (rc < 0) rc = dx_split_leaf(dir, frames, &nframes, buf, name, len, ino);
+
+  release_buffer(dir->fs->cache, buf);
+  if (rc == 0)
+  {
+    frames[0].node->entries++;
+    mark_buffer_updated(frames[0].buf);
+  }
+  dx_release(dir, frames, nframes);
+  return rc;
+}
+
+//
+// Convert a single block directory to an indexed directory
+//
+
+static int dx_create_index(struct inode *dir)
+{
+  struct filsys *fs = dir->fs;
+  struct buf *rootbuf;
+  struct buf *leafbuf;
+  struct dxnode *root;
+  struct dentry *de;
+  vfs_blkno_t blk;
+  char *p;
+  unsigned int entries;
+
+  rootbuf = get_buffer(fs->cache, get_inode_block(dir, 0));
+  if (!rootbuf) return -1;
+
+  blk = expand_inode(dir);
+  if (blk == -1)
+  {
+    release_buffer(fs->cache, rootbuf);
+    return -1;
+  }
+  leafbuf = alloc_buffer(fs->cache, blk);
+  if (!leafbuf)
+  {
+    release_buffer(fs->cache, rootbuf);
+    return -1;
+  }
+
+  memcpy(leafbuf->data, rootbuf->data, fs->blocksize);
+  mark_buffer_updated(leafbuf);
+
+  entries = 0;
+  p = leafbuf->data;
+  while (p < leafbuf->data + fs->blocksize)
+  {
+    de = (struct dentry *) p;
+    if (de->reclen == 0) break;
+    if (de->ino != NOINODE) entries++;
+    p += de->reclen;
+  }
+  release_buffer(fs->cache, leafbuf);
+
+  root = (struct dxnode *) rootbuf->data;
+  dx_init_node(fs, root);
+  root->entries = entries;
+  root->count = 1;
+  root->entry[0].hash = 0;
+  root->entry[0].block = 1;
+  mark_buffer_updated(rootbuf);
+  release_buffer(fs->cache, rootbuf);
+
+  dir->desc->flags |= DFS_INODE_FLAG_DIRINDEX;
+  dir->desc->size += fs->blocksize;
+  mark_inode_dirty(dir);
+
+  return 0;
+}
+
 vfs_ino_t find_dir_entry(struct inode *dir, char *name, int len)
 {
   unsigned int block;
+  unsigned int first;
+  unsigned int last;
   vfs_blkno_t blk;
   struct buf *buf;
   char *p;
@@ -19,8 +573,9 @@ vfs_ino_t find_dir_entry(struct inode *dir, char *name, int len)
 
   if (len <= 0 || len >= MAXPATH) return -1;
   if (!VFS_S_ISDIR(dir->desc->mode)) return -1;
+  if (dir_range(dir, name, len, &first, &last) < 0) return -1;
 
-  for (block = 0; block < dir->desc->blocks; block++)
+  for (block = first; block < last; block++)
   {
     blk = get_inode_block(dir, block);
     buf = get_buffer(dir->fs->cache, blk);
@@ -134,50 +689,43 @@ int add_dir_entry(struct inode *dir, char *name, int len, vfs_ino_t ino)
   unsigned int block;
   vfs_blkno_t blk;
   struct buf *buf;
-  char *p;
-  struct dentry *de;
   struct dentry *newde;
-  int minlen;
+  int rc;
 
   if (len <= 0 || len >= MAXPATH) return -1;
   if (!VFS_S_ISDIR(dir->desc->mode)) return -1;
 
+  if (is_indexed(dir))
+  {
+    if (dx_add_entry(dir, name, len, ino) < 0) return -1;
+
+    dir->desc->mtime = time(NULL);
+    mark_inode_dirty(dir);
+    return 0;
+  }
+
   for (block = 0; block < dir->desc->blocks; block++)
   {
     blk = get_inode_block(dir, block);
     buf = get_buffer(dir->fs->cache, blk);
     if (!buf) return -1;
 
-    p = buf->data;
-    while (p < buf->data + dir->fs->blocksize)
+    rc = insert_into_block(dir->fs, buf, name, len, ino);
+    release_buffer(dir->fs->cache, buf);
+    if (rc == 0)
     {
-      de = (struct dentry *) p;
-      minlen = sizeof(struct dentry) + NAME_ALIGN_LEN(de->namelen);
-
-      if (de->reclen >= minlen + sizeof(struct dentry) + NAME_ALIGN_LEN(de->namelen))
-      {
-        newde = (struct dentry *) (p + minlen);
-
-        newde->ino = ino;
-        newde->reclen = de->reclen - minlen;
-        newde->namelen = len;
-        memcpy(newde->name, name, len);
-
-        de->reclen = minlen;
+      dir->desc->mtime = time(NULL);
+      mark_inode_dirty(dir);
 
-        mark_buffer_updated(buf);
-        release_buffer(dir->fs->cache, buf);
-
-        dir->desc->mtime = time(NULL);
-        mark_inode_dirty(dir);
-
-        return 0;
-      }
-
-      p += de->reclen;
+      return 0;
     }
+  }
 
-    release_buffer(dir->fs->cache, buf);
+  // Switch to a hash indexed directory when the first block is full
+  if (dir->desc->blocks == 1 && (dir->fs->super->incompat_features & DFS_INCOMPAT_DIRINDEX))
+  {
+    if (dx_create_index(dir) < 0) return -1;
+    return add_dir_entry(dir, name, len, ino);
   }
 
   blk = expand_inode(dir);
@@ -205,6 +753,8 @@ int add_dir_entry(struct inode *dir, char *name, int len, vfs_ino_t ino)
 vfs_ino_t modify_dir_entry(struct inode *dir, char *name, int len, vfs_ino_t ino)
 {
   unsigned int block;
+  unsigned int first;
+  unsigned int last;
   vfs_blkno_t blk;
   struct buf *buf;
   char *p;
@@ -213,8 +763,9 @@ vfs_ino_t modify_dir_entry(struct inode *dir, char *name, int len, vfs_ino_t ino
 
   if (len <= 0 || len >= MAXPATH) return -1;
   if (!VFS_S_ISDIR(dir->desc->mode)) return -1;
+  if (dir_range(dir, name, len, &first, &last) < 0) return -1;
 
-  for (block = 0; block < dir->desc->blocks; block++)
+  for (block = first; block < last; block++)
   {
     blk = get_inode_block(dir, block);
     buf = get_buffer(dir->fs->cache, blk);
@@ -253,11 +804,14 @@ int delete_dir_entry(struct inode *dir, char *name, int len)
   struct dentry *de;
   struct dentry *prevde;
   struct dentry *nextde;
+  unsigned int first;
+  unsigned int last;
 
   if (len <= 0 || len >= MAXPATH) return -1;
   if (!VFS_S_ISDIR(dir->desc->mode)) return -1;
+  if (dir_range(dir, name, len, &first, &last) < 0) return -1;
 
-  for (block = 0; block < dir->desc->blocks; block++)
+  for (block = first; block < last; block++)
   {
     blk = get_inode_block(dir, block);
     buf = get_buffer(dir->fs->cache, blk);
@@ -278,6 +832,13 @@ int delete_dir_entry(struct inode *dir, char *name, int len)
           memset(de, 0, sizeof(struct dentry) + NAME_ALIGN_LEN(de->namelen));
           mark_buffer_updated(buf);
         }
+        else if (de->reclen == dir->fs->blocksize && is_indexed(dir))
+        {
+          // Leaf blocks are referenced from the index, leave an empty entry
+          de->ino = NOINODE;
+          de->namelen = 0;
+          mark_buffer_updated(buf);
+        }
         else if (de->reclen == dir->fs->blocksize)
         {
           // Block is empty, swap this block with last block and truncate
@@ -308,6 +869,7 @@ int delete_dir_entry(struct inode *dir, char *name, int len)
         dir->desc->mtime = time(NULL);
         mark_inode_dirty(dir);
 
+        if (is_indexed(dir)) return dx_adjust_entries(dir, -1);
         return 0;
       }
 
@@ -342,12 +904,17 @@ int read_dir(struct inode *dir, filldir_t filldir, void *data)
     while (p < buf->data + dir->fs->blocksize)
     {
       de = (struct dentry *) p;
+      if (de->reclen == 0) break;
 
-      rc = filldir(de->name, de->namelen, de->ino, data);
-      if (rc != 0)
+      // Skip index blocks and empty leaf blocks
+      if (de->ino != NOINODE)
       {
-        release_buffer(dir->fs->cache, buf);
-        return rc;
+        rc = filldir(de->name, de->namelen, de->ino, data);
+        if (rc != 0)
+        {
+          release_buffer(dir->fs->cache, buf);
+          return rc;
+        }
       }
 
       p += de->reclen;
@@ -396,20 +963,35 @@ int dfs_readdir(struct file *filp, struct vfs_dirent *dirp, int count)
 
   inode = (struct inode *) filp->data;
   if (count != 1) return -1;
-  if (filp->pos == inode->desc->size) return 0;
-  if (filp->pos > inode->desc->size) return -1;
 
-  iblock = filp->pos / inode->fs->blocksize;
-  start = filp->pos % inode->fs->blocksize;
+  while (1)
+  {
+    if (filp->pos == inode->desc->size) return 0;
+    if (filp->pos > inode->desc->size) return -1;
 
-  blk = get_inode_block(inode, iblock);
-  if (blk == -1) return -1;
+    iblock = filp->pos / inode->fs->blocksize;
+    start = filp->pos % inode->fs->blocksize;
 
-  buf = get_buffer(inode->fs->cache, blk);
-  if (!buf) return -1;
+    blk = get_inode_block(inode, iblock);
+    if (blk == -1) return -1;
+
+    buf = get_buffer(inode->fs->cache, blk);
+    if (!buf) return -1;
+
+    de = (struct dentry *) (buf->data + start);
+    if (de->reclen == 0 || de->reclen + start > inode->fs->blocksize)
+    {
+      release_buffer(inode->fs->cache, buf);
+      return -1;
+    }
+
+    // Skip index blocks and empty leaf blocks in indexed directories
+    if (de->ino != NOINODE) break;
+    filp->pos += de->reclen;
+    release_buffer(inode->fs->cache, buf);
+  }
 
-  de = (struct dentry *) (buf->data + start);
-  if (de->reclen + start > inode->fs->blocksize || de->namelen <= 0 || de->namelen >= MAXPATH)
+  if (de->namelen <= 0 || de->namelen >= MAXPATH)
   {
     release_buffer(inode->fs->cache, buf);
     return -1;
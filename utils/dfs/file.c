@@ -348,7 +348,8 @@ int dfs_write(struct file *filp, void *data, size_t size)
 
     if (blk == -1) return written;
 
-    if (count == inode->fs->blocksize)
+    // Blocks that are completely overwritten or beyond the end of file do not need to be read
+    if (count == inode->fs->blocksize || (start == 0 && filp->pos >= inode->desc->size))
       buf = alloc_buffer(inode->fs->cache, blk);
     else
       buf = get_buffer(inode->fs->cache, blk);
@@ -426,6 +427,21 @@ int dfs_chsize(struct file *filp, vfs_loff_t size)
   return 0;
 }
 
+int dfs_allocate(struct file *filp, vfs_loff_t size)
+{
+  struct inode *inode;
+  unsigned int blocks;
+
+  inode = (struct inode *) filp->data;
+
+  // Preallocate the blocks needed for the file as contiguous runs, so the
+  // file data can be written without interleaved block allocations
+  blocks = (size + inode->fs->blocksize - 1) / inode->fs->blocksize;
+  if (blocks <= inode->desc->blocks) return 0;
+
+  return preallocate_inode(inode, blocks - inode->desc->blocks);
+}
+
 int dfs_futime(struct file *filp, struct vfs_utimbuf *times)
 {
   struct inode *inode;
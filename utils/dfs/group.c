@@ -85,6 +85,84 @@ block_found:
   return block;
 }
 
+int new_blocks(struct filsys *fs, vfs_blkno_t goal, unsigned int count, vfs_blkno_t *first)
+{
+  unsigned int group;
+  unsigned int start;
+  unsigned int block;
+  unsigned int len;
+  unsigned int best_group;
+  unsigned int best_start;
+  unsigned int best_len;
+  unsigned int i;
+  struct buf *buf;
+
+  if (count == 0) return 0;
+
+  // Look for the first run of count free blocks starting from the goal and
+  // remember the longest run seen in case there is no such run
+  best_group = best_start = best_len = 0;
+  if (goal < fs->super->block_count)
+  {
+    group = goal / fs->super->blocks_per_group;
+    start = goal % fs->super->blocks_per_group;
+  }
+  else
+    group = start = 0;
+
+  for (i = 0; i < fs->super->group_count && best_len < count; i++)
+  {
+    if (fs->groups[group].desc->free_block_count > 0)
+    {
+      buf = get_buffer(fs->cache, fs->groups[group].desc->block_bitmap_block);
+      block = find_next_zero_bit(buf->data, fs->groups[group].desc->block_count, start);
+      while (block < fs->groups[group].desc->block_count)
+      {
+        len = 1;
+        while (len < count && block + len < fs->groups[group].desc->block_count && !test_bit(buf->data, block + len)) len++;
+
+        if (len > best_len)
+        {
+          best_group = group;
+          best_start = block;
+          best_len = len;
+          if (len == count) break;
+        }
+
+        block = find_next_zero_bit(buf->data, fs->groups[group].desc->block_count, block + len);
+      }
+      release_buffer(fs->cache, buf);
+    }
+
+    // Try next group
+    start = 0;
+    group++;
+    if (group >= fs->super->group_count) group = 0;
+  }
+
+  if (best_len == 0)
+  {
+    panic("disk full");
+    return -1;
+  }
+
+  // Mark run as allocated
+  buf = get_buffer(fs->cache, fs->groups[best_group].desc->block_bitmap_block);
+  set_bits(buf->data, best_start, best_len);
+  mark_buffer_updated(buf);
+  release_buffer(fs->cache, buf);
+
+  fs->super->free_block_count -= best_len;
+  fs->super_dirty = 1;
+
+  if (fs->groups[best_group].first_free_block == best_start) fs->groups[best_group].first_free_block = best_start + best_len;
+  fs->groups[best_group].desc->free_block_count -= best_len;
+  mark_group_desc_dirty(fs, best_group);
+
+  *first = best_group * fs->super->blocks_per_group + best_start;
+  return best_len;
+}
+
 void free_blocks(struct filsys *fs, vfs_blkno_t *blocks, int count)
 {
   unsigned int group;
@@ -30,12 +30,353 @@ void mark_inode_dirty(struct inode *inode)
   mark_buffer_updated(inode->buf);
 }
 
+#define EXTENTS(hdr)    ((struct extent *) ((hdr) + 1))
+#define EXTENTIDX(hdr)  ((struct extentidx *) ((hdr) + 1))
+
+struct extentpath
+{
+  struct buf *buf;
+  struct extenthdr *hdr;
+};
+
+static int is_extent_mapped(struct inode *inode)
+{
+  return (inode->desc->flags & DFS_INODE_FLAG_EXTENTS) != 0;
+}
+
+static struct extenthdr *extent_root(struct inode *inode)
+{
+  return (struct extenthdr *) inode->desc->blockdir;
+}
+
+static void init_extent_node(struct extenthdr *hdr, int size, int leaf)
+{
+  memset(hdr, 0, size);
+  hdr->magic = DFS_EXTENT_MAGIC;
+  hdr->limit = (size - sizeof(struct extenthdr)) / (leaf ? sizeof(struct extent) : sizeof(struct extentidx));
+}
+
+static int bad_extent_node(struct extenthdr *hdr, int index)
+{
+  return hdr->magic != DFS_EXTENT_MAGIC || hdr->count > hdr->limit || (index && hdr->count == 0);
+}
+
+static void mark_extent_node_dirty(struct inode *inode, struct extentpath *path, int level)
+{
+  if (level == 0)
+    mark_inode_dirty(inode);
+  else
+    mark_buffer_updated(path[level].buf);
+}
+
+static void release_extent_path(struct inode *inode, struct extentpath *path, int depth)
+{
+  int d;
+
+  for (d = 1; d <= depth; d++)
+  {
+    if (path[d].buf) release_buffer(inode->fs->cache, path[d].buf);
+  }
+}
+
+static int extent_rightmost(struct inode *inode, struct extentpath *path)
+{
+  struct extenthdr *hdr;
+  int depth = inode->desc->depth;
+  int d;
+
+  for (d = 0; d <= depth; d++) path[d].buf = NULL;
+  path[0].hdr = extent_root(inode);
+
+  for (d = 0; d <= depth; d++)
+  {
+    hdr = path[d].hdr;
+    if (bad_extent_node(hdr, d < depth))
+    {
+      release_extent_path(inode, path, depth);
+      return -1;
+    }
+
+    if (d < depth)
+    {
+      path[d + 1].buf = get_buffer(inode->fs->cache, EXTENTIDX(hdr)[hdr->count - 1].block);
+      path[d + 1].hdr = (struct extenthdr *) path[d + 1].buf->data;
+    }
+  }
+
+  return 0;
+}
+
+static int lookup_extent(struct inode *inode, unsigned int iblock, struct extent *ext)
+{
+  struct extenthdr *hdr;
+  struct extent *e;
+  struct buf *buf;
+  int depth = inode->desc->depth;
+  int lo, hi, mid;
+  int d;
+
+  buf = NULL;
+  hdr = extent_root(inode);
+  for (d = 0; d <= depth; d++)
+  {
+    if (bad_extent_node(hdr, d < depth) || hdr->count == 0) break;
+
+    // Find last entry starting at or before the block
+    lo = 0;
+    hi = hdr->count - 1;
+    while (lo < hi)
+    {
+      mid = (lo + hi + 1) / 2;
+      if ((d < depth ? EXTENTIDX(hdr)[mid].iblock : EXTENTS(hdr)[mid].iblock) <= iblock)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+
+    if (d == depth)
+    {
+      e = EXTENTS(hdr) + lo;
+      if (iblock < e->iblock || iblock - e->iblock >= e->count) break;
+      *ext = *e;
+      if (buf) release_buffer(inode->fs->cache, buf);
+      return 0;
+    }
+
+    if (buf) release_buffer(inode->fs->cache, buf);
+    buf = get_buffer(inode->fs->cache, EXTENTIDX(hdr)[lo].block);
+    hdr = (struct extenthdr *) buf->data;
+  }
+
+  if (buf) release_buffer(inode->fs->cache, buf);
+  return -1;
+}
+
+static int grow_extent_tree(struct inode *inode, vfs_blkno_t goal)
+{
+  struct filsys *fs = inode->fs;
+  struct extenthdr *root = extent_root(inode);
+  struct extenthdr *hdr;
+  struct extentidx *idx;
+  struct buf *buf;
+  vfs_blkno_t blk;
+  int leaf = inode->desc->depth == 0;
+
+  if (inode->desc->depth >= DFS_MAX_DEPTH - 1) return -1;
+
+  blk = new_block(fs, goal);
+  if (blk == -1) return -1;
+
+  // Move root entries to new tree block
+  buf = alloc_buffer(fs->cache, blk);
+  hdr = (struct extenthdr *) buf->data;
+  init_extent_node(hdr, fs->blocksize, leaf);
+  hdr->count = root->count;
+  memcpy(hdr + 1, root + 1, root->count * (leaf ? sizeof(struct extent) : sizeof(struct extentidx)));
+  mark_buffer_updated(buf);
+  release_buffer(fs->cache, buf);
+
+  // Make root an index node with the new block as its only child
+  init_extent_node(root, sizeof(inode->desc->blockdir), 0);
+  idx = EXTENTIDX(root);
+  idx->iblock = 0;
+  idx->block = blk;
+  root->count = 1;
+  inode->desc->depth++;
+  mark_inode_dirty(inode);
+
+  return 0;
+}
+
+static vfs_blkno_t append_extent_block(struct inode *inode, vfs_blkno_t block)
+{
+  struct filsys *fs = inode->fs;
+  struct extentpath path[DFS_MAX_DEPTH + 1];
+  struct extenthdr *hdr;
+  struct extent *last;
+  struct extentidx *idx;
+  struct buf *buf;
+  vfs_blkno_t goal;
+  vfs_blkno_t blk;
+  int allocated;
+  int depth;
+  int d;
+
+  goal = inode->ino / fs->super->inodes_per_group * fs->super->blocks_per_group;
+  allocated = 0;
+
+  while (1)
+  {
+    depth = inode->desc->depth;
+    if (extent_rightmost(inode, path) < 0) goto error;
+
+    hdr = path[depth].hdr;
+    last = hdr->count > 0 ? EXTENTS(hdr) + hdr->count - 1 : NULL;
+
+    // Allocate new block after the last block in file if requested
+    if (block == -1)
+    {
+      block = new_block(fs, last ? last->start + last->count : goal);
+      if (block == -1)
+      {
+        release_extent_path(inode, path, depth);
+        return -1;
+      }
+      allocated = 1;
+    }
+
+    // Extend last extent if the block is contiguous with it
+    if (last && last->start + last->count == block && last->iblock + last->count == inode->desc->blocks)
+    {
+      last->count++;
+      mark_extent_node_dirty(inode, path, depth);
+      break;
+    }
+
+    // Find the lowest node on the right edge with room for a new entry
+    for (d = depth; d >= 0 && path[d].hdr->count == path[d].hdr->limit; d--);
+
+    if (d < 0)
+    {
+      // All nodes on the right edge are full, add a level to the tree
+      release_extent_path(inode, path, depth);
+      if (grow_extent_tree(inode, goal) < 0) goto error;
+      continue;
+    }
+
+    // Add new nodes on the right edge of the tree down to a new leaf
+    while (d < depth)
+    {
+      blk = new_block(fs, goal);
+      if (blk == -1)
+      {
+        release_extent_path(inode, path, depth);
+        goto error;
+      }
+      buf = alloc_buffer(fs->cache, blk);
+      init_extent_node((struct extenthdr *) buf->data, fs->blocksize, d + 1 == depth);
+
+      idx = EXTENTIDX(path[d].hdr) + path[d].hdr->count++;
+      idx->iblock = inode->desc->blocks;
+      idx->block = blk;
+      mark_extent_node_dirty(inode, path, d);
+
+      d++;
+      if (path[d].buf) release_buffer(fs->cache, path[d].buf);
+      path[d].buf = buf;
+      path[d].hdr = (struct extenthdr *) buf->data;
+      mark_buffer_updated(buf);
+    }
+
+    // Add new extent to the last leaf
+    hdr = path[depth].hdr;
+    last = EXTENTS(hdr) + hdr->count++;
+    last->iblock = inode->desc->blocks;
+    last->count = 1;
+    last->start = block;
+    mark_extent_node_dirty(inode, path, depth);
+    break;
+  }
+
+  release_extent_path(inode, path, depth);
+  inode->desc->blocks++;
+  mark_inode_dirty(inode);
+
+  return block;
+
+error:
+  if (allocated) free_blocks(fs, &block, 1);
+  return -1;
+}
+
+static void free_extent_blocks(struct filsys *fs, vfs_blkno_t start, unsigned int count)
+{
+  vfs_blkno_t blocks[32];
+  unsigned int i, n;
+
+  while (count > 0)
+  {
+    n = count < 32 ? count : 32;
+    for (i = 0; i < n; i++)
+    {
+      blocks[i] = start + i;
+      invalidate_buffer(fs->cache, blocks[i]);
+    }
+    free_blocks(fs, blocks, n);
+
+    start += n;
+    count -= n;
+  }
+}
+
+static int truncate_extents(struct inode *inode, unsigned int blocks)
+{
+  struct filsys *fs = inode->fs;
+  struct extentpath path[DFS_MAX_DEPTH + 1];
+  struct extenthdr *hdr;
+  struct extent *last;
+  unsigned int n;
+  int depth;
+  int d;
+
+  while (inode->desc->blocks > blocks)
+  {
+    depth = inode->desc->depth;
+    if (extent_rightmost(inode, path) < 0) return -1;
+
+    hdr = path[depth].hdr;
+    if (hdr->count > 0)
+    {
+      // Remove blocks from the end of the last extent
+      last = EXTENTS(hdr) + hdr->count - 1;
+      n = inode->desc->blocks - blocks;
+      if (n > last->count) n = last->count;
+
+      free_extent_blocks(fs, last->start + last->count - n, n);
+      last->count -= n;
+      inode->desc->blocks -= n;
+      if (last->count == 0) hdr->count--;
+      mark_extent_node_dirty(inode, path, depth);
+    }
+    else if (depth == 0)
+      return -1;
+
+    // Remove empty nodes from the right edge of the tree
+    for (d = depth; d > 0 && path[d].hdr->count == 0; d--)
+    {
+      free_blocks(fs, &(path[d].buf->blkno), 1);
+      mark_buffer_invalid(path[d].buf);
+      path[d - 1].hdr->count--;
+      mark_extent_node_dirty(inode, path, d - 1);
+    }
+
+    release_extent_path(inode, path, depth);
+  }
+
+  // Reset tree when all blocks have been removed
+  if (extent_root(inode)->count == 0)
+  {
+    init_extent_node(extent_root(inode), sizeof(inode->desc->blockdir), 1);
+    inode->desc->depth = 0;
+  }
+  mark_inode_dirty(inode);
+
+  return 0;
+}
+
 vfs_blkno_t get_inode_block(struct inode *inode, unsigned int iblock)
 {
   int d;
   vfs_blkno_t block;
   struct buf *buf;
   unsigned int offsets[DFS_MAX_DEPTH];
+  struct extent ext;
+
+  if (is_extent_mapped(inode))
+  {
+    if (lookup_extent(inode, iblock, &ext) < 0) return -1;
+    return ext.start + (iblock - ext.iblock);
+  }
 
   split_levels(inode, iblock, offsets);
   block = inode->desc->blockdir[offsets[0]];
@@ -60,6 +401,13 @@ vfs_blkno_t set_inode_block(struct inode *inode, unsigned int iblock, vfs_blkno_
   vfs_blkno_t goal;
   unsigned int offsets[DFS_MAX_DEPTH];
 
+  if (is_extent_mapped(inode))
+  {
+    // Extent mapped files can only grow at the end
+    if (iblock != inode->desc->blocks) return -1;
+    return append_extent_block(inode, block);
+  }
+
   goal = inode->ino / inode->fs->super->inodes_per_group * inode->fs->super->blocks_per_group;
 
   if (inode->desc->depth == 0)
@@ -166,6 +514,13 @@ struct inode *alloc_inode(struct inode *parent, int mode)
   inode->desc->mode = mode;
   inode->desc->ctime = inode->desc->mtime = time(NULL);
 
+  // Regular files are extent mapped if the file system supports it
+  if (VFS_S_ISREG(mode) && (inode->fs->super->incompat_features & DFS_INCOMPAT_EXTENTS))
+  {
+    inode->desc->flags |= DFS_INODE_FLAG_EXTENTS;
+    init_extent_node(extent_root(inode), sizeof(inode->desc->blockdir), 1);
+  }
+
   mark_inode_dirty(inode);
 
   return inode;  
@@ -216,13 +571,15 @@ void release_inode(struct inode *inode)
   free(inode);
 }
 
-vfs_blkno_t expand_inode(struct inode *inode)
+static vfs_blkno_t add_inode_block(struct inode *inode, vfs_blkno_t block)
 {
   unsigned int maxblocks;
   unsigned int dirblock;
   unsigned int i;
   struct buf *buf;
 
+  if (is_extent_mapped(inode)) return append_extent_block(inode, block);
+
   // Increase depth of block directory tree if tree is full
   maxblocks = DFS_TOPBLOCKDIR_SIZE * (1 << (inode->desc->depth * inode->fs->log_blkptrs_per_block));
   if (inode->desc->blocks == maxblocks)
@@ -249,8 +606,54 @@ vfs_blkno_t expand_inode(struct inode *inode)
     release_buffer(inode->fs->cache, buf);
   }
 
-  // Allocate new block and add to inode block directory
-  return set_inode_block(inode, inode->desc->blocks, -1);
+  // Allocate new block if requested and add to inode block directory
+  if (block == -1) return set_inode_block(inode, inode->desc->blocks, -1);
+
+  block = set_inode_block(inode, inode->desc->blocks, block);
+  inode->desc->blocks++;
+  mark_inode_dirty(inode);
+  return block;
+}
+
+vfs_blkno_t expand_inode(struct inode *inode)
+{
+  return add_inode_block(inode, -1);
+}
+
+int preallocate_inode(struct inode *inode, unsigned int count)
+{
+  struct filsys *fs = inode->fs;
+  vfs_blkno_t goal;
+  vfs_blkno_t first;
+  int n, i;
+
+  // Allocate blocks after the last block in the file or in the group of the inode
+  if (inode->desc->blocks > 0)
+    goal = get_inode_block(inode, inode->desc->blocks - 1) + 1;
+  else
+    goal = inode->ino / fs->super->inodes_per_group * fs->super->blocks_per_group;
+
+  // Append the blocks in as few runs of contiguous blocks as possible
+  while (count > 0)
+  {
+    n = new_blocks(fs, goal, count, &first);
+    if (n <= 0) return -1;
+
+    for (i = 0; i < n; i++)
+    {
+      if (add_inode_block(inode, first + i) == -1)
+      {
+        first += i;
+        free_extent_blocks(fs, first, n - i);
+        return -1;
+      }
+    }
+
+    goal = first + n;
+    count -= n;
+  }
+
+  return 0;
 }
 
 static void remove_blocks(struct filsys *fs, vfs_blkno_t *blocks, int count)
@@ -282,6 +685,8 @@ int truncate_inode(struct inode *inode, unsigned int blocks)
   if (blocks == inode->desc->blocks) return 0;
   if (inode->desc->blocks == 0) return 0;
 
+  if (is_extent_mapped(inode)) return truncate_extents(inode, blocks);
+
   // If depth 0 we just have to free blocks from top directory
   if (inode->desc->depth == 0)
   {
@@ -16,6 +16,8 @@
 #ifdef __linux__
 #include <dirent.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 #endif
 
 #ifndef __linux__
@@ -48,6 +50,31 @@ extern struct fs *mountlist;
 #define KRNLOPTS_POSOFS      0x1A
 #define KRNLOPTS_LEN         128
 
+#define TRANSFER_CHUNK       (1024 * K)       // Read size for files that are not read ahead
+#define READAHEAD_MAX        (16 * K * K)     // Largest file read ahead by reader threads
+#define READAHEAD_WINDOW     (64 * K * K)     // Memory for files read ahead
+#define MAX_READERS          32
+
+//
+// Files are transferred in bulk. The file list and source directories are
+// first scanned into a list of transfers, creating directories on the way.
+// The files are then written in order with all blocks preallocated, while
+// optional reader threads read the source files ahead of the writer.
+//
+
+struct transfer
+{
+  char *dstfn;
+  char *srcfn;
+  struct stat st;
+  char *data;
+  int state;
+};
+
+#define TRANSFER_PENDING     0
+#define TRANSFER_LOADED      1
+#define TRANSFER_DIRECT      2
+
 char bootsect[SECTORSIZE];
 
 char *command;
@@ -67,6 +94,9 @@ int doinit = 0;
 int dowipe = 0;
 int doformat = 0;
 int quick = 0;
+int dirindex = 1;
+int extents = 1;
+int enable_features = 0;
 char *source = NULL;
 char *target = "";
 int part = -1;
@@ -76,6 +106,14 @@ int ldrsize;
 char *krnlopts = "";
 int altfile = 0;
 int verbose = 0;
+int sparse = 1;
+int readers = 0;
+int timing = 0;
+
+struct transfer *transfers = NULL;
+int num_transfers = 0;
+int max_transfers = 0;
+unsigned int transfer_bytes = 0;
 
 void panic(char *reason)
 {
@@ -113,14 +151,36 @@ void create_device(char *devname, int devsize)
 
 void clear_device(struct blockdevice *bs, int devsize)
 {
-  char sector[SECTORSIZE];
-  int i;
-
-  memset(sector, 0, SECTORSIZE);
-  for (i = 0; i < devsize; i++)
+  uint8_t *zeros;
+  int sectors;
+  int i, n;
+
+  sectors = TRANSFER_CHUNK / SECTORSIZE;
+  zeros = calloc(sectors, SECTORSIZE);
+  if (!zeros) panic("out of memory");
+  for (i = 0; i < devsize; i += n)
   {
-    if (bdrv_write(bs, i, sector, 1) < 0) panic("error writing to device");
+    n = devsize - i < sectors ? devsize - i : sectors;
+    if (bdrv_write(bs, i, zeros, n) < 0) panic("error writing to device");
   }
+  free(zeros);
+}
+
+double now()
+{
+#ifdef WIN32
+  return GetTickCount() / 1000.0;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+void report_time(char *phase, double start)
+{
+  if (timing) printf("%s: %.3f seconds\n", phase, now() - start);
 }
 
 size_t filesize(int fd)
@@ -213,42 +273,52 @@ int isdir(char *filename)
   return (st.st_mode & S_IFMT) == S_IFDIR;
 }
 
-void set_time(int fd, struct file *f)
+void set_time(struct stat *st, struct file *f)
 {
-  struct stat st;
   struct vfs_utimbuf t;
 
-  fstat(fd, &st);
-  t.atime = st.st_atime;
-  t.ctime = st.st_ctime;
-  t.mtime = st.st_mtime;
+  t.atime = st->st_atime;
+  t.ctime = st->st_ctime;
+  t.mtime = st->st_mtime;
   if (vfs_futime(f, &t) < 0) panic("error setting file time");
 }
 
+void copy_file(struct file *file, int fd)
+{
+  char *buf;
+  int count;
+
+  buf = malloc(TRANSFER_CHUNK);
+  if (!buf) panic("out of memory");
+
+  count = read(fd, buf, TRANSFER_CHUNK);
+  while (count > 0)
+  {
+    if (vfs_write(file, buf, count) != count) panic("error writing file");
+    count = read(fd, buf, TRANSFER_CHUNK);
+  }
+  if (count < 0) panic("error reading file");
+
+  free(buf);
+}
+
 void install_kernel()
 {
   int fd;
-  size_t size;
-  size_t count;
-
+  struct stat st;
   struct file *file;
-  char buf[4096];
 
   fd = open(krnlfile, O_BINARY);
-  size = filesize(fd);
+  if (fd == -1 || fstat(fd, &st) == -1) panic("unable to read kernel");
 
   vfs_mkdir("/boot", 0755);
   file = vfs_open("/boot/krnl.dll", VFS_O_SPECIAL | (DFS_INODE_KERNEL << 24) | O_WRONLY, 0644);
   if (file == NULL) panic("error creating kernel file");
 
-  count = read(fd, buf, 4096);
-  while (count > 0)
-  {
-    vfs_write(file, buf, count);
-    count = read(fd, buf, 4096);
-  }
-  
-  set_time(fd, file);
+  if (vfs_allocate(file, st.st_size) < 0) panic("error allocating kernel file");
+  copy_file(file, fd);
+
+  set_time(&st, file);
   vfs_close(file);
   close(fd);
 }
@@ -259,21 +329,71 @@ void make_directory(char *dirname)
 }
 
 void transfer_file(char *dstfn, char *srcfn)
+{
+  struct transfer *t;
+
+  if (num_transfers == max_transfers)
+  {
+    max_transfers = max_transfers ? max_transfers * 2 : 256;
+    transfers = (struct transfer *) realloc(transfers, max_transfers * sizeof(struct transfer));
+    if (!transfers) panic("out of memory");
+  }
+
+  t = &transfers[num_transfers];
+  memset(t, 0, sizeof(struct transfer));
+  t->dstfn = strdup(dstfn);
+  t->srcfn = strdup(srcfn);
+  if (!t->dstfn || !t->srcfn) panic("out of memory");
+  if (stat(srcfn, &t->st) == -1)
+  {
+    perror(srcfn);
+    panic("cannot stat file");
+  }
+
+  num_transfers++;
+  transfer_bytes += t->st.st_size;
+}
+
+int load_file(struct transfer *t)
 {
   int fd;
-  size_t size;
-  size_t count;
+  int count;
+
+  // Large files are copied by the writer in chunks
+  if (t->st.st_size > READAHEAD_MAX) return TRANSFER_DIRECT;
+
+  t->data = malloc(t->st.st_size + 1);
+  if (!t->data) return TRANSFER_DIRECT;
+
+  fd = open(t->srcfn, O_BINARY);
+  if (fd == -1) 
+  {
+    free(t->data);
+    t->data = NULL;
+    return TRANSFER_DIRECT;
+  }
+
+  count = read(fd, t->data, t->st.st_size);
+  close(fd);
+  if (count != t->st.st_size)
+  {
+    free(t->data);
+    t->data = NULL;
+    return TRANSFER_DIRECT;
+  }
+
+  return TRANSFER_LOADED;
+}
 
+void store_file(struct transfer *t)
+{
   struct file *file;
-  char buf[4096];
   char *ext;
   int executable = 0;
+  int fd;
 
-  fd = open(srcfn, O_BINARY);
-  size = filesize(fd);
-
-  ext = dstfn + strlen(dstfn) - 1;
-  while (ext > dstfn && *ext != '.' && *ext != PS1 && *ext != PS2) ext--;
+  ext = t->dstfn + strlen(t->dstfn) - 1;
+  while (ext > t->dstfn && *ext != '.' && *ext != PS1 && *ext != PS2) ext--;
   if (strcmp(ext, ".dll") == 0 || 
       strcmp(ext, ".exe") == 0 || 
       strcmp(ext, ".sys") == 0 ||
@@ -281,22 +401,127 @@ void transfer_file(char *dstfn, char *srcfn)
     executable = 1;
   }
 
-  file = vfs_open(dstfn, VFS_O_CREAT, executable ? 0755 : 0644);
+  file = vfs_open(t->dstfn, VFS_O_CREAT, executable ? 0755 : 0644);
+  if (!file) panic("error creating file");
 
-  if (verbose) printf("%s -> %s (%d bytes)\n", srcfn, dstfn, size);
+  if (verbose) printf("%s -> %s (%d bytes)\n", t->srcfn, t->dstfn, (int) t->st.st_size);
 
-  count = read(fd, buf, 4096);
-  while (count > 0)
+  // Allocate all blocks for the file before writing the data
+  if (vfs_allocate(file, t->st.st_size) < 0) panic("error allocating file");
+
+  if (t->state == TRANSFER_LOADED)
   {
-    vfs_write(file, buf, count);
-    count = read(fd, buf, 4096);
+    if (vfs_write(file, t->data, t->st.st_size) != t->st.st_size) panic("error writing file");
+    free(t->data);
+    t->data = NULL;
   }
-  
-  set_time(fd, file);
+  else
+  {
+    fd = open(t->srcfn, O_BINARY);
+    if (fd == -1)
+    {
+      perror(t->srcfn);
+      panic("unable to read file");
+    }
+    copy_file(file, fd);
+    close(fd);
+  }
+
+  set_time(&t->st, file);
   vfs_close(file);
-  close(fd);
 }
 
+#ifdef __linux__
+pthread_mutex_t transfer_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t transfer_done = PTHREAD_COND_INITIALIZER;
+int next_read = 0;
+unsigned int readahead_bytes = 0;
+
+void *reader(void *arg)
+{
+  struct transfer *t;
+  unsigned int size;
+  int state;
+
+  pthread_mutex_lock(&transfer_lock);
+  while (next_read < num_transfers)
+  {
+    // Wait until there is room in the read ahead window
+    t = &transfers[next_read];
+    size = t->st.st_size <= READAHEAD_MAX ? t->st.st_size : 0;
+    if (readahead_bytes > 0 && readahead_bytes + size > READAHEAD_WINDOW)
+    {
+      pthread_cond_wait(&transfer_done, &transfer_lock);
+      continue;
+    }
+    next_read++;
+    readahead_bytes += size;
+    pthread_mutex_unlock(&transfer_lock);
+
+    state = load_file(t);
+
+    pthread_mutex_lock(&transfer_lock);
+    t->state = state;
+    pthread_cond_broadcast(&transfer_done);
+  }
+  pthread_mutex_unlock(&transfer_lock);
+
+  return NULL;
+}
+
+void write_files()
+{
+  pthread_t threads[MAX_READERS];
+  struct transfer *t;
+  int nthreads;
+  int i;
+
+  nthreads = readers < MAX_READERS ? readers : MAX_READERS;
+  for (i = 0; i < nthreads; i++)
+  {
+    if (pthread_create(&threads[i], NULL, reader, NULL) != 0) panic("unable to create reader thread");
+  }
+
+  for (i = 0; i < num_transfers; i++)
+  {
+    t = &transfers[i];
+
+    // Wait for reader threads to read the file
+    if (nthreads > 0)
+    {
+      pthread_mutex_lock(&transfer_lock);
+      while (t->state == TRANSFER_PENDING) pthread_cond_wait(&transfer_done, &transfer_lock);
+      pthread_mutex_unlock(&transfer_lock);
+    }
+    else
+      t->state = load_file(t);
+
+    store_file(t);
+
+    if (nthreads > 0)
+    {
+      pthread_mutex_lock(&transfer_lock);
+      if (t->st.st_size <= READAHEAD_MAX) readahead_bytes -= t->st.st_size;
+      pthread_cond_broadcast(&transfer_done);
+      pthread_mutex_unlock(&transfer_lock);
+    }
+  }
+
+  for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+}
+#else
+void write_files()
+{
+  int i;
+
+  for (i = 0; i < num_transfers; i++)
+  {
+    transfers[i].state = load_file(&transfers[i]);
+    store_file(&transfers[i]);
+  }
+}
+#endif
+
 #ifdef WIN32
 void transfer_files(char *dstdir, char *srcdir)
 {
@@ -445,6 +670,12 @@ void usage()
   fprintf(stderr, "  -p <partition>\n");
   fprintf(stderr, "  -P <partition start sector>\n");
   fprintf(stderr, "  -q (quick format)\n");
+  fprintf(stderr, "  -s (write zero blocks to new device instead of leaving holes)\n");
+  fprintf(stderr, "  -j <threads> (read files in parallel)\n");
+  fprintf(stderr, "  -m (measure and report time for each phase)\n");
+  fprintf(stderr, "  -n (format without directory index)\n");
+  fprintf(stderr, "  -e (format without extent mapped files)\n");
+  fprintf(stderr, "  -x (enable directory index and extents on existing filesystem)\n");
   fprintf(stderr, "  -B <block size> (default 4096)\n");
   fprintf(stderr, "  -C <device capacity> (capacity in kilobytes)\n");
   fprintf(stderr, "  -F <file list file>\n");
@@ -475,10 +706,13 @@ int str2sectors(char *str)
 int main(int argc, char **argv)
 {
   struct blockdevice blkdev;
+  char mntopts[32];
+  double start;
+  double phase;
   int c;
 
   // Parse command line options
-  while ((c = getopt(argc, argv, "ad:b:c:ifk:l:t:vwp:qB:C:F:I:K:P:S:T:?")) != EOF)
+  while ((c = getopt(argc, argv, "ad:b:c:eifj:k:l:mnst:vwp:qxB:C:F:I:K:P:S:T:?")) != EOF)
   {
     switch (c)
     {
@@ -530,6 +764,30 @@ int main(int argc, char **argv)
         quick = !quick;
         break;
 
+      case 's':
+        sparse = !sparse;
+        break;
+
+      case 'j':
+        readers = atoi(optarg);
+        break;
+
+      case 'm':
+        timing = !timing;
+        break;
+
+      case 'n':
+        dirindex = !dirindex;
+        break;
+
+      case 'e':
+        extents = !extents;
+        break;
+
+      case 'x':
+        enable_features = !enable_features;
+        break;
+
       case 't':
         devtype = optarg;
         break;
@@ -575,12 +833,17 @@ int main(int argc, char **argv)
 
   // Register dfs filesystem
   dfs_init();
+  start = phase = now();
 
   // Create device file
+  memset(&blkdev, 0, sizeof(struct blockdevice));
   if (doinit) 
   {
     printf("Creating %s device file %s %dKB\n", devtype, devname, devcap / 2);
     create_device(devname, devcap);
+
+    // A new device file is all zeros, so zero blocks can be left as holes
+    if (sparse) blkdev.flags |= BDRV_SPARSE;
   }
 
   // Open device file
@@ -604,16 +867,19 @@ int main(int argc, char **argv)
   {
     char options[256];
 
-    sprintf(options, "blocksize=%d,inoderatio=%d%s", blocksize, inoderatio, quick ? ",quick" : "");
+    sprintf(options, "blocksize=%d,inoderatio=%d%s%s%s", blocksize, inoderatio, quick ? ",quick" : "", dirindex ? "" : ",nodirindex", extents ? "" : ",noextents");
     printf("Formating device (%s)...\n", options);
     if (vfs_format((vfs_devno_t) &blkdev, "dfs", options) < 0) panic("error formatting device");
+    report_time("format", phase);
   }
 
   // Initialize the file system
   printf("Mounting device\n");
-  if (vfs_mount("dfs", "/", (vfs_devno_t) &blkdev, NULL) < 0) panic("error mounting device");
+  strcpy(mntopts, enable_features ? "dirindex,extents" : "");
+  if (vfs_mount("dfs", "/", (vfs_devno_t) &blkdev, mntopts) < 0) panic("error mounting device");
 
   // Install os loader
+  phase = now();
   if (ldrfile) 
   {
     printf("Writing os loader %s\n", ldrfile);
@@ -669,14 +935,23 @@ int main(int argc, char **argv)
     else
       transfer_file(target, source);
   }
+  write_files();
+  if (timing) 
+  {
+    printf("%d files, %d KB\n", num_transfers, transfer_bytes / K);
+    report_time("populate", phase);
+  }
 
   // Close file system
   printf("Unmounting device\n");
+  phase = now();
   vfs_unmount_all();
+  report_time("flush", phase);
 
   // Close device file
   printf("Closing device\n");
   bdrv_close(&blkdev);
+  report_time("total", start);
 
   return 0;
 }
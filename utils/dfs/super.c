@@ -41,7 +41,14 @@ static int bits(int n)
   return l;
 }
 
-static int parse_options(char *opts, int *blocksize, int *inode_ratio, int *quick)
+void set_incompat_feature(struct filsys *fs, unsigned int feature)
+{
+  fs->super->incompat_features |= feature;
+  fs->super->version = DFS_VERSION;
+  fs->super_dirty = 1;
+}
+
+static int parse_options(char *opts, int *blocksize, int *inode_ratio, int *quick, int *dirindex, int *extents)
 {
   char *value;
   char *p;
@@ -74,6 +81,22 @@ static int parse_options(char *opts, int *blocksize, int *inode_ratio, int *quic
     {
       if (quick) *quick = 1;
     }
+    else if (strcmp(opts, "dirindex") == 0)
+    {
+      if (dirindex) *dirindex = 1;
+    }
+    else if (strcmp(opts, "nodirindex") == 0)
+    {
+      if (dirindex) *dirindex = 0;
+    }
+    else if (strcmp(opts, "extents") == 0)
+    {
+      if (extents) *extents = 1;
+    }
+    else if (strcmp(opts, "noextents") == 0)
+    {
+      if (extents) *extents = 0;
+    }
     else
       return -1;
 
@@ -86,7 +109,7 @@ static int parse_options(char *opts, int *blocksize, int *inode_ratio, int *quic
   return 0;
 }
 
-struct filsys *create_filesystem(vfs_devno_t devno, int blocksize, int inode_ratio, int quick)
+struct filsys *create_filesystem(vfs_devno_t devno, int blocksize, int inode_ratio, int quick, int dirindex, int extents)
 {
   struct filsys *fs;
   unsigned int blocks;
@@ -116,8 +139,10 @@ struct filsys *create_filesystem(vfs_devno_t devno, int blocksize, int inode_rat
 
   // Set signature, version and block size in super block
   fs->super->signature = DFS_SIGNATURE;
-  fs->super->version = DFS_VERSION;
+  fs->super->version = DFS_VERSION_NOINCOMPAT;
   fs->super->log_block_size = bits(blocksize);
+  if (dirindex) set_incompat_feature(fs, DFS_INCOMPAT_DIRINDEX);
+  if (extents) set_incompat_feature(fs, DFS_INCOMPAT_EXTENTS);
 
   // Each group has as many blocks as can be represented by the block bitmap block
   fs->super->blocks_per_group = fs->blocksize * 8;
@@ -297,11 +322,33 @@ struct filsys *open_filesystem(vfs_devno_t devno)
 
   // Check signature and version
   if (fs->super->signature != DFS_SIGNATURE) panic("invalid DFS signature");
-  if (fs->super->version != DFS_VERSION) panic("invalid DFS version");
+  if (fs->super->version == DFS_VERSION_NOINCOMPAT)
+    fs->super->incompat_features = 0;
+  else if (fs->super->version != DFS_VERSION)
+    panic("invalid DFS version");
+  if (fs->super->incompat_features & ~DFS_INCOMPAT_SUPPORTED) panic("unsupported DFS features");
+
+  // Kernels without the directory index must not mount indexed file systems
+  if (fs->super->features & DFS_FEATURE_DIRINDEX)
+  {
+    fs->super->features &= ~DFS_FEATURE_DIRINDEX;
+    set_incompat_feature(fs, DFS_INCOMPAT_DIRINDEX);
+  }
 
   // Set device number and block size
   fs->devno = devno;
   fs->blocksize = 1 << fs->super->log_block_size;
+
+  // Changes made in place would be overwritten when the journal is replayed
+  if (fs->super->incompat_features & DFS_INCOMPAT_JOURNAL)
+  {
+    struct jsuper *jsb = (struct jsuper *) malloc(fs->blocksize);
+
+    if (dev_read(devno, jsb, fs->blocksize, fs->super->journal_block * (fs->blocksize / SECTORSIZE)) != fs->blocksize) panic("unable to read journal");
+    if (jsb->magic != DFS_JOURNAL_MAGIC) panic("invalid journal");
+    if (jsb->start != 0) panic("journal needs recovery, mount the file system first");
+    free(jsb);
+  }
   fs->inodes_per_block = fs->blocksize / sizeof(struct inodedesc);
 
   // Initialize buffer cache
@@ -363,13 +410,17 @@ int dfs_format(vfs_devno_t devno, char *opts)
   int blocksize;
   int inode_ratio;
   int quick;
+  int dirindex;
+  int extents;
   struct filsys *fs;
 
   blocksize = DEFAULT_BLOCKSIZE;
   inode_ratio = DEFAULT_INODE_RATIO;
   quick = 0;
-  if (parse_options(opts, &blocksize, &inode_ratio, &quick) != 0) return -1;
-  fs = create_filesystem(devno, blocksize, inode_ratio, quick);
+  dirindex = 1;
+  extents = 1;
+  if (parse_options(opts, &blocksize, &inode_ratio, &quick, &dirindex, &extents) != 0) return -1;
+  fs = create_filesystem(devno, blocksize, inode_ratio, quick, dirindex, extents);
   if (!fs) return -1;
   close_filesystem(fs);
   return 0;
@@ -377,11 +428,30 @@ int dfs_format(vfs_devno_t devno, char *opts)
 
 int dfs_mount(struct fs *fs, char *opts)
 {
-  if (parse_options(opts, NULL, NULL, NULL) != 0) return -1;
+  struct filsys *filsys;
+  int dirindex;
+  int extents;
+
+  dirindex = 0;
+  extents = 0;
+  if (parse_options(opts, NULL, NULL, NULL, &dirindex, &extents) != 0) return -1;
 
   fs->data = open_filesystem(fs->devno);
   if (!fs->data) return -1;
 
+  // Enable directory indexing on an existing filesystem
+  filsys = (struct filsys *) fs->data;
+  if (dirindex && !(filsys->super->incompat_features & DFS_INCOMPAT_DIRINDEX))
+  {
+    set_incompat_feature(filsys, DFS_INCOMPAT_DIRINDEX);
+  }
+
+  // Enable extent mapped files on an existing filesystem
+  if (extents && !(filsys->super->incompat_features & DFS_INCOMPAT_EXTENTS))
+  {
+    set_incompat_feature(filsys, DFS_INCOMPAT_EXTENTS);
+  }
+
   return 0;
 }
 
@@ -305,6 +305,15 @@ int vfs_chsize(struct file *filp, vfs_loff_t size)
   return filp->fs->ops->chsize(filp, size);
 }
 
+int vfs_allocate(struct file *filp, vfs_loff_t size)
+{
+  if (!filp) return -1;
+  if (filp->flags & VFS_O_RDONLY) return -1;
+
+  if (!filp->fs->ops->allocate) return 0;
+  return filp->fs->ops->allocate(filp, size);
+}
+
 int vfs_futime(struct file *filp, struct vfs_utimbuf *times)
 {
   if (!filp) return -1;
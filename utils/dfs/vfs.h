@@ -101,6 +101,7 @@ struct fsops
   vfs_loff_t (*tell)(struct file *filp);
   vfs_loff_t (*lseek)(struct file *filp, vfs_loff_t offset, int origin);
   int (*chsize)(struct file *filp, vfs_loff_t size);
+  int (*allocate)(struct file *filp, vfs_loff_t size);
 
   int (*futime)(struct file *filp, struct vfs_utimbuf *times);
 
@@ -136,6 +137,7 @@ int vfs_write(struct file *filp, void *data, size_t size);
 vfs_loff_t vfs_tell(struct file *filp);
 vfs_loff_t vfs_lseek(struct file *filp, vfs_loff_t offset, int origin);
 int vfs_chsize(struct file *filp, vfs_loff_t size);
+int vfs_allocate(struct file *filp, vfs_loff_t size);
 
 int vfs_futime(struct file *filp, struct vfs_utimbuf *times);
 
@@ -344,17 +344,41 @@ static int vmdk_read(struct blockdevice *bs, int64_t sector_num, uint8_t *buf, i
 static int vmdk_write(struct blockdevice *bs, int64_t sector_num,  const uint8_t *buf, int nb_sectors)
 {
   struct vmdkdev *s = bs->opaque;
-  int index_in_cluster, n;
-  uint64_t cluster_offset, pos;
+  int index_in_cluster, n, m;
+  uint64_t cluster_offset, next, pos;
 
   while (nb_sectors > 0) 
   {
     index_in_cluster = (int) sector_num & (s->cluster_sectors - 1);
     n = s->cluster_sectors - index_in_cluster;
     if (n > nb_sectors) n = nb_sectors;
-    cluster_offset = get_cluster_offset(bs, sector_num << 9, 1);
+
+    // Unallocated grains read as zeros, so zero data does not need a grain
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, 0);
+    if (!cluster_offset && bdrv_zero_sectors(buf, n)) 
+    {
+      nb_sectors -= n;
+      sector_num += n;
+      buf += n * 512;
+      continue;
+    }
+
+    if (!cluster_offset) cluster_offset = get_cluster_offset(bs, sector_num << 9, 1);
     if (!cluster_offset) return -1;
     pos = cluster_offset + index_in_cluster * 512;
+
+    // Extend the write over following grains stored next to it in the image file
+    while (n < nb_sectors)
+    {
+      m = nb_sectors - n;
+      if (m > (int) s->cluster_sectors) m = s->cluster_sectors;
+      next = get_cluster_offset(bs, (sector_num + n) << 9, 0);
+      if (!next && bdrv_zero_sectors(buf + n * 512, m)) break;
+      if (!next) next = get_cluster_offset(bs, (sector_num + n) << 9, 1);
+      if (next != pos + n * 512) break;
+      n += m;
+    }
+
     seek(s->fd, pos);
     if (write(s->fd, buf, n * 512) != n * 512) return -1;
     nb_sectors -= n;
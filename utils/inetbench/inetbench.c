@@ -0,0 +1,164 @@
+//
+// inetbench.c
+//
+// Internet checksum correctness test and benchmark
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 
+// 1. Redistributions of source code must retain the above copyright 
+//    notice, this list of conditions and the following disclaimer.  
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.  
+// 3. Neither the name of the project nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission. 
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+// ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+// OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+// HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+// LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+// OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF 
+// SUCH DAMAGE.
+// 
+
+//
+// Tests the kernel checksum routines in src/sys/net/chksum.c against a
+// straightforward reference implementation and measures their throughput.
+// Build and run on the host with:
+//
+//   cc -O2 -o inetbench utils/inetbench/inetbench.c src/sys/net/chksum.c
+//   ./inetbench [seconds per test]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAXLEN    2048
+#define MAXALIGN  8
+
+unsigned long chksum(void *data, int len);
+unsigned long chksum_copy(void *dst, void *src, int len);
+unsigned long chksum_add(unsigned long sum, unsigned long partial, int offset);
+
+static unsigned char src[65536 + 64];
+static unsigned char dst[65536 + 64];
+
+//
+// Reference implementation from RFC 1071, summing the data as little
+// endian 16-bit words like the kernel does on x86
+//
+
+static unsigned long ref_chksum(unsigned char *p, int len) {
+  unsigned long acc = 0;
+  int i;
+
+  for (i = 0; i + 1 < len; i += 2) acc += p[i] | (p[i + 1] << 8);
+  if (len & 1) acc += p[len - 1];
+
+  while (acc >> 16) acc = (acc & 0xFFFF) + (acc >> 16);
+  return acc;
+}
+
+static double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int test_chksum() {
+  int len, align, split;
+  unsigned long ref, sum;
+  int errors = 0;
+
+  for (align = 0; align < MAXALIGN; align++) {
+    for (len = 0; len <= MAXLEN; len++) {
+      ref = ref_chksum(src + align, len);
+
+      sum = chksum(src + align, len);
+      if (sum != ref) {
+        printf("chksum: len %d align %d: 0x%04lx, expected 0x%04lx\n", len, align, sum, ref);
+        errors++;
+      }
+
+      memset(dst, 0, len + MAXALIGN);
+      sum = chksum_copy(dst + (align ^ 3), src + align, len);
+      if (sum != ref) {
+        printf("chksum_copy: len %d align %d: 0x%04lx, expected 0x%04lx\n", len, align, sum, ref);
+        errors++;
+      }
+      if (memcmp(dst + (align ^ 3), src + align, len) != 0) {
+        printf("chksum_copy: len %d align %d: data mismatch\n", len, align);
+        errors++;
+      }
+
+      // Sum the data in two parts like a pbuf chain split at an arbitrary offset
+      if (len > 0) {
+        split = rand() % len;
+        sum = chksum_add(chksum(src + align, split), chksum(src + align + split, len - split), split);
+        if (sum != ref) {
+          printf("chksum_add: len %d align %d split %d: 0x%04lx, expected 0x%04lx\n", len, align, split, sum, ref);
+          errors++;
+        }
+      }
+    }
+  }
+
+  return errors;
+}
+
+static void bench(char *name, int mode, int len, double secs) {
+  double start, elapsed;
+  unsigned long sum = 0;
+  long rounds = 0;
+  int i;
+
+  start = now();
+  do {
+    for (i = 0; i < 1000; i++) {
+      switch (mode) {
+        case 0: sum += ref_chksum(src, len); break;
+        case 1: sum += chksum(src, len); break;
+        case 2: memcpy(dst, src, len); sum += chksum(dst, len); break;
+        case 3: sum += chksum_copy(dst, src, len); break;
+      }
+    }
+    rounds += 1000;
+    elapsed = now() - start;
+  } while (elapsed < secs);
+
+  printf("%-16s %6d bytes %10.1f MB/s (%lx)\n", name, len, (double) rounds * len / elapsed / (1024 * 1024), sum & 0xF);
+}
+
+int main(int argc, char *argv[]) {
+  static int sizes[] = {64, 576, 1460, 8192, 65536};
+  double secs = argc > 1 ? atof(argv[1]) : 0.5;
+  int errors;
+  int i;
+
+  srand(1);
+  for (i = 0; i < sizeof(src); i++) src[i] = rand();
+
+  errors = test_chksum();
+  printf("%s: %d errors\n", errors ? "FAILED" : "passed", errors);
+  if (errors) return 1;
+
+  for (i = 0; i < sizeof(sizes) / sizeof(int); i++) {
+    bench("reference", 0, sizes[i], secs);
+    bench("chksum", 1, sizes[i], secs);
+    bench("memcpy+chksum", 2, sizes[i], secs);
+    bench("chksum_copy", 3, sizes[i], secs);
+  }
+
+  return 0;
+}